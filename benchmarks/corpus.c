@@ -0,0 +1,407 @@
+/* corpus.c -- deterministic inputs for the benchmark drivers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+#include <config.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zlib.h"
+#include "corpus.h"
+
+static char const *const names[CORPUS_KINDS] = {
+  "logs", "json", "csv", "binary", "compressed", "sparse"
+};
+
+char const *
+corpus_name (enum corpus_kind kind)
+{
+  return names[kind];
+}
+
+/* Return the kind called NAME, or -1.  */
+int
+corpus_lookup (char const *name)
+{
+  for (int i = 0; i < CORPUS_KINDS; i++)
+    if (strcmp (name, names[i]) == 0)
+      return i;
+  return -1;
+}
+
+/* ===========================================================================
+ * Pseudo-random numbers.  splitmix64 is tiny, fast and gives the same
+ * sequence everywhere, unlike rand ().
+ */
+static uint64_t
+next_random (uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+/* Return a number in [0, N).  */
+static unsigned
+pick (uint64_t *state, unsigned n)
+{
+  return (unsigned) ((next_random (state) >> 32) * n >> 32);
+}
+
+/* Return a number in [0, N), small ones much more often than large
+ * ones, the way ids and sizes are spread in real data.
+ */
+static unsigned
+pick_skewed (uint64_t *state, unsigned n)
+{
+  unsigned a = pick (state, n);
+  unsigned b = pick (state, n);
+  return a < b ? a : b;
+}
+
+#define PICK(state, array) ((array)[pick (state, sizeof (array) \
+                                                / sizeof *(array))])
+
+/* ===========================================================================
+ * Text output into a fixed-size buffer.  Text past the end is dropped,
+ * so each generator simply writes records until the buffer is full.
+ */
+struct sink
+{
+  unsigned char *buf;
+  size_t size;
+  size_t len;
+};
+
+static void
+emit (struct sink *sink, char const *format, ...)
+{
+  char line[1024];
+  va_list args;
+  int n;
+
+  va_start (args, format);
+  n = vsnprintf (line, sizeof line, format, args);
+  va_end (args);
+  if (n < 0)
+    return;
+  if ((size_t) n >= sizeof line)
+    n = sizeof line - 1;
+  if ((size_t) n > sink->size - sink->len)
+    n = sink->size - sink->len;
+  memcpy (sink->buf + sink->len, line, n);
+  sink->len += n;
+}
+
+static bool
+full (struct sink const *sink)
+{
+  return sink->len == sink->size;
+}
+
+/* Format T, seconds since the epoch, as an ISO 8601 date and time.  */
+static void
+format_time (char *buf, size_t size, uint64_t t)
+{
+  /* Days to civil date, after Howard Hinnant; avoids gmtime and the
+     host's time zone rules.  */
+  uint64_t days = t / 86400, secs = t % 86400;
+  uint64_t z = days + 719468;
+  uint64_t era = z / 146097;
+  uint64_t doe = z - era * 146097;
+  uint64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint64_t mp = (5 * doy + 2) / 153;
+  unsigned day = doy - (153 * mp + 2) / 5 + 1;
+  unsigned month = mp < 10 ? mp + 3 : mp - 9;
+  unsigned year = yoe + era * 400 + (month <= 2);
+
+  snprintf (buf, size, "%04u-%02u-%02uT%02u:%02u:%02u", year, month, day,
+            (unsigned) (secs / 3600), (unsigned) (secs / 60 % 60),
+            (unsigned) (secs % 60));
+}
+
+#define EPOCH 1560600000        /* 2019-06-15 */
+
+static char const *const hosts[] = {
+  "web-01", "web-02", "web-03", "web-04", "api-01", "api-02", "edge-11"
+};
+static char const *const methods[] = {
+  "GET", "GET", "GET", "GET", "POST", "POST", "PUT", "DELETE", "HEAD"
+};
+static char const *const paths[] = {
+  "/", "/index.html", "/api/v1/users", "/api/v1/orders", "/api/v1/search",
+  "/static/app.js", "/static/style.css", "/img/logo.png", "/login",
+  "/healthz", "/api/v2/items", "/favicon.ico"
+};
+static unsigned const statuses[] = {
+  200, 200, 200, 200, 200, 200, 304, 301, 404, 500, 201, 204
+};
+static char const *const agents[] = {
+  "Mozilla/5.0 (X11; Linux x86_64; rv:67.0) Gecko/20100101 Firefox/67.0",
+  "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36"
+  " (KHTML, like Gecko) Chrome/75.0.3770.90 Safari/537.36",
+  "curl/7.64.0", "Go-http-client/1.1", "python-requests/2.22.0",
+  "Mozilla/5.0 (iPhone; CPU iPhone OS 12_3 like Mac OS X)"
+};
+static char const *const users[] = {
+  "alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi",
+  "ivan", "judy", "mallory", "niaj", "olivia", "peggy", "rupert", "sybil"
+};
+static char const *const regions[] = {
+  "north", "south", "east", "west", "central"
+};
+static char const *const products[] = {
+  "widget", "gadget", "sprocket", "gizmo", "doohickey", "thingamajig",
+  "whatsit", "contraption"
+};
+static char const *const tags[] = {
+  "new", "sale", "vip", "beta", "legacy", "mobile", "trial", "gift"
+};
+
+static void
+generate_logs (struct sink *sink, uint64_t *state)
+{
+  uint64_t t = EPOCH;
+  char when[32];
+
+  while (!full (sink))
+    {
+      t += pick (state, 3);
+      format_time (when, sizeof when, t);
+      emit (sink, "%s.%03uZ %s nginx[%u]: 10.%u.%u.%u - - \"%s %s/%u"
+            " HTTP/1.1\" %u %u \"-\" \"%s\" rt=%u.%03u\n",
+            when, pick (state, 1000), PICK (state, hosts),
+            1000 + pick (state, 8), pick (state, 4), pick (state, 256),
+            pick (state, 256), PICK (state, methods), PICK (state, paths),
+            pick_skewed (state, 100000), PICK (state, statuses),
+            pick_skewed (state, 65536), PICK (state, agents),
+            pick_skewed (state, 3), pick (state, 1000));
+    }
+}
+
+static void
+generate_json (struct sink *sink, uint64_t *state)
+{
+  uint64_t t = EPOCH;
+  char when[32];
+
+  for (unsigned id = 1; !full (sink); id++)
+    {
+      char const *user = PICK (state, users);
+      t += pick (state, 600);
+      format_time (when, sizeof when, t);
+      emit (sink, "{\"id\":%u,\"user\":\"%s\",\"email\":\"%s%u@example.com\","
+            "\"active\":%s,\"score\":%u.%u,\"tags\":[\"%s\",\"%s\"],"
+            "\"created\":\"%sZ\",\"address\":{\"zip\":\"%05u\","
+            "\"region\":\"%s\"}}\n",
+            id, user, user, pick_skewed (state, 1000),
+            pick (state, 4) ? "true" : "false", pick (state, 100),
+            pick (state, 10), PICK (state, tags), PICK (state, tags), when,
+            pick (state, 100000), PICK (state, regions));
+    }
+}
+
+static void
+generate_csv (struct sink *sink, uint64_t *state)
+{
+  uint64_t t = EPOCH;
+  char when[32];
+
+  emit (sink, "id,date,region,product,quantity,unit_price,total\n");
+  for (unsigned id = 1; !full (sink); id++)
+    {
+      unsigned quantity = 1 + pick_skewed (state, 50);
+      unsigned cents = 99 + pick (state, 20000);
+      t += pick (state, 120);
+      format_time (when, sizeof when, t);
+      when[10] = '\0';
+      emit (sink, "%u,%s,%s,%s,%u,%u.%02u,%u.%02u\n", id, when,
+            PICK (state, regions), PICK (state, products), quantity,
+            cents / 100, cents % 100, quantity * cents / 100,
+            quantity * cents % 100);
+    }
+}
+
+/* Sections of little-endian integers with small deltas, 32-bit floats
+ * sampled from a noisy triangle wave, and bytes with a skewed
+ * distribution, like the code and data of an executable.  Only integer
+ * arithmetic feeds the floats, so they do not depend on the libm.
+ */
+static void
+generate_binary (struct sink *sink, uint64_t *state)
+{
+  while (!full (sink))
+    {
+      size_t n = sink->size - sink->len;
+      unsigned char *p = sink->buf + sink->len;
+      if (n > 4096)
+        n = 4096;
+      memset (p, 0, n);
+
+      switch (pick (state, 3))
+        {
+        case 0:
+          {
+            uint32_t v = next_random (state);
+            for (size_t i = 0; i + 4 <= n; i += 4)
+              {
+                v += pick_skewed (state, 64);
+                p[i] = v;
+                p[i + 1] = v >> 8;
+                p[i + 2] = v >> 16;
+                p[i + 3] = v >> 24;
+              }
+          }
+          break;
+        case 1:
+          {
+            unsigned phase = pick (state, 2000);
+            for (size_t i = 0; i + 4 <= n; i += 4)
+              {
+                int x = (phase + i) % 2000;
+                float f = (x < 1000 ? x : 2000 - x) - 500
+                  + pick (state, 100) / 100.0f;
+                memcpy (p + i, &f, 4);
+              }
+          }
+          break;
+        default:
+          for (size_t i = 0; i < n; i++)
+            p[i] = pick_skewed (state, 256);
+          break;
+        }
+      sink->len += n;
+    }
+}
+
+/* Independently deflated chunks of generated text.  These bytes are
+ * only as stable as the bundled zlib's output.
+ */
+static bool
+generate_compressed (struct sink *sink, uint64_t *state)
+{
+  size_t chunk = 1 << 20;
+  struct sink text;
+  bool ok = true;
+
+  text.buf = malloc (chunk);
+  if (text.buf == NULL)
+    return false;
+  text.size = chunk;
+  while (ok && !full (sink))
+    {
+      text.len = 0;
+      if (pick (state, 2))
+        generate_logs (&text, state);
+      else
+        generate_json (&text, state);
+
+      uLongf len = sink->size - sink->len;
+      int ret = compress2 (sink->buf + sink->len, &len, text.buf, text.len,
+                           Z_BEST_COMPRESSION);
+      if (ret == Z_BUF_ERROR)
+        {
+          /* The last chunk does not fit; fill up with a partial one.  */
+          len = sink->size - sink->len;
+          memset (sink->buf + sink->len, 0, len);
+          z_stream strm = { 0 };
+          ok = deflateInit (&strm, Z_BEST_COMPRESSION) == Z_OK;
+          if (ok)
+            {
+              strm.next_in = text.buf;
+              strm.avail_in = text.len;
+              strm.next_out = sink->buf + sink->len;
+              strm.avail_out = len;
+              deflate (&strm, Z_FINISH);
+              deflateEnd (&strm);
+            }
+        }
+      else
+        ok = ret == Z_OK;
+      sink->len += len;
+    }
+  free (text.buf);
+  return ok;
+}
+
+/* A 256 KiB period: a few KiB of log text, then zeros.  */
+static void
+generate_sparse (struct sink *sink, uint64_t *state)
+{
+  memset (sink->buf, 0, sink->size);
+  for (size_t off = 0; off < sink->size; off += 256 * 1024)
+    {
+      size_t end = off + 4096 + pick (state, 8192);
+      struct sink island;
+      island.buf = sink->buf + off;
+      island.size = (end < sink->size ? end : sink->size) - off;
+      island.len = 0;
+      generate_logs (&island, state);
+    }
+  sink->len = sink->size;
+}
+
+/* Return a malloc'd buffer of SIZE bytes of KIND, or NULL if out of
+ * memory.
+ */
+unsigned char *
+corpus_generate (enum corpus_kind kind, size_t size, uint64_t seed)
+{
+  uint64_t state = seed * 0x100 + kind;
+  struct sink sink;
+  bool ok = true;
+
+  sink.buf = malloc (size ? size : 1);
+  if (sink.buf == NULL)
+    return NULL;
+  sink.size = size;
+  sink.len = 0;
+
+  switch (kind)
+    {
+    case CORPUS_LOGS:
+      generate_logs (&sink, &state);
+      break;
+    case CORPUS_JSON:
+      generate_json (&sink, &state);
+      break;
+    case CORPUS_CSV:
+      generate_csv (&sink, &state);
+      break;
+    case CORPUS_BINARY:
+      generate_binary (&sink, &state);
+      break;
+    case CORPUS_COMPRESSED:
+      ok = generate_compressed (&sink, &state);
+      break;
+    case CORPUS_SPARSE:
+      generate_sparse (&sink, &state);
+      break;
+    default:
+      ok = false;
+      break;
+    }
+  if (!ok)
+    {
+      free (sink.buf);
+      return NULL;
+    }
+  return sink.buf;
+}
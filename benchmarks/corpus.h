@@ -0,0 +1,38 @@
+/* corpus.h -- deterministic inputs for the benchmark drivers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kinds of generated input.  The same kind, size and seed always give
+ * the same bytes, on every host, so results can be compared across
+ * machines and builds.
+ */
+enum corpus_kind
+{
+  CORPUS_LOGS,                  /* web server access logs */
+  CORPUS_JSON,                  /* newline-delimited JSON records */
+  CORPUS_CSV,                   /* tabular sales data */
+  CORPUS_BINARY,                /* integer and float arrays, opcodes */
+  CORPUS_COMPRESSED,            /* deflate streams, nearly incompressible */
+  CORPUS_SPARSE,                /* mostly zeros with islands of text */
+  CORPUS_KINDS
+};
+
+extern char const *corpus_name (enum corpus_kind kind);
+extern int corpus_lookup (char const *name);
+extern unsigned char *corpus_generate (enum corpus_kind kind, size_t size,
+                                       uint64_t seed);
@@ -0,0 +1,953 @@
+/* gzbench.c -- in-process compression benchmark
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/*
+ * Generates each corpus in memory, then compresses and decompresses it
+ * with mem_zip and mem_unzip for every combination of level and thread
+ * count.  Nothing touches the disk or the network, and each result is
+ * checked for a correct round trip before it is timed.
+ *
+ * One row per configuration, as CSV or JSON:
+ *   ratio           compressed size / original size
+ *   *_mbps          throughput in 10^6 bytes of original data per second:
+ *                   mean, sample standard deviation and minimum over runs
+ *   *_cpu_s         mean process CPU time per run, all threads included
+ *   peak_rss_kb     high-water resident set size during the configuration
+ *
+ * Thread count 0 means the calling thread does all the work.
+ *
+ * With --sweep, each corpus is instead run through parallel_compress at
+ * every thread count and block size, with each deflate engine asked for,
+ * and each row adds
+ *   speedup         throughput over that of the first thread count
+ *   efficiency      speedup divided by the relative number of threads
+ *   *_util          share of the wall time each stage spent busy; the
+ *                   compress figure is per thread
+ *   saturated       the busiest stage: read, compress or write
+ *
+ * With --baseline, the results are compared with a CSV file written by
+ * an earlier run with the same options, and the exit status is 1 if any
+ * throughput, speedup or efficiency figure dropped, or any ratio grew,
+ * by more than the tolerance.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zlib.h"
+#include "parallel.h"
+#include "corpus.h"
+
+#define MAX_LIST 64
+#define MAX_FIELDS 24
+
+static char const *program_name = "gzbench";
+
+struct options
+{
+  size_t size;
+  int runs;
+  int warmup;
+  uint64_t seed;
+  int levels[MAX_LIST];
+  int nlevels;
+  int threads[MAX_LIST];
+  int nthreads;
+  size_t blocks[MAX_LIST];
+  int nblocks;
+  int corpora[CORPUS_KINDS];
+  int ncorpora;
+  struct deflate_engine const *engines[MAX_LIST];
+  int nengines;
+  bool json;
+  bool sweep;
+  char const *baseline;
+  double tolerance;
+};
+
+/* Summary of repeated measurements.  */
+struct stat_summary
+{
+  double mean;
+  double sd;
+  double min;
+};
+
+/* One line of output: named fields, kept as text so that rows read back
+ * from a baseline file compare the same way as fresh ones.
+ */
+struct row
+{
+  int n;
+  char const *names[MAX_FIELDS];
+  char values[MAX_FIELDS][48];
+};
+
+/* All rows produced so far.  */
+static struct row *rows;
+static int nrows;
+
+static _Noreturn void
+die (char const *format, ...)
+{
+  va_list args;
+  fprintf (stderr, "%s: ", program_name);
+  va_start (args, format);
+  vfprintf (stderr, format, args);
+  va_end (args);
+  fputc ('\n', stderr);
+  exit (EXIT_FAILURE);
+}
+
+static void *
+xmalloc (size_t size)
+{
+  void *p = malloc (size ? size : 1);
+  if (!p)
+    die ("memory exhausted");
+  return p;
+}
+
+static _Noreturn void
+usage (int status)
+{
+  FILE *out = status == EXIT_SUCCESS ? stdout : stderr;
+  fprintf (out, "Usage: %s [OPTION]...\n", program_name);
+  fputs ("\
+Benchmark in-process compression and decompression of generated data.\n\
+\n\
+  -b, --block-sizes=LIST  block sizes for --sweep (default: 32K,128K,1M)\n\
+  -B, --baseline=FILE     compare results with an earlier CSV run\n\
+  -c, --corpus=LIST       corpora to run (default: all of logs,json,csv,\n\
+                          binary,compressed,sparse)\n\
+  -e, --engines=LIST      deflate engines for --sweep, e.g. zlib,native\n\
+                          (default: the one this machine compresses with)\n\
+  -f, --format=FORMAT     csv (default) or json\n\
+  -j, --threads=LIST      thread counts; 0 means no extra threads\n\
+                          (default: 0,1 and powers of two up to the CPUs;\n\
+                          with --sweep, every count from 1 to the CPUs)\n\
+  -l, --levels=LIST       compression levels (default: 1,6,9)\n\
+  -o, --output=FILE       write results to FILE instead of standard output\n\
+  -r, --runs=N            timed runs per configuration (default: 5)\n\
+  -s, --size=SIZE         bytes per corpus, with optional K, M or G suffix\n\
+                          (default: 16M)\n\
+  -S, --seed=N            corpus seed (default: 1)\n\
+  -t, --tolerance=PCT     allowed change from the baseline (default: 10)\n\
+  -w, --warmup=N          untimed runs per configuration (default: 1)\n\
+  -x, --sweep             measure thread scaling of the parallel pipeline\n\
+  -h, --help              display this help and exit\n", out);
+  exit (status);
+}
+
+static size_t
+parse_size (char const *arg)
+{
+  char *end;
+  unsigned long long n;
+
+  errno = 0;
+  n = strtoull (arg, &end, 10);
+  switch (*end)
+    {
+    case 'G': case 'g':
+      n <<= 10;
+      /* fall through */
+    case 'M': case 'm':
+      n <<= 10;
+      /* fall through */
+    case 'K': case 'k':
+      n <<= 10;
+      end++;
+      break;
+    }
+  if (errno || end == arg || *end || SIZE_MAX < n)
+    die ("invalid size: %s", arg);
+  return n;
+}
+
+static int
+parse_int (char const *arg, int min)
+{
+  char *end;
+  long n;
+
+  errno = 0;
+  n = strtol (arg, &end, 10);
+  if (errno || end == arg || *end || n < min || INT_MAX < n)
+    die ("invalid number: %s", arg);
+  return n;
+}
+
+/* Parse a comma-separated list of integers into LIST.  */
+static int
+parse_list (char *arg, int *list, int min, int max)
+{
+  int n = 0;
+  for (char *tok = strtok (arg, ","); tok; tok = strtok (NULL, ","))
+    {
+      if (n == MAX_LIST)
+        die ("too many values in list");
+      list[n] = parse_int (tok, min);
+      if (max < list[n])
+        die ("value out of range: %s", tok);
+      n++;
+    }
+  if (n == 0)
+    die ("empty list");
+  return n;
+}
+
+static void
+parse_options (int argc, char **argv, struct options *opt)
+{
+  static struct option const longopts[] = {
+    {"block-sizes", required_argument, NULL, 'b'},
+    {"baseline", required_argument, NULL, 'B'},
+    {"corpus", required_argument, NULL, 'c'},
+    {"engines", required_argument, NULL, 'e'},
+    {"format", required_argument, NULL, 'f'},
+    {"threads", required_argument, NULL, 'j'},
+    {"levels", required_argument, NULL, 'l'},
+    {"output", required_argument, NULL, 'o'},
+    {"runs", required_argument, NULL, 'r'},
+    {"size", required_argument, NULL, 's'},
+    {"seed", required_argument, NULL, 'S'},
+    {"tolerance", required_argument, NULL, 't'},
+    {"warmup", required_argument, NULL, 'w'},
+    {"sweep", no_argument, NULL, 'x'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  int c;
+
+  opt->size = 16 << 20;
+  opt->runs = 5;
+  opt->warmup = 1;
+  opt->seed = 1;
+  opt->levels[0] = 1;
+  opt->levels[1] = 6;
+  opt->levels[2] = 9;
+  opt->nlevels = 3;
+  opt->nthreads = 0;
+  opt->nblocks = 0;
+  opt->ncorpora = 0;
+  opt->nengines = 0;
+  opt->json = false;
+  opt->sweep = false;
+  opt->baseline = NULL;
+  opt->tolerance = 10;
+
+  while ((c = getopt_long (argc, argv, "b:B:c:e:f:j:l:o:r:s:S:t:w:xh",
+                           longopts, NULL)) != -1)
+    switch (c)
+      {
+      case 'b':
+        for (char *tok = strtok (optarg, ","); tok; tok = strtok (NULL, ","))
+          {
+            if (opt->nblocks == MAX_LIST)
+              die ("too many block sizes");
+            opt->blocks[opt->nblocks] = parse_size (tok);
+            if (opt->blocks[opt->nblocks] < 32768)
+              die ("block size below 32K: %s", tok);
+            opt->nblocks++;
+          }
+        break;
+      case 'B':
+        opt->baseline = optarg;
+        break;
+      case 'c':
+        for (char *tok = strtok (optarg, ","); tok; tok = strtok (NULL, ","))
+          {
+            int kind = corpus_lookup (tok);
+            if (kind < 0)
+              die ("unknown corpus: %s", tok);
+            if (opt->ncorpora == CORPUS_KINDS)
+              die ("too many corpora");
+            opt->corpora[opt->ncorpora++] = kind;
+          }
+        break;
+      case 'e':
+        for (char *tok = strtok (optarg, ","); tok; tok = strtok (NULL, ","))
+          {
+            struct deflate_engine const *e = deflate_engine_find (tok);
+            if (!e)
+              die ("unknown engine: %s", tok);
+            if (!e->available ())
+              die ("engine not supported on this machine: %s", tok);
+            if (opt->nengines == MAX_LIST)
+              die ("too many engines");
+            opt->engines[opt->nengines++] = e;
+          }
+        break;
+      case 'f':
+        if (strcmp (optarg, "json") == 0)
+          opt->json = true;
+        else if (strcmp (optarg, "csv") == 0)
+          opt->json = false;
+        else
+          die ("unknown format: %s", optarg);
+        break;
+      case 'j':
+        opt->nthreads = parse_list (optarg, opt->threads, 0, 1024);
+        break;
+      case 'l':
+        opt->nlevels = parse_list (optarg, opt->levels, 1, 9);
+        break;
+      case 'o':
+        if (!freopen (optarg, "w", stdout))
+          die ("%s: %s", optarg, strerror (errno));
+        break;
+      case 'r':
+        opt->runs = parse_int (optarg, 1);
+        break;
+      case 's':
+        opt->size = parse_size (optarg);
+        break;
+      case 'S':
+        opt->seed = parse_int (optarg, 0);
+        break;
+      case 't':
+        opt->tolerance = parse_int (optarg, 0);
+        break;
+      case 'w':
+        opt->warmup = parse_int (optarg, 0);
+        break;
+      case 'x':
+        opt->sweep = true;
+        break;
+      case 'h':
+        usage (EXIT_SUCCESS);
+      default:
+        usage (EXIT_FAILURE);
+      }
+  if (optind != argc)
+    usage (EXIT_FAILURE);
+
+  if (opt->nthreads == 0 && opt->sweep)
+    {
+      for (long t = 1; t <= cpus && opt->nthreads < MAX_LIST; t++)
+        opt->threads[opt->nthreads++] = t;
+      if (opt->nthreads == 0)
+        opt->threads[opt->nthreads++] = 1;
+    }
+  else if (opt->nthreads == 0)
+    {
+      opt->threads[opt->nthreads++] = 0;
+      for (long t = 1; t < cpus && opt->nthreads < MAX_LIST - 1; t *= 2)
+        opt->threads[opt->nthreads++] = t;
+      if (cpus > 0)
+        opt->threads[opt->nthreads++] = cpus;
+    }
+  if (opt->sweep)
+    for (int i = 0; i < opt->nthreads; i++)
+      if (opt->threads[i] == 0)
+        die ("--sweep needs thread counts of at least 1");
+  if (opt->nblocks == 0)
+    {
+      opt->blocks[opt->nblocks++] = 32 << 10;
+      opt->blocks[opt->nblocks++] = 128 << 10;
+      opt->blocks[opt->nblocks++] = 1 << 20;
+    }
+  if (opt->ncorpora == 0)
+    for (int i = 0; i < CORPUS_KINDS; i++)
+      opt->corpora[opt->ncorpora++] = i;
+  if (opt->nengines == 0)
+    opt->engines[opt->nengines++] = deflate_engine_default (false);
+}
+
+/* ===========================================================================
+ * Measurement.
+ */
+
+static double
+seconds (clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime (clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Restart the high-water mark of the resident set, where Linux lets us.  */
+static void
+reset_peak_rss (void)
+{
+  int fd = open ("/proc/self/clear_refs", O_WRONLY);
+  if (0 <= fd)
+    {
+      if (write (fd, "5", 1) != 1)
+        {
+          /* Older kernels; the mark then covers the whole process.  */
+        }
+      close (fd);
+    }
+}
+
+static long
+peak_rss_kb (void)
+{
+  FILE *f = fopen ("/proc/self/status", "r");
+  char line[256];
+  long kb = -1;
+
+  if (f)
+    {
+      while (fgets (line, sizeof line, f))
+        if (sscanf (line, "VmHWM: %ld kB", &kb) == 1)
+          break;
+      fclose (f);
+    }
+  if (kb < 0)
+    {
+      struct rusage usage;
+      if (getrusage (RUSAGE_SELF, &usage) == 0)
+        kb = usage.ru_maxrss;
+    }
+  return kb;
+}
+
+static struct stat_summary
+summarize (double const *v, int n)
+{
+  struct stat_summary s = { 0, 0, v[0] };
+  for (int i = 0; i < n; i++)
+    {
+      s.mean += v[i];
+      if (v[i] < s.min)
+        s.min = v[i];
+    }
+  s.mean /= n;
+  if (n > 1)
+    {
+      double sq = 0;
+      for (int i = 0; i < n; i++)
+        sq += (v[i] - s.mean) * (v[i] - s.mean);
+      s.sd = sqrt (sq / (n - 1));
+    }
+  return s;
+}
+
+static double
+mbps (size_t size, double secs)
+{
+  return size / 1e6 / (secs > 0 ? secs : 1e-9);
+}
+
+static void
+check (int ret, char const *what, char const *corpus)
+{
+  if (ret == Z_MEM_ERROR)
+    die ("%s: %s: memory exhausted", corpus, what);
+  if (ret != Z_OK)
+    die ("%s: %s failed with status %d", corpus, what, ret);
+}
+
+/* Die unless the gzip data in ZIP decompresses to the SIZE bytes at DATA.  */
+static void
+verify (struct mem_buffer const *zip, unsigned char const *data, size_t size,
+        char const *corpus, int level, int threads)
+{
+  struct iovec z = { zip->data, zip->len };
+  struct mem_buffer unzip = { NULL, 0, 0, true };
+
+  check (mem_unzip (&unzip, &z, 1), "decompression", corpus);
+  if (unzip.len != size || memcmp (unzip.data, data, size) != 0)
+    die ("%s: level %d, %d threads: round trip mismatch",
+         corpus, level, threads);
+  free (unzip.data);
+}
+
+/* ===========================================================================
+ * Rows.
+ */
+
+static void
+add_field (struct row *r, char const *name, char const *format, ...)
+{
+  va_list args;
+
+  if (r->n == MAX_FIELDS)
+    die ("too many fields");
+  r->names[r->n] = name;
+  va_start (args, format);
+  vsnprintf (r->values[r->n], sizeof r->values[r->n], format, args);
+  va_end (args);
+  r->n++;
+}
+
+static char const *
+field (struct row const *r, char const *name)
+{
+  for (int i = 0; i < r->n; i++)
+    if (strcmp (r->names[i], name) == 0)
+      return r->values[i];
+  return NULL;
+}
+
+static bool
+numeric (char const *s)
+{
+  char *end;
+  strtod (s, &end);
+  return *s && !*end;
+}
+
+static void
+print_row (struct options const *opt, struct row const *r)
+{
+  bool first = nrows == 0;
+
+  if (opt->json)
+    {
+      printf ("%s  {", first ? "[\n" : ",\n");
+      for (int i = 0; i < r->n; i++)
+        printf (numeric (r->values[i]) ? "%s\"%s\": %s" : "%s\"%s\": \"%s\"",
+                i ? ", " : "", r->names[i], r->values[i]);
+      putchar ('}');
+    }
+  else
+    {
+      if (first)
+        for (int i = 0; i < r->n; i++)
+          printf ("%s%c", r->names[i], i + 1 < r->n ? ',' : '\n');
+      for (int i = 0; i < r->n; i++)
+        printf ("%s%c", r->values[i], i + 1 < r->n ? ',' : '\n');
+    }
+  fflush (stdout);
+}
+
+static void
+emit_row (struct options const *opt, struct row const *r)
+{
+  static int allocated;
+
+  print_row (opt, r);
+  if (nrows == allocated)
+    {
+      allocated = allocated ? 2 * allocated : 64;
+      rows = realloc (rows, allocated * sizeof *rows);
+      if (!rows)
+        die ("memory exhausted");
+    }
+  rows[nrows++] = *r;
+}
+
+/* ===========================================================================
+ * Default mode: mem_zip and mem_unzip.
+ */
+
+static void
+run_config (struct options const *opt, char const *corpus,
+            unsigned char const *data, int level, int threads)
+{
+  struct iovec in = { (void *) data, opt->size };
+  struct mem_buffer zip = { NULL, 0, 0, true };
+  struct mem_buffer unzip = { NULL, 0, 0, true };
+  double *comp = xmalloc (opt->runs * sizeof *comp);
+  double *decomp = xmalloc (opt->runs * sizeof *decomp);
+  double comp_cpu = 0, decomp_cpu = 0;
+  struct row r = { 0 };
+
+  reset_peak_rss ();
+  for (int i = -opt->warmup; i < opt->runs; i++)
+    {
+      double t0, c0;
+
+      zip.len = 0;
+      t0 = seconds (CLOCK_MONOTONIC);
+      c0 = seconds (CLOCK_PROCESS_CPUTIME_ID);
+      check (mem_zip (&zip, &in, 1, level, threads), "compression", corpus);
+      double comp_wall = seconds (CLOCK_MONOTONIC) - t0;
+      double comp_c = seconds (CLOCK_PROCESS_CPUTIME_ID) - c0;
+
+      struct iovec z = { zip.data, zip.len };
+      unzip.len = 0;
+      t0 = seconds (CLOCK_MONOTONIC);
+      c0 = seconds (CLOCK_PROCESS_CPUTIME_ID);
+      check (mem_unzip (&unzip, &z, 1), "decompression", corpus);
+      double decomp_wall = seconds (CLOCK_MONOTONIC) - t0;
+      double decomp_c = seconds (CLOCK_PROCESS_CPUTIME_ID) - c0;
+
+      if (i == -opt->warmup
+          && (unzip.len != opt->size
+              || memcmp (unzip.data, data, opt->size) != 0))
+        die ("%s: level %d, %d threads: round trip mismatch",
+             corpus, level, threads);
+      if (i < 0)
+        continue;
+      comp[i] = mbps (opt->size, comp_wall);
+      decomp[i] = mbps (opt->size, decomp_wall);
+      comp_cpu += comp_c;
+      decomp_cpu += decomp_c;
+    }
+
+  struct stat_summary c = summarize (comp, opt->runs);
+  struct stat_summary d = summarize (decomp, opt->runs);
+  add_field (&r, "corpus", "%s", corpus);
+  add_field (&r, "size", "%zu", opt->size);
+  add_field (&r, "level", "%d", level);
+  add_field (&r, "threads", "%d", threads);
+  add_field (&r, "runs", "%d", opt->runs);
+  add_field (&r, "ratio", "%.4f",
+             opt->size ? (double) zip.len / opt->size : 0.0);
+  add_field (&r, "comp_mbps", "%.2f", c.mean);
+  add_field (&r, "comp_mbps_sd", "%.2f", c.sd);
+  add_field (&r, "comp_mbps_min", "%.2f", c.min);
+  add_field (&r, "comp_cpu_s", "%.4f", comp_cpu / opt->runs);
+  add_field (&r, "decomp_mbps", "%.2f", d.mean);
+  add_field (&r, "decomp_mbps_sd", "%.2f", d.sd);
+  add_field (&r, "decomp_mbps_min", "%.2f", d.min);
+  add_field (&r, "decomp_cpu_s", "%.4f", decomp_cpu / opt->runs);
+  add_field (&r, "peak_rss_kb", "%ld", peak_rss_kb ());
+  emit_row (opt, &r);
+
+  free (comp);
+  free (decomp);
+  free (zip.data);
+  free (unzip.data);
+}
+
+/* ===========================================================================
+ * Sweep mode: parallel_compress directly, to control the block size and
+ * collect its stage timings.
+ */
+
+struct sweep_io
+{
+  unsigned char const *data;
+  size_t size;
+  size_t off;
+  struct mem_buffer *out;
+};
+
+static ssize_t
+sweep_read (void *opaque, unsigned char **data, size_t size)
+{
+  struct sweep_io *io = opaque;
+  size_t len = io->size - io->off;
+
+  if (len > size)
+    len = size;
+  *data = (unsigned char *) io->data + io->off;
+  io->off += len;
+  return len;
+}
+
+static int
+sweep_write (void *opaque, unsigned char const *data, size_t len)
+{
+  struct mem_buffer *out = ((struct sweep_io *) opaque)->out;
+
+  if (out->size - out->len < len)
+    {
+      size_t size = 2 * out->size + len;
+      unsigned char *p = realloc (out->data, size);
+      if (!p)
+        return -1;
+      out->data = p;
+      out->size = size;
+    }
+  memcpy (out->data + out->len, data, len);
+  out->len += len;
+  return 0;
+}
+
+static void
+sweep_config (struct options const *opt, char const *corpus,
+              unsigned char const *data, struct deflate_engine const *engine,
+              int level, size_t block, int threads, double *base_mbps,
+              int *base_threads)
+{
+  struct mem_buffer zip = { NULL, 0, 0, true };
+  struct sweep_io io = { data, opt->size, 0, &zip };
+  struct pipeline_stats stats, sum = { 0 };
+  struct pipeline_params params = {
+    .level = level,
+    .threads = threads,
+    .block_size = block,
+    .engine = engine,
+    .read = sweep_read,
+    .borrow = true,
+    .write = sweep_write,
+    .opaque = &io,
+    .stats = &stats
+  };
+  double *speed = xmalloc (opt->runs * sizeof *speed);
+  struct row r = { 0 };
+
+  for (int i = -opt->warmup; i < opt->runs; i++)
+    {
+      io.off = 0;
+      zip.len = 0;
+      double t0 = seconds (CLOCK_MONOTONIC);
+      check (parallel_compress (&params), "compression", corpus);
+      double wall = seconds (CLOCK_MONOTONIC) - t0;
+
+      if (i == -opt->warmup)
+        verify (&zip, data, opt->size, corpus, level, threads);
+      if (i < 0)
+        continue;
+      speed[i] = mbps (opt->size, wall);
+      sum.wall += stats.wall;
+      sum.read_busy += stats.read_busy;
+      sum.compress_busy += stats.compress_busy / stats.threads;
+      sum.write_busy += stats.write_busy;
+    }
+
+  struct stat_summary s = summarize (speed, opt->runs);
+  if (*base_threads == 0)
+    {
+      *base_mbps = s.mean;
+      *base_threads = threads;
+    }
+  double speedup = s.mean / *base_mbps;
+  double util[3] = {
+    sum.read_busy / sum.wall,
+    sum.compress_busy / sum.wall,
+    sum.write_busy / sum.wall
+  };
+  static char const *const stages[3] = { "read", "compress", "write" };
+  int busiest = 0;
+  for (int i = 1; i < 3; i++)
+    if (util[busiest] < util[i])
+      busiest = i;
+
+  add_field (&r, "corpus", "%s", corpus);
+  add_field (&r, "size", "%zu", opt->size);
+  add_field (&r, "engine", "%s", engine->name);
+  add_field (&r, "level", "%d", level);
+  add_field (&r, "block_size", "%zu", block);
+  add_field (&r, "threads", "%d", threads);
+  add_field (&r, "runs", "%d", opt->runs);
+  add_field (&r, "ratio", "%.4f",
+             opt->size ? (double) zip.len / opt->size : 0.0);
+  add_field (&r, "mbps", "%.2f", s.mean);
+  add_field (&r, "mbps_sd", "%.2f", s.sd);
+  add_field (&r, "speedup", "%.3f", speedup);
+  add_field (&r, "efficiency", "%.3f",
+             speedup * *base_threads / threads);
+  add_field (&r, "read_util", "%.3f", util[0]);
+  add_field (&r, "compress_util", "%.3f", util[1]);
+  add_field (&r, "write_util", "%.3f", util[2]);
+  add_field (&r, "saturated", "%s", stages[busiest]);
+  emit_row (opt, &r);
+
+  free (speed);
+  free (zip.data);
+}
+
+/* ===========================================================================
+ * Baseline comparison.
+ */
+
+/* Fields that identify a configuration.  */
+static char const *const key_fields[] = {
+  "corpus", "size", "engine", "level", "block_size", "threads"
+};
+
+/* Fields compared against the baseline; for the first group higher is
+ * better, for the second lower.
+ */
+static char const *const higher_better[] = {
+  "comp_mbps", "decomp_mbps", "mbps", "speedup", "efficiency"
+};
+static char const *const lower_better[] = { "ratio" };
+
+#define COUNTOF(a) (sizeof (a) / sizeof *(a))
+
+/* Read the CSV file NAME into a malloc'd array of rows.  */
+static struct row *
+load_baseline (char const *name, int *count)
+{
+  FILE *f = fopen (name, "r");
+  char line[4096];
+  char *header[MAX_FIELDS];
+  int nheader = 0;
+  struct row *base = NULL;
+  int n = 0, allocated = 0;
+
+  if (!f)
+    die ("%s: %s", name, strerror (errno));
+  if (!fgets (line, sizeof line, f))
+    die ("%s: empty baseline", name);
+  line[strcspn (line, "\r\n")] = '\0';
+  for (char *tok = strtok (line, ","); tok; tok = strtok (NULL, ","))
+    {
+      if (nheader == MAX_FIELDS)
+        die ("%s: too many columns", name);
+      header[nheader] = strdup (tok);
+      if (!header[nheader])
+        die ("memory exhausted");
+      nheader++;
+    }
+
+  while (fgets (line, sizeof line, f))
+    {
+      struct row r = { 0 };
+      line[strcspn (line, "\r\n")] = '\0';
+      for (char *tok = strtok (line, ","); tok && r.n < nheader;
+           tok = strtok (NULL, ","))
+        add_field (&r, header[r.n], "%s", tok);
+      if (r.n == 0)
+        continue;
+      if (n == allocated)
+        {
+          allocated = allocated ? 2 * allocated : 64;
+          base = realloc (base, allocated * sizeof *base);
+          if (!base)
+            die ("memory exhausted");
+        }
+      base[n++] = r;
+    }
+  fclose (f);
+  *count = n;
+  return base;
+}
+
+static bool
+same_config (struct row const *a, struct row const *b)
+{
+  for (size_t i = 0; i < COUNTOF (key_fields); i++)
+    {
+      char const *x = field (a, key_fields[i]);
+      char const *y = field (b, key_fields[i]);
+      if ((x == NULL) != (y == NULL) || (x && strcmp (x, y) != 0))
+        return false;
+    }
+  return true;
+}
+
+static void
+describe (struct row const *r, char *buf, size_t size)
+{
+  size_t len = 0;
+  buf[0] = '\0';
+  for (size_t i = 0; i < COUNTOF (key_fields) && len < size; i++)
+    {
+      char const *v = field (r, key_fields[i]);
+      if (v)
+        len += snprintf (buf + len, size - len, "%s%s=%s", len ? " " : "",
+                         key_fields[i], v);
+    }
+}
+
+/* Report a change beyond the tolerance in metric NAME of R; SIGN is 1
+ * if higher is better and -1 if lower is.  Return true if there was one.
+ */
+static bool
+regressed (struct options const *opt, struct row const *r,
+           struct row const *base, char const *name, int sign)
+{
+  char const *now = field (r, name);
+  char const *was = field (base, name);
+  if (!now || !was)
+    return false;
+
+  double x = strtod (now, NULL), y = strtod (was, NULL);
+  double change = y ? (x - y) / y * 100 : 0;
+  if (sign * change >= -opt->tolerance)
+    return false;
+
+  char config[256];
+  describe (r, config, sizeof config);
+  fprintf (stderr, "%s: regression: %s: %s %s -> %s (%+.1f%%)\n",
+           program_name, config, name, was, now, change);
+  return true;
+}
+
+static int
+compare_baseline (struct options const *opt)
+{
+  int nbase;
+  struct row *base = load_baseline (opt->baseline, &nbase);
+  int regressions = 0, matched = 0;
+
+  for (int i = 0; i < nrows; i++)
+    for (int j = 0; j < nbase; j++)
+      if (same_config (&rows[i], &base[j]))
+        {
+          matched++;
+          for (size_t k = 0; k < COUNTOF (higher_better); k++)
+            regressions += regressed (opt, &rows[i], &base[j],
+                                      higher_better[k], 1);
+          for (size_t k = 0; k < COUNTOF (lower_better); k++)
+            regressions += regressed (opt, &rows[i], &base[j],
+                                      lower_better[k], -1);
+          break;
+        }
+
+  fprintf (stderr, "%s: %d of %d configurations found in %s, "
+           "%d regressions beyond %g%%\n", program_name, matched, nrows,
+           opt->baseline, regressions, opt->tolerance);
+  free (base);
+  return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct options opt;
+  int status = EXIT_SUCCESS;
+
+  parse_options (argc, argv, &opt);
+
+  for (int c = 0; c < opt.ncorpora; c++)
+    {
+      char const *name = corpus_name (opt.corpora[c]);
+      unsigned char *data = corpus_generate (opt.corpora[c], opt.size,
+                                             opt.seed);
+      if (!data)
+        die ("%s: cannot generate corpus", name);
+
+      for (int l = 0; l < opt.nlevels; l++)
+        if (opt.sweep)
+          for (int e = 0; e < opt.nengines; e++)
+            for (int b = 0; b < opt.nblocks; b++)
+              {
+                double base_mbps = 0;
+                int base_threads = 0;
+                for (int t = 0; t < opt.nthreads; t++)
+                  sweep_config (&opt, name, data, opt.engines[e],
+                                opt.levels[l], opt.blocks[b], opt.threads[t],
+                                &base_mbps, &base_threads);
+              }
+        else
+          for (int t = 0; t < opt.nthreads; t++)
+            run_config (&opt, name, data, opt.levels[l], opt.threads[t]);
+      free (data);
+    }
+
+  if (opt.json)
+    fputs (nrows ? "\n]\n" : "[]\n", stdout);
+  if (fclose (stdout) != 0)
+    die ("write error: %s", strerror (errno));
+  if (opt.baseline)
+    status = compare_baseline (&opt);
+  free (rows);
+  return status;
+}
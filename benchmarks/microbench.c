@@ -0,0 +1,669 @@
+/* microbench.c -- benchmarks for the primitives of the parallel pipeline
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/*
+ * Times each building block of the pipeline on its own, so that a change
+ * in gzbench's end-to-end figures can be traced to the stage behind it:
+ *
+ *   crc32z        check value of one block, as compress_job computes it
+ *   crc32_comb    combination of two check values
+ *   updcrc        the serial code's table-driven CRC
+ *   deflate       one block with each engine that this machine can run,
+ *                 at each level, as compress_job deflates it
+ *   inflate       the same block, deflated by zlib, with each engine
+ *   buffer_pool   get_buffer and return_buffer, by N threads at once
+ *   job_list      get_job and queue_job by one thread, pop_job and
+ *                 return_job by N others
+ *
+ * Each benchmark first doubles its iteration count until one run takes
+ * at least --min-time, then makes --warmup untimed runs and --runs timed
+ * ones.  One row per benchmark, as CSV or JSON:
+ *   ns_op, ns_op_sd   mean and standard deviation of the time per iteration;
+ *                     in buffer_pool every thread makes all the iterations
+ *   cycles_op         time stamp counter ticks per iteration, where the
+ *                     processor has one; empty or null otherwise
+ *   mbps              10^6 bytes processed per second, for the benchmarks
+ *                     that work on data
+ *
+ * The functions measured are static, so parallel.c is compiled into this
+ * program directly rather than linked from libgzippier.a.
+ */
+
+#include "parallel.c"
+
+#include <getopt.h>
+#include <math.h>
+#include <stdarg.h>
+
+#if defined __x86_64__ || defined __i386__
+# include <x86intrin.h>
+# define HAVE_TSC 1
+#else
+# define HAVE_TSC 0
+#endif
+
+#include "corpus.h"
+
+#define MAX_LIST 64
+
+static char const *progname = "microbench";
+
+struct options
+{
+  int runs;
+  int warmup;
+  double min_time;
+  size_t sizes[MAX_LIST];
+  int nsizes;
+  int threads[MAX_LIST];
+  int nthreads;
+  int corpus;
+  char const *only;
+  bool json;
+};
+
+/* One timed run.  */
+struct sample
+{
+  double secs;
+  uint64_t ticks;
+};
+
+/* Run ITERS iterations of a benchmark on CTX and say how long they took.  */
+typedef struct sample (*bench_fn) (void *ctx, long iters);
+
+static int nrows;
+
+static _Noreturn void
+die (char const *format, ...)
+{
+  va_list args;
+  fprintf (stderr, "%s: ", progname);
+  va_start (args, format);
+  vfprintf (stderr, format, args);
+  va_end (args);
+  fputc ('\n', stderr);
+  exit (EXIT_FAILURE);
+}
+
+static void *
+xmalloc (size_t size)
+{
+  void *p = malloc (size ? size : 1);
+  if (!p)
+    die ("memory exhausted");
+  return p;
+}
+
+static _Noreturn void
+usage (int status)
+{
+  FILE *out = status == EXIT_SUCCESS ? stdout : stderr;
+  fprintf (out, "Usage: %s [OPTION]...\n", progname);
+  fputs ("\
+Benchmark the primitives of the parallel compressor one at a time.\n\
+\n\
+  -b, --bench=NAME        run only the benchmarks called NAME\n\
+  -c, --corpus=NAME       data for deflate and inflate (default: logs)\n\
+  -f, --format=FORMAT     csv (default) or json\n\
+  -j, --threads=LIST      thread counts for the contention benchmarks\n\
+                          (default: 1,2 and powers of two up to the CPUs)\n\
+  -m, --min-time=MS       minimum length of one run (default: 50)\n\
+  -o, --output=FILE       write results to FILE instead of standard output\n\
+  -r, --runs=N            timed runs per benchmark (default: 5)\n\
+  -s, --sizes=LIST        buffer sizes for the CRC benchmarks, with\n\
+                          optional K or M suffix (default: 4K,128K,1M);\n\
+                          deflate and inflate use the pipeline's block\n\
+                          size\n\
+  -w, --warmup=N          untimed runs per benchmark (default: 1)\n\
+  -h, --help              display this help and exit\n", out);
+  exit (status);
+}
+
+static long
+parse_number (char const *arg, long min, bool suffix)
+{
+  char *end;
+  long n;
+
+  errno = 0;
+  n = strtol (arg, &end, 10);
+  if (suffix && (*end == 'M' || *end == 'm'))
+    n <<= 20, end++;
+  else if (suffix && (*end == 'K' || *end == 'k'))
+    n <<= 10, end++;
+  if (errno || end == arg || *end || n < min || INT_MAX < n)
+    die ("invalid number: %s", arg);
+  return n;
+}
+
+static void
+parse_options (int argc, char **argv, struct options *opt)
+{
+  static struct option const longopts[] = {
+    {"bench", required_argument, NULL, 'b'},
+    {"corpus", required_argument, NULL, 'c'},
+    {"format", required_argument, NULL, 'f'},
+    {"threads", required_argument, NULL, 'j'},
+    {"min-time", required_argument, NULL, 'm'},
+    {"output", required_argument, NULL, 'o'},
+    {"runs", required_argument, NULL, 'r'},
+    {"sizes", required_argument, NULL, 's'},
+    {"warmup", required_argument, NULL, 'w'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  int c;
+
+  opt->runs = 5;
+  opt->warmup = 1;
+  opt->min_time = 0.05;
+  opt->nsizes = 0;
+  opt->nthreads = 0;
+  opt->corpus = CORPUS_LOGS;
+  opt->only = NULL;
+  opt->json = false;
+
+  while ((c = getopt_long (argc, argv, "b:c:f:j:m:o:r:s:w:h",
+                           longopts, NULL)) != -1)
+    switch (c)
+      {
+      case 'b':
+        opt->only = optarg;
+        break;
+      case 'c':
+        opt->corpus = corpus_lookup (optarg);
+        if (opt->corpus < 0)
+          die ("unknown corpus: %s", optarg);
+        break;
+      case 'f':
+        if (strcmp (optarg, "json") == 0)
+          opt->json = true;
+        else if (strcmp (optarg, "csv") == 0)
+          opt->json = false;
+        else
+          die ("unknown format: %s", optarg);
+        break;
+      case 'j':
+        for (char *tok = strtok (optarg, ","); tok; tok = strtok (NULL, ","))
+          {
+            if (opt->nthreads == MAX_LIST)
+              die ("too many thread counts");
+            opt->threads[opt->nthreads++] = parse_number (tok, 1, false);
+          }
+        break;
+      case 'm':
+        opt->min_time = parse_number (optarg, 1, false) / 1e3;
+        break;
+      case 'o':
+        if (!freopen (optarg, "w", stdout))
+          die ("%s: %s", optarg, strerror (errno));
+        break;
+      case 'r':
+        opt->runs = parse_number (optarg, 1, false);
+        break;
+      case 's':
+        for (char *tok = strtok (optarg, ","); tok; tok = strtok (NULL, ","))
+          {
+            if (opt->nsizes == MAX_LIST)
+              die ("too many sizes");
+            opt->sizes[opt->nsizes++] = parse_number (tok, 1, true);
+          }
+        break;
+      case 'w':
+        opt->warmup = parse_number (optarg, 0, false);
+        break;
+      case 'h':
+        usage (EXIT_SUCCESS);
+      default:
+        usage (EXIT_FAILURE);
+      }
+  if (optind != argc)
+    usage (EXIT_FAILURE);
+
+  if (opt->nsizes == 0)
+    {
+      opt->sizes[opt->nsizes++] = 4 << 10;
+      opt->sizes[opt->nsizes++] = PARALLEL_BLOCK_SIZE;
+      opt->sizes[opt->nsizes++] = 1 << 20;
+    }
+  if (opt->nthreads == 0)
+    {
+      opt->threads[opt->nthreads++] = 1;
+      for (long t = 2; t < cpus && opt->nthreads < MAX_LIST - 1; t *= 2)
+        opt->threads[opt->nthreads++] = t;
+      opt->threads[opt->nthreads++] = cpus > 2 ? cpus : 2;
+    }
+}
+
+/* ===========================================================================
+ * Timing.
+ */
+
+static uint64_t
+ticks (void)
+{
+#if HAVE_TSC
+  return __rdtsc ();
+#else
+  return 0;
+#endif
+}
+
+static struct sample
+start_sample (void)
+{
+  struct sample s = { now (), ticks () };
+  return s;
+}
+
+static struct sample
+stop_sample (struct sample start)
+{
+  struct sample s = { now () - start.secs, ticks () - start.ticks };
+  return s;
+}
+
+/* Keeps results alive so that the compiler cannot drop the work.  */
+static volatile unsigned long sink;
+
+/* Time FN on CTX and print a row for it.  BYTES is the data processed by
+ * one iteration, or 0.
+ */
+static void
+measure (struct options const *opt, char const *name, char const *arg,
+         int threads, size_t bytes, bench_fn fn, void *ctx)
+{
+  long iters = 1;
+  double *ns = xmalloc (opt->runs * sizeof *ns);
+  double mean = 0, sd = 0, cycles = 0;
+
+  if (opt->only && strcmp (opt->only, name) != 0)
+    {
+      free (ns);
+      return;
+    }
+
+  // calibrate, which also warms up caches and the allocator
+  while (fn (ctx, iters).secs < opt->min_time && iters < LONG_MAX / 2)
+    iters *= 2;
+  for (int i = 0; i < opt->warmup; i++)
+    fn (ctx, iters);
+
+  for (int i = 0; i < opt->runs; i++)
+    {
+      struct sample s = fn (ctx, iters);
+      ns[i] = s.secs * 1e9 / iters;
+      mean += ns[i];
+      cycles += (double) s.ticks / iters;
+    }
+  mean /= opt->runs;
+  cycles /= opt->runs;
+  for (int i = 0; i < opt->runs; i++)
+    sd += (ns[i] - mean) * (ns[i] - mean);
+  sd = opt->runs > 1 ? sqrt (sd / (opt->runs - 1)) : 0;
+
+  if (opt->json)
+    {
+      printf ("%s  {\"bench\": \"%s\", \"arg\": \"%s\", \"threads\": %d, "
+              "\"runs\": %d, \"iters\": %ld, \"ns_op\": %.2f, "
+              "\"ns_op_sd\": %.2f, ",
+              nrows ? ",\n" : "[\n", name, arg, threads, opt->runs, iters,
+              mean, sd);
+      if (HAVE_TSC)
+        printf ("\"cycles_op\": %.1f, ", cycles);
+      else
+        fputs ("\"cycles_op\": null, ", stdout);
+      if (bytes)
+        printf ("\"mbps\": %.2f}", bytes * 1e3 / mean);
+      else
+        fputs ("\"mbps\": null}", stdout);
+    }
+  else
+    {
+      if (nrows == 0)
+        puts ("bench,arg,threads,runs,iters,ns_op,ns_op_sd,cycles_op,mbps");
+      printf ("%s,%s,%d,%d,%ld,%.2f,%.2f,", name, arg, threads, opt->runs,
+              iters, mean, sd);
+      if (HAVE_TSC)
+        printf ("%.1f", cycles);
+      putchar (',');
+      if (bytes)
+        printf ("%.2f", bytes * 1e3 / mean);
+      putchar ('\n');
+    }
+  fflush (stdout);
+  nrows++;
+  free (ns);
+}
+
+/* ===========================================================================
+ * Checksums.
+ */
+
+struct data_ctx
+{
+  unsigned char *data;
+  size_t len;
+};
+
+static struct sample
+bench_crc32z (void *arg, long iters)
+{
+  struct data_ctx *ctx = arg;
+  unsigned long crc = crc32z (0L, Z_NULL, 0);
+  struct sample s = start_sample ();
+
+  for (long i = 0; i < iters; i++)
+    crc = crc32z (crc, ctx->data, ctx->len);
+  s = stop_sample (s);
+  sink = crc;
+  return s;
+}
+
+static struct sample
+bench_crc32_comb (void *arg, long iters)
+{
+  struct data_ctx *ctx = arg;
+  unsigned long crc = 0x12345678UL;
+  struct sample s = start_sample ();
+
+  // each result feeds the next, as when the writer folds in every block
+  for (long i = 0; i < iters; i++)
+    crc = crc32_comb (crc, 0x9abcdef0UL ^ i, ctx->len);
+  s = stop_sample (s);
+  sink = crc;
+  return s;
+}
+
+static struct sample
+bench_updcrc (void *arg, long iters)
+{
+  struct data_ctx *ctx = arg;
+  struct sample s;
+  unsigned long crc;
+
+  updcrc (NULL, 0);
+  s = start_sample ();
+  for (long i = 0; i < iters; i++)
+    {
+      size_t len = ctx->len;
+      uch const *p = ctx->data;
+      for (; len > UINT_MAX; len -= UINT_MAX, p += UINT_MAX)
+        updcrc (p, UINT_MAX);
+      updcrc (p, len);
+    }
+  s = stop_sample (s);
+  crc = getcrc ();
+  sink = crc;
+  return s;
+}
+
+/* ===========================================================================
+ * Deflate.
+ */
+
+struct deflate_ctx
+{
+  struct deflate_engine const *engine;
+  void *state;
+  unsigned char *out;
+  size_t out_len;
+  unsigned char *data;
+  size_t len;
+  int level;
+};
+
+static struct sample
+bench_deflate (void *arg, long iters)
+{
+  struct deflate_ctx *ctx = arg;
+  struct sample s = start_sample ();
+
+  // the same call as compress_job, for the last block of a stream
+  for (long i = 0; i < iters; i++)
+    ctx->out_len = ctx->engine->compress (ctx->state, ctx->level,
+                                          Z_DEFAULT_STRATEGY, NULL, 0,
+                                          ctx->data, ctx->len, true,
+                                          ctx->out);
+  s = stop_sample (s);
+  sink = ctx->out_len;
+  return s;
+}
+
+static int
+discard (void *opaque, unsigned char const *data, size_t len)
+{
+  sink += len;
+  return 0;
+}
+
+static struct sample
+bench_inflate (void *arg, long iters)
+{
+  struct deflate_ctx *ctx = arg;
+  struct sample s = start_sample ();
+  size_t used;
+
+  for (long i = 0; i < iters; i++)
+    if (ctx->engine->inflate (ctx->out, ctx->out_len, &used, discard, NULL)
+        != Z_OK)
+      die ("%s: cannot inflate", ctx->engine->name);
+  return stop_sample (s);
+}
+
+/* ===========================================================================
+ * Contention.  The threads start together at a barrier and the clock
+ * runs until the last of them is done.
+ */
+
+struct contention_ctx
+{
+  int threads;
+  long iters;
+  bool bounded;
+  pthread_barrier_t barrier;
+  struct buffer_pool pool;
+  struct pipeline pl;
+  struct pipeline_params params;
+};
+
+static void *
+pool_worker (void *arg)
+{
+  struct contention_ctx *ctx = arg;
+
+  pthread_barrier_wait (&ctx->barrier);
+  for (long i = 0; i < ctx->iters; i++)
+    {
+      struct buffer *buffer = get_buffer (&ctx->pool);
+      if (buffer == NULL)
+        die ("memory exhausted");
+      return_buffer (buffer);
+    }
+  return NULL;
+}
+
+static struct sample
+bench_buffer_pool (void *arg, long iters)
+{
+  struct contention_ctx *ctx = arg;
+  pthread_t *tid = xmalloc (ctx->threads * sizeof *tid);
+  struct sample s;
+
+  // sized like the pipeline's input pool, or unbounded like its output pool
+  init_pool (&ctx->pool, DICTIONARY_SIZE,
+             ctx->bounded ? ctx->threads * 2 + 1 : -1);
+  ctx->iters = iters;
+  pthread_barrier_init (&ctx->barrier, NULL, ctx->threads + 1);
+  for (int i = 0; i < ctx->threads; i++)
+    if (pthread_create (tid + i, NULL, pool_worker, ctx) != 0)
+      die ("cannot create thread");
+  pthread_barrier_wait (&ctx->barrier);
+  s = start_sample ();
+  for (int i = 0; i < ctx->threads; i++)
+    pthread_join (tid[i], NULL);
+  s = stop_sample (s);
+  pthread_barrier_destroy (&ctx->barrier);
+  free_pool (&ctx->pool);
+  free (tid);
+  return s;
+}
+
+static void *
+list_worker (void *arg)
+{
+  struct contention_ctx *ctx = arg;
+  struct job *job;
+
+  pthread_barrier_wait (&ctx->barrier);
+  while ((job = pop_job (&ctx->pl.compress_jobs)) != NULL)
+    return_job (&ctx->pl, job);
+  return NULL;
+}
+
+static struct sample
+bench_job_list (void *arg, long iters)
+{
+  struct contention_ctx *ctx = arg;
+  pthread_t *tid = xmalloc (ctx->threads * sizeof *tid);
+  struct pipeline *pl = &ctx->pl;
+  struct sample s;
+
+  init_pipeline (pl, &ctx->params);
+  pthread_barrier_init (&ctx->barrier, NULL, ctx->threads + 1);
+  for (int i = 0; i < ctx->threads; i++)
+    if (pthread_create (tid + i, NULL, list_worker, ctx) != 0)
+      die ("cannot create thread");
+  pthread_barrier_wait (&ctx->barrier);
+  s = start_sample ();
+  // the reader's side: recycle a job and queue it for compression
+  for (long i = 0; i < iters; i++)
+    {
+      struct job *job = get_job (pl, i);
+      if (job == NULL)
+        die ("memory exhausted");
+      queue_job (&pl->compress_jobs, job);
+    }
+  lock (&pl->compress_jobs.lock);
+  pl->compress_jobs.lock.value = 1;
+  broadcast (&pl->compress_jobs.lock);
+  unlock (&pl->compress_jobs.lock);
+  for (int i = 0; i < ctx->threads; i++)
+    pthread_join (tid[i], NULL);
+  s = stop_sample (s);
+  pthread_barrier_destroy (&ctx->barrier);
+  free_jobs (pl);
+  free (tid);
+  return s;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct options opt;
+  size_t max_size = PARALLEL_BLOCK_SIZE;
+  unsigned char *data;
+  char arg[32];
+
+  parse_options (argc, argv, &opt);
+
+  for (int i = 0; i < opt.nsizes; i++)
+    if (max_size < opt.sizes[i])
+      max_size = opt.sizes[i];
+  data = corpus_generate (opt.corpus, max_size, 1);
+  if (!data)
+    die ("cannot generate corpus");
+
+  for (int i = 0; i < opt.nsizes; i++)
+    {
+      struct data_ctx ctx = { data, opt.sizes[i] };
+      snprintf (arg, sizeof arg, "%zu", opt.sizes[i]);
+      measure (&opt, "crc32z", arg, 1, ctx.len, bench_crc32z, &ctx);
+      measure (&opt, "updcrc", arg, 1, ctx.len, bench_updcrc, &ctx);
+      measure (&opt, "crc32_comb", arg, 1, 0, bench_crc32_comb, &ctx);
+    }
+
+  struct deflate_ctx dctx;
+  size_t bound = 0;
+  memset (&dctx, 0, sizeof dctx);
+  dctx.data = data;
+  dctx.len = PARALLEL_BLOCK_SIZE;
+  for (int e = 0; deflate_engines[e] != NULL; e++)
+    if (bound < deflate_engines[e]->bound (dctx.len))
+      bound = deflate_engines[e]->bound (dctx.len);
+  dctx.out = xmalloc (bound);
+  for (int e = 0; deflate_engines[e] != NULL; e++)
+    {
+      dctx.engine = deflate_engines[e];
+      if (!dctx.engine->available ())
+        continue;
+      dctx.state = dctx.engine->init ();
+      if (dctx.state == NULL)
+        die ("%s: cannot initialize", dctx.engine->name);
+      for (dctx.level = 1; dctx.level <= 9; dctx.level++)
+        {
+          snprintf (arg, sizeof arg, "%s/%s/%d", dctx.engine->name,
+                    corpus_name (opt.corpus), dctx.level);
+          measure (&opt, "deflate", arg, 1, dctx.len, bench_deflate, &dctx);
+        }
+      dctx.engine->finish (dctx.state);
+    }
+
+  // every engine decodes the same data, deflated by zlib at the default
+  // level
+  dctx.state = zlib_engine.init ();
+  if (dctx.state == NULL)
+    die ("zlib: cannot initialize");
+  dctx.engine = &zlib_engine;
+  dctx.level = 6;
+  bench_deflate (&dctx, 1);
+  zlib_engine.finish (dctx.state);
+  for (int e = 0; deflate_engines[e] != NULL; e++)
+    {
+      dctx.engine = deflate_engines[e];
+      if (!dctx.engine->available ())
+        continue;
+      snprintf (arg, sizeof arg, "%s/%s", dctx.engine->name,
+                corpus_name (opt.corpus));
+      measure (&opt, "inflate", arg, 1, dctx.len, bench_inflate, &dctx);
+    }
+  free (dctx.out);
+
+  for (int i = 0; i < opt.nthreads; i++)
+    {
+      struct contention_ctx ctx;
+      memset (&ctx, 0, sizeof ctx);
+      ctx.threads = opt.threads[i];
+      ctx.params.level = 1;
+      ctx.params.threads = ctx.threads;
+      ctx.bounded = true;
+      measure (&opt, "buffer_pool", "bounded", ctx.threads, 0,
+               bench_buffer_pool, &ctx);
+      ctx.bounded = false;
+      measure (&opt, "buffer_pool", "unbounded", ctx.threads, 0,
+               bench_buffer_pool, &ctx);
+      measure (&opt, "job_list", "", ctx.threads, 0, bench_job_list, &ctx);
+    }
+
+  if (opt.json)
+    fputs (nrows ? "\n]\n" : "[]\n", stdout);
+  free (data);
+  if (fclose (stdout) != 0)
+    die ("write error: %s", strerror (errno));
+  return EXIT_SUCCESS;
+}
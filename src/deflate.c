@@ -65,153 +65,97 @@
  *
  *  INTERFACE
  *
- *      void lm_init (int pack_level, ush *flags)
- *          Initialize the "longest match" routines for a new file
+ *      struct native_deflate *native_deflate_new (void)
+ *          Allocate a compressor, or return NULL if out of memory.
  *
- *      off_t deflateGZIP (void)
- *          Processes a new input file and return its compressed length. Sets
- *          the compressed length, crc, deflate flags and internal file
- *          attributes.
+ *      void native_deflate_reset (struct native_deflate *s, int level,
+ *                                 int (*write) (void *opaque,
+ *                                               unsigned char const *data,
+ *                                               size_t len),
+ *                                 void *opaque)
+ *          Start a new raw deflate stream at LEVEL, 0 to 9, whose output
+ *          goes to WRITE, which returns 0, or -1 on error.  Level 0 is
+ *          not zlib's stored level but a greedy compressor that tries a
+ *          single candidate per position, for speed before ratio.
+ *
+ *      void native_deflate_dictionary (struct native_deflate *s,
+ *                                      unsigned char const *dict,
+ *                                      size_t len)
+ *          Let the stream just reset refer back to the last 32 KiB of
+ *          DICT, as if it had been compressed before it.
+ *
+ *      int native_deflate (struct native_deflate *s,
+ *                          unsigned char const *in, size_t len, int flush)
+ *          Compress the LEN bytes at IN.  FLUSH is zlib's Z_NO_FLUSH;
+ *          Z_SYNC_FLUSH to end the current block and pad the output to a
+ *          byte boundary, with the fewest bits that do it; Z_FULL_FLUSH to
+ *          do that and forget the data so far; or Z_FINISH to end the
+ *          stream.  All of the output is written by the time a flush
+ *          returns.  Return Z_OK, or Z_ERRNO once WRITE has failed.
+ *
+ *      size_t native_deflate_bound (size_t len)
+ *          Return the most that native_deflate_block can write for LEN
+ *          bytes of input.
+ *
+ *      size_t native_deflate_block (struct native_deflate *s, int level,
+ *                                   unsigned char const *dict,
+ *                                   size_t dict_len,
+ *                                   unsigned char const *in, size_t len,
+ *                                   bool last, unsigned char *out)
+ *          Compress the LEN bytes at IN at LEVEL, referring back to the
+ *          DICT_LEN bytes of DICT, as a whole raw deflate stream if LAST
+ *          and otherwise as blocks that end on a byte boundary.  The
+ *          output goes straight to OUT, which has room for
+ *          native_deflate_bound (LEN) bytes; return its length.
+ *
+ *      void native_deflate_free (struct native_deflate *s)
+ *          Free the compressor.
+ *
+ *  The compressor keeps all its state in S, so each thread can run its
+ *  own.  Matches are compared 32 bytes at a time with AVX2, 16 with SSE2
+ *  or NEON and 8 otherwise, strings are hashed on 16 bits, and trees.c
+ *  gathers the output bits 64 at a time.
  */
 
 #include <config.h>
-#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#include "tailor.h"
-#include "gzip.h"
-#include "verify.h"
+#include "zlib.h"
+#include "parallel.h"
+#include "deflate.h"
 
 /* ===========================================================================
  * Configuration parameters
  */
 
-/* Compile with MEDIUM_MEM to reduce the memory requirements or
- * with SMALL_MEM to use as little memory as possible. Use BIG_MEM if the
- * entire input file can be held in memory (not possible on 16 bit systems).
- * Warning: defining these symbols affects HASH_BITS (see below) and thus
- * affects the compression ratio. The compressed output
- * is still correct, and might even be smaller in some cases.
- */
-
-#ifdef SMALL_MEM
-#define HASH_BITS  13		/* Number of bits used to hash strings */
-#endif
-#ifdef MEDIUM_MEM
-#define HASH_BITS  14
-#endif
-#ifndef HASH_BITS
-#define HASH_BITS  15
-   /* For portability to 16 bit machines, do not use values above 15. */
-#endif
-
-/* To save space (see unlzw.c), we overlay prev+head with tab_prefix and
- * window with tab_suffix. Check that we can do this:
- */
-#if (WSIZE<<1) > (1<<BITS)
-error:cannot overlay window with tab_suffix and prev with tab_prefix0
-#endif
-#if HASH_BITS > BITS-1
-error:cannot overlay head with tab_prefix1
-#endif
-#define HASH_SIZE (unsigned)(1<<HASH_BITS)
 #define HASH_MASK (HASH_SIZE-1)
 #define WMASK     (WSIZE-1)
 /* HASH_SIZE and WSIZE must be powers of two */
 #define NIL 0
 /* Tail of hash chains */
-#ifndef TOO_FAR
 #define TOO_FAR 4096
-#endif
 /* Matches of length 3 are discarded if their distance exceeds TOO_FAR */
-#ifndef RSYNC_WIN
-#define RSYNC_WIN 4096
-#endif
-verify (RSYNC_WIN < MAX_DIST);
-
-#define RSYNC_SUM_MATCH(sum) ((sum) % RSYNC_WIN == 0)
-/* Whether window sum matches magic value */
-
-/* ===========================================================================
- * Local data used by the "longest match" routines.
- */
-
-typedef ush Pos;
-typedef unsigned IPos;
-/* A Pos is an index in the character window. We use short instead of int to
- * save space in the various tables. IPos is used only for parameter passing.
- */
 
-/* DECLARE(uch, window, 2L*WSIZE); */
-/* Sliding window. Input bytes are read into the second half of the window,
- * and move to the first half later to keep a dictionary of at least WSIZE
- * bytes. With this organization, matches are limited to a distance of
- * WSIZE-MAX_MATCH bytes, but this ensures that IO is always
- * performed with a length multiple of the block size. Also, it limits
- * the window size to 64K, which is quite useful on MSDOS.
- * To do: limit the window size to WSIZE+BSZ if SMALL_MEM (the code would
- * be less efficient).
+#define FASTEST_HASH_BITS 15
+/* Level 0 hashes four bytes into the first 2^FASTEST_HASH_BITS heads,
+ * which fit in the L1 cache of most processors.
  */
 
-/* DECLARE(Pos, prev, WSIZE); */
-/* Link to older string with same hash index. To limit the size of this
- * array to 64K, this link is maintained only for the last 32K strings.
- * An index in this array is thus a window index modulo 32K.
+#define WINDOW_SIZE (2 * WSIZE)
+/* Sliding window. Input bytes are copied into the second half of the
+ * window, and move to the first half later to keep a dictionary of at
+ * least WSIZE bytes. With this organization, matches are limited to a
+ * distance of WSIZE-MAX_MATCH bytes.
  */
 
-/* DECLARE(Pos, head, 1<<HASH_BITS); */
-/* Heads of the hash chains or NIL. */
-
-static ulg window_size = (ulg) 2 * WSIZE;
-/* window size, 2*WSIZE except for MMAP or BIG_MEM, where it is the
- * input file length plus MIN_LOOKAHEAD.
- */
-
-long block_start;
-/* window position at the beginning of the current output block. Gets
- * negative when the window is moved backwards.
- */
-
-static unsigned ins_h;		/* hash index of string to be inserted */
-
 #define H_SHIFT  ((HASH_BITS+MIN_MATCH-1)/MIN_MATCH)
-/* Number of bits by which ins_h and del_h must be shifted at each
- * input step. It must be such that after MIN_MATCH steps, the oldest
- * byte no longer takes part in the hash key, that is:
+/* Number of bits by which ins_h must be shifted at each input step. It
+ * must be such that after MIN_MATCH steps, the oldest byte no longer
+ * takes part in the hash key, that is:
  *   H_SHIFT * MIN_MATCH >= HASH_BITS
  */
 
-unsigned int prev_length;
-/* Length of the best match at previous step. Matches not greater than this
- * are discarded. This is used in the lazy match evaluation.
- */
-
-unsigned strstart;		/* start of string to insert */
-unsigned match_start;		/* start of matching string */
-static int eofile;		/* flag set at end of input file */
-static unsigned lookahead;	/* number of valid bytes ahead in window */
-
-unsigned max_chain_length;
-/* To speed up deflation, hash chains are never searched beyond this length.
- * A higher limit improves compression ratio but degrades the speed.
- */
-
-static unsigned int max_lazy_match;
-/* Attempt to find a better match only when the current match is strictly
- * smaller than this value. This mechanism is used only for compression
- * levels >= 4.
- */
-#define max_insert_length  max_lazy_match
-/* Insert new strings in the hash table only if the match length
- * is not greater than this length. This saves time but degrades compression.
- * max_insert_length is used only for compression levels <= 3.
- */
-
-unsigned good_match;
-/* Use a faster search when the previous match is longer than this */
-
-static ulg rsync_sum;		/* rolling sum of rsync window */
-static ulg rsync_chunk_end;	/* next rsync sequence point */
-
 /* Values for max_lazy_match, good_match and max_chain_length, depending on
  * the desired pack level (0..9). The values given below have been tuned to
  * exclude worst case performance for pathological files. Better values may be
@@ -226,57 +170,27 @@ typedef struct config
   ush max_chain;
 } config;
 
-#ifdef ASMV
-#define static_unless_ASMV
-#else
-#define static_unless_ASMV static
-#endif
-
-#ifdef  FULL_SEARCH
-#define nice_match MAX_MATCH
-#else
-  /* Stop searching when current match exceeds this */
-static_unless_ASMV int nice_match;
-#endif
-
-static config configuration_table[10] = {
+static config const configuration_table[10] = {
 /*      good lazy nice chain */
-				/* 0 */ {0, 0, 0, 0},
-				/* store only */
-				/* 1 */ {4, 4, 8, 4},
-				/* maximum speed, no lazy matches */
+/* 0 */ {0, 0, 0, 0},		/* one candidate, see deflate_fastest */
+/* 1 */ {4, 4, 8, 4},		/* maximum speed, no lazy matches */
 /* 2 */ {4, 5, 16, 8},
 /* 3 */ {4, 6, 32, 32},
 
-				/* 4 */ {4, 4, 16, 16},
-				/* lazy matches */
+/* 4 */ {4, 4, 16, 16},		/* lazy matches */
 /* 5 */ {8, 16, 32, 32},
 /* 6 */ {8, 16, 128, 128},
 /* 7 */ {8, 32, 128, 256},
 /* 8 */ {32, 128, 258, 1024},
-/* 9 */ {32, 258, 258, 4096}
-};				/* maximum compression */
+/* 9 */ {32, 258, 258, 4096}	/* maximum compression */
+};
 
 /* Note: the deflate() code requires max_lazy >= MIN_MATCH and max_chain >= 4
- * For deflate_fast() (levels <= 3) good is ignored and lazy has a different
- * meaning.
+ * For deflate_fast() (levels 1 to 3) good is ignored and lazy has a different
+ * meaning: it is max_insert_length, the longest match whose strings are
+ * inserted in the hash table.
  */
 
-/* ===========================================================================
- *  Prototypes for local functions.
- */
-static void fill_window (void);
-static off_t deflate_fast (void);
-
-#ifdef ASMV
-int longest_match (IPos cur_match);
-void match_init (void);		/* asm code initialization */
-#endif
-
-#ifdef DEBUG
-static void check_match (IPos start, IPos match, int length);
-#endif
-
 /* ===========================================================================
  * Update a hash value with the given input byte
  * IN  assertion: all calls to UPDATE_HASH are made with consecutive
@@ -286,80 +200,145 @@ static void check_match (IPos start, IPos match, int length);
 #define UPDATE_HASH(h,c) (h = (((h)<<H_SHIFT) ^ (c)) & HASH_MASK)
 
 /* ===========================================================================
- * Insert string s in the dictionary and set match_head to the previous head
- * of the hash chain (the most recent string with same hash key). Return
- * the previous length of the hash chain.
+ * Insert string str in the dictionary and set match_head to the previous
+ * head of the hash chain (the most recent string with same hash key).
  * IN  assertion: all calls to INSERT_STRING are made with consecutive
- *    input characters and the first MIN_MATCH bytes of s are valid
+ *    input characters and the first MIN_MATCH bytes of str are valid
  *    (except for the last MIN_MATCH-1 bytes of the input file).
  */
-#define INSERT_STRING(s, match_head) \
-   (UPDATE_HASH(ins_h, window[(s) + MIN_MATCH-1]), \
-    prev[(s) & WMASK] = match_head = head[ins_h], \
-    head[ins_h] = (s))
+#define INSERT_STRING(s, str, match_head) \
+   (UPDATE_HASH((s)->ins_h, (s)->window[(str) + MIN_MATCH-1]), \
+    (s)->prev[(str) & WMASK] = match_head = (s)->head[(s)->ins_h], \
+    (s)->head[(s)->ins_h] = (Pos) (str))
 
 /* ===========================================================================
- * Initialize the "longest match" routines for a new file
+ * Flush the current block, with given end-of-file flag.
+ * IN assertion: strstart is set to the end of the current match.
  */
+#define FLUSH_BLOCK(s, eof) \
+   (flush_block ((s), block_data (s), \
+                 (long) (s)->strstart - (s)->block_start, (eof)), \
+    (s)->block_start = (s)->strstart)
+
+static inline uint16_t
+load16 (uch const *p)
+{
+  uint16_t v;
+  memcpy (&v, p, 2);
+  return v;
+}
+
+static inline uint32_t
+load32 (uch const *p)
+{
+  uint32_t v;
+  memcpy (&v, p, 4);
+  return v;
+}
+
+/* ===========================================================================
+ * Hash the four bytes at P for level 0.
+ */
+static inline unsigned
+hash4 (uch const *p)
+{
+  return (load32 (p) * 0x9e3779b1u) >> (32 - FASTEST_HASH_BITS);
+}
+
+struct native_deflate *
+native_deflate_new (void)
+{
+  /* Zeroing the window keeps the comparisons past the lookahead, whose
+     results are discarded, from reading uninitialized memory.  */
+  struct native_deflate *s = calloc (1, sizeof *s);
+
+  if (s != NULL)
+    ct_static_init ();
+  return s;
+}
+
 void
-lm_init (pack_level)
-     int pack_level;		/* 0: store, 1: best speed, 9: best compression */
+native_deflate_free (struct native_deflate *s)
 {
-  register unsigned j;
+  if (s != NULL)
+    optimal_free (s->opt);
+  free (s);
+}
 
-  if (pack_level < 1 || pack_level > 9)
-    gzip_error ("bad pack level");
+/* ===========================================================================
+ * Initialize the "longest match" routines for a new stream
+ */
+void
+native_deflate_reset (struct native_deflate *s, int level,
+                      int (*write) (void *opaque, unsigned char const *data,
+                                    size_t len), void *opaque)
+{
+  if (level < 0)
+    level = 0;
+  if (level > 9)
+    level = 9;
+
+  s->write = write;
+  s->opaque = opaque;
+  s->status = Z_OK;
+  s->bi_buf = 0;
+  s->bi_valid = 0;
+  s->out = s->outbuf;
+  s->outcnt = 0;
+  s->out_size = OUT_SIZE;
+  s->whole = false;
 
   /* Initialize the hash table. */
-#if defined MAXSEG_64K && HASH_BITS == 15
-  for (j = 0; j < HASH_SIZE; j++)
-    head[j] = NIL;
-#else
-  memzero ((char *) head, HASH_SIZE * sizeof (*head));
-#endif
+  memset (s->head, 0, sizeof s->head);
   /* prev will be initialized on the fly */
 
-  /* rsync params */
-  rsync_chunk_end = 0xFFFFFFFFUL;
-  rsync_sum = 0;
-
   /* Set the default configuration parameters:
    */
-  max_lazy_match = configuration_table[pack_level].max_lazy;
-  good_match = configuration_table[pack_level].good_length;
-#ifndef FULL_SEARCH
-  nice_match = configuration_table[pack_level].nice_length;
-#endif
-  max_chain_length = configuration_table[pack_level].max_chain;
-  /* ??? reduce max_chain_length for binary files */
-
-  strstart = 0;
-  block_start = 0L;
-#ifdef ASMV
-  match_init ();		/* initialize the asm code */
-#endif
+  s->level = level;
+  s->max_lazy_match = configuration_table[level].max_lazy;
+  s->good_match = configuration_table[level].good_length;
+  s->nice_match = configuration_table[level].nice_length;
+  s->max_chain_length = configuration_table[level].max_chain;
+
+  s->strstart = 0;
+  s->block_start = 0L;
+  s->lookahead = 0;
+  s->ins_h = 0;
+  s->match_start = 0;
+  s->prev_match = 0;
+  s->match_length = s->prev_length = MIN_MATCH - 1;
+  s->match_available = false;
+  ct_init (s);
+}
 
-  lookahead = read_buf ((char *) window,
-			sizeof (int) <= 2 ? (unsigned) WSIZE : 2 * WSIZE);
+void
+native_deflate_dictionary (struct native_deflate *s,
+                           unsigned char const *dict, size_t len)
+{
+  IPos hash_head;
+  unsigned n;
 
-  if (lookahead == 0 || lookahead == (unsigned) EOF)
+  if (len > WSIZE)
     {
-      eofile = 1, lookahead = 0;
+      dict += len - WSIZE;
+      len = WSIZE;
+    }
+  memcpy (s->window, dict, len);
+  s->strstart = len;
+  s->block_start = (long) len;
+  if (s->level == 0)
+    {
+      for (n = 0; n + 4 <= len; n++)
+	s->head[hash4 (s->window + n)] = (Pos) n;
       return;
     }
-  eofile = 0;
-  /* Make sure that we always have enough lookahead. This is important
-   * if input comes from a device such as a tty.
-   */
-  while (lookahead < MIN_LOOKAHEAD && !eofile)
-    fill_window ();
-
-  ins_h = 0;
-  for (j = 0; j < MIN_MATCH - 1; j++)
-    UPDATE_HASH (ins_h, window[j]);
-  /* If lookahead < MIN_MATCH, ins_h is garbage, but this is
-   * not important since only literal bytes will be emitted.
-   */
+  if (len < MIN_MATCH)
+    return;
+  s->ins_h = s->window[0];
+  UPDATE_HASH (s->ins_h, s->window[1]);
+  for (n = 0; n <= len - MIN_MATCH; n++)
+    INSERT_STRING (s, n, hash_head);
+  (void) hash_head;
 }
 
 /* ===========================================================================
@@ -370,136 +349,54 @@ lm_init (pack_level)
  * IN assertions: cur_match is the head of the hash chain for the current
  *   string (strstart) and its distance is <= MAX_DIST, and prev_length >= 1
  */
-#ifndef ASMV
-/* For MSDOS, OS/2 and 386 Unix, an optimized version is in match.asm or
- * match.s. The code is functionally equivalent, so you can use the C version
- * if desired.
- */
-static int
-longest_match (IPos cur_match)
+static unsigned
+longest_match (struct native_deflate *s, IPos cur_match)
 {
-  unsigned chain_length = max_chain_length;	/* max hash chain length */
-  register uch *scan = window + strstart;	/* current string */
-  register uch *match;		/* matched string */
-  register int len;		/* length of current match */
-  int best_len = prev_length;	/* best match length so far */
-  IPos limit = strstart > (IPos) MAX_DIST ? strstart - (IPos) MAX_DIST : NIL;
+  unsigned chain_length = s->max_chain_length;	/* max hash chain length */
+  uch const *window = s->window;
+  Pos const *prev = s->prev;
+  uch const *scan = window + s->strstart;	/* current string */
+  uch const *match;		/* matched string */
+  unsigned len;			/* length of current match */
+  unsigned best_len = s->prev_length;	/* best match length so far */
+  unsigned nice_match = s->nice_match;	/* stop if match long enough */
+  IPos limit = s->strstart > (IPos) MAX_DIST ? s->strstart - (IPos) MAX_DIST
+    : NIL;
   /* Stop when cur_match becomes <= limit. To simplify the code,
    * we prevent matches with the string of window index 0.
    */
-
-/* The code is optimized for HASH_BITS >= 8 and MAX_MATCH-2 multiple of 16.
- * It is easy to get rid of this optimization if necessary.
- */
-#if HASH_BITS < 8 || MAX_MATCH != 258
-error:Code too clever
-#endif
-#ifdef UNALIGNED_OK
-    /* Compare two bytes at a time. Note: this is not always beneficial.
-     * Try with and without -DUNALIGNED_OK to check.
-     */
-  register uch *strend = window + strstart + MAX_MATCH - 1;
-  register ush scan_start = *(ush *) scan;
-  register ush scan_end = *(ush *) (scan + best_len - 1);
-#else
-  register uch *strend = window + strstart + MAX_MATCH;
-  register uch scan_end1 = scan[best_len - 1];
-  register uch scan_end = scan[best_len];
-#endif
+  uint16_t scan_start = load16 (scan);
+  uint16_t scan_end = load16 (scan + best_len - 1);
 
   /* Do not waste too much time if we already have a good match: */
-  if (prev_length >= good_match)
+  if (s->prev_length >= s->good_match)
     {
       chain_length >>= 2;
     }
-  Assert (strstart <= window_size - MIN_LOOKAHEAD, "insufficient lookahead");
+  /* Do not look for matches beyond the end of the input.  */
+  if (nice_match > s->lookahead)
+    nice_match = s->lookahead;
 
   do
     {
-      Assert (cur_match < strstart, "no future");
       match = window + cur_match;
 
       /* Skip to next match if the match length cannot increase
-       * or if the match length is less than 2:
+       * or if the match length is less than 2.  Most candidates stop
+       * here; the others are compared a whole vector at a time.
        */
-#if defined UNALIGNED_OK && MAX_MATCH == 258
-      /* This code assumes sizeof(unsigned short) == 2. Do not use
-       * UNALIGNED_OK if your compiler uses a different size.
-       */
-      if (*(ush *) (match + best_len - 1) != scan_end ||
-	  *(ush *) match != scan_start)
+      if (load16 (match + best_len - 1) != scan_end
+          || load16 (match) != scan_start)
 	continue;
 
-      /* It is not necessary to compare scan[2] and match[2] since they are
-       * always equal when the other bytes match, given that the hash keys
-       * are equal and that HASH_BITS >= 8. Compare 2 bytes at a time at
-       * strstart+3, +5, ... up to strstart+257. We check for insufficient
-       * lookahead only every 4th comparison; the 128th check will be made
-       * at strstart+257. If MAX_MATCH-2 is not a multiple of 8, it is
-       * necessary to put more guard bytes at the end of the window, or
-       * to check more often for insufficient lookahead.
-       */
-      scan++, match++;
-      do
-	{
-	}
-      while (*(ush *) (scan += 2) == *(ush *) (match += 2) &&
-	     *(ush *) (scan += 2) == *(ush *) (match += 2) &&
-	     *(ush *) (scan += 2) == *(ush *) (match += 2) &&
-	     *(ush *) (scan += 2) == *(ush *) (match += 2) && scan < strend);
-      /* The funny "do {}" generates better code on most compilers */
-
-      /* Here, scan <= window+strstart+257 */
-      Assert (scan <= window + (unsigned) (window_size - 1), "wild scan");
-      if (*scan == *match)
-	scan++;
-
-      len = (MAX_MATCH - 1) - (int) (strend - scan);
-      scan = strend - (MAX_MATCH - 1);
-
-#else /* UNALIGNED_OK */
-
-      if (match[best_len] != scan_end ||
-	  match[best_len - 1] != scan_end1 ||
-	  *match != *scan || *++match != scan[1])
-	continue;
-
-      /* The check at best_len-1 can be removed because it will be made
-       * again later. (This heuristic is not always a win.)
-       * It is not necessary to compare scan[2] and match[2] since they
-       * are always equal when the other bytes match, given that
-       * the hash keys are equal and that HASH_BITS >= 8.
-       */
-      scan += 2, match++;
-
-      /* We check for insufficient lookahead only every 8th comparison;
-       * the 256th check will be made at strstart+258.
-       */
-      do
-	{
-	}
-      while (*++scan == *++match && *++scan == *++match &&
-	     *++scan == *++match && *++scan == *++match &&
-	     *++scan == *++match && *++scan == *++match &&
-	     *++scan == *++match && *++scan == *++match && scan < strend);
-
-      len = MAX_MATCH - (int) (strend - scan);
-      scan = strend - MAX_MATCH;
-
-#endif /* UNALIGNED_OK */
-
+      len = match_length (scan, match);
       if (len > best_len)
 	{
-	  match_start = cur_match;
+	  s->match_start = cur_match;
 	  best_len = len;
 	  if (len >= nice_match)
 	    break;
-#ifdef UNALIGNED_OK
-	  scan_end = *(ush *) (scan + best_len - 1);
-#else
-	  scan_end1 = scan[best_len - 1];
-	  scan_end = scan[best_len];
-#endif
+	  scan_end = load16 (scan + best_len - 1);
 	}
     }
   while ((cur_match = prev[cur_match & WMASK]) > limit
@@ -507,211 +404,191 @@ error:Code too clever
 
   return best_len;
 }
-#endif /* ASMV */
 
-#ifdef DEBUG
 /* ===========================================================================
- * Check that the match at match_start is indeed a match.
+ * Fill the window from the input when the lookahead becomes insufficient.
+ * Updates strstart and lookahead.
+ * IN assertion: lookahead < MIN_LOOKAHEAD
+ * OUT assertion: all the input has been taken, or the lookahead is
+ *    at least MIN_LOOKAHEAD.
  */
 static void
-check_match (start, match, length)
-     IPos start, match;
-     int length;
+fill_window (struct native_deflate *s)
 {
-  /* check that the match is indeed a match */
-  if (memcmp ((char *) window + match, (char *) window + start, length) != 0)
-    {
-      fprintf (stderr,
-	       " start %d, match %d, length %d\n", start, match, length);
-      gzip_error ("invalid match");
-    }
-  if (verbose > 1)
-    {
-      fprintf (stderr, "\\[%d,%d]", start - match, length);
-      do
-	{
-	  putc (window[start++], stderr);
-	}
-      while (--length != 0);
-    }
-}
-#else
-#define check_match(start, match, length)
-#endif
-
-/* ===========================================================================
- * Fill the window when the lookahead becomes insufficient.
- * Updates strstart and lookahead, and sets eofile if end of input file.
- * IN assertion: lookahead < MIN_LOOKAHEAD && strstart + lookahead > 0
- * OUT assertions: at least one byte has been read, or eofile is set;
- *    file reads are performed for at least two bytes (required for the
- *    translate_eol option).
- */
-static void
-fill_window ()
-{
-  register unsigned n, m;
-  unsigned more = (unsigned) (window_size - (ulg) lookahead - (ulg) strstart);
+  unsigned n, m;
+  unsigned more = WINDOW_SIZE - s->lookahead - s->strstart;
   /* Amount of free space at the end of the window. */
 
   /* If the window is almost full and there is insufficient lookahead,
    * move the upper half to the lower one to make room in the upper half.
    */
-  if (more == (unsigned) EOF)
-    {
-      /* Very unlikely, but possible on 16 bit machine if strstart == 0
-       * and lookahead == 1 (input done one byte at time)
-       */
-      more--;
-    }
-  else if (strstart >= WSIZE + MAX_DIST)
+  if (s->strstart >= WSIZE + MAX_DIST)
     {
-      /* By the IN assertion, the window is not empty so we can't confuse
-       * more == 0 with more == 64K on a 16 bit machine.
-       */
-      Assert (window_size == (ulg) 2 * WSIZE, "no sliding with BIG_MEM");
-
-      memcpy ((char *) window, (char *) window + WSIZE, (unsigned) WSIZE);
-      match_start -= WSIZE;
-      strstart -= WSIZE;	/* we now have strstart >= MAX_DIST: */
-      if (rsync_chunk_end != 0xFFFFFFFFUL)
-	rsync_chunk_end -= WSIZE;
-
-      block_start -= (long) WSIZE;
+      memcpy (s->window, s->window + WSIZE, WSIZE);
+      s->match_start -= WSIZE;
+      s->strstart -= WSIZE;	/* we now have strstart >= MAX_DIST: */
+      s->block_start -= (long) WSIZE;
 
       for (n = 0; n < HASH_SIZE; n++)
 	{
-	  m = head[n];
-	  head[n] = (Pos) (m >= WSIZE ? m - WSIZE : NIL);
+	  m = s->head[n];
+	  s->head[n] = (Pos) (m >= WSIZE ? m - WSIZE : NIL);
 	}
-      for (n = 0; n < WSIZE; n++)
+      /* Level 0 has no hash chains.  */
+      for (n = 0; n < (s->level == 0 ? 0 : WSIZE); n++)
 	{
-	  m = prev[n];
-	  prev[n] = (Pos) (m >= WSIZE ? m - WSIZE : NIL);
+	  m = s->prev[n];
+	  s->prev[n] = (Pos) (m >= WSIZE ? m - WSIZE : NIL);
 	  /* If n is not on any hash chain, prev[n] is garbage but
 	   * its value will never be used.
 	   */
 	}
       more += WSIZE;
     }
-  /* At this point, more >= 2 */
-  if (!eofile)
+
+  n = s->avail_in < more ? s->avail_in : more;
+  if (n == 0)
+    return;
+  memcpy (s->window + s->strstart + s->lookahead, s->next_in, n);
+  s->next_in += n;
+  s->avail_in -= n;
+
+  /* The running hash must cover the first bytes of the string at
+   * strstart, which may have just arrived.
+   */
+  if (s->lookahead < MIN_MATCH - 1)
     {
-      n = read_buf ((char *) window + strstart + lookahead, more);
-      if (n == 0 || n == (unsigned) EOF)
-	{
-	  eofile = 1;
-	  /* Don't let garbage pollute the dictionary.  */
-	  memzero (window + strstart + lookahead, MIN_MATCH - 1);
-	}
-      else
-	{
-	  lookahead += n;
-	}
+      s->ins_h = s->window[s->strstart];
+      UPDATE_HASH (s->ins_h, s->window[s->strstart + 1]);
     }
+  s->lookahead += n;
 }
 
-/* With an initial offset of START, advance rsync's rolling checksum
-   by NUM bytes.  */
+/* ===========================================================================
+ * Compress as fast as possible, for level 0: each position looks up a
+ * single earlier position with the same four byte hash, a match is taken
+ * as soon as it is found, and the positions it covers are not hashed.
+ * The output is ordinary deflate data, typically a few percent larger than
+ * at level 1.
+ */
 static void
-rsync_roll (unsigned int start, unsigned int num)
+deflate_fastest (struct native_deflate *s, int flush)
 {
-  unsigned i;
+  uch const *window = s->window;
 
-  if (start < RSYNC_WIN)
+  for (;;)
     {
-      /* before window fills. */
-      for (i = start; i < RSYNC_WIN; i++)
+      if (s->lookahead < MIN_LOOKAHEAD)
 	{
-	  if (i == start + num)
+	  fill_window (s);
+	  if (s->lookahead < MIN_LOOKAHEAD && flush == Z_NO_FLUSH)
+	    return;
+	  if (s->lookahead == 0)
 	    return;
-	  rsync_sum += (ulg) window[i];
 	}
-      num -= (RSYNC_WIN - start);
-      start = RSYNC_WIN;
-    }
 
-  /* buffer after window full */
-  for (i = start; i < start + num; i++)
-    {
-      /* New character in */
-      rsync_sum += (ulg) window[i];
-      /* Old character out */
-      rsync_sum -= (ulg) window[i - RSYNC_WIN];
-      if (rsync_chunk_end == 0xFFFFFFFFUL && RSYNC_SUM_MATCH (rsync_sum))
-	rsync_chunk_end = i;
+      uch const *scan = window + s->strstart;
+      unsigned h = hash4 (scan);
+      IPos cur_match = s->head[h];
+      unsigned len = 0;
+      bool flush_it;
+
+      s->head[h] = (Pos) s->strstart;
+      /* As in the other levels, strstart <= WINDOW_SIZE - MIN_LOOKAHEAD,
+       * so the comparison stays within the window and its slack.
+       */
+      if (cur_match != NIL && s->strstart - cur_match <= MAX_DIST
+	  && s->lookahead >= 4 && load32 (window + cur_match) == load32 (scan))
+	{
+	  len = match_length (scan, window + cur_match);
+	  if (len > s->lookahead)
+	    len = s->lookahead;
+	}
+      if (len >= MIN_MATCH)
+	{
+	  flush_it = ct_tally (s, s->strstart - cur_match, len - MIN_MATCH);
+	  s->strstart += len;
+	  s->lookahead -= len;
+	}
+      else
+	{
+	  flush_it = ct_tally (s, 0, *scan);
+	  s->strstart++;
+	  s->lookahead--;
+	}
+      if (flush_it)
+	FLUSH_BLOCK (s, false);
     }
 }
 
 /* ===========================================================================
- * Set rsync_chunk_end if window sum matches magic value.
+ * Compress as much of the input as possible, without lazy evaluation of
+ * matches: new strings are inserted in the dictionary only for unmatched
+ * strings or for short matches.  Without FLUSH, stop when the lookahead
+ * is too short for the longest match; otherwise, go to the end of the
+ * input.  This is used only for the fast compression levels.
  */
-#define RSYNC_ROLL(s, n) \
-   do { if (rsync) rsync_roll((s), (n)); } while(0)
-
-/* ===========================================================================
- * Flush the current block, with given end-of-file flag.
- * IN assertion: strstart is set to the end of the current match.
- */
-#define FLUSH_BLOCK(eof) \
-   flush_block(block_start >= 0L ? (char*)&window[(unsigned)block_start] : \
-                (char*)NULL, (long)strstart - block_start, flush-1, (eof))
-
-/* ===========================================================================
- * Processes a new input file and return its compressed length. This
- * function does not perform lazy evaluationof matches and inserts
- * new strings in the dictionary only for unmatched strings or for short
- * matches. It is used only for the fast compression options.
- */
-static off_t
-deflate_fast ()
+static void
+deflate_fast (struct native_deflate *s, int flush)
 {
   IPos hash_head;		/* head of the hash chain */
-  int flush = 0;		/* set if current block must be flushed, 2=>and padded  */
-  unsigned match_length = 0;	/* length of best match */
+  unsigned match_length;	/* length of best match */
 
-  prev_length = MIN_MATCH - 1;
-  while (lookahead != 0)
+  s->prev_length = MIN_MATCH - 1;
+  for (;;)
     {
+      /* Make sure that we always have enough lookahead, except
+       * at the end of the input. We need MAX_MATCH bytes
+       * for the next match, plus MIN_MATCH bytes to insert the
+       * string following the next match.
+       */
+      if (s->lookahead < MIN_LOOKAHEAD)
+	{
+	  fill_window (s);
+	  if (s->lookahead < MIN_LOOKAHEAD && flush == Z_NO_FLUSH)
+	    return;
+	  if (s->lookahead == 0)
+	    return;
+	}
+
       /* Insert the string window[strstart .. strstart+2] in the
        * dictionary, and set hash_head to the head of the hash chain:
        */
-      INSERT_STRING (strstart, hash_head);
+      INSERT_STRING (s, s->strstart, hash_head);
 
       /* Find the longest match, discarding those <= prev_length.
        * At this point we have always match_length < MIN_MATCH
        */
-      if (hash_head != NIL && strstart - hash_head <= MAX_DIST
-	  && strstart <= window_size - MIN_LOOKAHEAD)
+      match_length = 0;
+      if (hash_head != NIL && s->strstart - hash_head <= MAX_DIST
+	  && s->strstart <= WINDOW_SIZE - MIN_LOOKAHEAD)
 	{
 	  /* To simplify the code, we prevent matches with the string
 	   * of window index 0 (in particular we have to avoid a match
 	   * of the string with itself at the start of the input file).
 	   */
-	  match_length = longest_match (hash_head);
+	  match_length = longest_match (s, hash_head);
 	  /* longest_match() sets match_start */
-	  if (match_length > lookahead)
-	    match_length = lookahead;
+	  if (match_length > s->lookahead)
+	    match_length = s->lookahead;
 	}
       if (match_length >= MIN_MATCH)
 	{
-	  check_match (strstart, match_start, match_length);
+	  bool flush_it = ct_tally (s, s->strstart - s->match_start,
+				    match_length - MIN_MATCH);
 
-	  flush = ct_tally (strstart - match_start, match_length - MIN_MATCH);
+	  s->lookahead -= match_length;
 
-	  lookahead -= match_length;
-
-	  RSYNC_ROLL (strstart, match_length);
 	  /* Insert new strings in the hash table only if the match length
 	   * is not too large. This saves time but degrades compression.
 	   */
-	  if (match_length <= max_insert_length)
+	  if (match_length <= s->max_lazy_match)
 	    {
 	      match_length--;	/* string at strstart already in hash table */
 	      do
 		{
-		  strstart++;
-		  INSERT_STRING (strstart, hash_head);
+		  s->strstart++;
+		  INSERT_STRING (s, s->strstart, hash_head);
 		  /* strstart never exceeds WSIZE-MAX_MATCH, so there are
 		   * always MIN_MATCH bytes ahead. If lookahead < MIN_MATCH
 		   * these bytes are garbage, but it does not matter since
@@ -719,159 +596,209 @@ deflate_fast ()
 		   */
 		}
 	      while (--match_length != 0);
-	      strstart++;
+	      s->strstart++;
 	    }
 	  else
 	    {
-	      strstart += match_length;
-	      match_length = 0;
-	      ins_h = window[strstart];
-	      UPDATE_HASH (ins_h, window[strstart + 1]);
+	      s->strstart += match_length;
+	      s->ins_h = s->window[s->strstart];
+	      UPDATE_HASH (s->ins_h, s->window[s->strstart + 1]);
 #if MIN_MATCH != 3
 	      Call UPDATE_HASH () MIN_MATCH - 3 more times
 #endif
 	    }
+	  if (flush_it)
+	    FLUSH_BLOCK (s, false);
 	}
       else
 	{
 	  /* No match, output a literal byte */
-	  Tracevv ((stderr, "%c", window[strstart]));
-	  flush = ct_tally (0, window[strstart]);
-	  RSYNC_ROLL (strstart, 1);
-	  lookahead--;
-	  strstart++;
+	  bool flush_it = ct_tally (s, 0, s->window[s->strstart]);
+	  s->lookahead--;
+	  s->strstart++;
+	  if (flush_it)
+	    FLUSH_BLOCK (s, false);
 	}
-      if (rsync && strstart > rsync_chunk_end)
+    }
+}
+
+/* ===========================================================================
+ * Same as above, but achieves better compression. We use a lazy
+ * evaluation for matches: a match is finally adopted only if there is
+ * no better match at the next window position.  The pending match or
+ * literal is kept in S between calls.
+ */
+static void
+deflate_slow (struct native_deflate *s, int flush)
+{
+  IPos hash_head;		/* head of hash chain */
+
+  /* Process the input block. */
+  for (;;)
+    {
+      if (s->lookahead < MIN_LOOKAHEAD)
 	{
-	  rsync_chunk_end = 0xFFFFFFFFUL;
-	  flush = 2;
+	  fill_window (s);
+	  if (s->lookahead < MIN_LOOKAHEAD && flush == Z_NO_FLUSH)
+	    return;
+	  if (s->lookahead == 0)
+	    break;
 	}
-      if (flush)
-	FLUSH_BLOCK (0), block_start = strstart;
 
-      /* Make sure that we always have enough lookahead, except
-       * at the end of the input file. We need MAX_MATCH bytes
-       * for the next match, plus MIN_MATCH bytes to insert the
-       * string following the next match.
+      /* Insert the string window[strstart .. strstart+2] in the
+       * dictionary, and set hash_head to the head of the hash chain:
+       */
+      INSERT_STRING (s, s->strstart, hash_head);
+
+      /* Find the longest match, discarding those <= prev_length.
        */
-      while (lookahead < MIN_LOOKAHEAD && !eofile)
-	fill_window ();
+      s->prev_length = s->match_length, s->prev_match = s->match_start;
+      s->match_length = MIN_MATCH - 1;
 
+      if (hash_head != NIL && s->prev_length < s->max_lazy_match
+	  && s->strstart - hash_head <= MAX_DIST
+	  && s->strstart <= WINDOW_SIZE - MIN_LOOKAHEAD)
+	{
+	  /* To simplify the code, we prevent matches with the string
+	   * of window index 0 (in particular we have to avoid a match
+	   * of the string with itself at the start of the input file).
+	   */
+	  s->match_length = longest_match (s, hash_head);
+	  /* longest_match() sets match_start */
+	  if (s->match_length > s->lookahead)
+	    s->match_length = s->lookahead;
+
+	  /* Ignore a length 3 match if it is too distant: */
+	  if (s->match_length == MIN_MATCH
+	      && s->strstart - s->match_start > TOO_FAR)
+	    {
+	      /* If prev_match is also MIN_MATCH, match_start is garbage
+	       * but we will ignore the current match anyway.
+	       */
+	      s->match_length--;
+	    }
+	}
+      /* If there was a match at the previous step and the current
+       * match is not better, output the previous match:
+       */
+      if (s->prev_length >= MIN_MATCH && s->match_length <= s->prev_length)
+	{
+	  bool flush_it = ct_tally (s, s->strstart - 1 - s->prev_match,
+				    s->prev_length - MIN_MATCH);
+
+	  /* Insert in hash table all strings up to the end of the match.
+	   * strstart-1 and strstart are already inserted.
+	   */
+	  s->lookahead -= s->prev_length - 1;
+	  s->prev_length -= 2;
+	  do
+	    {
+	      s->strstart++;
+	      INSERT_STRING (s, s->strstart, hash_head);
+	      /* strstart never exceeds WSIZE-MAX_MATCH, so there are
+	       * always MIN_MATCH bytes ahead. If lookahead < MIN_MATCH
+	       * these bytes are garbage, but it does not matter since the
+	       * next lookahead bytes will always be emitted as literals.
+	       */
+	    }
+	  while (--s->prev_length != 0);
+	  s->match_available = false;
+	  s->match_length = MIN_MATCH - 1;
+	  s->strstart++;
+	  if (flush_it)
+	    FLUSH_BLOCK (s, false);
+	}
+      else if (s->match_available)
+	{
+	  /* If there was no match at the previous position, output a
+	   * single literal. If there was a match but the current match
+	   * is longer, truncate the previous match to a single literal.
+	   */
+	  if (ct_tally (s, 0, s->window[s->strstart - 1]))
+	    FLUSH_BLOCK (s, false);
+	  s->strstart++;
+	  s->lookahead--;
+	}
+      else
+	{
+	  /* There is no previous match to compare with, wait for
+	   * the next step to decide.
+	   */
+	  s->match_available = true;
+	  s->strstart++;
+	  s->lookahead--;
+	}
+    }
+  if (s->match_available)
+    {
+      ct_tally (s, 0, s->window[s->strstart - 1]);
+      s->match_available = false;
     }
-  return FLUSH_BLOCK (1);	/* eof */
 }
 
 /* ===========================================================================
- * Same as above, but achieves better compression. We use a lazy
- * evaluation for matches: a match is finally adopted only if there is
- * no better match at the next window position.
+ * Compress the input of S, then end the block or the stream as FLUSH
+ * asks, leaving the output in S->out.
  */
-/* off_t*/
-/* deflateGZIP (int pack_level)*/
-/* {*/
-/*     IPos hash_head;          /* head of hash chain */ */
-/*     IPos prev_match;         /* previous match */ */
-/*     int flush = 0;           /* set if current block must be flushed */ */
-/*     int match_available = 0; /* set if previous match exists */ */
-/*     register unsigned match_length = MIN_MATCH-1; /* length of best match */ */
-/*     lm_init (pack_level);*/
-/*     if (pack_level <= 3)*/
-/*       return deflate_fast();*/
-/*     /* Process the input block. */ */
-/*     while (lookahead != 0) {*/
-/*         /* Insert the string window[strstart .. strstart+2] in the*/
-/*          * dictionary, and set hash_head to the head of the hash chain:*/
-/*          */ */
-/*         INSERT_STRING(strstart, hash_head);*/
-/*         /* Find the longest match, discarding those <= prev_length.*/
-/*          */ */
-/*         prev_length = match_length, prev_match = match_start;*/
-/*         match_length = MIN_MATCH-1;*/
-/*         if (hash_head != NIL && prev_length < max_lazy_match &&*/
-/*             strstart - hash_head <= MAX_DIST &&*/
-/*             strstart <= window_size - MIN_LOOKAHEAD) {*/
-/*             /* To simplify the code, we prevent matches with the string*/
-/*              * of window index 0 (in particular we have to avoid a match*/
-/*              * of the string with itself at the start of the input file).*/
-/*              */ */
-/*             match_length = longest_match (hash_head);*/
-/*             /* longest_match() sets match_start */ */
-/*             if (match_length > lookahead) match_length = lookahead;*/
-/*             /* Ignore a length 3 match if it is too distant: */ */
-/*             if (match_length == MIN_MATCH && strstart-match_start > TOO_FAR){*/
-/*                 /* If prev_match is also MIN_MATCH, match_start is garbage*/
-/*                  * but we will ignore the current match anyway.*/
-/*                  */ */
-/*                 match_length--;*/
-/*             }*/
-/*         }*/
-/*         /* If there was a match at the previous step and the current*/
-/*          * match is not better, output the previous match:*/
-/*          */ */
-/*         if (prev_length >= MIN_MATCH && match_length <= prev_length) {*/
-/*             check_match(strstart-1, prev_match, prev_length);*/
-/*             flush = ct_tally(strstart-1-prev_match, prev_length - MIN_MATCH);*/
-/*             /* Insert in hash table all strings up to the end of the match.*/
-/*              * strstart-1 and strstart are already inserted.*/
-/*              */ */
-/*             lookahead -= prev_length-1;*/
-/*             prev_length -= 2;*/
-/*             RSYNC_ROLL(strstart, prev_length+1);*/
-/*             do {*/
-/*                 strstart++;*/
-/*                 INSERT_STRING(strstart, hash_head);*/
-/*                 /* strstart never exceeds WSIZE-MAX_MATCH, so there are*/
-/*                  * always MIN_MATCH bytes ahead. If lookahead < MIN_MATCH*/
-/*                  * these bytes are garbage, but it does not matter since the*/
-/*                  * next lookahead bytes will always be emitted as literals.*/
-/*                  */ */
-/*             } while (--prev_length != 0);*/
-/*             match_available = 0;*/
-/*             match_length = MIN_MATCH-1;*/
-/*             strstart++;*/
-/*             if (rsync && strstart > rsync_chunk_end) {*/
-/*                 rsync_chunk_end = 0xFFFFFFFFUL;*/
-/*                 flush = 2;*/
-/*             }*/
-/*             if (flush) FLUSH_BLOCK(0), block_start = strstart;*/
-/*         } else if (match_available) {*/
-//             /* If there was no match at the previous position, output a
-//              * single literal. If there was a match but the current match
-//              * is longer, truncate the previous match to a single literal.
-//              */
-/*             Tracevv((stderr,"%c",window[strstart-1]));*/
-/*             flush = ct_tally (0, window[strstart-1]);*/
-/*             if (rsync && strstart > rsync_chunk_end) {*/
-/*                 rsync_chunk_end = 0xFFFFFFFFUL;*/
-/*                 flush = 2;*/
-/*             }*/
-/*             if (flush) FLUSH_BLOCK(0), block_start = strstart;*/
-/*             RSYNC_ROLL(strstart, 1);*/
-/*             strstart++;*/
-/*             lookahead--;*/
-/*         } else {*/
-//             /* There is no previous match to compare with, wait for
-//              * the next step to decide.
-//              */
-/*             if (rsync && strstart > rsync_chunk_end) {*/
-/*                 /* Reset huffman tree */ */
-/*                 rsync_chunk_end = 0xFFFFFFFFUL;*/
-/*                 flush = 2;*/
-/*                 FLUSH_BLOCK(0), block_start = strstart;*/
-/*             }*/
-/*             match_available = 1;*/
-/*             RSYNC_ROLL(strstart, 1);*/
-/*             strstart++;*/
-/*             lookahead--;*/
-/*         }*/
-/*         Assert (strstart <= bytes_in && lookahead <= bytes_in, "a bit too far");*/
-//         /* Make sure that we always have enough lookahead, except
-//          * at the end of the input file. We need MAX_MATCH bytes
-//          * for the next match, plus MIN_MATCH bytes to insert the
-//          * string following the next match.
-//          */
-/*         while (lookahead < MIN_LOOKAHEAD && !eofile) fill_window();*/
-/*     }*/
-/*     if (match_available) ct_tally (0, window[strstart-1]);*/
-/*     return FLUSH_BLOCK(1); /* eof */ */
-/* }*/
+static void
+deflate_input (struct native_deflate *s, int flush)
+{
+  if (s->level == 0)
+    deflate_fastest (s, flush);
+  else if (s->level <= 3)
+    deflate_fast (s, flush);
+  else
+    deflate_slow (s, flush);
+
+  if (flush == Z_FINISH)
+    FLUSH_BLOCK (s, true);
+  else if (flush != Z_NO_FLUSH)
+    {
+      if (s->last_lit != 0)
+	FLUSH_BLOCK (s, false);
+      ct_align (s);
+      if (flush == Z_FULL_FLUSH)
+	memset (s->head, 0, sizeof s->head);
+    }
+}
+
+int
+native_deflate (struct native_deflate *s, unsigned char const *in,
+                size_t len, int flush)
+{
+  s->next_in = in;
+  s->avail_in = len;
+  deflate_input (s, flush);
+  if (flush != Z_NO_FLUSH)
+    flush_out (s);
+  return s->status;
+}
+
+size_t
+native_deflate_bound (size_t len)
+{
+  /* Every block but the last holds at least 4096 literals and matches,
+   * so as many bytes, and costs at most 5 bytes more than storing it;
+   * stored blocks hold up to 65535 bytes.  The alignment costs at most 5
+   * more, and send_bits may store 8 bytes beyond the end.
+   */
+  return len + 5 * (len / 4096 + len / 65535 + 3) + 8;
+}
+
+size_t
+native_deflate_block (struct native_deflate *s, int level,
+                      unsigned char const *dict, size_t dict_len,
+                      unsigned char const *in, size_t len, bool last,
+                      unsigned char *out)
+{
+  native_deflate_reset (s, level, NULL, NULL);
+  s->out = out;
+  s->out_size = SIZE_MAX;
+  if (dict_len != 0)
+    native_deflate_dictionary (s, dict, dict_len);
+  s->whole = true;
+  s->next_in = in;
+  s->avail_in = len;
+  deflate_input (s, last ? Z_FINISH : Z_SYNC_FLUSH);
+  return s->outcnt;
+}
@@ -0,0 +1,379 @@
+/* deflate.h -- state of the native deflate compressor
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/* Shared by deflate.c, which finds the matches, and trees.c, which
+ * encodes them.  Everything that used to be a global of those two files
+ * is a member of struct native_deflate, so that each compress thread can
+ * run its own compressor.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined __AVX2__ || defined __SSE2__
+# include <immintrin.h>
+#elif defined __ARM_NEON
+# include <arm_neon.h>
+#endif
+
+typedef unsigned char uch;
+typedef unsigned short ush;
+typedef unsigned long ulg;
+
+#define WSIZE 0x8000		/* window size, must be a power of two */
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+
+#define MIN_LOOKAHEAD (MAX_MATCH+MIN_MATCH+1)
+/* Minimum amount of lookahead, except at the end of the input file.
+ * See deflate.c for comments about the MIN_MATCH+1.
+ */
+
+#define MAX_DIST  (WSIZE-MIN_LOOKAHEAD)
+/* In order to simplify the code, particularly on 16 bit machines, match
+ * distances are limited to MAX_DIST instead of WSIZE.
+ */
+
+/* Room past the end of the window for match comparisons that read a
+ * whole vector beyond the longest match.
+ */
+#define WINDOW_SLACK 64
+
+#define HASH_BITS 16		/* Number of bits used to hash strings */
+#define HASH_SIZE (1 << HASH_BITS)
+
+/* ===========================================================================
+ * Huffman coding
+ */
+
+#define MAX_BITS 15
+/* All codes must not exceed MAX_BITS bits */
+
+#define MAX_BL_BITS 7
+/* Bit length codes must not exceed MAX_BL_BITS bits */
+
+#define LENGTH_CODES 29
+/* number of length codes, not counting the special END_BLOCK code */
+
+#define LITERALS  256
+/* number of literal bytes 0..255 */
+
+#define END_BLOCK 256
+/* end of block literal code */
+
+#define L_CODES (LITERALS+1+LENGTH_CODES)
+/* number of Literal or Length codes, including the END_BLOCK code */
+
+#define D_CODES   30
+/* number of distance codes */
+
+#define BL_CODES  19
+/* number of codes used to transfer the bit lengths */
+
+#define HEAP_SIZE (2*L_CODES+1)
+/* maximum heap size */
+
+#define LIT_BUFSIZE 0x8000
+/* Size of the match buffer: a block is ended when it holds this many
+ * literals and matches, so that the frequencies fit in 16 bits.
+ */
+
+#define OUT_SIZE 0x10000
+/* Compressed output collected before it is handed to the write callback */
+
+/* Data structure describing a single value and its code string. */
+typedef struct ct_data
+{
+  union
+  {
+    ush freq;			/* frequency count */
+    ush code;			/* bit string */
+  } fc;
+  union
+  {
+    ush dad;			/* father node in Huffman tree */
+    ush len;			/* length of bit string */
+  } dl;
+} ct_data;
+
+#define Freq fc.freq
+#define Code fc.code
+#define Dad  dl.dad
+#define Len  dl.len
+
+typedef struct tree_desc
+{
+  ct_data *dyn_tree;		/* the dynamic tree */
+  ct_data const *static_tree;	/* corresponding static tree or NULL */
+  int const *extra_bits;	/* extra bits for each code or NULL */
+  int extra_base;		/* base index for extra_bits */
+  int elems;			/* max number of elements in the tree */
+  int max_length;		/* max bit length for the codes */
+  int max_code;			/* largest code with non zero frequency */
+} tree_desc;
+
+typedef ush Pos;
+typedef unsigned IPos;
+/* A Pos is an index in the character window. We use short instead of int to
+ * save space in the various tables. IPos is used only for parameter passing.
+ */
+
+struct native_deflate
+{
+  /* Output.  Whole bytes go to OUT and from there to WRITE; up to 63
+   * bits wait in BI_BUF.  native_deflate_block points OUT at the
+   * caller's buffer instead, which is never flushed.
+   */
+  int (*write) (void *opaque, unsigned char const *data, size_t len);
+  void *opaque;
+  int status;			/* Z_OK, or Z_ERRNO once WRITE failed */
+  uint64_t bi_buf;		/* bits not yet in OUT, from bit 0 */
+  int bi_valid;			/* number of valid bits in bi_buf */
+  uch *out;			/* OUTBUF or the caller's buffer */
+  size_t outcnt;		/* bytes in OUT */
+  size_t out_size;		/* OUT is flushed once it holds this many */
+  uch outbuf[OUT_SIZE + 8];
+
+  /* Input of the current native_deflate call.  If WHOLE, that is all of
+   * the stream's input, which stays in memory until it is compressed, so
+   * stored blocks can be copied from it wherever the window is, and
+   * blocks are split where the statistics change (see ct_end_block).
+   */
+  uch const *next_in;
+  size_t avail_in;
+  bool whole;
+
+  /* Matching */
+  int level;
+  unsigned max_chain_length;	/* never search hash chains beyond this */
+  unsigned max_lazy_match;	/* see configuration_table in deflate.c */
+  unsigned good_match;		/* shorten the search beyond this length */
+  unsigned nice_match;		/* stop searching beyond this length */
+  unsigned ins_h;		/* hash index of string to be inserted */
+  long block_start;		/* window position at the beginning of the
+				   current output block, negative once the
+				   window has moved past it */
+  unsigned strstart;		/* start of string to insert */
+  unsigned match_start;		/* start of matching string */
+  unsigned lookahead;		/* number of valid bytes ahead in window */
+  unsigned prev_length;		/* length of the best match at the previous
+				   step, for lazy evaluation */
+  unsigned match_length;	/* length of the best match */
+  unsigned prev_match;		/* start of the previous match */
+  bool match_available;		/* set if a previous match exists */
+
+  Pos head[HASH_SIZE];		/* heads of the hash chains or NIL */
+  Pos prev[WSIZE];		/* link to older string with same hash */
+  uch window[2 * WSIZE + WINDOW_SLACK];
+
+  /* Huffman coding */
+  ct_data dyn_ltree[HEAP_SIZE];	/* literal and length tree */
+  ct_data dyn_dtree[2 * D_CODES + 1];	/* distance tree */
+  ct_data bl_tree[2 * BL_CODES + 1];	/* Huffman tree for the bit lengths */
+  tree_desc l_desc;
+  tree_desc d_desc;
+  tree_desc bl_desc;
+  ush bl_count[MAX_BITS + 1];	/* number of codes at each bit length */
+  int heap[2 * L_CODES + 1];	/* heap used to build the Huffman trees */
+  int heap_len;			/* number of elements in the heap */
+  int heap_max;			/* element of largest frequency */
+  uch depth[2 * L_CODES + 1];	/* tie breaker for trees of equal freq. */
+
+  /* The literals and matches of the current block: l_buf holds the
+   * literal or the match length - MIN_MATCH, d_buf the distance, or 0 for
+   * a literal.
+   */
+  uch l_buf[LIT_BUFSIZE];
+  ush d_buf[LIT_BUFSIZE];
+  unsigned last_lit;		/* running index in l_buf and d_buf */
+  unsigned last_dist;		/* number of matches in the block */
+  ulg opt_len;			/* bit length of block with optimal trees */
+  ulg static_len;		/* bit length of block with static trees */
+
+  struct optimal *opt;		/* buffers of native_deflate_optimal, or
+				   NULL until it is first called */
+};
+
+        /* in optimal.c */
+extern void optimal_free (struct optimal *opt);
+
+        /* in trees.c */
+extern int const extra_lbits[LENGTH_CODES];
+extern int const extra_dbits[D_CODES];
+extern uch length_code[MAX_MATCH - MIN_MATCH + 1];
+extern uch dist_code[512];
+extern void ct_static_init (void);
+extern void ct_init (struct native_deflate *s);
+extern bool ct_end_block (struct native_deflate *s);
+extern void flush_block (struct native_deflate *s, uch const *buf,
+                         ulg stored_len, bool eof);
+extern void ct_align (struct native_deflate *s);
+extern void flush_out (struct native_deflate *s);
+extern uint64_t ct_entropy (unsigned const *freq, int n);
+
+#define d_code(dist) \
+   ((dist) < 256 ? dist_code[dist] : dist_code[256+((dist)>>7)])
+/* Mapping from a distance to a distance code. dist is the distance - 1 and
+ * must not have side effects. dist_code[256] and dist_code[257] are never
+ * used.
+ */
+
+/* ===========================================================================
+ * Return log2 (X) in 256ths of a bit, for X > 0, interpolating linearly
+ * between powers of two, which is within 0.09 bit.
+ */
+static inline unsigned
+log2_q8 (unsigned x)
+{
+  int b = 31 - __builtin_clz (x);
+  unsigned frac = b >= 8 ? x >> (b - 8) : x << (8 - b);
+  return (b << 8) + (frac & 0xff);
+}
+
+/* ===========================================================================
+ * Send a value on a given number of bits, at most 48, enough for a whole
+ * match.  The bits gather in a 64-bit buffer, which is stored whole,
+ * little endian, when it fills.
+ */
+static inline void
+send_bits (struct native_deflate *s, uint64_t value, int length)
+{
+  uint64_t v = value;
+
+  s->bi_buf |= v << s->bi_valid;
+  s->bi_valid += length;
+  if (s->bi_valid < 64)
+    return;
+
+  uch *p = s->out + s->outcnt;
+  for (int i = 0; i < 8; i++)
+    p[i] = (uch) (s->bi_buf >> (8 * i));
+  s->outcnt += 8;
+  s->bi_valid -= 64;
+  /* Here the old bi_valid was at least 16, so the shift is below 64.  */
+  s->bi_buf = v >> (length - s->bi_valid);
+  if (s->outcnt >= s->out_size)
+    flush_out (s);
+}
+
+/* ===========================================================================
+ * Return the data of the current block, which begins at window position
+ * block_start, or NULL if it is no longer in memory.
+ */
+static inline uch const *
+block_data (struct native_deflate const *s)
+{
+  if (s->block_start >= 0)
+    return s->window + s->block_start;
+  if (s->whole)
+    return s->next_in - s->lookahead - ((long) s->strstart - s->block_start);
+  return NULL;
+}
+
+/* ===========================================================================
+ * Save the match info and tally the frequency counts. Return true if
+ * the current block must be flushed.
+ */
+static inline bool
+ct_tally (struct native_deflate *s, unsigned dist, unsigned lc)
+{
+  s->l_buf[s->last_lit] = (uch) lc;
+  s->d_buf[s->last_lit++] = (ush) dist;
+  if (dist == 0)
+    {
+      /* lc is the unmatched char */
+      s->dyn_ltree[lc].Freq++;
+    }
+  else
+    {
+      /* Here, lc is the match length - MIN_MATCH */
+      dist--;			/* dist = match distance - 1 */
+      s->dyn_ltree[length_code[lc] + LITERALS + 1].Freq++;
+      s->dyn_dtree[d_code (dist)].Freq++;
+      s->last_dist++;
+    }
+  if ((s->last_lit & 0xfff) == 0 && ct_end_block (s))
+    return true;
+  return s->last_lit == LIT_BUFSIZE - 1;
+}
+
+/* ===========================================================================
+ * Return the number of leading bytes that A and B have in common, up to
+ * MAX_MATCH.  Both may be read a vector past MAX_MATCH.
+ */
+static inline unsigned
+match_length (uch const *a, uch const *b)
+{
+  unsigned len;
+
+#if defined __AVX2__
+  for (len = 0; len < MAX_MATCH; len += 32)
+    {
+      __m256i x = _mm256_loadu_si256 ((__m256i const *) (a + len));
+      __m256i y = _mm256_loadu_si256 ((__m256i const *) (b + len));
+      unsigned diff = ~(unsigned) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (x, y));
+      if (diff != 0)
+        {
+          len += __builtin_ctz (diff);
+          break;
+        }
+    }
+#elif defined __SSE2__
+  for (len = 0; len < MAX_MATCH; len += 16)
+    {
+      __m128i x = _mm_loadu_si128 ((__m128i const *) (a + len));
+      __m128i y = _mm_loadu_si128 ((__m128i const *) (b + len));
+      unsigned diff = ~_mm_movemask_epi8 (_mm_cmpeq_epi8 (x, y)) & 0xffff;
+      if (diff != 0)
+        {
+          len += __builtin_ctz (diff);
+          break;
+        }
+    }
+#elif defined __ARM_NEON
+  for (len = 0; len < MAX_MATCH; len += 16)
+    {
+      uint8x16_t eq = vceqq_u8 (vld1q_u8 (a + len), vld1q_u8 (b + len));
+      /* Narrow the comparison to four bits per byte.  */
+      uint8x8_t nibbles = vshrn_n_u16 (vreinterpretq_u16_u8 (eq), 4);
+      uint64_t diff = ~vget_lane_u64 (vreinterpret_u64_u8 (nibbles), 0);
+      if (diff != 0)
+        {
+          len += __builtin_ctzll (diff) >> 2;
+          break;
+        }
+    }
+#else
+  for (len = 0; len < MAX_MATCH; len += 8)
+    {
+      uint64_t x, y;
+      memcpy (&x, a + len, 8);
+      memcpy (&y, b + len, 8);
+      if (x != y)
+        {
+# ifdef WORDS_BIGENDIAN
+          len += __builtin_clzll (x ^ y) >> 3;
+# else
+          len += __builtin_ctzll (x ^ y) >> 3;
+# endif
+          break;
+        }
+    }
+#endif
+  return len < MAX_MATCH ? len : MAX_MATCH;
+}
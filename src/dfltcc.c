@@ -18,204 +18,19 @@
 
 #include <config.h>
 
-#include <stdalign.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
-#ifdef DFLTCC_USDT
-#include <sys/sdt.h>
-#endif
-
 #include "tailor.h"
 #include "gzip.h"
+#include "dfltcc.h"
 
 #ifdef DYN_ALLOC
 #error "DYN_ALLOC is not supported by DFLTCC"
 #endif
 
-/* ===========================================================================
- * C wrappers for the DEFLATE CONVERSION CALL instruction.
- */
-
-typedef enum
-{
-  DFLTCC_CC_OK = 0,
-  DFLTCC_CC_OP1_TOO_SHORT = 1,
-  DFLTCC_CC_OP2_TOO_SHORT = 2,
-  DFLTCC_CC_OP2_CORRUPT = 2,
-  DFLTCC_CC_AGAIN = 3,
-} dfltcc_cc;
-
-#define DFLTCC_QAF 0
-#define DFLTCC_GDHT 1
-#define DFLTCC_CMPR 2
-#define DFLTCC_XPND 4
-#define HBT_CIRCULAR (1 << 7)
-/* #define HB_BITS 15 */
-/* #define HB_SIZE (1 << HB_BITS) */
-#define DFLTCC_FACILITY 151
-#define DFLTCC_FMT0 0
-#define CVT_CRC32 0
-#define HTT_FIXED 0
-#define HTT_DYNAMIC 1
-
-#ifndef DFLTCC_BLOCK_SIZE
-#define DFLTCC_BLOCK_SIZE 1048576
-#endif
-#ifndef DFLTCC_FIRST_FHT_BLOCK_SIZE
-#define DFLTCC_FIRST_FHT_BLOCK_SIZE 4096
-#endif
-#ifndef DFLTCC_LEVEL_MASK
-#define DFLTCC_LEVEL_MASK 0x2
-#endif
-#ifndef DFLTCC_RIBM
-#define DFLTCC_RIBM 0
-#endif
-
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
-struct dfltcc_qaf_param
-{
-  char fns[16];
-  char reserved1[8];
-  char fmts[2];
-  char reserved2[6];
-};
-
-union aligned_dfltcc_qaf_param
-{
-  struct dfltcc_qaf_param af;
-  char alignas (8) aligned;
-};
-
-struct dfltcc_param_v0
-{
-  unsigned short pbvn;		/* Parameter-Block-Version Number */
-  unsigned char mvn;		/* Model-Version Number */
-  unsigned char ribm;		/* Reserved for IBM use */
-  unsigned reserved32:31;
-  unsigned cf:1;		/* Continuation Flag */
-  unsigned char reserved64[8];
-  unsigned nt:1;		/* New Task */
-  unsigned reserved129:1;
-  unsigned cvt:1;		/* Check Value Type */
-  unsigned reserved131:1;
-  unsigned htt:1;		/* Huffman-Table Type */
-  unsigned bcf:1;		/* Block-Continuation Flag */
-  unsigned bcc:1;		/* Block Closing Control */
-  unsigned bhf:1;		/* Block Header Final */
-  unsigned reserved136:1;
-  unsigned reserved137:1;
-  unsigned dhtgc:1;		/* DHT Generation Control */
-  unsigned reserved139:5;
-  unsigned reserved144:5;
-  unsigned sbb:3;		/* Sub-Byte Boundary */
-  unsigned char oesc;		/* Operation-Ending-Supplemental Code */
-  unsigned reserved160:12;
-  unsigned ifs:4;		/* Incomplete-Function Status */
-  unsigned short ifl;		/* Incomplete-Function Length */
-  unsigned char reserved192[8];
-  unsigned char reserved256[8];
-  unsigned char reserved320[4];
-  unsigned short hl;		/* History Length */
-  unsigned reserved368:1;
-  unsigned short ho:15;		/* History Offset */
-  unsigned int cv;		/* Check Value */
-  unsigned eobs:15;		/* End-of-block Symbol */
-  unsigned reserved431:1;
-  unsigned char eobl:4;		/* End-of-block Length */
-  unsigned reserved436:12;
-  unsigned reserved448:4;
-  unsigned short cdhtl:12;	/* Compressed-Dynamic-Huffman Table
-				   Length */
-  unsigned char reserved464[6];
-  unsigned char cdht[288];
-  unsigned char reserved[32];
-  unsigned char csb[1152];
-};
-
-union aligned_dfltcc_param_v0
-{
-  struct dfltcc_param_v0 param;
-  char alignas (8) aligned;
-};
-
-static int
-is_bit_set (const char *bits, int n)
-{
-  return bits[n / 8] & (1 << (7 - (n % 8)));
-}
-
-static int
-is_dfltcc_enabled (void)
-{
-  char facilities[(DFLTCC_FACILITY / 64 + 1) * 8];
-
-  char const *env = getenv ("DFLTCC");
-  if (env && !strcmp (env, "0"))
-    return 0;
-
-  register int r0 __asm__ ("r0") = sizeof facilities / 8;
-__asm__ ("stfle %[facilities]\n": [facilities] "=Q" (facilities): [r0] "r" (r0):"cc", "memory");
-  return is_bit_set (facilities, DFLTCC_FACILITY);
-}
-
-static dfltcc_cc
-dfltcc (int fn, void *param,
-	uch ** op1, size_t * len1, uch const **op2, size_t * len2, void *hist)
-{
-  uch *t2 = op1 ? *op1 : NULL;
-  size_t t3 = len1 ? *len1 : 0;
-  const uch *t4 = op2 ? *op2 : NULL;
-  size_t t5 = len2 ? *len2 : 0;
-  register int r0 __asm__ ("r0") = fn;
-  register void *r1 __asm__ ("r1") = param;
-  register uch *r2 __asm__ ("r2") = t2;
-  register size_t r3 __asm__ ("r3") = t3;
-  register const uch *r4 __asm__ ("r4") = t4;
-  register size_t r5 __asm__ ("r5") = t5;
-  int cc;
-
-  __asm__ volatile (
-#ifdef DFLTCC_USDT
-		     STAP_PROBE_ASM (zlib, dfltcc_entry,
-				     STAP_PROBE_ASM_TEMPLATE (5))
-#endif
-		     ".insn rrf,0xb9390000,%[r2],%[r4],%[hist],0\n"
-#ifdef DFLTCC_USDT
-		     STAP_PROBE_ASM (zlib, dfltcc_exit,
-				     STAP_PROBE_ASM_TEMPLATE (5))
-#endif
-		     "ipm %[cc]\n":[r2] "+r" (r2),[r3] "+r" (r3),
-		     [r4] "+r" (r4),[r5] "+r" (r5),
-		     [cc] "=r" (cc):[r0] "r" (r0),[r1] "r" (r1),
-		     [hist] "r" (hist)
-#ifdef DFLTCC_USDT
-		     , STAP_PROBE_ASM_OPERANDS (5, r2, r3, r4, r5, hist)
-#endif
-		     :"cc", "memory");
-  t2 = r2;
-  t3 = r3;
-  t4 = r4;
-  t5 = r5;
-
-  if (op1)
-    *op1 = t2;
-  if (len1)
-    *len1 = t3;
-  if (op2)
-    *op2 = t4;
-  if (len2)
-    *len2 = t5;
-  return (cc >> 28) & 3;
-}
-
-static void
-dfltcc_qaf (struct dfltcc_qaf_param *param)
-{
-  dfltcc (DFLTCC_QAF, param, NULL, NULL, NULL, NULL, NULL);
-}
-
 static void
 dfltcc_gdht (struct dfltcc_param_v0 *param)
 {
@@ -299,18 +114,18 @@ dfltcc_deflate (int pack_level)
 {
   /* Check whether we can use hardware compression.  */
   if (!is_dfltcc_enabled () || getenv ("SOURCE_DATE_EPOCH"))
-    return deflateGZIP (pack_level);
+    return zlib_zip (pack_level);
   char const *s = getenv ("DFLTCC_LEVEL_MASK");
   unsigned long level_mask
     = s && *s ? strtoul (s, NULL, 0) : DFLTCC_LEVEL_MASK;
   if ((level_mask & (1 << pack_level)) == 0)
-    return deflateGZIP (pack_level);
+    return zlib_zip (pack_level);
   union aligned_dfltcc_qaf_param ctx;
   dfltcc_qaf (&ctx.af);
   if (!is_bit_set (ctx.af.fns, DFLTCC_CMPR)
       || !is_bit_set (ctx.af.fns, DFLTCC_GDHT)
       || !is_bit_set (ctx.af.fmts, DFLTCC_FMT0))
-    return deflateGZIP (pack_level);
+    return zlib_zip (pack_level);
 
   /* Initialize tuning parameters.  */
   s = getenv ("DFLTCC_BLOCK_SIZE");
@@ -0,0 +1,575 @@
+/* engine.c -- the deflate implementations chosen from at run time
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/*
+ *  PURPOSE
+ *
+ *      Put zlib, gzip's own deflate code and, on IBM Z, the DEFLATE
+ *      CONVERSION CALL instruction behind one struct deflate_engine each,
+ *      so that the compress threads, the decoders and the benchmarks can
+ *      use whichever one the machine and --engine call for.
+ *
+ *  DISCUSSION
+ *
+ *      The hardware engine is compiled in only with --enable-dfltcc, but
+ *      whether it is used is decided when gzip runs, by asking the CPU,
+ *      so one binary serves machines with and without the facility.
+ *      Setting DFLTCC=0 in the environment turns it off, as it does for
+ *      the serial code in dfltcc.c.
+ *
+ *      The hardware keeps its history in a circular buffer of its own,
+ *      so its blocks are compressed without the dictionary that primes
+ *      the software engines; it has no levels either.
+ *
+ *  INTERFACE
+ *
+ *      struct deflate_engine const *deflate_engine_find (char const *name)
+ *          Return the engine called NAME, whether or not this machine can
+ *          run it, or NULL if there is none.
+ *
+ *      struct deflate_engine const *deflate_engine_default (bool
+ *                                                           decompress)
+ *          Return the engine to use when none was asked for: the hardware
+ *          one where the CPU has it, otherwise zlib to compress and gzip's
+ *          own decoder, which is faster, to decompress.
+ */
+
+#include <config.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zlib.h"
+#include "parallel.h"
+#ifdef IBM_Z_DFLTCC
+# include "dfltcc.h"
+#endif
+
+/* The largest power of two that fits in an unsigned int.  */
+#define MAXP2 (UINT_MAX - (UINT_MAX >> 1))
+
+static bool
+always (void)
+{
+  return true;
+}
+
+/* ===========================================================================
+ * zlib.
+ */
+
+static void *
+zlib_init (void)
+{
+  z_stream *strm = malloc (sizeof *strm);
+
+  if (strm == NULL)
+    return NULL;
+  strm->zalloc = Z_NULL;
+  strm->zfree = Z_NULL;
+  strm->opaque = Z_NULL;
+  if (deflateInit2 (strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+		    Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      free (strm);
+      return NULL;
+    }
+  return strm;
+}
+
+static size_t
+zlib_bound (size_t len)
+{
+  /* compressBound allows for the zlib wrapper, which raw deflate does
+     not have; the rest is for the few bytes that align the end.  */
+  return compressBound (len) + 16;
+}
+
+/* Deflate the input of STRM with FLUSH into the ROOM bytes at OUT, of
+   which STRM has used the bytes before its next_out.  Return false if
+   they were not enough.  */
+static bool
+zlib_run (z_stream *strm, unsigned char *out, size_t room, int flush)
+{
+  do
+    {
+      size_t left = room - (size_t) (strm->next_out - out);
+      if (left == 0)
+	return false;
+      strm->avail_out = left < UINT_MAX ? left : UINT_MAX;
+      deflate (strm, flush);
+    }
+  while (strm->avail_out == 0);
+  return true;
+}
+
+static size_t
+zlib_compress (void *state, int level, int strategy,
+	       unsigned char const *dict, size_t dict_len,
+	       unsigned char const *in, size_t len, bool last,
+	       unsigned char *out)
+{
+  z_stream *strm = state;
+  size_t room = zlib_bound (len);
+  size_t left = len;
+  bool ok = true;
+
+  deflateReset (strm);
+  deflateParams (strm, level, strategy);
+  if (dict_len != 0)
+    deflateSetDictionary (strm, dict, dict_len);
+  strm->next_in = (z_const Bytef *) in;
+  strm->next_out = out;
+  while (left > MAXP2 && ok)
+    {
+      strm->avail_in = MAXP2;
+      ok = zlib_run (strm, out, room, Z_NO_FLUSH);
+      left -= MAXP2;
+    }
+  strm->avail_in = (unsigned) left;
+
+  if (!ok)
+    ;
+  else if (last)
+    ok = zlib_run (strm, out, room, Z_FINISH);
+  else
+    {
+      /* End the last block, then reach a byte boundary with an empty
+	 stored block if a bit is left over, which is the only way, or
+	 else with empty static blocks, which cost less.  */
+      int bits;
+      ok = zlib_run (strm, out, room, Z_BLOCK);
+      deflatePending (strm, Z_NULL, &bits);
+      if (ok && (bits & 1))
+	ok = zlib_run (strm, out, room, Z_SYNC_FLUSH);
+      else if (ok && (bits & 7))
+	{
+	  do
+	    {
+	      deflatePrime (strm, 10, 2);
+	      deflatePending (strm, Z_NULL, &bits);
+	    }
+	  while (bits & 7);
+	  ok = zlib_run (strm, out, room, Z_BLOCK);
+	}
+    }
+  return ok ? (size_t) (strm->next_out - out) : (size_t) -1;
+}
+
+static void
+zlib_finish (void *state)
+{
+  if (state != NULL)
+    deflateEnd (state);
+  free (state);
+}
+
+/* What zlib_inflate's callbacks work with.  */
+struct zlib_inflate_io
+{
+  unsigned char const *next;	/* input not yet handed to inflateBack */
+  size_t left;
+  int (*write) (void *opaque, unsigned char const *data, size_t len);
+  void *opaque;
+  bool write_failed;
+};
+
+static unsigned
+zlib_inflate_in (void *desc, z_const unsigned char **buf)
+{
+  struct zlib_inflate_io *io = desc;
+  unsigned len = io->left < UINT_MAX ? io->left : UINT_MAX;
+
+  *buf = (z_const unsigned char *) io->next;
+  io->next += len;
+  io->left -= len;
+  return len;
+}
+
+/* Write a run of output straight from the inflateBack window.  */
+static int
+zlib_inflate_out (void *desc, unsigned char *buf, unsigned len)
+{
+  struct zlib_inflate_io *io = desc;
+
+  if (io->write (io->opaque, buf, len) != 0)
+    io->write_failed = true;
+  return io->write_failed;
+}
+
+static int
+zlib_inflate (unsigned char const *in, size_t len, size_t *used,
+	      int (*write) (void *opaque, unsigned char const *data,
+			    size_t len),
+	      void *opaque)
+{
+  struct zlib_inflate_io io = { in, len, write, opaque, false };
+  unsigned char *window = malloc (1U << MAX_WBITS);
+  z_stream strm;
+  int ret;
+
+  *used = 0;
+  if (window == NULL)
+    return Z_MEM_ERROR;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  ret = inflateBackInit (&strm, MAX_WBITS, window);
+  if (ret != Z_OK)
+    {
+      free (window);
+      return ret;
+    }
+  strm.next_in = Z_NULL;
+  strm.avail_in = 0;
+  ret = inflateBack (&strm, zlib_inflate_in, &io, zlib_inflate_out, &io);
+  *used = len - io.left - strm.avail_in;
+  (void) inflateBackEnd (&strm);
+  free (window);
+  if (ret == Z_STREAM_END)
+    return Z_OK;
+  if (ret == Z_BUF_ERROR)
+    return io.write_failed ? Z_ERRNO : Z_DATA_ERROR;
+  return ret;
+}
+
+struct deflate_engine const zlib_engine = {
+  .name = "zlib",
+  .available = always,
+  .init = zlib_init,
+  .bound = zlib_bound,
+  .compress = zlib_compress,
+  .optimal = NULL,
+  .finish = zlib_finish,
+  .inflate = zlib_inflate
+};
+
+/* ===========================================================================
+ * gzip's own deflate code.
+ */
+
+static void *
+native_init (void)
+{
+  return native_deflate_new ();
+}
+
+static size_t
+native_compress (void *state, int level, int strategy,
+		 unsigned char const *dict, size_t dict_len,
+		 unsigned char const *in, size_t len, bool last,
+		 unsigned char *out)
+{
+  /* There is no run length encoding, but at level 1 a run of one byte
+     still comes out as back to back matches of the longest length.  */
+  if (strategy == Z_RLE)
+    level = 1;
+  return native_deflate_block (state, level, dict, dict_len, in, len, last,
+			       out);
+}
+
+static size_t
+native_optimal (void *state, int iterations,
+		unsigned char const *dict, size_t dict_len,
+		unsigned char const *in, size_t len, bool last,
+		unsigned char *out)
+{
+  return native_deflate_optimal (state, iterations, dict, dict_len, in, len,
+				 last, out);
+}
+
+static void
+native_finish (void *state)
+{
+  native_deflate_free (state);
+}
+
+struct deflate_engine const native_engine = {
+  .name = "native",
+  .available = always,
+  .init = native_init,
+  .bound = native_deflate_bound,
+  .compress = native_compress,
+  .optimal = native_optimal,
+  .finish = native_finish,
+  .inflate = native_inflate
+};
+
+/* ===========================================================================
+ * IBM Z DEFLATE CONVERSION CALL.
+ */
+
+#ifdef IBM_Z_DFLTCC
+
+/* The size of the circular history buffer, which the instruction wants
+   aligned on a page.  */
+#define HB_SIZE 32768
+#define HB_ALIGN 4096
+
+/* The state of one thread: the history and the parameter block.  */
+struct dfltcc_state
+{
+  alignas (HB_ALIGN) unsigned char window[HB_SIZE];
+  union aligned_dfltcc_param_v0 ctx;
+};
+
+static bool
+dfltcc_available (void)
+{
+  union aligned_dfltcc_qaf_param ctx;
+
+  if (!is_dfltcc_enabled ())
+    return false;
+  dfltcc_qaf (&ctx.af);
+  return (is_bit_set (ctx.af.fns, DFLTCC_CMPR)
+	  && is_bit_set (ctx.af.fns, DFLTCC_GDHT)
+	  && is_bit_set (ctx.af.fns, DFLTCC_XPND)
+	  && is_bit_set (ctx.af.fmts, DFLTCC_FMT0));
+}
+
+static void *
+dfltcc_init (void)
+{
+  size_t size = (sizeof (struct dfltcc_state) + HB_ALIGN - 1)
+		/ HB_ALIGN * HB_ALIGN;
+  return aligned_alloc (HB_ALIGN, size);
+}
+
+/* Start a new stream with the parameter block of ST.  */
+static struct dfltcc_param_v0 *
+dfltcc_new_task (struct dfltcc_state *st)
+{
+  struct dfltcc_param_v0 *param = &st->ctx.param;
+
+  memset (param, 0, sizeof *param);
+  param->ribm = DFLTCC_RIBM;
+  param->nt = 1;
+  param->cvt = CVT_CRC32;
+  return param;
+}
+
+static size_t
+dfltcc_bound (size_t len)
+{
+  /* A dynamic code may spend up to 15 bits on a literal, and each block
+     of DFLTCC_BLOCK_SIZE bytes has a header of at most 288 bytes and an
+     end of block code; then comes the empty stored block that ends the
+     output.  */
+  return 2 * len + (len / DFLTCC_BLOCK_SIZE + 1) * 300 + 16;
+}
+
+/* Reverse the LEN bits of CODE, 1 <= LEN <= 15.  */
+static unsigned
+dfltcc_reverse (unsigned code, int len)
+{
+  unsigned res = 0;
+
+  do
+    {
+      res = res << 1 | (code & 1);
+      code >>= 1;
+    }
+  while (--len > 0);
+  return res;
+}
+
+/* Append the N low bits of VALUE to the output at *NEXT, whose first
+   byte holds the *SBB bits written so far.  */
+static void
+dfltcc_put_bits (unsigned char **next, unsigned *sbb, unsigned value, int n)
+{
+  unsigned buf = *sbb != 0 ? **next & ((1U << *sbb) - 1) : 0;
+  int bits = *sbb;
+
+  buf |= value << bits;
+  bits += n;
+  while (bits >= 8)
+    {
+      *(*next)++ = buf;
+      buf >>= 8;
+      bits -= 8;
+    }
+  if (bits != 0)
+    **next = buf;
+  *sbb = bits;
+}
+
+static size_t
+dfltcc_compress (void *state, int level, int strategy,
+		 unsigned char const *dict, size_t dict_len,
+		 unsigned char const *in, size_t len, bool last,
+		 unsigned char *out)
+{
+  struct dfltcc_state *st = state;
+  struct dfltcc_param_v0 *param = dfltcc_new_task (st);
+  unsigned char *next_out = out;
+  size_t avail_out = dfltcc_bound (len);
+  unsigned char const *next_in = in;
+  unsigned sbb = 0;
+
+  while (next_in != in + len)
+    {
+      size_t block = in + len - next_in;
+      if (block > DFLTCC_BLOCK_SIZE)
+	block = DFLTCC_BLOCK_SIZE;
+
+      /* Short blocks do better with the fixed code than with a dynamic
+	 one that has to be sent.  */
+      param->bcf = 0;
+      param->sbb = sbb;
+      if (block < DFLTCC_FIRST_FHT_BLOCK_SIZE)
+	param->htt = HTT_FIXED;
+      else
+	{
+	  unsigned char const *p = next_in;
+	  size_t n = block;
+	  param->htt = HTT_DYNAMIC;
+	  dfltcc (DFLTCC_GDHT, param, NULL, NULL, &p, &n, NULL);
+	}
+      while (block != 0)
+	{
+	  unsigned char const *p = next_in;
+	  size_t n = block;
+	  dfltcc_cc cc = dfltcc (DFLTCC_CMPR | HBT_CIRCULAR, param,
+				 &next_out, &avail_out, &p, &n,
+				 st->window);
+	  if (cc == DFLTCC_CC_OP1_TOO_SHORT)
+	    return (size_t) -1;
+	  block -= p - next_in;
+	  next_in = p;
+	  param->bcf = 1;
+	}
+
+      /* Close the block with its end of block code.  */
+      sbb = param->sbb;
+      dfltcc_put_bits (&next_out, &sbb,
+		       dfltcc_reverse (param->eobs >> (15 - param->eobl),
+				       param->eobl),
+		       param->eobl);
+    }
+
+  /* An empty stored block, final if LAST, ends the output at a byte
+     boundary.  */
+  dfltcc_put_bits (&next_out, &sbb, last, 3);
+  if (sbb != 0)
+    next_out++;
+  memcpy (next_out, "\0\0\377\377", 4);
+  return next_out + 4 - out;
+}
+
+static void
+dfltcc_finish (void *state)
+{
+  free (state);
+}
+
+/* The size of the buffer that dfltcc_inflate writes out of.  */
+#define DFLTCC_OUT_SIZE (1 << 20)
+
+static int
+dfltcc_inflate (unsigned char const *in, size_t len, size_t *used,
+		int (*write) (void *opaque, unsigned char const *data,
+			      size_t len),
+		void *opaque)
+{
+  struct dfltcc_state *st = dfltcc_init ();
+  unsigned char *buf = malloc (DFLTCC_OUT_SIZE);
+  unsigned char const *next_in = in;
+  size_t avail_in = len;
+  int ret = Z_MEM_ERROR;
+
+  if (st != NULL && buf != NULL)
+    {
+      struct dfltcc_param_v0 *param = dfltcc_new_task (st);
+      for (;;)
+	{
+	  unsigned char *next_out = buf;
+	  size_t avail_out = DFLTCC_OUT_SIZE;
+	  dfltcc_cc cc = dfltcc (DFLTCC_XPND | HBT_CIRCULAR, param,
+				 &next_out, &avail_out, &next_in,
+				 &avail_in, st->window);
+	  if (next_out != buf && write (opaque, buf, next_out - buf) != 0)
+	    {
+	      ret = Z_ERRNO;
+	      break;
+	    }
+	  if (cc == DFLTCC_CC_OK)
+	    {
+	      ret = Z_OK;
+	      break;
+	    }
+	  /* The whole input is at hand, so running out of it means that
+	     the stream is truncated.  */
+	  if (cc == DFLTCC_CC_OP2_CORRUPT)
+	    {
+	      ret = Z_DATA_ERROR;
+	      break;
+	    }
+	}
+      /* A stream that ends in the middle of a byte uses all of it.  */
+      if (ret == Z_OK && param->sbb != 0)
+	next_in++;
+    }
+  *used = next_in - in;
+  free (buf);
+  free (st);
+  return ret;
+}
+
+struct deflate_engine const dfltcc_engine = {
+  .name = "dfltcc",
+  .available = dfltcc_available,
+  .init = dfltcc_init,
+  .bound = dfltcc_bound,
+  .compress = dfltcc_compress,
+  .optimal = NULL,
+  .finish = dfltcc_finish,
+  .inflate = dfltcc_inflate
+};
+
+#endif /* IBM_Z_DFLTCC */
+
+/* ===========================================================================
+ * Choosing one.
+ */
+
+struct deflate_engine const *const deflate_engines[] = {
+#ifdef IBM_Z_DFLTCC
+  &dfltcc_engine,
+#endif
+  &native_engine,
+  &zlib_engine,
+  NULL
+};
+
+struct deflate_engine const *
+deflate_engine_find (char const *name)
+{
+  for (int i = 0; deflate_engines[i] != NULL; i++)
+    if (strcmp (deflate_engines[i]->name, name) == 0)
+      return deflate_engines[i];
+  return NULL;
+}
+
+struct deflate_engine const *
+deflate_engine_default (bool decompress)
+{
+#ifdef IBM_Z_DFLTCC
+  if (dfltcc_available ())
+    return &dfltcc_engine;
+#endif
+  return decompress ? &native_engine : &zlib_engine;
+}
@@ -90,6 +90,7 @@ static char const *const license_msg[] = {
 #include "zlib.h"
 
 #include "gzip.h"
+#include "parallel.h"
 
 
 		/* configuration */
@@ -200,6 +201,11 @@ static char *env;		/* contents of GZIP env variable */
 static char const *z_suffix;	/* default suffix (can be set with --suffix) */
 static size_t z_len;		/* strlen(z_suffix) */
 int threads = 0;		/* no parallel if defaults threads=0 */
+int flush_interval = 0;		/* --flush-interval in ms, or 0 */
+static int show_stats = 0;	/* --stats: STATS_HUMAN or STATS_JSON */
+static char const *trace_name;	/* --trace file name */
+static FILE *trace_file;
+struct pipeline_trace *job_trace;	/* job timelines of -j, or NULL */
 int pkzip = 0;			/* set for pkzip decompression */
 
 /* The original timestamp (modification time).  If the original is
@@ -242,6 +248,13 @@ unsigned int insize;		/* valid bytes in inbuf */
 unsigned int inptr;		/* index of next byte to be processed in inbuf */
 unsigned int outcnt;		/* bytes in output buffer */
 int rsync = 0;			/* make rsyncable chunks */
+int no_cache = 0;		/* keep files out of the page cache */
+static bool preallocated;	/* output blocks were allocated ahead */
+int adaptive = 0;		/* adapt the -j level to the input rate */
+int best_plus = 0;		/* --best-plus=ITERATIONS */
+static bool background;		/* --background */
+unsigned long background_rate;	/* --background=RATE, or 0 */
+struct deflate_engine const *engine;	/* --engine */
 
 static int handled_sig[] = {
   /* SIGINT must be first, as 'foreground' depends on it.  */
@@ -267,12 +280,28 @@ static int handled_sig[] = {
    non-character as a pseudo short option, starting with CHAR_MAX + 1.  */
 enum
 {
-  PRESUME_INPUT_TTY_OPTION = CHAR_MAX + 1,
+  ADAPTIVE_OPTION = CHAR_MAX + 1,
+  BACKGROUND_OPTION,
+  BEST_PLUS_OPTION,
+  ENGINE_OPTION,
+  FAST_OPTION,
+  FLUSH_INTERVAL_OPTION,
+  NO_CACHE_OPTION,
+  PRESUME_INPUT_TTY_OPTION,
   RSYNCABLE_OPTION,
-  SYNCHRONOUS_OPTION
+  STATS_OPTION,
+  SYNCHRONOUS_OPTION,
+  TRACE_OPTION
 };
 
-static char const shortopts[] = "ab:cdfhH?j:klLmMnNqrS:tvVZ123456789";
+/* Formats for --stats.  */
+enum
+{
+  STATS_HUMAN = 1,
+  STATS_JSON
+};
+
+static char const shortopts[] = "ab:cdfhH?j:klLmMnNqrS:tvVZ0123456789";
 
 static const struct option longopts[] = {
   /* { name,  has_arg,  *flag,  val } */
@@ -282,31 +311,39 @@ static const struct option longopts[] = {
      which is the flag for this option. The value in val is the value to store
      in the flag to indicate that the option was seen. */
 
+  {"adaptive", 0, NULL, ADAPTIVE_OPTION},	/* adapt -j level to input */
   {"ascii", 0, NULL, 'a'},	/* ascii text mode */
+  {"background", optional_argument, NULL, BACKGROUND_OPTION},	/* idle */
   {"to-stdout", 0, NULL, 'c'},	/* write output on standard output */
   {"stdout", 0, NULL, 'c'},	/* write output on standard output */
   {"decompress", 0, NULL, 'd'},	/* decompress */
   {"uncompress", 0, NULL, 'd'},	/* decompress */
   /* {"encrypt",    0, 0, 'e'},    encrypt */
+  {"engine", 1, NULL, ENGINE_OPTION},	/* choose the implementation */
+  {"flush-interval", 1, NULL, FLUSH_INTERVAL_OPTION},	/* flush on stalls */
   {"force", 0, NULL, 'f'},	/* force overwrite of output file */
   {"help", 0, NULL, 'h'},	/* give help */
   /* {"pkzip",      0, 0, 'k'},    force output in pkzip format */
   {"keep", 0, NULL, 'k'},	/* keep (don't delete) input files */
   {"list", 0, NULL, 'l'},	/* list .gz file contents */
   {"license", 0, NULL, 'L'},	/* display software license */
+  {"no-cache", 0, NULL, NO_CACHE_OPTION},	/* spare the page cache */
   {"no-name", 0, NULL, 'n'},	/* don't save or restore original name & time */
   {"name", 0, NULL, 'N'},	/* save or restore original name & time */
   {"-presume-input-tty", no_argument, NULL, PRESUME_INPUT_TTY_OPTION},
   {"quiet", 0, NULL, 'q'},	/* quiet mode */
   {"silent", 0, NULL, 'q'},	/* quiet mode */
+  {"stats", optional_argument, NULL, STATS_OPTION},	/* report timings */
   {"synchronous", 0, NULL, SYNCHRONOUS_OPTION},
   {"recursive", 0, NULL, 'r'},	/* recurse through directories */
   {"suffix", 1, NULL, 'S'},	/* use given suffix instead of .gz */
   {"test", 0, NULL, 't'},	/* test compressed file integrity */
+  {"trace", 1, NULL, TRACE_OPTION},	/* write job timelines */
   {"verbose", 0, NULL, 'v'},	/* verbose mode */
   {"version", 0, NULL, 'V'},	/* display version number */
-  {"fast", 0, NULL, '1'},	/* compress faster */
+  {"fast", 2, NULL, FAST_OPTION},	/* compress faster, or fastest */
   {"best", 0, NULL, '9'},	/* compress better */
+  {"best-plus", 1, NULL, BEST_PLUS_OPTION},	/* optimal parsing */
   {"lzw", 0, NULL, 'Z'},	/* make output compatible with old compress */
   {"bits", 1, NULL, 'b'},	/* max number of bits per code (implies -Z) */
   {"rsyncable", 0, NULL, RSYNCABLE_OPTION},	/* make rsync-friendly archive */
@@ -328,6 +365,7 @@ static void discard_input_bytes (size_t nbytes, unsigned int flags);
 static int make_ofname (void);
 static void shorten_name (char *name);
 static int get_method (int in);
+static bool input_eof (void);
 static void do_list (int ifd, int method);
 static int check_ofname (void);
 static void copy_stat (struct stat *ifstat);
@@ -336,6 +374,7 @@ static void remove_output_file (bool);
 static void abort_gzip_signal (int);
 static noreturn void do_exit (int exitcode);
 static void finish_out (void);
+static void print_stats (void);
 
 int main (int argc, char **argv);
 static int (*work) (int infile, int outfile) = zip;	/* function to call */
@@ -362,15 +401,29 @@ help (void)
     "",
     "Mandatory arguments to long options are mandatory for short options too.",
     "",
+    "      --adaptive         with -j, lower the level of blocks as needed",
+    "                         to keep up with the input",
+    "      --background[=RATE]  run at idle CPU and I/O priority, reading",
+    "                         at most RATE bytes per second (suffix K, M, G)",
 #if O_BINARY
     "  -a, --ascii            ascii text; convert end-of-line using local conventions",
 #endif
     "  -c, --stdout           write on standard output, keep original files unchanged",
     "  -d, --decompress       decompress",
 /*  -e, --encrypt          encrypt */
+    "      --engine=ENGINE    use gzip's own deflate code ('native'), 'zlib',",
+#ifdef IBM_Z_DFLTCC
+    "                         the IBM Z DEFLATE CONVERSION CALL ('dfltcc'),",
+#endif
+    "                         or whichever suits this machine ('auto')",
+    "      --flush-interval=MS  when input stalls for MS milliseconds,",
+    "                         flush what has been compressed so far",
     "  -f, --force            force overwrite of output file and compress links",
     "  -h, --help             give this help",
-    "  -j, --parallel=THREADS compress in parallel with THREADS number of threads",
+    "  -j, --parallel=THREADS compress in parallel with THREADS number of threads,",
+    "                         or decompress as many gzip members at once,",
+    "                         or with -t test as many files at once;",
+    "                         'auto' uses as many as the CPU quota allows",
 /*  -k, --pkzip            force output in pkzip format */
     "  -k, --keep             keep (don't delete) input files",
     "  -l, --list             list compressed file contents",
@@ -379,6 +432,8 @@ help (void)
     "  -m                     do not save or restore the original modification time",
     "  -M, --time             save or restore the original modification time",
 #endif
+    "      --no-cache         keep files out of the page cache, and preallocate",
+    "                         output files",
     "  -n, --no-name          do not save or restore the original name and timestamp",
     "  -N, --name             save or restore the original name and timestamp",
     "  -q, --quiet            suppress all warnings",
@@ -387,12 +442,19 @@ help (void)
 #endif
     "      --rsyncable        make rsync-friendly archive",
     "  -S, --suffix=SUF       use suffix SUF on compressed files",
+    "      --stats[=FORMAT]   report where the time went on standard error;",
+    "                         FORMAT is 'human' (the default) or 'json'",
     "      --synchronous      synchronous output (safer if system crashes, but slower)",
     "  -t, --test             test compressed file integrity",
+    "      --trace=FILE       write the timeline of each -j block to FILE",
+    "                         in Chrome trace event format",
     "  -v, --verbose          verbose mode",
     "  -V, --version          display version number",
+    "  -0, --fast=0           compress fastest, greedily with gzip's own deflate",
     "  -1, --fast             compress faster",
     "  -9, --best             compress better",
+    "      --best-plus=ITERATIONS  compress better still, parsing each -j block",
+    "                         optimally ITERATIONS times (15 is typical)",
     "",
     "With no FILE, or when FILE is -, read standard input.",
     "",
@@ -450,6 +512,64 @@ should_output_to_stdout (void)
   return to_stdout && !test && !list && (!decompress || !ascii);
 }
 
+/* What test_files hands to parallel_each.  */
+struct test_run
+{
+  char *const *names;
+};
+
+static bool
+test_one (void *opaque, size_t i, struct pipeline_stats *stats)
+{
+  struct test_run *run = opaque;
+
+  return (!strequ (run->names[i], "-")
+	  && test_mapped (run->names[i], stats));
+}
+
+/* Report a file that test_one found good, or else test it here, the
+   same way as without -j.  */
+static void
+test_done (void *opaque, size_t i, bool ok,
+	   struct pipeline_stats const *stats)
+{
+  struct test_run *run = opaque;
+
+  if (!ok)
+    {
+      treat_file (run->names[i]);
+      return;
+    }
+  if (verbose)
+    {
+      fprintf (stderr, "%s:\t OK\n", run->names[i]);
+    }
+  struct pipeline_stats file = *stats;
+  file.wall = 0;
+  pipeline_stats_add (&unzip_stats, &file);
+}
+
+/* Test the files named in ARGV with -t -j, several at once; the time
+   they take altogether is what --stats reports.  */
+static void
+test_files (const int argc, char *const *const argv)
+{
+  struct test_run run = { argv + optind };
+  struct each_params params = {
+    .threads = threads,
+    .count = argc - optind,
+    .work = test_one,
+    .done = test_done,
+    .opaque = &run
+  };
+  double wall = unzip_stats.wall;
+  double start = pipeline_stats_now ();
+
+  parallel_each (&params);
+  optind = argc;
+  unzip_stats.wall = wall + pipeline_stats_now () - start;
+}
+
 static void
 treat_files (const int argc, char *const *const argv)
 {
@@ -457,6 +577,10 @@ treat_files (const int argc, char *const *const argv)
     {
       SET_BINARY_MODE (STDOUT_FILENO);
     }
+  if (test && 1 < threads && !recursive && 1 < argc - optind)
+    {
+      test_files (argc, argv);
+    }
   while (optind < argc)
     {
       treat_file (argv[optind++]);
@@ -547,6 +671,26 @@ main (int argc, char **argv)
 	case 'N':
 	  no_name = no_time = 0;
 	  break;
+	case FLUSH_INTERVAL_OPTION:
+	  {
+	    char *end;
+	    long ms;
+
+	    errno = 0;
+	    ms = strtol (optarg, &end, 10);
+	    if (errno || end == optarg || *end || !(0 < ms && ms <= INT_MAX))
+	      {
+		fprintf (stderr,
+			 "%s: --flush-interval operand is not a positive"
+			 " integer\n", program_name);
+		try_help ();
+	      }
+	    flush_interval = ms;
+	  }
+	  break;
+	case NO_CACHE_OPTION:
+	  no_cache = 1;
+	  break;
 	case PRESUME_INPUT_TTY_OPTION:
 	  presume_input_tty = true;
 	  break;
@@ -564,6 +708,49 @@ main (int argc, char **argv)
 #endif
 	  break;
 
+	case ADAPTIVE_OPTION:
+	  adaptive = 1;
+	  break;
+	case BEST_PLUS_OPTION:
+	  {
+	    char *end;
+	    long n = strtol (optarg, &end, 10);
+	    if (end == optarg || *end || !(0 < n && n <= 1000))
+	      {
+		fprintf (stderr, "%s: --best-plus operand is not an integer"
+			 " from 1 to 1000\n", program_name);
+		try_help ();
+	      }
+	    best_plus = n;
+	  }
+	  break;
+	case BACKGROUND_OPTION:
+	  background = true;
+	  if (optarg)
+	    {
+	      char *end;
+	      unsigned long rate;
+	      unsigned long scale = 1;
+
+	      errno = 0;
+	      rate = strtoul (optarg, &end, 10);
+	      switch (*end)
+		{
+		case 'k': case 'K': scale = 1UL << 10; end++; break;
+		case 'M': scale = 1UL << 20; end++; break;
+		case 'G': scale = 1UL << 30; end++; break;
+		}
+	      if (errno || end == optarg || *end
+		  || !('0' <= *optarg && *optarg <= '9')
+		  || rate == 0 || ULONG_MAX / scale < rate)
+		{
+		  fprintf (stderr, "%s: invalid --background rate: %s\n",
+			   program_name, optarg);
+		  try_help ();
+		}
+	      background_rate = rate * scale;
+	    }
+	  break;
 	case RSYNCABLE_OPTION:
 	  rsync = 1;
 	  break;
@@ -575,12 +762,55 @@ main (int argc, char **argv)
 	  z_len = strlen (optarg);
 	  z_suffix = optarg;
 	  break;
+	case ENGINE_OPTION:
+	  if (strequ (optarg, "auto"))
+	    engine = NULL;
+	  else if ((engine = deflate_engine_find (optarg)) == NULL)
+	    {
+	      fprintf (stderr, "%s: invalid --engine '%s'\n",
+		       program_name, optarg);
+	      try_help ();
+	    }
+	  else if (!engine->available ())
+	    {
+	      fprintf (stderr, "%s: --engine '%s' is not supported"
+		       " on this machine\n", program_name, optarg);
+	      do_exit (ERROR);
+	    }
+	  break;
+	case FAST_OPTION:
+	  if (optarg == NULL || strequ (optarg, "1"))
+	    level = 1;
+	  else if (strequ (optarg, "0"))
+	    level = 0;
+	  else
+	    {
+	      fprintf (stderr, "%s: invalid --fast level '%s'\n",
+		       program_name, optarg);
+	      try_help ();
+	    }
+	  break;
+	case STATS_OPTION:
+	  if (optarg == NULL || strequ (optarg, "human"))
+	    show_stats = STATS_HUMAN;
+	  else if (strequ (optarg, "json"))
+	    show_stats = STATS_JSON;
+	  else
+	    {
+	      fprintf (stderr, "%s: invalid --stats format '%s'\n",
+		       program_name, optarg);
+	      try_help ();
+	    }
+	  break;
 	case SYNCHRONOUS_OPTION:
 	  synchronous = true;
 	  break;
 	case 't':
 	  test = decompress = to_stdout = 1;
 	  break;
+	case TRACE_OPTION:
+	  trace_name = optarg;
+	  break;
 	case 'v':
 	  verbose++;
 	  quiet = 0;
@@ -589,6 +819,7 @@ main (int argc, char **argv)
 	  version ();
 	  finish_out ();
 	  break;
+	case '0':
 	case '1':
 	case '2':
 	case '3':
@@ -601,6 +832,11 @@ main (int argc, char **argv)
 	  level = optc - '0';
 	  break;
 	case 'j':
+	  if (strcmp (optarg, "auto") == 0)
+	    {
+	      threads = pipeline_cpus ();
+	      break;
+	    }
 	  threads = atoi (optarg);
 	  for (; *optarg; optarg++)
 	    if (!('0' <= *optarg && *optarg <= '9'))
@@ -671,6 +907,23 @@ main (int argc, char **argv)
   ALLOC (ush, tab_prefix1, 1L << (BITS - 1));
 #endif
 
+  if (background)
+    enter_background ();
+
+  if (trace_name != NULL)
+    {
+      trace_file = fopen (trace_name, "w");
+      if (trace_file == NULL)
+	{
+	  fprintf (stderr, "%s: %s: %s\n", program_name, trace_name,
+		   strerror (errno));
+	  do_exit (ERROR);
+	}
+      job_trace = pipeline_trace_open (trace_file);
+      if (job_trace == NULL)
+	xalloc_die ();
+    }
+
   exiting_signal = quiet ? SIGPIPE : 0;
   install_signal_handlers ();
 
@@ -701,9 +954,99 @@ main (int argc, char **argv)
 	   && fdatasync (STDOUT_FILENO) != 0 && errno != EINVAL)
 	  || close (STDOUT_FILENO) != 0) && errno != EBADF)
     write_error ();
+  if (show_stats)
+    print_stats ();
+  if (job_trace != NULL
+      && (pipeline_trace_close (job_trace) != 0 || fclose (trace_file) != 0))
+    {
+      fprintf (stderr, "%s: %s: %s\n", program_name, trace_name,
+	       strerror (errno));
+      exit_code = ERROR;
+    }
   do_exit (exit_code);
 }
 
+/* ========================================================================
+ * Report the statistics gathered for --stats on standard error.
+ */
+static void
+print_stats (void)
+{
+  bool json = show_stats == STATS_JSON;
+  bool zipped = zip_stats.wall > 0 || zip_stats.bytes_in != 0;
+  bool unzipped = unzip_stats.wall > 0 || unzip_stats.bytes_in != 0;
+  char what[64];
+
+  if (json)
+    {
+      fputc ('{', stderr);
+      if (zipped)
+	{
+	  fputs ("\"compress\": ", stderr);
+	  pipeline_stats_print (stderr, NULL, &zip_stats, true);
+	}
+      if (unzipped)
+	{
+	  fputs (zipped ? ", \"decompress\": " : "\"decompress\": ", stderr);
+	  pipeline_stats_print (stderr, NULL, &unzip_stats, true);
+	}
+      fputs ("}\n", stderr);
+      return;
+    }
+  if (zipped)
+    {
+      snprintf (what, sizeof what, "%s: compress", program_name);
+      pipeline_stats_print (stderr, what, &zip_stats, false);
+    }
+  if (unzipped)
+    {
+      snprintf (what, sizeof what, "%s: decompress", program_name);
+      pipeline_stats_print (stderr, what, &unzip_stats, false);
+    }
+}
+
+/* Guess the size of the output of the current file, or return 0.  When
+   compressing, take the input size, which is rarely exceeded.  When
+   decompressing gzip format, the ISIZE of the trailer gives the size of
+   the last member modulo 2^32: take the smallest size it allows that is
+   no less than the compressed size, unless that is more than deflate's
+   best ratio of 1032 to 1 could produce, in which case the trailer
+   cannot be trusted.  */
+static off_t
+estimate_output_size (void)
+{
+  unsigned char trailer[4];
+  off_t size;
+
+  if (!S_ISREG (istat.st_mode))
+    return 0;
+  if (!decompress)
+    return istat.st_size;
+  if (method != DEFLATED || last_member || istat.st_size < 18
+      || pread (ifd, trailer, 4, istat.st_size - 4) != 4)
+    return 0;
+  size = (trailer[0] | trailer[1] << 8 | trailer[2] << 16
+	  | (off_t) trailer[3] << 24);
+  while (size < istat.st_size)
+    size += (off_t) 1 << 32;
+  return size / 1032 <= istat.st_size ? size : 0;
+}
+
+/* With --no-cache, allocate the blocks of the output file ahead of
+   writing it, from an estimate of its size, to cut fragmentation and
+   metadata updates.  The file size is left alone, and the blocks not
+   used are released when the file is done.  */
+static void
+preallocate_output (void)
+{
+  preallocated = false;
+#ifdef FALLOC_FL_KEEP_SIZE
+  off_t size = estimate_output_size ();
+  if (size != 0 && fallocate (ofd, FALLOC_FL_KEEP_SIZE, 0, size) == 0)
+    preallocated = true;
+#endif
+}
+
 static void
 get_input_size_and_time (void)
 {
@@ -796,13 +1139,24 @@ treat_stdin (void)
       return;
     }
 
-  /* Actually do the compression/decompression. zlib loops over zipped members
-   * internally.
+  grow_pipe (STDIN_FILENO);
+  grow_pipe (STDOUT_FILENO);
+
+  /* Actually do the compression/decompression. Loop over zipped members.
    */
-  if (work (STDIN_FILENO, STDOUT_FILENO) != OK)
-    return;
+  for (;;)
+    {
+      if (work (STDIN_FILENO, STDOUT_FILENO) != OK)
+	return;
 
-  bytes_out = 0;		/* required for length check */
+      if (input_eof ())
+	break;
+
+      method = get_method (ifd);
+      if (method < 0)
+	return;			/* error message already emitted */
+      bytes_out = 0;		/* required for length check */
+    }
 
   if (verbose)
     {
@@ -1005,6 +1359,8 @@ treat_file (char *iname)
     {
       if (create_outfile () != OK)
 	return;
+      if (no_cache)
+	preallocate_output ();
 
       if (!decompress && save_orig_name && !verbose && !quiet)
 	{
@@ -1021,21 +1377,42 @@ treat_file (char *iname)
       fprintf (stderr, "%s:\t", ifname);
     }
 
-  /* Actually do the compression/decompression. zlib loops over zipped members
-     internally, so don't worry about that here.
+  grow_pipe (ifd);
+  if (to_stdout)
+    grow_pipe (ofd);
+
+  /* Actually do the compression/decompression. Loop over zipped members.
    */
-  if ((*work) (ifd, ofd) != OK)
+  for (;;)
     {
-      method = -1;		/* force cleanup */
-    }
+      if ((*work) (ifd, ofd) != OK)
+	{
+	  method = -1;		/* force cleanup */
+	  break;
+	}
 
-  bytes_out = 0;		/* required for length check */
+      if (input_eof ())
+	break;
+
+      method = get_method (ifd);
+      if (method < 0)
+	break;			/* error message already emitted */
+      bytes_out = 0;		/* required for length check */
+    }
 
   if (close (ifd) != 0)
     read_error ();
 
   if (!to_stdout)
     {
+      /* Release the blocks allocated beyond the end.  */
+      if (preallocated)
+	{
+	  off_t size = lseek (ofd, 0, SEEK_CUR);
+	  if (0 <= size)
+	    ignore_value (ftruncate (ofd, size));
+	}
+
       copy_stat (&istat);
 
       if ((synchronous
@@ -1100,6 +1477,28 @@ treat_file (char *iname)
     }
 }
 
+/* Return true if the input is at end of file.  The decoders leave
+   inbuf[inptr] at the first byte after the member they read, and an
+   empty inbuf is filled afresh, so that the next member's header starts
+   at inbuf[0].  */
+static bool
+input_eof (void)
+{
+  if (!decompress || last_member)
+    return true;
+
+  if (inptr == insize)
+    {
+      if (fill_inbuf (true, CHUNK) == EOF)
+	return true;
+
+      /* Unget the char that fill_inbuf got.  */
+      inptr = 0;
+    }
+
+  return false;
+}
+
 static void
 volatile_strcpy (char volatile *dst, char const volatile *src)
 {
@@ -1868,6 +2267,7 @@ get_method (int in)
     {				/* pass input unchanged */
       method = STORED;
       work = copy;
+      last_member = 1;
     }
 
   if (method >= 0)
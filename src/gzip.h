@@ -138,6 +138,15 @@ extern unsigned insize; /* valid bytes in inbuf */
 extern unsigned inptr;  /* index of next byte to be processed in inbuf */
 extern unsigned outcnt; /* bytes in output buffer */
 extern int rsync;  /* deflate into rsyncable chunks */
+extern int adaptive;  /* adapt the -j level to the input rate */
+extern int best_plus; /* --best-plus optimal parsing passes, or 0 */
+extern unsigned long background_rate; /* --background input bytes/s, or 0 */
+extern int no_cache;  /* keep files out of the page cache */
+
+/* The implementation --engine asked for, or NULL to let the machine
+   choose; see deflate_engine_default in engine.c.  */
+struct deflate_engine;
+extern struct deflate_engine const *engine;
 
 extern off_t bytes_in;   /* number of input bytes */
 extern off_t bytes_out;  /* number of output bytes */
@@ -146,6 +155,8 @@ extern off_t header_bytes;/* number of bytes in gzip header */
 extern int  ifd;        /* input file descriptor */
 extern int  ofd;        /* output file descriptor */
 extern int  threads;    /* number of compress threads */
+extern int  flush_interval; /* flush after this many ms without input */
+extern struct pipeline_trace *job_trace; /* --trace output, or NULL */
 extern char ifname[];   /* input file name or "stdin" */
 extern char ofname[];   /* output file name or "stdout" */
 extern char *program_name;  /* program name */
@@ -267,13 +278,20 @@ extern int pkzip;          /* global variable for pkzip */
 #define WARN(msg) {if (!quiet) fprintf msg ; \
                    if (exit_code == OK) exit_code = WARNING;}
 
+struct pipeline_stats;
+
         /* in zip.c: */
+extern struct pipeline_stats zip_stats; /* totals for --stats */
 extern int zip        (int in, int out);
+extern off_t deflateGZIP (int pack_level);
+extern off_t zlib_zip (int pack_level);
 extern int file_read  (char *buf,  unsigned size);
 
         /* in unzip.c */
+extern struct pipeline_stats unzip_stats; /* totals for --stats */
 extern int unzip      (int in, int out);
 extern int check_zipfile (int in);
+extern bool test_mapped (char const *name, struct pipeline_stats *stats);
 
         /* in unpack.c */
 extern int unpack     (int in, int out);
@@ -281,15 +299,6 @@ extern int unpack     (int in, int out);
         /* in gzip.c */
 extern noreturn void abort_gzip (void);
 
-        /* in deflate.c */
-extern void lm_init (int pack_level);
-extern off_t deflateGZIP (int pack_level);
-
-        /* in trees.c */
-extern void ct_init     (ush *attr, int *method);
-extern int  ct_tally    (int dist, int lc);
-extern off_t flush_block (char *buf, ulg stored_len, int pad, int eof);
-
         /* in bits.c */
 extern unsigned short bi_buf;
 extern int bi_valid;
@@ -300,17 +309,24 @@ extern void     bi_windup  (void);
 extern void     copy_block (char *buf, unsigned len, int header);
 extern int     (*read_buf) (char *buf, unsigned size);
 
-        /* in util.c: */
-extern int copy           (int in, int out);
+        /* in crc.c: */
 extern ulg  updcrc        (const uch *s, unsigned n);
 extern ulg  getcrc        (void) _GL_ATTRIBUTE_PURE;
 extern void setcrc        (ulg c);
+
+        /* in util.c: */
+extern int copy           (int in, int out);
+extern void grow_pipe     (int fd);
 extern void clear_bufs    (void);
 extern int  fill_inbuf    (int eof_ok, int max_fill);
 extern void flush_outbuf  (void);
 extern void flush_window  (void);
 extern void write_buf     (int fd, voidp buf, unsigned cnt);
 extern int read_buffer    (int fd, voidp buf, unsigned int cnt);
+extern int write_sparse   (int fd, voidp buf, unsigned int cnt);
+extern int finish_sparse  (int fd);
+extern void enter_background (void);
+extern void uncache       (int fd, size_t len, bool written);
 extern char *strlwr       (char *s);
 extern char *gzip_base_name (char *fname) _GL_ATTRIBUTE_PURE;
 extern int xunlink        (char *fname);
@@ -334,5 +350,3 @@ extern int dfltcc_deflate (int pack_level);
 extern int dfltcc_inflate (void);
 #endif
 
-        /* in parallel.c */
-extern off_t parallel_zip (int pack_level);
@@ -0,0 +1,599 @@
+/* inflate.c -- native decoder for deflate data held in memory
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/*
+ *  INTERFACE
+ *
+ *      int native_inflate (unsigned char const *in, size_t len,
+ *                          size_t *used,
+ *                          int (*write) (void *opaque,
+ *                                        unsigned char const *data,
+ *                                        size_t len),
+ *                          void *opaque)
+ *          Decode the raw deflate stream at the start of the LEN bytes at
+ *          IN, handing the output to WRITE a megabyte or so at a time, and
+ *          set *USED to the length of the stream, up to the byte after its
+ *          last block.  WRITE returns 0, or -1 on error.  Return Z_OK,
+ *          Z_DATA_ERROR if the stream is invalid or truncated, Z_MEM_ERROR,
+ *          or Z_ERRNO if WRITE failed.
+ *
+ *  The decoder accepts what zlib's inflate accepts, but since the whole
+ *  input is at hand it never has to stop in the middle of a symbol, which
+ *  lets it be much simpler and faster:
+ *
+ *  - Input goes through a 64-bit bit buffer that is refilled with one
+ *    unaligned load, to at least 56 bits, once per symbol: enough for a
+ *    length, a distance and their extra bits.
+ *
+ *  - Codes are decoded by table lookup, 12 bits at a time for literals and
+ *    lengths, 8 for distances, with subtables for longer codes.  A
+ *    literal/length table entry whose bits hold two whole literal codes
+ *    decodes both at once.
+ *
+ *  - Matches are copied 16 bytes at a time with SSE2 or NEON, 32 with
+ *    AVX2, when the distance allows it, and are allowed to write past
+ *    their end into the slack at the end of the output buffer.
+ *
+ *  - Output is decoded into a buffer that keeps the last 32 KiB, the
+ *    deflate window, in front of what has not been written yet, so that
+ *    matches never need to wrap.
+ *
+ *  Nothing here touches gzip's global state, so members can be decoded
+ *  in several threads at once.
+ */
+
+#include <config.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined __AVX2__ || defined __SSE2__
+# include <immintrin.h>
+#elif defined __ARM_NEON
+# include <arm_neon.h>
+#endif
+
+#include "zlib.h"
+#include "parallel.h"
+
+/* Root bits of the decoding tables.  */
+#define LITLEN_BITS 12
+#define DIST_BITS 8
+#define PRECODE_BITS 7
+
+/* Table sizes: the root table plus at most one subtable, of up to
+   2^(15 - root bits) entries, per code longer than the root bits.  */
+#define LITLEN_ENOUGH ((1 << LITLEN_BITS) + 288 * (1 << (15 - LITLEN_BITS)))
+#define DIST_ENOUGH ((1 << DIST_BITS) + 32 * (1 << (15 - DIST_BITS)))
+
+/* A table entry: the number of bits of the code in the low byte, then
+   four bits of extra bits (or of subtable bits, or the number of literals),
+   four flag bits, and in the upper half the base of the length or
+   distance, the offset of the subtable, or one or two literals.  */
+#define E_LITERAL 0x1000
+#define E_EOB 0x2000
+#define E_SUB 0x4000
+#define E_INVALID 0x8000
+
+#define E_BITS(e) ((e) & 0xff)
+#define E_EXTRA(e) (((e) >> 8) & 0xf)
+#define E_BASE(e) ((e) >> 16)
+
+/* The deflate window, and how much output is collected behind it before
+   it is written.  */
+#define WSIZE 32768
+#define OUT_CHUNK (1 << 20)
+
+/* Room past the end of the output chunk: a whole match, started just
+   before the end, and the overrun of its last wide copy.  */
+#define OUT_SLACK (258 + 64)
+
+static unsigned short const len_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static unsigned char const len_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static unsigned short const dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+  16385, 24577
+};
+static unsigned char const dist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Order of the code length code lengths in a dynamic block header.  */
+static unsigned char const precode_order[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+struct inflater
+{
+  uint32_t litlen[LITLEN_ENOUGH];
+  uint32_t dist[DIST_ENOUGH];
+  uint32_t precode[1 << PRECODE_BITS];
+  /* What each symbol decodes to, less its code length.  */
+  uint32_t litlen_value[288];
+  uint32_t dist_value[32];
+  uint32_t precode_value[19];
+  unsigned char lens[288 + 32];
+  bool fixed;			/* the tables are those of fixed blocks */
+  unsigned char buf[WSIZE + OUT_CHUNK + OUT_SLACK];
+};
+
+static struct inflater *
+new_inflater (void)
+{
+  struct inflater *d = malloc (sizeof *d);
+
+  if (d == NULL)
+    return NULL;
+  for (int i = 0; i < 256; i++)
+    d->litlen_value[i] = (uint32_t) i << 16 | 1 << 8 | E_LITERAL;
+  d->litlen_value[256] = E_EOB;
+  for (int i = 0; i < 29; i++)
+    d->litlen_value[257 + i] = (uint32_t) len_base[i] << 16
+      | len_extra[i] << 8;
+  d->litlen_value[286] = d->litlen_value[287] = E_INVALID;
+  for (int i = 0; i < 30; i++)
+    d->dist_value[i] = (uint32_t) dist_base[i] << 16 | dist_extra[i] << 8;
+  d->dist_value[30] = d->dist_value[31] = E_INVALID;
+  for (int i = 0; i < 19; i++)
+    d->precode_value[i] = (uint32_t) i << 16;
+  d->fixed = false;
+  return d;
+}
+
+/* Build in TABLE the decoding table, with ROOT bits, of the canonical code
+   with the N code lengths LENS, whose symbols decode to VALUE.  Accept an
+   incomplete code only if INCOMPLETE, and then only one of a single
+   1-bit code, as zlib does.  Return 0, or -1 if the code is invalid.  */
+static int
+build_table (uint32_t *table, int root, unsigned char const *lens, int n,
+	     uint32_t const *value, bool incomplete)
+{
+  unsigned count[16] = { 0 };
+  unsigned next_code[16];
+  unsigned char need[1 << LITLEN_BITS];
+  uint32_t sub_offset[1 << LITLEN_BITS];
+  uint32_t mask = (1u << root) - 1;
+  int left = 1;
+  int max = 0;
+
+  for (int i = 0; i < n; i++)
+    count[lens[i]]++;
+  for (int len = 1; len < 16; len++)
+    {
+      left = (left << 1) - count[len];
+      if (left < 0)
+	return -1;
+      if (count[len])
+	max = len;
+    }
+  if (0 < left && max != 0 && (!incomplete || max != 1))
+    return -1;
+
+  next_code[1] = 0;
+  for (int len = 1; len < 15; len++)
+    next_code[len + 1] = (next_code[len] + count[len]) << 1;
+
+  for (uint32_t i = 0; i <= mask; i++)
+    table[i] = E_INVALID;
+  if (root < max)
+    memset (need, 0, mask + 1);
+
+  /* Reverse each code, since deflate sends codes from their top bit.  */
+  uint32_t rev[288 + 32];
+  for (int sym = 0; sym < n; sym++)
+    {
+      int len = lens[sym];
+      uint32_t code = len ? next_code[len]++ : 0;
+      uint32_t r = 0;
+      for (int b = 0; b < len; b++)
+	r |= ((code >> b) & 1) << (len - 1 - b);
+      rev[sym] = r;
+      if (root < len && need[r & mask] < len - root)
+	need[r & mask] = len - root;
+    }
+
+  /* Lay out a subtable for each root entry that needs one.  */
+  if (root < max)
+    {
+      uint32_t offset = mask + 1;
+      for (uint32_t i = 0; i <= mask; i++)
+	if (need[i])
+	  {
+	    sub_offset[i] = offset;
+	    table[i] = offset << 16 | E_SUB | need[i] << 8 | root;
+	    for (uint32_t j = 0; j < 1u << need[i]; j++)
+	      table[offset + j] = E_INVALID;
+	    offset += 1u << need[i];
+	  }
+    }
+
+  for (int sym = 0; sym < n; sym++)
+    {
+      int len = lens[sym];
+      if (len == 0)
+	continue;
+      if (len <= root)
+	for (uint32_t i = rev[sym]; i <= mask; i += 1u << len)
+	  table[i] = value[sym] | len;
+      else
+	{
+	  uint32_t r = rev[sym];
+	  uint32_t *sub = table + sub_offset[r & mask];
+	  int sub_len = len - root;
+	  for (uint32_t i = r >> root; i < 1u << need[r & mask];
+	       i += 1u << sub_len)
+	    sub[i] = value[sym] | sub_len;
+	}
+    }
+  return 0;
+}
+
+/* Let each root entry of the literal/length TABLE that decodes a literal,
+   and whose remaining bits hold a whole second literal code, decode both.
+   Entries are done from the top down, since the entry that decodes the
+   second literal of entry I is entry I shifted right, which must still
+   decode one literal only.  */
+static void
+pair_literals (uint32_t *table)
+{
+  for (int i = (1 << LITLEN_BITS) - 1; 0 <= i; i--)
+    {
+      uint32_t e = table[i];
+      if (!(e & E_LITERAL))
+	continue;
+      int len = E_BITS (e);
+      uint32_t e2 = table[i >> len];
+      if ((e2 & E_LITERAL) && E_BITS (e2) <= LITLEN_BITS - len)
+	table[i] = ((e & 0xff0000) | (e2 & 0xff0000) << 8 | 2 << 8
+		    | E_LITERAL | (len + E_BITS (e2)));
+    }
+}
+
+/* Copy LEN bytes from DIST bytes back to OUT, which may write up to 32
+   bytes past the end.  */
+static inline void
+copy_match (unsigned char *out, size_t dist, unsigned len)
+{
+  unsigned char const *src = out - dist;
+  unsigned char *end = out + len;
+
+#ifdef __AVX2__
+  if (32 <= dist)
+    {
+      do
+	{
+	  _mm256_storeu_si256 ((__m256i *) out,
+			       _mm256_loadu_si256 ((__m256i const *) src));
+	  out += 32;
+	  src += 32;
+	}
+      while (out < end);
+      return;
+    }
+#endif
+  if (16 <= dist)
+    {
+      do
+	{
+#if defined __SSE2__
+	  _mm_storeu_si128 ((__m128i *) out,
+			    _mm_loadu_si128 ((__m128i const *) src));
+#elif defined __ARM_NEON
+	  vst1q_u8 (out, vld1q_u8 (src));
+#else
+	  memcpy (out, src, 16);
+#endif
+	  out += 16;
+	  src += 16;
+	}
+      while (out < end);
+    }
+  else if (8 <= dist)
+    {
+      do
+	{
+	  memcpy (out, src, 8);
+	  out += 8;
+	  src += 8;
+	}
+      while (out < end);
+    }
+  else if (dist == 1)
+    memset (out, *src, len);
+  else
+    do
+      *out++ = *src++;
+    while (out < end);
+}
+
+static inline uint64_t
+load64 (unsigned char const *p)
+{
+  uint64_t v;
+  memcpy (&v, p, 8);
+#ifdef WORDS_BIGENDIAN
+  v = __builtin_bswap64 (v);
+#endif
+  return v;
+}
+
+int
+native_inflate (unsigned char const *in, size_t len, size_t *used,
+		int (*write) (void *opaque, unsigned char const *data,
+			      size_t len), void *opaque)
+{
+  struct inflater *d = new_inflater ();
+  unsigned char const *next = in;
+  unsigned char const *in_end = in + len;
+  uint64_t bitbuf = 0;
+  unsigned bitsleft = 0;
+  size_t overread = 0;		/* zero bytes fed in past IN_END */
+  unsigned char *out;
+  unsigned char *flushed;	/* output not yet written starts here */
+  unsigned char *out_limit;
+  size_t history = 0;		/* bytes of output a match may reach back */
+  int ret = Z_DATA_ERROR;
+  bool final;
+
+  if (d == NULL)
+    return Z_MEM_ERROR;
+  out = flushed = d->buf;
+  out_limit = d->buf + WSIZE + OUT_CHUNK;
+
+/* Fill the bit buffer to at least 56 bits.  Past the end of the input,
+   feed in zeros, which is an error if more than a buffer's worth of
+   them gets used.  */
+#define REFILL()							\
+  do									\
+    {									\
+      if (8 <= in_end - next)						\
+	{								\
+	  bitbuf |= load64 (next) << bitsleft;				\
+	  next += (63 - bitsleft) >> 3;					\
+	  bitsleft |= 56;						\
+	}								\
+      else								\
+	{								\
+	  for (; bitsleft <= 56; bitsleft += 8)				\
+	    if (next < in_end)						\
+	      bitbuf |= (uint64_t) *next++ << bitsleft;			\
+	    else							\
+	      overread++;						\
+	  if (8 < overread)						\
+	    goto done;							\
+	}								\
+    }									\
+  while (0)
+
+#define BITS(n) ((uint32_t) bitbuf & ((1u << (n)) - 1))
+#define DROP(n) (bitbuf >>= (n), bitsleft -= (n))
+
+/* Write the output collected so far, and move the window down to the
+   start of the buffer.  */
+#define FLUSH()								\
+  do									\
+    {									\
+      if (write (opaque, flushed, out - flushed) != 0)			\
+	{								\
+	  ret = Z_ERRNO;						\
+	  goto done;							\
+	}								\
+      history += out - flushed;						\
+      if (WSIZE < history)						\
+	history = WSIZE;						\
+      memmove (d->buf, out - history, history);			\
+      out = flushed = d->buf + history;				\
+    }									\
+  while (0)
+
+  do
+    {
+      REFILL ();
+      final = BITS (1);
+      int type = (bitbuf >> 1) & 3;
+      DROP (3);
+
+      if (type == 0)
+	{
+	  /* Stored: go back to reading whole bytes.  */
+	  DROP (bitsleft & 7);
+	  size_t buffered = bitsleft >> 3;
+	  if (buffered < overread)
+	    goto done;
+	  next -= buffered - overread;
+	  bitbuf = 0;
+	  bitsleft = 0;
+	  overread = 0;
+	  if (in_end - next < 4)
+	    goto done;
+	  unsigned stored = next[0] | next[1] << 8;
+	  if ((stored ^ (next[2] | next[3] << 8)) != 0xffff)
+	    goto done;
+	  next += 4;
+	  if ((size_t) (in_end - next) < stored)
+	    goto done;
+	  while (stored)
+	    {
+	      if (out_limit <= out)
+		FLUSH ();
+	      unsigned n = out_limit - out < stored ? out_limit - out : stored;
+	      memcpy (out, next, n);
+	      out += n;
+	      next += n;
+	      stored -= n;
+	    }
+	  continue;
+	}
+      else if (type == 1)
+	{
+	  if (!d->fixed)
+	    {
+	      memset (d->lens, 8, 144);
+	      memset (d->lens + 144, 9, 112);
+	      memset (d->lens + 256, 7, 24);
+	      memset (d->lens + 280, 8, 8);
+	      memset (d->lens + 288, 5, 32);
+	      build_table (d->litlen, LITLEN_BITS, d->lens, 288,
+			   d->litlen_value, false);
+	      pair_literals (d->litlen);
+	      build_table (d->dist, DIST_BITS, d->lens + 288, 32,
+			   d->dist_value, true);
+	      d->fixed = true;
+	    }
+	}
+      else if (type == 2)
+	{
+	  unsigned char pre_lens[19] = { 0 };
+	  unsigned nlit = BITS (5) + 257;
+	  unsigned ndist = ((bitbuf >> 5) & 31) + 1;
+	  unsigned npre = ((bitbuf >> 10) & 15) + 4;
+	  DROP (14);
+	  if (286 < nlit || 30 < ndist)
+	    goto done;
+	  for (unsigned i = 0; i < npre; i++)
+	    {
+	      REFILL ();
+	      pre_lens[precode_order[i]] = BITS (3);
+	      DROP (3);
+	    }
+	  if (build_table (d->precode, PRECODE_BITS, pre_lens, 19,
+			   d->precode_value, false) != 0)
+	    goto done;
+	  for (unsigned i = 0; i < nlit + ndist; )
+	    {
+	      REFILL ();
+	      uint32_t e = d->precode[BITS (PRECODE_BITS)];
+	      if (e & E_INVALID)
+		goto done;
+	      DROP (E_BITS (e));
+	      unsigned sym = E_BASE (e);
+	      unsigned char val = 0;
+	      unsigned rep;
+	      if (sym < 16)
+		{
+		  d->lens[i++] = sym;
+		  continue;
+		}
+	      if (sym == 16)
+		{
+		  if (i == 0)
+		    goto done;
+		  val = d->lens[i - 1];
+		  rep = 3 + BITS (2);
+		  DROP (2);
+		}
+	      else if (sym == 17)
+		{
+		  rep = 3 + BITS (3);
+		  DROP (3);
+		}
+	      else
+		{
+		  rep = 11 + BITS (7);
+		  DROP (7);
+		}
+	      if (nlit + ndist - i < rep)
+		goto done;
+	      memset (d->lens + i, val, rep);
+	      i += rep;
+	    }
+	  if (d->lens[256] == 0)
+	    goto done;
+	  if (build_table (d->litlen, LITLEN_BITS, d->lens, nlit,
+			   d->litlen_value, true) != 0
+	      || build_table (d->dist, DIST_BITS, d->lens + nlit, ndist,
+			      d->dist_value, true) != 0)
+	    goto done;
+	  pair_literals (d->litlen);
+	  d->fixed = false;
+	}
+      else
+	goto done;
+
+      /* Decode the symbols of a compressed block.  */
+      for (;;)
+	{
+	  if (out_limit <= out)
+	    FLUSH ();
+	  REFILL ();
+	  uint32_t e = d->litlen[BITS (LITLEN_BITS)];
+	  if (e & E_SUB)
+	    {
+	      DROP (LITLEN_BITS);
+	      e = d->litlen[E_BASE (e) + BITS (E_EXTRA (e))];
+	    }
+	  DROP (E_BITS (e));
+	  if (e & E_LITERAL)
+	    {
+	      out[0] = e >> 16;
+	      out[1] = e >> 24;
+	      out += E_EXTRA (e);
+	      continue;
+	    }
+	  if (e & (E_EOB | E_INVALID))
+	    {
+	      if (e & E_INVALID)
+		goto done;
+	      break;
+	    }
+	  unsigned length = E_BASE (e) + BITS (E_EXTRA (e));
+	  DROP (E_EXTRA (e));
+
+	  e = d->dist[BITS (DIST_BITS)];
+	  if (e & E_SUB)
+	    {
+	      DROP (DIST_BITS);
+	      e = d->dist[E_BASE (e) + BITS (E_EXTRA (e))];
+	    }
+	  if (e & E_INVALID)
+	    goto done;
+	  DROP (E_BITS (e));
+	  size_t dist = E_BASE (e) + BITS (E_EXTRA (e));
+	  DROP (E_EXTRA (e));
+	  if (history + (out - flushed) < dist)
+	    goto done;
+	  copy_match (out, dist, length);
+	  out += length;
+	}
+    }
+  while (!final);
+
+  /* The stream ends at the next byte boundary.  */
+  DROP (bitsleft & 7);
+  if ((bitsleft >> 3) < overread)
+    goto done;
+  *used = (next - in) - ((bitsleft >> 3) - overread);
+  ret = Z_OK;
+  if (out != flushed && write (opaque, flushed, out - flushed) != 0)
+    ret = Z_ERRNO;
+
+done:
+  free (d);
+  return ret;
+#undef REFILL
+#undef BITS
+#undef DROP
+#undef FLUSH
+}
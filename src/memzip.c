@@ -0,0 +1,381 @@
+/* memzip.c -- compress and decompress between memory buffers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/*
+ *  INTERFACE
+ *
+ *      int mem_zip (struct mem_buffer *out, struct iovec const *iov,
+ *                   int iovcnt, int pack_level, int nthreads)
+ *          Append a gzip member holding the concatenation of IOV[0..IOVCNT-1]
+ *          to OUT.  Inputs of a couple of blocks or more are cut into blocks
+ *          that are compressed by NTHREADS threads, straight from the
+ *          caller's memory if each iovec holds a block or more, or else
+ *          gathered into the pipeline's buffers; smaller ones are deflated
+ *          by the calling thread.
+ *
+ *      int mem_unzip (struct mem_buffer *out, struct iovec const *iov,
+ *                     int iovcnt)
+ *          Append the decompressed contents of all gzip members in IOV to OUT.
+ *
+ *  Both return Z_OK, Z_BUF_ERROR if OUT is too small and may not grow,
+ *  Z_MEM_ERROR, or (mem_unzip only) Z_DATA_ERROR for corrupt input.
+ *  Neither uses file descriptors or gzip's global buffers.
+ */
+
+#include <config.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zlib.h"
+#include "parallel.h"
+
+/* Below this many bytes, starting threads costs more than it saves.  */
+#define MEM_PARALLEL_MIN (2 * PARALLEL_BLOCK_SIZE)
+
+/* Initial allocation for a growable buffer that starts out empty.  */
+#define MEM_INITIAL_SIZE 4096
+
+/* Position in an iovec list.  */
+struct iov_cursor
+{
+  struct iovec const *iov;
+  int left;			/* iovecs left, including the current one */
+  size_t off;			/* offset into the current iovec */
+};
+
+/* Make room for at least NEED more bytes in OUT.  */
+static int
+reserve (struct mem_buffer *out, size_t need)
+{
+  size_t size;
+  unsigned char *data;
+
+  if (out->size - out->len >= need)
+    return Z_OK;
+  if (!out->grow)
+    return Z_BUF_ERROR;
+
+  size = out->size ? out->size : MEM_INITIAL_SIZE;
+  while (size - out->len < need)
+    {
+      if (SIZE_MAX / 2 < size)
+	return Z_MEM_ERROR;
+      size *= 2;
+    }
+  data = realloc (out->data, size);
+  if (data == NULL)
+    return Z_MEM_ERROR;
+  out->data = data;
+  out->size = size;
+  return Z_OK;
+}
+
+/* Move CUR past any used up iovecs.  Return false at the end of the
+ * list.
+ */
+static bool
+skip_used (struct iov_cursor *cur)
+{
+  while (cur->left > 0 && cur->off == cur->iov->iov_len)
+    {
+      cur->iov++;
+      cur->left--;
+      cur->off = 0;
+    }
+  return cur->left > 0;
+}
+
+/* Point STRM's input at the next nonempty piece of CUR, at most UINT_MAX
+ * bytes long.  Return false at the end of the list.
+ */
+static bool
+feed (z_stream *strm, struct iov_cursor *cur)
+{
+  if (!skip_used (cur))
+    return false;
+
+  size_t len = cur->iov->iov_len - cur->off;
+  if (len > UINT_MAX)
+    len = UINT_MAX;
+  strm->next_in = (unsigned char *) cur->iov->iov_base + cur->off;
+  strm->avail_in = (unsigned) len;
+  cur->off += len;
+  return true;
+}
+
+/* Point STRM's output at the free space of OUT, growing it if it is full.  */
+static int
+make_room (z_stream *strm, struct mem_buffer *out)
+{
+  size_t room;
+  int ret = reserve (out, out->len < out->size ? 1
+		     : out->size ? out->size : MEM_INITIAL_SIZE);
+  if (ret != Z_OK)
+    return ret;
+  room = out->size - out->len;
+  strm->next_out = out->data + out->len;
+  strm->avail_out = room < UINT_MAX ? (unsigned) room : UINT_MAX;
+  return Z_OK;
+}
+
+static size_t
+iov_total (struct iovec const *iov, int iovcnt)
+{
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  return total;
+}
+
+/* ===========================================================================
+ * Compression.
+ */
+
+/* Deflate the whole input in the calling thread.  */
+static int
+mem_zip_serial (struct mem_buffer *out, struct iovec const *iov, int iovcnt,
+		int pack_level)
+{
+  struct iov_cursor cur = { iov, iovcnt, 0 };
+  z_stream strm;
+  int ret;
+  int flush;
+
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  ret = deflateInit2 (&strm, pack_level, Z_DEFLATED, MAX_WBITS + 16, 8,
+		      Z_DEFAULT_STRATEGY);
+  if (ret != Z_OK)
+    return ret;
+
+  /* One allocation up front is enough for a buffer that may grow.  */
+  if (out->grow)
+    {
+      ret = reserve (out, deflateBound (&strm, iov_total (iov, iovcnt)));
+      if (ret != Z_OK)
+	{
+	  deflateEnd (&strm);
+	  return ret;
+	}
+    }
+
+  strm.avail_in = 0;
+  do
+    {
+      if (strm.avail_in == 0 && !feed (&strm, &cur))
+	strm.avail_in = 0;
+      flush = (strm.avail_in == 0
+	       || (cur.left == 1 && cur.off == cur.iov->iov_len))
+	? Z_FINISH : Z_NO_FLUSH;
+      do
+	{
+	  ret = make_room (&strm, out);
+	  if (ret != Z_OK)
+	    {
+	      deflateEnd (&strm);
+	      return ret;
+	    }
+	  ret = deflate (&strm, flush);
+	  out->len = (size_t) (strm.next_out - out->data);
+	}
+      while (strm.avail_out == 0 && ret != Z_STREAM_END);
+    }
+  while (ret != Z_STREAM_END);
+
+  deflateEnd (&strm);
+  return Z_OK;
+}
+
+/* Pipeline stages reading from an iovec list and appending to a buffer.  */
+struct mem_stages
+{
+  struct iov_cursor in;
+  struct mem_buffer *out;
+  int status;
+};
+
+/* Read stage when borrowing: point at a block of the current iovec.  */
+static ssize_t
+mem_borrow (void *opaque, unsigned char **data, size_t size)
+{
+  struct mem_stages *st = opaque;
+  struct iov_cursor *cur = &st->in;
+
+  if (!skip_used (cur))
+    return 0;
+  size_t len = cur->iov->iov_len - cur->off;
+  if (len > size)
+    len = size;
+  if (len > SSIZE_MAX)
+    len = SSIZE_MAX;
+  *data = (unsigned char *) cur->iov->iov_base + cur->off;
+  cur->off += len;
+  return (ssize_t) len;
+}
+
+/* Read stage otherwise: gather a whole block from as many iovecs as it
+ * takes into the pipeline's buffer, so that small iovecs still make
+ * full blocks, each primed with the end of the one before.
+ */
+static ssize_t
+mem_gather (void *opaque, unsigned char **data, size_t size)
+{
+  struct mem_stages *st = opaque;
+  struct iov_cursor *cur = &st->in;
+  size_t done = 0;
+
+  if (size > SSIZE_MAX)
+    size = SSIZE_MAX;
+  while (done < size && skip_used (cur))
+    {
+      size_t len = cur->iov->iov_len - cur->off;
+      if (len > size - done)
+	len = size - done;
+      memcpy (*data + done, (unsigned char *) cur->iov->iov_base + cur->off,
+	      len);
+      cur->off += len;
+      done += len;
+    }
+  return (ssize_t) done;
+}
+
+/* Whether the blocks can be read from the iovecs in place: only if every
+ * iovec but the last holds at least a block, as a block never straddles
+ * two of them and a short one costs its own header and dictionary.
+ */
+static bool
+can_borrow (struct iovec const *iov, int iovcnt)
+{
+  for (int i = 0; i < iovcnt - 1; i++)
+    if (iov[i].iov_len != 0 && iov[i].iov_len < PARALLEL_BLOCK_SIZE)
+      return false;
+  return true;
+}
+
+static int
+mem_write (void *opaque, unsigned char const *data, size_t len)
+{
+  struct mem_stages *st = opaque;
+  int ret = reserve (st->out, len);
+
+  if (ret != Z_OK)
+    {
+      st->status = ret;
+      return -1;
+    }
+  memcpy (st->out->data + st->out->len, data, len);
+  st->out->len += len;
+  return 0;
+}
+
+int
+mem_zip (struct mem_buffer *out, struct iovec const *iov, int iovcnt,
+	 int pack_level, int nthreads)
+{
+  if (nthreads < 1 || iov_total (iov, iovcnt) < MEM_PARALLEL_MIN)
+    return mem_zip_serial (out, iov, iovcnt, pack_level);
+
+  struct mem_stages st = { { iov, iovcnt, 0 }, out, Z_OK };
+  bool borrow = can_borrow (iov, iovcnt);
+  struct pipeline_params params = {
+    .level = pack_level,
+    .threads = nthreads,
+    .read = borrow ? mem_borrow : mem_gather,
+    .borrow = borrow,
+    .write = mem_write,
+    .opaque = &st
+  };
+  int ret = parallel_compress (&params);
+  return st.status != Z_OK ? st.status : ret;
+}
+
+/* ===========================================================================
+ * Decompression.
+ */
+
+/* Skip zero bytes after a member, the way gzip ignores trailing zeros.
+ * Return true if more input follows them.
+ */
+static bool
+skip_zeros (z_stream *strm, struct iov_cursor *cur)
+{
+  for (;;)
+    {
+      while (strm->avail_in != 0 && *strm->next_in == 0)
+	{
+	  strm->next_in++;
+	  strm->avail_in--;
+	}
+      if (strm->avail_in != 0)
+	return true;
+      if (!feed (strm, cur))
+	return false;
+    }
+}
+
+int
+mem_unzip (struct mem_buffer *out, struct iovec const *iov, int iovcnt)
+{
+  struct iov_cursor cur = { iov, iovcnt, 0 };
+  z_stream strm;
+  int ret;
+
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = 0;
+  strm.next_in = Z_NULL;
+  ret = inflateInit2 (&strm, MAX_WBITS + 16);
+  if (ret != Z_OK)
+    return ret;
+
+  for (;;)
+    {
+      if (strm.avail_in == 0 && !feed (&strm, &cur))
+	{
+	  /* Input ended in the middle of a member.  */
+	  ret = Z_DATA_ERROR;
+	  break;
+	}
+      ret = make_room (&strm, out);
+      if (ret != Z_OK)
+	break;
+      ret = inflate (&strm, Z_NO_FLUSH);
+      out->len = (size_t) (strm.next_out - out->data);
+      if (ret == Z_STREAM_END)
+	{
+	  /* Another member may follow.  */
+	  if (!skip_zeros (&strm, &cur))
+	    {
+	      ret = Z_OK;
+	      break;
+	    }
+	  inflateReset (&strm);
+	}
+      else if (ret == Z_NEED_DICT)
+	{
+	  ret = Z_DATA_ERROR;
+	  break;
+	}
+      else if (ret != Z_OK && ret != Z_BUF_ERROR)
+	break;
+    }
+
+  inflateEnd (&strm);
+  return ret;
+}
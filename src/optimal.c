@@ -0,0 +1,643 @@
+/* optimal.c -- choose the matches of a block by iterated optimal parsing
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/*
+ *  PURPOSE
+ *
+ *      Compress a block held whole in memory about as well as deflate
+ *      data can be, however long it takes.
+ *
+ *  DISCUSSION
+ *
+ *      The lazy evaluation of deflate.c decides between the longest match
+ *      at a position and the one at the next.  Here, every position
+ *      keeps instead each match that is the longest up to its distance,
+ *      and the cheapest way through the block, a literal or a match of
+ *      any length at each step, is found by dynamic programming over the
+ *      cost of each literal, length and distance in bits.  Those costs
+ *      are estimated from the symbols of the previous way through, so
+ *      the search is repeated, keeping the cheapest result, as many
+ *      times as asked.  This is the method of Zopfli.
+ *
+ *      The block is first parsed with the costs of the static trees and
+ *      split, every 4096 symbols at most, wherever separate Huffman trees
+ *      are estimated to pay for themselves.  Each part is then optimized
+ *      with its own statistics and sent by trees.c.
+ *
+ *  REFERENCES
+ *
+ *      Alakuijala, J. and Vandevenne, L.
+ *         Data compression using Zopfli, Google, 2013.
+ *
+ *  INTERFACE
+ *
+ *      size_t native_deflate_optimal (struct native_deflate *s,
+ *                                     int iterations,
+ *                                     unsigned char const *dict,
+ *                                     size_t dict_len,
+ *                                     unsigned char const *in, size_t len,
+ *                                     bool last, unsigned char *out)
+ *          Like native_deflate_block at level 9, but parse each part of
+ *          the block ITERATIONS times.  Return the length of the output,
+ *          or (size_t) -1 if out of memory.
+ *
+ *      void optimal_free (struct optimal *opt)
+ *          Free the buffers of the parser of a compressor.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zlib.h"
+#include "parallel.h"
+#include "deflate.h"
+
+#define MAX_CANDIDATES 32
+/* Most matches kept for one position, each longer than the one before */
+
+#define MAX_CHAIN 1024
+/* Earlier positions with the same hash examined for each position */
+
+#define SPLIT_CHUNK 0x1000
+/* Symbols between the points where a block may be split.  Since each
+ * symbol stands for at least one byte, every deflate block but the last
+ * has at least this many bytes, as native_deflate_bound assumes.
+ */
+
+#define SPLIT_TREE_BITS 600
+/* Estimated cost of the trees of a new block, in bits */
+
+#define COST_MAX UINT64_MAX
+
+/* A match, or a literal if DIST is 0, whose byte is then LEN.  */
+struct symbol
+{
+  ush len;
+  ush dist;
+};
+
+/* Estimated costs, in 256ths of a bit.  */
+struct costs
+{
+  uint32_t lit[LITERALS];
+  uint32_t len[MAX_MATCH + 1];	/* code and extra bits of each length */
+  uint32_t dist[D_CODES];	/* code, without the extra bits */
+};
+
+/* Symbol counts of part of a block.  */
+struct stats
+{
+  unsigned lit[L_CODES];
+  unsigned dist[D_CODES];
+};
+
+struct optimal
+{
+  size_t size;			/* input positions the buffers hold */
+  size_t total;			/* dictionary and input positions they hold */
+  uch *buf;			/* dictionary then input, with room to spare */
+  int32_t *head;		/* latest position of each hash, or -1 */
+  int32_t *prev;		/* earlier position with the same hash */
+  uint32_t *first;		/* index in CAND of each input position's
+				   matches; one more for the end */
+  struct symbol *cand;		/* matches, as longest up to their distance */
+  size_t cand_size;
+  uint64_t *cost;		/* cheapest way to each position of a part */
+  struct symbol *step;		/* and its last step */
+  struct symbol *sym;		/* symbols of the current parse */
+  struct symbol *best;		/* symbols of the cheapest parse */
+};
+
+void
+optimal_free (struct optimal *o)
+{
+  if (o == NULL)
+    return;
+  free (o->buf);
+  free (o->head);
+  free (o->prev);
+  free (o->first);
+  free (o->cand);
+  free (o->cost);
+  free (o->step);
+  free (o->sym);
+  free (o->best);
+  free (o);
+}
+
+/* Make the buffers of O big enough for LEN bytes of input after DICT_LEN
+ * of dictionary.  Return false if out of memory.
+ */
+static bool
+reserve (struct optimal *o, size_t dict_len, size_t len)
+{
+  size_t total = dict_len + len;
+
+  if (o->head == NULL
+      && (o->head = malloc (HASH_SIZE * sizeof *o->head)) == NULL)
+    return false;
+  if (o->buf == NULL || o->total < total)
+    {
+      free (o->buf);
+      free (o->prev);
+      o->buf = malloc (total + MAX_MATCH + WINDOW_SLACK);
+      o->prev = malloc ((total + 1) * sizeof *o->prev);
+      if (o->buf == NULL || o->prev == NULL)
+	{
+	  o->total = 0;
+	  return false;
+	}
+      o->total = total;
+    }
+  if (o->size < len)
+    {
+      free (o->first);
+      free (o->cost);
+      free (o->step);
+      free (o->sym);
+      free (o->best);
+      o->first = malloc ((len + 1) * sizeof *o->first);
+      o->cost = malloc ((len + 1) * sizeof *o->cost);
+      o->step = malloc ((len + 1) * sizeof *o->step);
+      o->sym = malloc (len * sizeof *o->sym);
+      o->best = malloc (len * sizeof *o->best);
+      o->size = (o->first != NULL && o->cost != NULL && o->step != NULL
+		 && o->sym != NULL && o->best != NULL) ? len : 0;
+      if (o->size == 0)
+	return false;
+    }
+  return true;
+}
+
+/* Hash the three bytes at P.  */
+static inline unsigned
+hash3 (uch const *p)
+{
+  uint32_t v = p[0] | p[1] << 8 | (uint32_t) p[2] << 16;
+  return (v * 0x9e3779b1u) >> (32 - HASH_BITS);
+}
+
+/* Find the matches of each input position of O, which follows DICT_LEN
+ * bytes of dictionary, for TOTAL positions in all.  Return false if out
+ * of memory.
+ */
+static bool
+find_matches (struct optimal *o, size_t dict_len, size_t total)
+{
+  uch const *buf = o->buf;
+  size_t n = 0;
+  size_t p;
+
+  for (p = 0; p < HASH_SIZE; p++)
+    o->head[p] = -1;
+  for (p = 0; p < total; p++)
+    {
+      bool hashed = p + MIN_MATCH <= total;
+      unsigned h = hashed ? hash3 (buf + p) : 0;
+
+      if (p >= dict_len)
+	{
+	  unsigned max_len = total - p < MAX_MATCH ? total - p : MAX_MATCH;
+	  unsigned best = MIN_MATCH - 1;
+	  unsigned chain = MAX_CHAIN;
+	  int32_t cur = hashed ? o->head[h] : -1;
+
+	  o->first[p - dict_len] = n;
+	  if (o->cand_size < n + MAX_CANDIDATES)
+	    {
+	      size_t size = o->cand_size ? 2 * o->cand_size : total;
+	      struct symbol *cand = realloc (o->cand, size * sizeof *cand);
+	      if (cand == NULL)
+		return false;
+	      o->cand = cand;
+	      o->cand_size = size;
+	    }
+	  for (; cur >= 0 && p - cur <= WSIZE && chain != 0;
+	       cur = o->prev[cur], chain--)
+	    {
+	      unsigned len;
+
+	      if (buf[cur + best] != buf[p + best])
+		continue;
+	      len = match_length (buf + p, buf + cur);
+	      if (len > max_len)
+		len = max_len;
+	      if (len > best)
+		{
+		  o->cand[n].len = len;
+		  o->cand[n++].dist = p - cur;
+		  best = len;
+		  if (len == max_len
+		      || n - o->first[p - dict_len] == MAX_CANDIDATES)
+		    break;
+		}
+	    }
+	}
+      if (hashed)
+	{
+	  o->prev[p] = o->head[h];
+	  o->head[h] = p;
+	}
+    }
+  o->first[total - dict_len] = n;
+  return true;
+}
+
+/* Set C to the costs of the static trees.  */
+static void
+static_costs (struct costs *c)
+{
+  unsigned n;
+  uint32_t dist = 5 << 8;
+
+  for (n = 0; n < LITERALS; n++)
+    c->lit[n] = (n < 144 ? 8 : 9) << 8;
+  for (n = MIN_MATCH; n <= MAX_MATCH; n++)
+    {
+      unsigned code = length_code[n - MIN_MATCH];
+      c->len[n] = ((code + LITERALS + 1 < 280 ? 7 : 8)
+		   + extra_lbits[code]) << 8;
+    }
+  for (n = 0; n < D_CODES; n++)
+    c->dist[n] = dist;
+}
+
+/* Return the cost of each of the N symbols of frequencies FREQ, in all
+ * TOTAL: about the length of its Huffman code, and at least one bit.
+ * A symbol not seen yet costs as if it had been seen once.
+ */
+static void
+symbol_costs (uint32_t *cost, unsigned const *freq, int n)
+{
+  unsigned total = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    total += freq[i];
+  for (i = 0; i < n; i++)
+    {
+      unsigned bits = total == 0 ? 0
+	: log2_q8 (total) - log2_q8 (freq[i] ? freq[i] : 1);
+      cost[i] = bits < 256 ? 256 : bits;
+    }
+}
+
+/* Set C to the costs estimated from the statistics ST.  */
+static void
+stats_costs (struct costs *c, struct stats const *st)
+{
+  uint32_t lit[L_CODES];
+  unsigned n;
+
+  symbol_costs (lit, st->lit, L_CODES);
+  symbol_costs (c->dist, st->dist, D_CODES);
+  memcpy (c->lit, lit, sizeof c->lit);
+  for (n = MIN_MATCH; n <= MAX_MATCH; n++)
+    {
+      unsigned code = length_code[n - MIN_MATCH];
+      c->len[n] = lit[code + LITERALS + 1] + (extra_lbits[code] << 8);
+    }
+}
+
+/* Count the N symbols SYM into ST.  */
+static void
+count_symbols (struct stats *st, struct symbol const *sym, size_t n)
+{
+  size_t i;
+
+  memset (st, 0, sizeof *st);
+  st->lit[END_BLOCK] = 1;
+  for (i = 0; i < n; i++)
+    if (sym[i].dist == 0)
+      st->lit[sym[i].len]++;
+    else
+      {
+	st->lit[length_code[sym[i].len - MIN_MATCH] + LITERALS + 1]++;
+	st->dist[d_code (sym[i].dist - 1)]++;
+      }
+}
+
+/* Return the estimated cost of the N symbols SYM, counted in ST, in
+ * 256ths of a bit.
+ */
+static uint64_t
+symbols_cost (struct stats const *st, struct symbol const *sym, size_t n)
+{
+  uint64_t bits = ct_entropy (st->lit, L_CODES) + ct_entropy (st->dist,
+							       D_CODES);
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    if (sym[i].dist != 0)
+      bits += (extra_lbits[length_code[sym[i].len - MIN_MATCH]]
+	       + extra_dbits[d_code (sym[i].dist - 1)]) << 8;
+  return bits;
+}
+
+/* Find the cheapest symbols for the input bytes from START to END, which
+ * are positions of the input after DICT_LEN bytes of dictionary, under
+ * the costs C.  Store them in O->sym and return their number.
+ */
+static size_t
+parse (struct optimal *o, struct costs const *c, size_t dict_len,
+       size_t start, size_t end)
+{
+  uch const *in = o->buf + dict_len + start;
+  uint32_t const *first = o->first + start;
+  uint64_t *cost = o->cost;
+  struct symbol *step = o->step;
+  size_t m = end - start;
+  size_t i, n;
+
+  cost[0] = 0;
+  for (i = 1; i <= m; i++)
+    cost[i] = COST_MAX;
+  for (i = 0; i < m; i++)
+    {
+      uint64_t here = cost[i];
+      uint64_t x = here + c->lit[in[i]];
+      unsigned k, len, shortest = MIN_MATCH;
+
+      if (x < cost[i + 1])
+	{
+	  cost[i + 1] = x;
+	  step[i + 1].len = 1;
+	  step[i + 1].dist = 0;
+	}
+      for (k = first[i]; k < first[i + 1]; k++)
+	{
+	  unsigned dist = o->cand[k].dist;
+	  unsigned dcode = d_code (dist - 1);
+	  uint64_t d = here + c->dist[dcode] + (extra_dbits[dcode] << 8);
+
+	  len = o->cand[k].len;
+	  if (len > m - i)
+	    len = m - i;
+	  /* In a long repetition, only the longest match is worth trying.  */
+	  if (len == MAX_MATCH)
+	    shortest = MAX_MATCH;
+	  for (; shortest <= len; shortest++)
+	    {
+	      x = d + c->len[shortest];
+	      if (x < cost[i + shortest])
+		{
+		  cost[i + shortest] = x;
+		  step[i + shortest].len = shortest;
+		  step[i + shortest].dist = dist;
+		}
+	    }
+	}
+    }
+
+  /* Walk back from the end, then put the steps in order.  */
+  n = 0;
+  for (i = m; i > 0; i -= step[i].len)
+    {
+      o->sym[n] = step[i];
+      if (step[i].dist == 0)
+	o->sym[n].len = in[i - 1];
+      n++;
+    }
+  for (i = 0; i < n / 2; i++)
+    {
+      struct symbol t = o->sym[i];
+      o->sym[i] = o->sym[n - 1 - i];
+      o->sym[n - 1 - i] = t;
+    }
+  return n;
+}
+
+/* Return the number of input bytes that the N symbols SYM stand for.  */
+static size_t
+symbols_len (struct symbol const *sym, size_t n)
+{
+  size_t len = 0, i;
+
+  for (i = 0; i < n; i++)
+    len += sym[i].dist == 0 ? 1 : sym[i].len;
+  return len;
+}
+
+/* Return the estimated cost, without extra bits, of the symbols from
+ * chunk A to chunk B, whose counts up to each chunk are in PREFIX.
+ */
+static uint64_t
+chunks_cost (struct stats const *prefix, size_t a, size_t b)
+{
+  struct stats st;
+  int n;
+
+  for (n = 0; n < L_CODES; n++)
+    st.lit[n] = prefix[b].lit[n] - prefix[a].lit[n];
+  for (n = 0; n < D_CODES; n++)
+    st.dist[n] = prefix[b].dist[n] - prefix[a].dist[n];
+  return ct_entropy (st.lit, L_CODES) + ct_entropy (st.dist, D_CODES);
+}
+
+/* Mark in SPLIT the chunks from A to B, of the counts PREFIX, before
+ * which a new block is estimated to pay off, trying the best point first.
+ */
+static void
+split_chunks (struct stats const *prefix, bool *split, size_t a, size_t b)
+{
+  uint64_t whole, best;
+  size_t k, best_k = 0;
+
+  if (b - a < 2)
+    return;
+  whole = chunks_cost (prefix, a, b);
+  best = whole;
+  for (k = a + 1; k < b; k++)
+    {
+      uint64_t parts = chunks_cost (prefix, a, k) + chunks_cost (prefix, k, b)
+	+ (SPLIT_TREE_BITS << 8);
+      if (parts < best)
+	{
+	  best = parts;
+	  best_k = k;
+	}
+    }
+  if (best_k == 0)
+    return;
+  split[best_k] = true;
+  split_chunks (prefix, split, a, best_k);
+  split_chunks (prefix, split, best_k, b);
+}
+
+/* Send the N symbols SYM, which stand for the input at DATA, as deflate
+ * blocks of at most LIT_BUFSIZE - 1 symbols each, of about equal sizes,
+ * the last one ending the stream if EOF.
+ */
+static void
+send_symbols (struct native_deflate *s, struct symbol const *sym, size_t n,
+	      uch const *data, bool eof)
+{
+  size_t pieces = n / (LIT_BUFSIZE - 1) + 1;
+  size_t done = 0;
+  size_t p;
+
+  for (p = 1; p <= pieces; p++)
+    {
+      size_t end = n * p / pieces;
+      size_t len = symbols_len (sym + done, end - done);
+
+      for (; done < end; done++)
+	{
+	  if (sym[done].dist == 0)
+	    ct_tally (s, 0, sym[done].len);
+	  else
+	    ct_tally (s, sym[done].dist, sym[done].len - MIN_MATCH);
+	}
+      flush_block (s, data, len, eof && p == pieces);
+      data += len;
+    }
+}
+
+size_t
+native_deflate_optimal (struct native_deflate *s, int iterations,
+			unsigned char const *dict, size_t dict_len,
+			unsigned char const *in, size_t len, bool last,
+			unsigned char *out)
+{
+  struct optimal *o = s->opt;
+  struct stats *prefix;
+  bool *split;
+  size_t n, chunks, k, pos;
+
+  if (dict_len > WSIZE)
+    {
+      dict += dict_len - WSIZE;
+      dict_len = WSIZE;
+    }
+  if (o == NULL && (o = s->opt = calloc (1, sizeof *o)) == NULL)
+    return (size_t) -1;
+  if (!reserve (o, dict_len, len))
+    return (size_t) -1;
+  if (dict_len)
+    memcpy (o->buf, dict, dict_len);
+  if (len)
+    memcpy (o->buf + dict_len, in, len);
+  memset (o->buf + dict_len + len, 0, MAX_MATCH + WINDOW_SLACK);
+
+  /* Only the tally and the trees of S are used; ct_tally's advice on
+   * where to end blocks is not taken.
+   */
+  native_deflate_reset (s, 9, NULL, NULL);
+  s->out = out;
+  s->out_size = SIZE_MAX;
+
+  if (len == 0)
+    {
+      if (last)
+	flush_block (s, o->buf, 0, true);
+      return s->outcnt;
+    }
+  if (!find_matches (o, dict_len, dict_len + len))
+    return (size_t) -1;
+
+  /* Parse with the static costs, and split where the statistics of
+   * that parse change.
+   */
+  struct costs c;
+  static_costs (&c);
+  n = parse (o, &c, dict_len, 0, len);
+  chunks = (n + SPLIT_CHUNK - 1) / SPLIT_CHUNK;
+  prefix = malloc ((chunks + 1) * sizeof *prefix);
+  split = calloc (chunks + 1, sizeof *split);
+  if (prefix == NULL || split == NULL)
+    {
+      free (prefix);
+      free (split);
+      return (size_t) -1;
+    }
+  memset (&prefix[0], 0, sizeof prefix[0]);
+  for (k = 0; k < chunks; k++)
+    {
+      size_t end = (k + 1) * SPLIT_CHUNK < n ? (k + 1) * SPLIT_CHUNK : n;
+      struct stats st;
+
+      count_symbols (&st, o->sym + k * SPLIT_CHUNK, end - k * SPLIT_CHUNK);
+      st.lit[END_BLOCK] = 0;
+      prefix[k + 1] = prefix[k];
+      for (int i = 0; i < L_CODES; i++)
+	prefix[k + 1].lit[i] += st.lit[i];
+      for (int i = 0; i < D_CODES; i++)
+	prefix[k + 1].dist[i] += st.dist[i];
+    }
+  split_chunks (prefix, split, 0, chunks);
+  free (prefix);
+
+  /* Turn the split points into byte offsets of the parts, since the
+   * parses below overwrite the symbols.
+   */
+  size_t *bounds = malloc ((chunks + 1) * sizeof *bounds);
+  size_t parts = 0;
+  if (bounds == NULL)
+    {
+      free (split);
+      return (size_t) -1;
+    }
+  bounds[parts++] = 0;
+  for (k = 0, pos = 0; k < chunks; k++)
+    {
+      size_t end = (k + 1) * SPLIT_CHUNK < n ? (k + 1) * SPLIT_CHUNK : n;
+
+      if (split[k])
+	bounds[parts++] = pos;
+      pos += symbols_len (o->sym + k * SPLIT_CHUNK, end - k * SPLIT_CHUNK);
+    }
+  bounds[parts] = len;
+  free (split);
+
+  /* Parse each part again with the costs estimated from the statistics
+   * of its previous parse, starting from the one with the static costs.
+   */
+  for (k = 0; k < parts; k++)
+    {
+      size_t start = bounds[k], end = bounds[k + 1];
+      uint64_t best_cost = COST_MAX;
+      size_t best_n = 0;
+      struct stats st;
+      int it;
+
+      static_costs (&c);
+      n = parse (o, &c, dict_len, start, end);
+      for (it = 0; it < iterations; it++)
+	{
+	  uint64_t cost;
+
+	  count_symbols (&st, o->sym, n);
+	  stats_costs (&c, &st);
+	  n = parse (o, &c, dict_len, start, end);
+	  count_symbols (&st, o->sym, n);
+	  cost = symbols_cost (&st, o->sym, n);
+	  if (cost < best_cost)
+	    {
+	      best_cost = cost;
+	      best_n = n;
+	      memcpy (o->best, o->sym, n * sizeof *o->sym);
+	    }
+	}
+      send_symbols (s, o->best, best_n, o->buf + dict_len + start,
+		    last && end == len);
+    }
+  free (bounds);
+
+  if (!last)
+    ct_align (s);
+  return s->outcnt;
+}
@@ -2,21 +2,45 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <config.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include "gzip.h"
 #include <stdio.h>
 #include "zlib.h"
 #include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include "ignore-value.h"
+#include "parallel.h"
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+#endif
+
+// static probes for bpftrace and friends, e.g. usdt:gzip:gzip:job__write;
+// each takes the job's sequence number and one more value
+#ifndef DTRACE_PROBE2
+# define DTRACE_PROBE2(provider, name, arg1, arg2)
+#endif
 
 // initial buffer sizes
-#define IN_BUF_SIZE 131072
 #define OUT_BUF_SIZE 32768
 #define DICTIONARY_SIZE 32768
 #define MAXP2 (UINT_MAX - (UINT_MAX >> 1))
 
-// compression level
-static int pack_level;
+// seconds a compress thread of a pipeline waits for a job before it
+// retires, freeing its deflate state, if another thread remains
+#define COMPRESS_IDLE 0.25
+
+// longest line of /proc/self/cgroup that pipeline_cpus looks at
+#define CGROUP_PATH_MAX 4096
 
 // headers and trailers
 
@@ -32,15 +56,15 @@ struct gzip_header
 };
 
 static struct gzip_header
-create_header (char const *name, int level)
+create_header (char const *name, uint32_t mtime, int level)
 {
   struct gzip_header header;
   header.magic1 = 31;
   header.magic2 = 139;
   header.deflate = 8;
   header.flags1 = (name != NULL) ? 8 : 0;
-  header.time = (uint32_t) time_stamp.tv_sec;
-  header.flags2 = (level >= 9 ? 2 : level == 1 ? 4 : 0);
+  header.time = mtime;
+  header.flags2 = (level >= 9 ? 2 : level <= 1 ? 4 : 0);
   header.os = 3;
 
   return header;
@@ -61,44 +85,50 @@ create_trailer (unsigned long check, size_t ulen)
   return trailer;
 }
 
-// i/o helpers
-
-static ssize_t
-readn (int fd, unsigned char *buf, size_t len)
+/* Return the length of the gzip header at the start of the LEN bytes of
+ * BUF, or 0 if it is not a whole, plain deflate header.
+ */
+size_t
+gzip_header_length (unsigned char const *buf, size_t len)
 {
-  ssize_t result;
-  ssize_t amount = 0;
+  size_t n = 10;
+  int flags;
 
-  while (len)
+  if (len < n || buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != Z_DEFLATED)
+    {
+      return 0;
+    }
+  flags = buf[3];
+  if (flags & 0xe0)
+    {
+      return 0;
+    }
+  if (flags & 4)		// FEXTRA
     {
-      result = read (fd, buf, len);
-      if (result < 0)
+      if (len < n + 2)
 	{
-	  return result;
+	  return 0;
 	}
-      if (result == 0)
+      n += 2 + (buf[n] | buf[n + 1] << 8);
+    }
+  for (int field = 8; field <= 16; field <<= 1)	// FNAME, FCOMMENT
+    {
+      if (flags & field)
 	{
-	  break;
+	  unsigned char const *end = n < len ? memchr (buf + n, 0, len - n)
+	    : NULL;
+	  if (end == NULL)
+	    {
+	      return 0;
+	    }
+	  n = end - buf + 1;
 	}
-      buf += result;
-      amount += result;
-      len -= (size_t) result;
     }
-  return amount;
-}
-
-static void
-writen (int fd, unsigned char const *buf, size_t len)
-{
-  size_t const max = SIZE_MAX >> 1;
-  ssize_t result;
-
-  while (len != 0)
+  if (flags & 2)		// FHCRC
     {
-      result = write (fd, buf, len > max ? max : len);
-      buf += result;
-      len -= (size_t) result;
+      n += 2;
     }
+  return n < len ? n : 0;
 }
 
 // Lock helpers
@@ -142,6 +172,70 @@ broadcast (struct lock *lock)
   return pthread_cond_broadcast (&lock->cond);
 }
 
+// Timing helpers
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU time of the calling thread, or 0 where that cannot be had
+static double
+thread_cpu (void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    {
+      return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+#endif
+  return 0;
+}
+
+// histogram bucket of a queue DEPTH, see PIPELINE_DEPTHS
+static int
+depth_bucket (long depth)
+{
+  int bucket = 0;
+  while (depth > 0 && bucket < PIPELINE_DEPTHS - 1)
+    {
+      depth >>= 1;
+      bucket++;
+    }
+  return bucket;
+}
+
+// Event helpers
+
+// make FD readable for whoever polls it: an eventfd, or the write end of
+// a pipe where eventfd is missing
+static void
+signal_event (int fd)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t one = 1;
+#else
+  unsigned char one = 1;
+#endif
+  // EAGAIN means it is readable already
+  ignore_value (write (fd, &one, sizeof one));
+}
+
+// make FD unreadable again
+static void
+clear_event (int fd)
+{
+  unsigned char drain[64];
+  while (read (fd, drain, sizeof drain) > 0)
+    {
+      continue;
+    }
+}
+
 // Buffer pool helpers
 
 struct buffer_pool
@@ -162,10 +256,6 @@ struct buffer
   struct buffer *next;
 };
 
-static struct buffer_pool in_pool;
-static struct buffer_pool out_pool;
-static struct buffer_pool dict_pool;
-
 static struct buffer *
 get_buffer (struct buffer_pool *pool)
 {
@@ -188,7 +278,13 @@ get_buffer (struct buffer_pool *pool)
 	  return NULL;
 	}
       init_lock (&result->lock);
-      result->data = malloc (pool->buffer_size);
+      // a pool with no buffer size hands out wrappers for borrowed memory
+      result->data = pool->buffer_size ? malloc (pool->buffer_size) : NULL;
+      if (pool->buffer_size && result->data == NULL)
+	{
+	  free (result);
+	  return NULL;
+	}
       result->size = pool->buffer_size;
       result->len = 0;
       result->pool = pool;
@@ -217,45 +313,39 @@ return_buffer (struct buffer *buffer)
   unlock (&pool->lock);
 }
 
-static inline size_t
-grow (size_t size)
+static void
+free_pool (struct buffer_pool *pool)
 {
-  size_t was = size;
-  size_t top;
-  int shift;
-
-  size += size >> 2;
-  top = size;
-  for (shift = 0; top > 7; shift++)
-    {
-      top >>= 1;
-    }
-  if (top == 7)
-    {
-      size = (size_t) 1 << (shift + 3);
-    }
-  if (size < 16)
-    {
-      size = 16;
-    }
-  if (size <= was)
+  struct buffer *buffer;
+  while ((buffer = pool->head) != NULL)
     {
-      size = (size_t) 0 - 1;
+      pool->head = buffer->next;
+      if (pool->buffer_size)
+	{
+	  free (buffer->data);
+	}
+      free (buffer);
     }
-  return size;
 }
 
-static void
-grow_buffer (struct buffer *buffer)
+// make BUFFER, which holds nothing yet, at least SIZE bytes long; return
+// false if out of memory
+static bool
+reserve_buffer (struct buffer *buffer, size_t size)
 {
-  unsigned char *tmp;
-  size_t bigger = grow (buffer->size);
-  tmp = realloc (buffer->data, bigger);
-  if (tmp != NULL)
+  if (buffer->size >= size)
+    {
+      return true;
+    }
+  unsigned char *data = malloc (size);
+  if (data == NULL)
     {
-      buffer->size = bigger;
-      buffer->data = tmp;
+      return false;
     }
+  free (buffer->data);
+  buffer->data = data;
+  buffer->size = size;
+  return true;
 }
 
 // Job helpers
@@ -265,10 +355,14 @@ struct job_list
   struct lock lock;
   struct job *head;
   struct job *tail;
+  int threads;			// compress threads serving the list
 };
 
+struct pipeline;
+
 struct job
 {
+  struct pipeline *pl;
   long seq;
   struct buffer *in;
   struct buffer *out;
@@ -277,20 +371,72 @@ struct job
   struct lock check_done;
   struct job *next;
   int more;
+  int level;			// compression level
+  double read_at;		// when the input was read
+};
+
+// Pipeline state
+
+struct pipeline
+{
+  struct pipeline_params const *params;
+  size_t block_size;
+  bool rsyncable;		// params->rsyncable, unless borrowing
+  size_t carry;			// bytes after the cut of the last block read,
+				// which start the next one
+  struct buffer_pool in_pool;
+  struct buffer_pool out_pool;
+  struct buffer_pool dict_pool;
+  struct job_list compress_jobs;
+  struct job_list write_jobs;
+  struct job_list free_jobs;
+  struct lock busy;		// value is the number of jobs being compressed
+  int event_fd;			// signalled as each job completes, or -1
+  int trace_run;		// process id of the run in params->trace
+  int status;			// first error seen by any stage, under busy
+  struct pipeline_stats stats;	// compress fields are guarded by busy
+
+  // level control for params->adaptive, by the reader
+  int level;			// level of the next block
+  long window;			// blocks queued since the level was set
+  long idle;			// those queued while a compress thread was idle
+  double window_read;		// stats.read_busy when the level was set
+  double window_wait;		// stats.read_wait when the level was set
+};
+
+// one compress thread and the list it takes jobs from
+struct compressor
+{
+  pthread_t thread;
+  struct job_list *list;
+  int id;			// index among the threads serving LIST
+  double idle;			// seconds without a job before retiring, or 0
+  bool started;			// THREAD is to be joined
+  bool retired;			// THREAD has exited for lack of work; guarded
+				// by the lock of LIST
+  struct pipeline_thread_stats stats;	// over all threads run in this slot
 };
 
-static struct job_list compress_jobs;
-static struct job_list write_jobs;
-static struct job_list free_jobs;
+static void
+init_compressor (struct compressor *c, struct job_list *list, int id,
+		 double idle)
+{
+  c->list = list;
+  c->id = id;
+  c->idle = idle;
+  c->started = false;
+  c->retired = false;
+  memset (&c->stats, 0, sizeof (c->stats));
+}
 
 static struct job *
-get_job (long seq)
+get_job (struct pipeline *pl, long seq)
 {
   struct job *result;
-  lock (&free_jobs.lock);
-  if (free_jobs.head == NULL)
+  lock (&pl->free_jobs.lock);
+  if (pl->free_jobs.head == NULL)
     {
-      unlock (&free_jobs.lock);
+      unlock (&pl->free_jobs.lock);
       // allocate a new job
       result = malloc (sizeof (struct job));
       if (result == NULL)
@@ -302,90 +448,113 @@ get_job (long seq)
   else
     {
       // grab one from the list
-      result = free_jobs.head;
-      free_jobs.head = free_jobs.head->next;
-      unlock (&free_jobs.lock);
+      result = pl->free_jobs.head;
+      pl->free_jobs.head = pl->free_jobs.head->next;
+      unlock (&pl->free_jobs.lock);
     }
-  lock (&result->check_done);
+  // -1 until the compress thread has computed the check value
+  result->check_done.value = -1;
+  result->pl = pl;
   result->next = NULL;
   result->seq = seq;
   return result;
 }
 
 static void
-return_job (struct job *job)
+return_job (struct pipeline *pl, struct job *job)
 {
-  lock (&free_jobs.lock);
-  job->next = free_jobs.head;
-  free_jobs.head = job;
-  broadcast (&free_jobs.lock);
-  unlock (&free_jobs.lock);
+  lock (&pl->free_jobs.lock);
+  job->next = pl->free_jobs.head;
+  pl->free_jobs.head = job;
+  broadcast (&pl->free_jobs.lock);
+  unlock (&pl->free_jobs.lock);
 }
 
-// init functions
+static void
+free_jobs (struct pipeline *pl)
+{
+  struct job *job;
+  while ((job = pl->free_jobs.head) != NULL)
+    {
+      pl->free_jobs.head = job->next;
+      free (job);
+    }
+}
 
+// free the buffers and jobs of a pipeline once all have been given back
 static void
-init_pools (void)
+free_pipeline (struct pipeline *pl)
 {
-  // input pool
-  init_lock (&in_pool.lock);
-  in_pool.head = NULL;
-  in_pool.buffer_size = rsync ? CHUNK : IN_BUF_SIZE;
-  in_pool.num_buffers = threads * 2 + 1;
+  free_pool (&pl->in_pool);
+  free_pool (&pl->out_pool);
+  free_pool (&pl->dict_pool);
+  free_jobs (pl);
+}
 
-  // output pool
-  init_lock (&out_pool.lock);
-  out_pool.head = NULL;
-  out_pool.buffer_size = OUT_BUF_SIZE;
-  out_pool.num_buffers = -1;
+// init functions
 
-  // dictionary pool
-  init_lock (&dict_pool.lock);
-  dict_pool.head = NULL;
-  dict_pool.buffer_size = DICTIONARY_SIZE;
-  dict_pool.num_buffers = -1;
+static void
+init_pool (struct buffer_pool *pool, size_t buffer_size, int num_buffers)
+{
+  init_lock (&pool->lock);
+  pool->head = NULL;
+  pool->buffer_size = buffer_size;
+  pool->num_buffers = num_buffers;
 }
 
 static void
-init_jobs (void)
+init_pools (struct pipeline *pl)
 {
-  // compress jobs
-  init_lock (&compress_jobs.lock);
-  compress_jobs.head = NULL;
-  compress_jobs.tail = NULL;
+  bool borrow = pl->params->borrow;
 
-  // write jobs
-  init_lock (&write_jobs.lock);
-  write_jobs.head = NULL;
-  write_jobs.tail = NULL;
+  // input pool, bounded to keep the reader from running too far ahead
+  init_pool (&pl->in_pool, borrow ? 0 : pl->block_size,
+	     pl->params->threads * 2 + 1);
 
-  // free jobs
-  init_lock (&free_jobs.lock);
-  free_jobs.head = NULL;
-  free_jobs.tail = NULL;
+  // output pool
+  init_pool (&pl->out_pool, OUT_BUF_SIZE, -1);
+
+  // dictionary pool
+  init_pool (&pl->dict_pool, borrow ? 0 : DICTIONARY_SIZE, -1);
 }
 
-// compress function
+static void
+init_list (struct job_list *list)
+{
+  init_lock (&list->lock);
+  list->head = NULL;
+  list->tail = NULL;
+  list->threads = 0;
+}
 
 static void
-deflate_buffer (z_stream * stream, struct buffer *out, int flush)
+init_jobs (struct pipeline *pl)
 {
-  size_t room;
+  init_list (&pl->compress_jobs);
+  init_list (&pl->write_jobs);
+  init_list (&pl->free_jobs);
+  init_lock (&pl->busy);
+}
 
-  do
-    {
-      room = out->size - out->len;
-      if (room == 0)
-	{
-	  grow_buffer (out);
-	  room = out->size - out->len;
-	}
-      stream->next_out = out->data + out->len;
-      stream->avail_out = room < UINT_MAX ? (unsigned) room : UINT_MAX;
-      deflate (stream, flush);
-      out->len = (size_t) (stream->next_out - out->data);
-    }
-  while (stream->avail_out == 0);
+static void
+init_pipeline (struct pipeline *pl, struct pipeline_params const *params)
+{
+  pl->params = params;
+  pl->block_size = params->block_size ? params->block_size
+    : PARALLEL_BLOCK_SIZE;
+  pl->rsyncable = params->rsyncable && !params->borrow;
+  pl->carry = 0;
+  pl->event_fd = -1;
+  pl->trace_run = 0;
+  pl->status = Z_OK;
+  memset (&pl->stats, 0, sizeof (pl->stats));
+  pl->level = params->level;
+  pl->window = 0;
+  pl->idle = 0;
+  pl->window_read = 0;
+  pl->window_wait = 0;
+  init_pools (pl);
+  init_jobs (pl);
 }
 
 // crc math functions (thanks adler)
@@ -487,348 +656,2164 @@ crc32z (unsigned long crc, unsigned char const *buf, size_t len)
 
 // thread functions
 
-static noreturn void *
-write_thread (void *nothing)
+// the first error of the run so far, or Z_OK
+static int
+get_status (struct pipeline *pl)
 {
-  unsigned long check = crc32z (0L, Z_NULL, 0);
+  lock (&pl->busy);
+  int status = pl->status;
+  unlock (&pl->busy);
+  return status;
+}
 
-  // write the header
-  struct gzip_header header;
-  if (ifd == STDIN_FILENO)
+// record ERR as the result of the run, unless an error came first
+static void
+set_status (struct pipeline *pl, int err)
+{
+  lock (&pl->busy);
+  if (pl->status == Z_OK)
     {
-      header = create_header (NULL, pack_level);
-      writen (ofd, (unsigned char *) &header, sizeof (header) - 2);
+      pl->status = err;
     }
-  else
+  unlock (&pl->busy);
+}
+
+// hand data to the output stage, remembering the first failure
+static void
+put (struct pipeline *pl, unsigned char const *data, size_t len)
+{
+  if (get_status (pl) == Z_OK
+      && pl->params->write (pl->params->opaque, data, len) != 0)
     {
-      header = create_header (ifname, pack_level);
-      writen (ofd, (unsigned char *) &header, sizeof (header) - 2);
-      writen (ofd, (unsigned char *) ifname, strlen (ifname) + 1);
+      set_status (pl, Z_ERRNO);
     }
+  pl->stats.bytes_out += len;
+}
 
+static noreturn void *
+write_thread (void *arg)
+{
+  struct pipeline *pl = arg;
+  struct pipeline_trace *trace = pl->params->trace;
+  int tid = PIPELINE_TRACE_WRITER;
+  char const *name = pl->params->name;
+  unsigned long check = crc32z (0L, Z_NULL, 0);
+
+  // write the header
+  struct gzip_header header =
+    create_header (name, pl->params->mtime, pl->params->level);
+  put (pl, (unsigned char *) &header, sizeof (header) - 2);
+  if (name != NULL)
+    {
+      put (pl, (unsigned char const *) name, strlen (name) + 1);
+    }
 
   size_t ulen = 0;
 
   long seq = 0;
   struct job *job;
+  int more;
   do
     {
       // wait for the next job in sequence
-      lock (&write_jobs.lock);
-      while ((write_jobs.head == NULL || seq != write_jobs.head->seq)
-	     && !write_jobs.lock.value)
+      double start = now ();
+      lock (&pl->write_jobs.lock);
+      while ((pl->write_jobs.head == NULL || seq != pl->write_jobs.head->seq)
+	     && !pl->write_jobs.lock.value)
 	{
-	  wait_lock (&write_jobs.lock);
+	  wait_lock (&pl->write_jobs.lock);
 	}
-      if (write_jobs.lock.value)
+      if (pl->write_jobs.lock.value)
 	{
 	  break;
 	}
 
       // get job
-      job = write_jobs.head;
-      write_jobs.head = job->next;
+      job = pl->write_jobs.head;
+      long ready = 0;
+      for (struct job *cur = job; cur != NULL; cur = cur->next)
+	{
+	  ready++;
+	}
+      pl->stats.write_depth[depth_bucket (ready)]++;
+      pl->write_jobs.head = job->next;
       if (job->next == NULL)
 	{
-	  write_jobs.tail = NULL;
+	  pl->write_jobs.tail = NULL;
+	}
+      unlock (&pl->write_jobs.lock);
+
+      // blocks behind this one may have been ready long before it was
+      double got = now ();
+      pl->stats.write_wait += got - start;
+      DTRACE_PROBE2 (gzip, write__wait, seq, (long) ((got - start) * 1e9));
+      if (trace != NULL)
+	{
+	  pipeline_trace_span (trace, pl->trace_run, tid, "wait for block",
+			       start, got, seq, 0);
 	}
-      unlock (&write_jobs.lock);
 
       // write data and return out buffer
-      writen (ofd, job->out->data, job->out->len);
+      size_t len = job->out->len;
+      DTRACE_PROBE2 (gzip, job__write, seq, len);
+      start = now ();
+      put (pl, job->out->data, len);
+      double done = now ();
+      pl->stats.write_busy += done - start;
+      pl->stats.flushes++;
+      pl->stats.latency += done - job->read_at;
+      if (pl->stats.latency_max < done - job->read_at)
+	{
+	  pl->stats.latency_max = done - job->read_at;
+	}
+      if (trace != NULL)
+	{
+	  pipeline_trace_span (trace, pl->trace_run, tid, "write", start, done,
+			       seq, len);
+	  pipeline_trace_flow (trace, pl->trace_run, tid, 'f',
+			       (start + done) / 2, seq);
+	}
       // return the buffer
       return_buffer (job->out);
       // wait for checksum
+      start = now ();
       lock (&job->check_done);
+      while (job->check_done.value < 0)
+	{
+	  wait_lock (&job->check_done);
+	}
+      done = now ();
+      pl->stats.check_wait += done - start;
+      if (trace != NULL)
+	{
+	  pipeline_trace_span (trace, pl->trace_run, tid, "wait for check",
+			       start, done, seq, 0);
+	}
       // assemble the checksum
       check = crc32_comb (check, job->check, job->check_done.value);
       ulen += job->check_done.value;
       unlock (&job->check_done);
       // return the job
-      return_job (job);
+      more = job->more;
+      return_job (pl, job);
 
       seq++;
     }
-  while (job->more);
+  while (more);
 
   // write the trailer
   struct gzip_trailer trailer = create_trailer (check, ulen);
-  writen (ofd, (unsigned char *) &trailer, sizeof (trailer));
+  put (pl, (unsigned char *) &trailer, sizeof (trailer));
   pthread_exit (NULL);
 }
 
-static noreturn void *
-compress_thread (void *nothing)
+// tell whoever is waiting on PL that one of its jobs is complete, after
+// BUSY seconds of work, DEFLATED and CHECKED of them in deflate and the
+// CRC, and WAITED seconds for the job to show up
+static void
+job_done (struct pipeline *pl, double busy, double deflated, double checked,
+	  double waited)
 {
-  struct job *job;
-  size_t len;
-
-  // init the deflate stream for this thread
-  z_stream stream;
-  stream.zfree = Z_NULL;
-  stream.zalloc = Z_NULL;
-  stream.opaque = Z_NULL;
-  deflateInit2 (&stream, pack_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
-  for (;;)
+  if (pl->event_fd >= 0)
     {
-      // get a job from the compress list
-      lock (&compress_jobs.lock);
-      while (compress_jobs.head == NULL)
-	{
-	  if (compress_jobs.lock.value != 0)
-	    {
-	      unlock (&compress_jobs.lock);
-	      pthread_exit (NULL);
-	    }
-	  wait_lock (&compress_jobs.lock);
-	}
-      // get a compress job
-      job = compress_jobs.head;
-      if (compress_jobs.head == compress_jobs.tail)
-	{
-	  compress_jobs.tail = NULL;
-	}
-      compress_jobs.head = compress_jobs.head->next;
-      unlock (&compress_jobs.lock);
-      len = job->in->len;
-      // reset the stream
-      deflateReset (&stream);
-      deflateParams (&stream, pack_level, Z_DEFAULT_STRATEGY);
-      // set the dictionary
-      if (job->dict != NULL)
-	{
-	  deflateSetDictionary (&stream, job->dict->data, DICTIONARY_SIZE);
-	  // return the dictionary buffer
-	  return_buffer (job->dict);
-	}
-      // get an out buffer
-      do
-	{
-	  job->out = get_buffer (&out_pool);
-	}
-      while (job->out == NULL);
-      // set up stream struct
-      stream.next_in = job->in->data;
-      stream.next_out = job->out->data;
-      // check if this is the last (empty) block
+      signal_event (pl->event_fd);
+    }
+  // PL may be freed as soon as busy drops, so this must come last
+  lock (&pl->busy);
+  pl->stats.compress_busy += busy;
+  pl->stats.deflate += deflated;
+  pl->stats.crc += checked;
+  pl->stats.compress_wait += waited;
+  pl->busy.value--;
+  broadcast (&pl->busy);
+  unlock (&pl->busy);
+}
 
-      size_t left = job->in->len;
-      while (left > MAXP2)
-	{
-	  stream.avail_in = MAXP2;
-	  deflate_buffer (&stream, job->out, Z_NO_FLUSH);
-	  left -= MAXP2;
-	}
-      stream.avail_in = (unsigned) left;
+// Return whether all LEN bytes of DATA are zero.
+static bool
+all_zeros (unsigned char const *data, size_t len)
+{
+  return len != 0 && data[0] == 0 && memcmp (data, data + 1, len - 1) == 0;
+}
 
-      if (job->more)
-	{
-	  // compress normally
-	  deflate_buffer (&stream, job->out, Z_BLOCK);
-	  int bits;
-	  deflatePending (&stream, Z_NULL, &bits);
-	  if (bits & 1)
-	    {
-	      deflate_buffer (&stream, job->out, Z_SYNC_FLUSH);
-	    }
-	  else if (bits & 7)
-	    {
-	      do
-		{
-		  bits = deflatePrime (&stream, 10, 2);
-		  deflatePending (&stream, Z_NULL, &bits);
-		}
-	      while (bits & 7);
-	      deflate_buffer (&stream, job->out, Z_BLOCK);
-	    }
-	}
-      else
-	{
-	  // finish compression
-	  deflate_buffer (&stream, job->out, Z_FINISH);
-	}
-      // put job on the write list
-      lock (&write_jobs.lock);
-      struct job *prev = NULL;
-      struct job *cur = write_jobs.head;
-      while (cur != NULL && cur->seq < job->seq)
-	{
-	  prev = cur;
-	  cur = cur->next;
-	}
-      if (write_jobs.head == NULL)
-	{
-	  job->next = NULL;
-	  write_jobs.head = job;
-	}
-      else if (cur == write_jobs.head)
+// deflate JOB into a fresh output buffer and hand it to the write stage,
+// with ENGINE, whose state for this thread is STATE; WAITED is how long
+// compressor C was idle before it got the job, and the work is also
+// counted in C's own stats
+static void
+compress_job (struct deflate_engine const *engine, void *state,
+	      struct job *job, double waited, struct compressor *c)
+{
+  struct pipeline *pl = job->pl;
+  struct pipeline_trace *trace = pl->params->trace;
+  long seq = job->seq;
+  double start = now ();
+  double deflate_start, deflate_end, crc_start, crc_end;
+  size_t len, out_len;
+
+  DTRACE_PROBE2 (gzip, job__start, seq, c->id);
+
+  // get an out buffer
+  do
+    {
+      job->out = get_buffer (&pl->out_pool);
+    }
+  while (job->out == NULL);
+  // a block of zeros, such as a hole of a sparse file, needs neither
+  // matching nor its dictionary: run length encoding does as well
+  bool zeros = all_zeros (job->in->data, job->in->len);
+  bool dict = job->dict != NULL && !zeros;
+
+  // the whole block is in memory, so it is compressed in one go straight
+  // into a buffer big enough for the worst case; blocks lowered from the
+  // top level by params->adaptive are not parsed optimally
+  deflate_start = now ();
+  size_t deflated = (size_t) -1;
+  if (state != NULL
+      && reserve_buffer (job->out, engine->bound (job->in->len)))
+    {
+      unsigned char const *data = dict ? job->dict->data : NULL;
+      size_t dict_len = dict ? DICTIONARY_SIZE : 0;
+      if (pl->params->iterations > 0 && engine->optimal != NULL && !zeros
+	  && job->level == pl->params->level)
 	{
-	  job->next = write_jobs.head;
-	  write_jobs.head = job;
+	  deflated = engine->optimal (state, pl->params->iterations, data,
+				      dict_len, job->in->data, job->in->len,
+				      !job->more, job->out->data);
 	}
       else
 	{
-	  job->next = cur;
-	  prev->next = job;
-	}
-      broadcast (&write_jobs.lock);
-      unlock (&write_jobs.lock);
-      // calculate check
-      len = job->in->len;
-      unsigned char *next = job->in->data;
-      unsigned long check = crc32z (0L, Z_NULL, 0);
-      while (len > MAXP2)
-	{
-	  check = crc32z (check, next, len);
-	  len -= MAXP2;
-	  next += MAXP2;
+	  deflated = engine->compress (state, zeros ? 1 : job->level,
+				       zeros ? Z_RLE : Z_DEFAULT_STRATEGY,
+				       data, dict_len, job->in->data,
+				       job->in->len, !job->more,
+				       job->out->data);
 	}
+    }
+  if (deflated != (size_t) -1)
+    {
+      job->out->len = deflated;
+    }
+  else
+    {
+      job->out->len = 0;
+      set_status (pl, Z_MEM_ERROR);
+    }
+  deflate_end = now ();
+  // return the dictionary buffer
+  if (job->dict != NULL)
+    {
+      return_buffer (job->dict);
+    }
+  out_len = job->out->len;
+  // put job on the write list
+  lock (&pl->write_jobs.lock);
+  struct job *prev = NULL;
+  struct job *cur = pl->write_jobs.head;
+  while (cur != NULL && cur->seq < job->seq)
+    {
+      prev = cur;
+      cur = cur->next;
+    }
+  if (pl->write_jobs.head == NULL)
+    {
+      job->next = NULL;
+      pl->write_jobs.head = job;
+    }
+  else if (cur == pl->write_jobs.head)
+    {
+      job->next = pl->write_jobs.head;
+      pl->write_jobs.head = job;
+    }
+  else
+    {
+      job->next = cur;
+      prev->next = job;
+    }
+  broadcast (&pl->write_jobs.lock);
+  unlock (&pl->write_jobs.lock);
+  // calculate check
+  crc_start = now ();
+  len = job->in->len;
+  unsigned char *next = job->in->data;
+  unsigned long check = crc32z (0L, Z_NULL, 0);
+  while (len > MAXP2)
+    {
       check = crc32z (check, next, len);
-      job->check_done.value = job->in->len;
-      job->check = check;
-      // return in buffer
-      return_buffer (job->in);
-      // unlock check
-      unlock (&job->check_done);
+      len -= MAXP2;
+      next += MAXP2;
     }
-
-  deflateEnd (&stream);
+  check = crc32z (check, next, len);
+  job->check = check;
+  crc_end = now ();
+  // the job may be recycled as soon as the check is published
+  struct buffer *in = job->in;
+  len = in->len;
+  lock (&job->check_done);
+  job->check_done.value = len;
+  broadcast (&job->check_done);
+  unlock (&job->check_done);
+  // return in buffer
+  return_buffer (in);
+  double end = now ();
+  c->stats.jobs++;
+  c->stats.bytes += len;
+  c->stats.busy += end - start;
+  c->stats.wait += waited;
+  DTRACE_PROBE2 (gzip, job__done, seq, out_len);
+  if (trace != NULL)
+    {
+      int run = pl->trace_run;
+      int tid = PIPELINE_TRACE_COMPRESS + c->id;
+      pipeline_trace_span (trace, run, tid, "wait for job", start - waited,
+			   start, seq, 0);
+      pipeline_trace_span (trace, run, tid, "compress", start, end, seq, len);
+      pipeline_trace_span (trace, run, tid, "deflate", deflate_start,
+			   deflate_end, seq, out_len);
+      pipeline_trace_span (trace, run, tid, "crc", crc_start, crc_end, seq,
+			   len);
+      pipeline_trace_flow (trace, run, tid, 't', (start + end) / 2, seq);
+    }
+  job_done (pl, end - start, deflate_end - deflate_start, crc_end - crc_start,
+	    waited);
 }
 
-off_t
-parallel_zip (int pack_lev)
+// unlink the head of LIST, which is locked and not empty
+static struct job *
+unlink_head (struct job_list *list)
 {
-  pack_level = pack_lev;
-  init_pools ();
-  init_jobs ();
-
-  // init compression threads array
-  pthread_t *compression_threads_t = malloc (sizeof (pthread_t) * threads);
+  struct job *job = list->head;
 
-  // launch write thread
-  pthread_t write_thread_t;
-  if (pthread_create (&write_thread_t, NULL, write_thread, NULL) != 0)
+  if (list->head == list->tail)
     {
-      return Z_ERRNO;
+      list->tail = NULL;
     }
+  list->head = list->head->next;
+  return job;
+}
 
-  // start reading
-  int threads_compressing = 0;
-  long seq = 0;
-  struct job *job = NULL;
-  ssize_t last_read;
+// take the job at the head of LIST, waiting for one to be queued; return
+// NULL once the list is empty and its lock value is set
+static struct job *
+pop_job (struct job_list *list)
+{
+  struct job *job;
 
-  // initial job
-  struct job *last_job = get_job (seq);
-  if (last_job == NULL)
+  lock (&list->lock);
+  while (list->head == NULL)
     {
-      return Z_ERRNO;
+      if (list->lock.value != 0)
+	{
+	  unlock (&list->lock);
+	  return NULL;
+	}
+      wait_lock (&list->lock);
     }
-  last_job->in = get_buffer (&in_pool);
-  if (last_job->in == NULL)
+  job = unlink_head (list);
+  unlock (&list->lock);
+  return job;
+}
+
+// pop a job for C like pop_job, but if C->idle seconds pass without one
+// while another thread serves the list, retire C and return NULL
+static struct job *
+next_job (struct compressor *c)
+{
+  struct job_list *list = c->list;
+  struct job *job;
+  struct timespec until;
+
+  if (c->idle == 0)
     {
-      return Z_ERRNO;
+      return pop_job (list);
     }
-  seq++;
-  //last_job->in->lock.value = 1;
-  last_read = readn (ifd, last_job->in->data, last_job->in->size);
-  if (last_read < 0)
+  clock_gettime (CLOCK_REALTIME, &until);
+  until.tv_sec += (time_t) c->idle;
+  until.tv_nsec += (long) ((c->idle - (time_t) c->idle) * 1e9);
+  if (until.tv_nsec >= 1000000000)
     {
-      return Z_ERRNO;
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000;
     }
-  last_job->in->len = last_read;
-  last_job->dict = NULL;
 
-  // file wasn't empty
-  while (last_read != 0)
+  lock (&list->lock);
+  while (list->head == NULL)
     {
-      // get a job
-      job = get_job (seq);
-      if (job == NULL)
+      if (list->lock.value != 0)
 	{
-	  return Z_ERRNO;
+	  unlock (&list->lock);
+	  return NULL;
 	}
-      job->in = get_buffer (&in_pool);
-      if (job->in == NULL)
+      if (list->threads == 1)
 	{
-	  return Z_ERRNO;
+	  wait_lock (&list->lock);
 	}
-
-      // read into it
-      last_read = readn (ifd, job->in->data, job->in->size);
-      if (last_read < 0)
+      else if (pthread_cond_timedwait (&list->lock.cond, &list->lock.mutex,
+				       &until) == ETIMEDOUT
+	       && list->head == NULL && list->threads > 1)
 	{
-	  return Z_ERRNO;
+	  list->threads--;
+	  c->retired = true;
+	  unlock (&list->lock);
+	  return NULL;
 	}
-      job->in->len = last_read;
-      last_job->more = last_read;
+    }
+  job = unlink_head (list);
+  unlock (&list->lock);
+  return job;
+}
 
-      // set the dict and prepare the dict for the next one
-      if (!rsync && last_job->in->len >= DICTIONARY_SIZE)
-	{
-	  job->dict = get_buffer (&dict_pool);
-	  memcpy (job->dict->data,
-		  last_job->in->data + last_job->in->len - DICTIONARY_SIZE,
-		  DICTIONARY_SIZE);
-	  job->dict->len = DICTIONARY_SIZE;
-	}
-      else
-	{
-	  job->dict = NULL;
-	}
+// compress jobs from the list of compressor ARG until its lock value is
+// set or the compressor retires
+static noreturn void *
+compress_thread (void *arg)
+{
+  struct compressor *c = arg;
+  struct job *job;
 
-      // put the previous job on the back of the compress list
-      lock (&compress_jobs.lock);
-      if (compress_jobs.head == NULL)
+  // the state of the engine of the last job, made when a job first needs
+  // it and again whenever a job of a stream with another engine comes
+  struct deflate_engine const *engine = NULL;
+  void *state = NULL;
+  for (;;)
+    {
+      // get a job from the compress list
+      double start = now ();
+      job = next_job (c);
+      if (job == NULL)
 	{
-	  compress_jobs.head = last_job;
-	  compress_jobs.tail = last_job;
+	  if (engine != NULL)
+	    {
+	      engine->finish (state);
+	    }
+	  c->stats.cpu += thread_cpu ();
+	  pthread_exit (NULL);
 	}
-      else
+      struct deflate_engine const *e = job->pl->params->engine;
+      if (e == NULL)
 	{
-	  compress_jobs.tail->next = last_job;
-	  compress_jobs.tail = last_job;
+	  e = &zlib_engine;
 	}
-      broadcast (&compress_jobs.lock);
-      unlock (&compress_jobs.lock);
-
-      // launch a compress thread if possible
-      if (threads_compressing < threads)
+      if (e != engine || state == NULL)
 	{
-	  int err =
-	    pthread_create (compression_threads_t + threads_compressing, NULL,
-			    compress_thread, NULL);
-	  if (err != 0 && threads_compressing == 0)
+	  if (engine != NULL)
 	    {
-	      return Z_ERRNO;
+	      engine->finish (state);
 	    }
-	  threads_compressing++;
+	  engine = e;
+	  state = engine->init ();
 	}
-
-      last_job = job;
-      seq++;
+      compress_job (engine, state, job, now () - start, c);
     }
+}
 
-  // call the threads home
-  pthread_join (write_thread_t, NULL);
+// content-defined chunking
 
-  lock (&compress_jobs.lock);
-  compress_jobs.lock.value = 1;
-  broadcast (&compress_jobs.lock);
-  unlock (&compress_jobs.lock);
+// pseudo-random value of byte C for the gear hash
+static inline uint32_t
+gear (unsigned char c)
+{
+  uint32_t x = (c + 1) * 0x9e3779b1u;
+  x ^= x >> 15;
+  x *= 0x85ebca77u;
+  x ^= x >> 13;
+  return x;
+}
 
-  for (int i = 0; i < threads_compressing; i++)
+void
+rsync_roll_init (struct rsync_roll *r, size_t max)
+{
+  int bits = 0;
+
+  // look for a cut from a quarter of MAX on, hitting one about every
+  // quarter of MAX after that
+  r->min = max / 4;
+  r->max = max;
+  while (bits < 31 && ((size_t) 2 << bits) <= r->min)
+    {
+      bits++;
+    }
+  r->mask = ~(UINT32_MAX >> bits);
+  r->hash = 0;
+  r->len = 0;
+}
+
+bool
+rsync_roll_cut (struct rsync_roll *r, unsigned char const *in, size_t len,
+		size_t *used)
+{
+  size_t i = 0;
+  uint32_t hash = r->hash;
+
+  // the bytes before MIN only feed the hash, which each byte leaves
+  // after 32 more, so skip all but the last 32 of them
+  if (r->len < r->min)
+    {
+      size_t skip = r->min - r->len;
+      if (skip > len)
+	{
+	  skip = len;
+	}
+      if (skip > 32)
+	{
+	  i = skip - 32;
+	  hash = 0;
+	}
+      for (; i < skip; i++)
+	{
+	  hash = (hash << 1) + gear (in[i]);
+	}
+    }
+  for (; i < len; i++)
+    {
+      hash = (hash << 1) + gear (in[i]);
+      if ((hash & r->mask) == 0 || r->len + i + 1 >= r->max)
+	{
+	  *used = i + 1;
+	  r->hash = 0;
+	  r->len = 0;
+	  return true;
+	}
+    }
+  *used = len;
+  r->hash = hash;
+  r->len += len;
+  return false;
+}
+
+// reader helpers
+
+// get a job with an input buffer, or NULL if out of memory
+static struct job *
+new_job (struct pipeline *pl, long seq)
+{
+  struct job *job = get_job (pl, seq);
+  if (job == NULL)
+    {
+      return NULL;
+    }
+  job->in = get_buffer (&pl->in_pool);
+  if (job->in == NULL)
+    {
+      return_job (pl, job);
+      return NULL;
+    }
+  job->dict = NULL;
+  job->more = 0;
+  job->level = pl->level;
+  job->read_at = 0;
+  return job;
+}
+
+// fill the input buffer of JOB after the bytes carried into it, and with
+// params->rsyncable cut it where its content says to, carrying the rest
+// into the next; return the length of the block, 0 at end of input or -1
+// on error
+static ssize_t
+read_block (struct pipeline *pl, struct job *job)
+{
+  struct buffer *in = job->in;
+  size_t carry = pl->carry;
+  unsigned char *data = in->data + carry;
+  double start = now ();
+  ssize_t len = pl->params->read (pl->params->opaque,
+				  pl->params->borrow ? &in->data : &data,
+				  pl->block_size - carry);
+  double end = now ();
+  size_t got = len < 0 ? 0 : (size_t) len;
+  in->len = carry + got;
+  pl->carry = 0;
+  job->read_at = end;
+  pl->stats.read_busy += end - start;
+  pl->stats.bytes_in += got;
+  DTRACE_PROBE2 (gzip, job__read, job->seq, got);
+  if (pl->params->trace != NULL)
+    {
+      pipeline_trace_span (pl->params->trace, pl->trace_run,
+			   PIPELINE_TRACE_READER, "read", start, end,
+			   job->seq, got);
+      if (in->len != 0)
+	{
+	  pipeline_trace_flow (pl->params->trace, pl->trace_run,
+			       PIPELINE_TRACE_READER, 's', (start + end) / 2,
+			       job->seq);
+	}
+    }
+  if (len < 0)
+    {
+      return len;
+    }
+
+  // a short read ends the block as it is: at end of input, or, with
+  // params->flush, when input stalls and what came must go out now
+  if (pl->rsyncable && in->len == pl->block_size)
+    {
+      struct rsync_roll roll;
+      size_t used;
+      rsync_roll_init (&roll, pl->block_size);
+      rsync_roll_cut (&roll, in->data, in->len, &used);
+      pl->carry = in->len - used;
+      in->len = used;
+    }
+  return in->len;
+}
+
+// start JOB with the bytes carried over from PREV
+static void
+carry_block (struct pipeline *pl, struct job *job, struct job *prev)
+{
+  if (pl->carry != 0)
+    {
+      memcpy (job->in->data, prev->in->data + prev->in->len, pl->carry);
+    }
+}
+
+// prime JOB with the last DICTIONARY_SIZE bytes of the block before it
+static void
+set_dictionary (struct pipeline *pl, struct job *job, struct job *prev)
+{
+  unsigned char *tail;
+
+  if (pl->params->independent || prev->in->len < DICTIONARY_SIZE)
+    {
+      return;
+    }
+  job->dict = get_buffer (&pl->dict_pool);
+  if (job->dict == NULL)
+    {
+      return;
+    }
+  tail = prev->in->data + prev->in->len - DICTIONARY_SIZE;
+  if (pl->params->borrow)
+    {
+      // the caller's memory outlives the pipeline, so no copy is needed
+      job->dict->data = tail;
+    }
+  else
+    {
+      memcpy (job->dict->data, tail, DICTIONARY_SIZE);
+    }
+  job->dict->len = DICTIONARY_SIZE;
+}
+
+// hand JOB to the compress threads serving LIST
+static void
+queue_job (struct job_list *list, struct job *job)
+{
+  struct pipeline *pl = job->pl;
+
+  lock (&pl->busy);
+  pl->stats.queue_depth[depth_bucket (pl->busy.value)]++;
+  pl->stats.levels[job->level]++;
+  if (pl->busy.value < pl->params->threads)
+    {
+      pl->idle++;
+    }
+  DTRACE_PROBE2 (gzip, job__queue, job->seq, pl->busy.value);
+  pl->busy.value++;
+  unlock (&pl->busy);
+
+  lock (&list->lock);
+  if (list->head == NULL)
+    {
+      list->head = job;
+      list->tail = job;
+    }
+  else
+    {
+      list->tail->next = job;
+      list->tail = job;
+    }
+  broadcast (&list->lock);
+  unlock (&list->lock);
+}
+
+// with params->adaptive, step the level of the blocks to come down if
+// over the last few blocks the reader spent much of its time waiting for
+// the compress threads to free a buffer, or up towards params->level if
+// it never waited and the threads were mostly idle
+static void
+adapt_level (struct pipeline *pl)
+{
+  long window = pl->params->threads * 2 < 8 ? 8 : pl->params->threads * 2;
+
+  if (!pl->params->adaptive || ++pl->window < window)
+    {
+      return;
+    }
+
+  double read = pl->stats.read_busy - pl->window_read;
+  double wait = pl->stats.read_wait - pl->window_wait;
+  double blocked = read + wait > 0 ? wait / (read + wait) : 0;
+  if (blocked > 0.1 && pl->level > 1)
+    {
+      pl->level--;
+    }
+  else if (blocked < 0.01 && pl->idle * 2 > pl->window
+	   && pl->level < pl->params->level)
+    {
+      pl->level++;
+    }
+  pl->window = 0;
+  pl->idle = 0;
+  pl->window_read = pl->stats.read_busy;
+  pl->window_wait = pl->stats.read_wait;
+}
+
+// queue JOB, which is not the last, after priming NEXT with its tail
+static void
+queue_block (struct pipeline *pl, struct job *job, struct job *next)
+{
+  job->more = 1;
+  set_dictionary (pl, next, job);
+  queue_job (&pl->compress_jobs, job);
+  adapt_level (pl);
+}
+
+// start the thread of compressor C; return 0, or -1 if it could not be
+static int
+start_compressor (struct compressor *c)
+{
+  lock (&c->list->lock);
+  c->list->threads++;
+  c->retired = false;
+  unlock (&c->list->lock);
+  if (pthread_create (&c->thread, NULL, compress_thread, c) != 0)
+    {
+      lock (&c->list->lock);
+      c->list->threads--;
+      unlock (&c->list->lock);
+      return -1;
+    }
+  c->started = true;
+  return 0;
+}
+
+// if more blocks are queued than there are compress threads to take
+// them, launch another in the first of the *COUNT slots of COMPRESSORS
+// whose thread has retired, or else in a new slot if the limit allows
+static void
+add_compressor (struct pipeline *pl, struct compressor *compressors,
+		int *count)
+{
+  struct job_list *list = &pl->compress_jobs;
+  struct compressor *c = NULL;
+
+  lock (&pl->busy);
+  long busy = pl->busy.value;
+  unlock (&pl->busy);
+
+  lock (&list->lock);
+  bool wanted = busy > list->threads;
+  for (int i = 0; wanted && c == NULL && i < *count; i++)
+    {
+      if (compressors[i].retired)
+	{
+	  c = compressors + i;
+	}
+    }
+  unlock (&list->lock);
+  if (!wanted)
+    {
+      return;
+    }
+
+  if (c != NULL)
+    {
+      // reap the retired thread; the slot keeps its figures
+      pthread_join (c->thread, NULL);
+      c->started = false;
+      pl->stats.retired++;
+    }
+  else if (*count < pl->params->threads)
+    {
+      c = compressors + *count;
+      init_compressor (c, list, *count, COMPRESS_IDLE);
+      if (pl->params->trace != NULL)
+	{
+	  pipeline_trace_thread (pl->params->trace, pl->trace_run, *count);
+	}
+      ++*count;
+    }
+  else
+    {
+      return;
+    }
+  start_compressor (c);
+}
+
+// the CPU bandwidth limit of the cgroup (v2) at PATH under
+// /sys/fs/cgroup and of its ancestors, rounded up to whole CPUs, or 0 if
+// there is none
+static int
+cgroup_cpus (char *path)
+{
+  int cpus = 0;
+
+  for (;;)
+    {
+      char file[CGROUP_PATH_MAX + 32];
+      char quota[32];
+      long long period;
+      FILE *f;
+
+      snprintf (file, sizeof file, "/sys/fs/cgroup%s/cpu.max", path);
+      f = fopen (file, "r");
+      if (f != NULL)
+	{
+	  if (fscanf (f, "%31s %lld", quota, &period) == 2
+	      && strcmp (quota, "max") != 0 && period > 0)
+	    {
+	      long long limit = (atoll (quota) + period - 1) / period;
+	      if (limit < 1)
+		{
+		  limit = 1;
+		}
+	      if (cpus == 0 || limit < cpus)
+		{
+		  cpus = limit < INT_MAX ? (int) limit : INT_MAX;
+		}
+	    }
+	  fclose (f);
+	}
+
+      char *slash = strrchr (path, '/');
+      if (slash == NULL || path[0] == '\0' || path[1] == '\0')
+	{
+	  return cpus;
+	}
+      *slash = '\0';
+    }
+}
+
+/* Return the number of CPUs this process can keep busy: those in its
+ * affinity mask, but no more than the CPU bandwidth limit (cpu.max) of
+ * its cgroup allows.
+ */
+int
+pipeline_cpus (void)
+{
+  int cpus = 0;
+  char line[CGROUP_PATH_MAX];
+  FILE *f;
+
+#ifdef CPU_COUNT
+  cpu_set_t set;
+  if (sched_getaffinity (0, sizeof set, &set) == 0)
+    {
+      cpus = CPU_COUNT (&set);
+    }
+#endif
+  if (cpus <= 0)
+    {
+      long online = sysconf (_SC_NPROCESSORS_ONLN);
+      cpus = online > 0 && online < INT_MAX ? (int) online : 1;
+    }
+
+  // the unified hierarchy is the line "0::PATH"
+  f = fopen ("/proc/self/cgroup", "r");
+  if (f == NULL)
+    {
+      return cpus;
+    }
+  while (fgets (line, sizeof line, f) != NULL)
+    {
+      if (strncmp (line, "0::", 3) == 0)
+	{
+	  line[strcspn (line, "\n")] = '\0';
+	  int limit = cgroup_cpus (line + 3);
+	  if (limit > 0 && limit < cpus)
+	    {
+	      cpus = limit;
+	    }
+	  break;
+	}
+    }
+  fclose (f);
+  return cpus;
+}
+
+// give back JOB, if any, and free the pipeline of a run that failed to
+// start; return ERR
+static int
+abandon_pipeline (struct pipeline *pl, struct job *job, int err)
+{
+  if (job != NULL)
+    {
+      return_buffer (job->in);
+      return_job (pl, job);
+    }
+  free_pipeline (pl);
+  return err;
+}
+
+/* Compress the input described by PARAMS into a single gzip member.
+ * The calling thread is the reader; it launches the write thread and up
+ * to PARAMS->threads compress threads.  Return Z_OK, Z_ERRNO if the read
+ * or write callback failed, or Z_MEM_ERROR.
+ */
+int
+parallel_compress (struct pipeline_params const *params)
+{
+  struct pipeline pipeline;
+  struct pipeline *pl = &pipeline;
+  double start = now ();
+
+  init_pipeline (pl, params);
+  if (params->trace != NULL)
+    {
+      pl->trace_run = pipeline_trace_begin (params->trace);
+    }
+
+  // init compression threads array
+  struct compressor *compressors = malloc (sizeof (struct compressor)
+					   * params->threads);
+  struct job *job = new_job (pl, 0);
+  if (compressors == NULL || job == NULL)
+    {
+      free (compressors);
+      return abandon_pipeline (pl, job, Z_MEM_ERROR);
+    }
+
+  // launch the write thread and the first compress thread
+  pthread_t write_thread_t;
+  int threads_compressing = 0;
+  if (pthread_create (&write_thread_t, NULL, write_thread, pl) != 0)
+    {
+      free (compressors);
+      return abandon_pipeline (pl, job, Z_ERRNO);
+    }
+  init_compressor (compressors, &pl->compress_jobs, 0, COMPRESS_IDLE);
+  if (params->trace != NULL)
+    {
+      pipeline_trace_thread (params->trace, pl->trace_run, 0);
+    }
+  if (start_compressor (compressors) != 0)
+    {
+      lock (&pl->write_jobs.lock);
+      pl->write_jobs.lock.value = 1;
+      broadcast (&pl->write_jobs.lock);
+      unlock (&pl->write_jobs.lock);
+      pthread_join (write_thread_t, NULL);
+      free (compressors);
+      return abandon_pipeline (pl, job, Z_ERRNO);
+    }
+  threads_compressing++;
+
+  // start reading; each block is queued once the next read tells us
+  // whether it is the last one, or, with params->flush, at once
+  long seq = 0;
+  struct job *last_job = NULL;
+  for (;;)
+    {
+      ssize_t len = read_block (pl, job);
+      if (len < 0)
+	{
+	  set_status (pl, Z_ERRNO);
+	  len = 0;
+	}
+      if (len == 0 && last_job != NULL)
+	{
+	  break;
+	}
+
+      if (last_job != NULL)
+	{
+	  queue_block (pl, last_job, job);
+	  add_compressor (pl, compressors, &threads_compressing);
+	}
+
+      last_job = job;
+      seq++;
+      if (len == 0)
+	{
+	  // end of input: this block, empty, is the last
+	  break;
+	}
+
+      // get a job; this waits while the compressors are behind
+      double wait_start = now ();
+      job = new_job (pl, seq);
+      double wait_end = now ();
+      pl->stats.read_wait += wait_end - wait_start;
+      if (params->trace != NULL)
+	{
+	  pipeline_trace_span (params->trace, pl->trace_run,
+			       PIPELINE_TRACE_READER, "wait for buffer",
+			       wait_start, wait_end, seq, 0);
+	}
+      if (job == NULL)
+	{
+	  set_status (pl, Z_MEM_ERROR);
+	  break;
+	}
+      carry_block (pl, job, last_job);
+
+      if (params->flush)
+	{
+	  queue_block (pl, last_job, job);
+	  add_compressor (pl, compressors, &threads_compressing);
+	  last_job = NULL;
+	}
+    }
+
+  // the last job finishes the deflate stream
+  last_job->more = 0;
+  queue_job (&pl->compress_jobs, last_job);
+
+  // call the threads home
+  pthread_join (write_thread_t, NULL);
+
+  lock (&pl->compress_jobs.lock);
+  pl->compress_jobs.lock.value = 1;
+  broadcast (&pl->compress_jobs.lock);
+  unlock (&pl->compress_jobs.lock);
+
+  for (int i = 0; i < threads_compressing; i++)
     {
-      pthread_join (compression_threads_t[i], NULL);
+      if (compressors[i].started)
+	{
+	  pthread_join (compressors[i].thread, NULL);
+	  pl->stats.retired += compressors[i].retired;
+	}
+      if (i < PIPELINE_STATS_THREADS)
+	{
+	  pl->stats.thread[i] = compressors[i].stats;
+	}
     }
+  free (compressors);
 
   // return remaining resources
-  return_buffer (last_job->in);
-  return_job (last_job);
-  if (last_job->dict != NULL)
+  if (job != NULL && job != last_job)
+    {
+      return_buffer (job->in);
+      return_job (pl, job);
+    }
+  free_pipeline (pl);
+
+  if (params->stats != NULL)
+    {
+      pl->stats.wall = now () - start;
+      pl->stats.threads = threads_compressing;
+      *params->stats = pl->stats;
+    }
+  return pl->status;
+}
+
+// Streaming interface
+
+struct worker_pool
+{
+  struct job_list jobs;
+  struct compressor *threads;
+  int nthreads;
+};
+
+/* Start THREADS compress threads to be shared by any number of streams.
+ * Return NULL if not even one thread could be started.
+ */
+struct worker_pool *
+worker_pool_create (int threads)
+{
+  struct worker_pool *pool = malloc (sizeof (struct worker_pool));
+  if (pool == NULL)
+    {
+      return NULL;
+    }
+  pool->threads = malloc (sizeof (struct compressor) * threads);
+  if (pool->threads == NULL)
+    {
+      free (pool);
+      return NULL;
+    }
+  init_list (&pool->jobs);
+  pool->nthreads = 0;
+  while (pool->nthreads < threads)
+    {
+      struct compressor *c = pool->threads + pool->nthreads;
+      init_compressor (c, &pool->jobs, pool->nthreads, 0);
+      if (start_compressor (c) != 0)
+	{
+	  break;
+	}
+      pool->nthreads++;
+    }
+  if (pool->nthreads == 0)
+    {
+      worker_pool_destroy (pool);
+      return NULL;
+    }
+  return pool;
+}
+
+// finish the queued jobs and stop the threads; close all streams first
+void
+worker_pool_destroy (struct worker_pool *pool)
+{
+  lock (&pool->jobs.lock);
+  pool->jobs.lock.value = 1;
+  broadcast (&pool->jobs.lock);
+  unlock (&pool->jobs.lock);
+  for (int i = 0; i < pool->nthreads; i++)
     {
-      return_buffer (last_job->dict);
+      pthread_join (pool->threads[i].thread, NULL);
     }
+  free (pool->threads);
+  free (pool);
+}
+
+enum stream_state
+{
+  STREAM_HEADER,
+  STREAM_BODY,
+  STREAM_TRAILER,
+  STREAM_DONE
+};
 
-  return Z_OK;
+/* The reader and writer stages of the pipeline, driven by the caller
+ * instead of by threads.  Only the compress stage runs in the pool.
+ */
+struct gzstream
+{
+  struct pipeline pl;
+  struct pipeline_params params;
+  struct worker_pool *pool;
+  int poll_fd;			// what the caller waits on
+  long limit;			// jobs allowed between push and pull
+  long seq;			// sequence number of the next new job
+  long next;			// sequence number of the next job to pull
+  struct job *fill;		// job whose input buffer is being filled
+  struct job *full;		// full job held back until more input arrives
+  bool finished;		// gzstream_finish has been called
+
+  enum stream_state state;
+  unsigned char *header;
+  struct gzip_trailer trailer;
+  struct job *drain;		// job whose output is being pulled
+  unsigned char const *pending;	// what is left of the current piece
+  size_t pending_len;
+  unsigned long check;
+  size_t ulen;
+};
+
+static bool
+open_event (struct gzstream *s)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  s->poll_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  s->pl.event_fd = s->poll_fd;
+  return s->poll_fd >= 0;
+#else
+  int fds[2];
+  if (pipe (fds) != 0)
+    {
+      return false;
+    }
+  for (int i = 0; i < 2; i++)
+    {
+      fcntl (fds[i], F_SETFL, fcntl (fds[i], F_GETFL) | O_NONBLOCK);
+      fcntl (fds[i], F_SETFD, FD_CLOEXEC);
+    }
+  s->poll_fd = fds[0];
+  s->pl.event_fd = fds[1];
+  return true;
+#endif
+}
+
+static void
+close_event (struct gzstream *s)
+{
+  close (s->poll_fd);
+  if (s->pl.event_fd != s->poll_fd)
+    {
+      close (s->pl.event_fd);
+    }
+}
+
+/* Open a stream that compresses pushed data into a single gzip member,
+ * using the compress threads of POOL.  The read, write, borrow and
+ * threads members of PARAMS are ignored.  Return NULL with errno set on
+ * failure.
+ */
+struct gzstream *
+gzstream_open (struct pipeline_params const *params, struct worker_pool *pool)
+{
+  struct gzstream *s = malloc (sizeof (struct gzstream));
+  if (s == NULL)
+    {
+      return NULL;
+    }
+  size_t name_len = params->name != NULL ? strlen (params->name) + 1 : 0;
+  struct gzip_header header =
+    create_header (params->name, params->mtime, params->level);
+  s->header = malloc (sizeof (header) - 2 + name_len);
+  if (s->header == NULL)
+    {
+      free (s);
+      return NULL;
+    }
+  memcpy (s->header, &header, sizeof (header) - 2);
+  if (name_len != 0)
+    {
+      memcpy (s->header + sizeof (header) - 2, params->name, name_len);
+    }
+
+  s->params = *params;
+  s->params.threads = pool->nthreads;
+  s->params.borrow = false;
+  s->params.name = NULL;
+  s->params.stats = NULL;
+  s->params.trace = NULL;
+  s->pool = pool;
+
+  struct pipeline *pl = &s->pl;
+  init_pipeline (pl, &s->params);
+  if (!open_event (s))
+    {
+      free (s->header);
+      free (s);
+      return NULL;
+    }
+
+  // as many jobs as there are input buffers, so get_buffer never waits
+  s->limit = pl->in_pool.num_buffers;
+  s->seq = 0;
+  s->next = 0;
+  s->fill = NULL;
+  s->full = NULL;
+  s->finished = false;
+
+  s->state = STREAM_HEADER;
+  s->drain = NULL;
+  s->pending = s->header;
+  s->pending_len = sizeof (header) - 2 + name_len;
+  s->check = crc32z (0L, Z_NULL, 0);
+  s->ulen = 0;
+  return s;
+}
+
+/* Return a descriptor that becomes readable whenever a block of the
+ * stream has been compressed, for use with poll or epoll.  Each call to
+ * gzstream_pull resets it.
+ */
+int
+gzstream_fd (struct gzstream const *s)
+{
+  return s->poll_fd;
+}
+
+// return Z_OK, or the error of a block that failed to compress, with
+// errno set to match
+static int
+stream_status (struct gzstream *s)
+{
+  int status = get_status (&s->pl);
+  if (status != Z_OK)
+    {
+      errno = status == Z_MEM_ERROR ? ENOMEM : EIO;
+    }
+  return status;
+}
+
+/* Copy up to LEN bytes of input into the stream.  Return the number of
+ * bytes taken, or -1 with errno EAGAIN if the stream has as many blocks
+ * in flight as it may have: pull some output before pushing again.
+ */
+ssize_t
+gzstream_push (struct gzstream *s, void const *data, size_t len)
+{
+  struct pipeline *pl = &s->pl;
+  unsigned char const *next = data;
+  size_t done = 0;
+
+  if (s->finished)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  if (stream_status (s) != Z_OK)
+    {
+      return -1;
+    }
+  if (len > SSIZE_MAX)
+    {
+      len = SSIZE_MAX;
+    }
+  while (done < len)
+    {
+      if (s->fill == NULL)
+	{
+	  if (s->seq - s->next >= s->limit)
+	    {
+	      errno = EAGAIN;
+	      break;
+	    }
+	  s->fill = new_job (pl, s->seq);
+	  if (s->fill == NULL)
+	    {
+	      errno = ENOMEM;
+	      break;
+	    }
+	  s->seq++;
+	}
+      if (s->full != NULL)
+	{
+	  // more input follows, so the held back block is not the last
+	  s->full->more = 1;
+	  set_dictionary (pl, s->fill, s->full);
+	  queue_job (&s->pool->jobs, s->full);
+	  s->full = NULL;
+	}
+
+      struct buffer *in = s->fill->in;
+      size_t n = in->size - in->len;
+      if (n > len - done)
+	{
+	  n = len - done;
+	}
+      memcpy (in->data + in->len, next + done, n);
+      in->len += n;
+      done += n;
+      if (in->len == in->size)
+	{
+	  s->full = s->fill;
+	  s->fill = NULL;
+	}
+    }
+  return done != 0 || len == 0 ? (ssize_t) done : -1;
+}
+
+/* Mark the end of the input.  Return 0, or -1 with errno set.  */
+int
+gzstream_finish (struct gzstream *s)
+{
+  struct job *last;
+
+  if (stream_status (s) != Z_OK)
+    {
+      return -1;
+    }
+  if (s->finished)
+    {
+      return 0;
+    }
+  // only one of these can be set; if neither is, the input was empty
+  last = s->full != NULL ? s->full : s->fill;
+  if (last == NULL)
+    {
+      last = new_job (&s->pl, s->seq);
+      if (last == NULL)
+	{
+	  errno = ENOMEM;
+	  return -1;
+	}
+      s->seq++;
+    }
+  s->full = NULL;
+  s->fill = NULL;
+  last->more = 0;
+  queue_job (&s->pool->jobs, last);
+  s->finished = true;
+  return 0;
+}
+
+// take the next job in sequence off the write list, if it is complete
+static struct job *
+take_job (struct gzstream *s)
+{
+  struct pipeline *pl = &s->pl;
+  struct job *job = NULL;
+
+  lock (&pl->write_jobs.lock);
+  struct job *head = pl->write_jobs.head;
+  if (head != NULL && head->seq == s->next)
+    {
+      lock (&head->check_done);
+      if (head->check_done.value >= 0)
+	{
+	  job = head;
+	}
+      unlock (&head->check_done);
+    }
+  if (job != NULL)
+    {
+      pl->write_jobs.head = job->next;
+      if (job->next == NULL)
+	{
+	  pl->write_jobs.tail = NULL;
+	}
+    }
+  unlock (&pl->write_jobs.lock);
+
+  if (job != NULL)
+    {
+      s->check = crc32_comb (s->check, job->check, job->check_done.value);
+      s->ulen += job->check_done.value;
+      s->next++;
+    }
+  return job;
+}
+
+/* Copy up to SIZE bytes of compressed output into BUF.  Return the
+ * number of bytes copied, 0 once the whole member has been pulled, or -1
+ * with errno EAGAIN if no output is ready yet, or with errno ENOMEM or
+ * EIO once a block has failed to compress.
+ */
+ssize_t
+gzstream_pull (struct gzstream *s, void *buf, size_t size)
+{
+  struct pipeline *pl = &s->pl;
+  unsigned char *out = buf;
+  size_t done = 0;
+  bool stalled = false;
+  bool failed = false;
+
+  // clear first, so a job finishing from here on signals again
+  clear_event (s->poll_fd);
+  if (s->state != STREAM_DONE && stream_status (s) != Z_OK)
+    {
+      return -1;
+    }
+  if (size > SSIZE_MAX)
+    {
+      size = SSIZE_MAX;
+    }
+  while (done < size && !stalled)
+    {
+      if (s->pending_len != 0)
+	{
+	  size_t n = s->pending_len < size - done ? s->pending_len
+	    : size - done;
+	  memcpy (out + done, s->pending, n);
+	  s->pending += n;
+	  s->pending_len -= n;
+	  done += n;
+	  continue;
+	}
+
+      // the current piece is used up; move on to the next one
+      switch (s->state)
+	{
+	case STREAM_HEADER:
+	  s->state = STREAM_BODY;
+	  break;
+	case STREAM_BODY:
+	  if (s->drain != NULL)
+	    {
+	      int more = s->drain->more;
+	      return_buffer (s->drain->out);
+	      return_job (pl, s->drain);
+	      s->drain = NULL;
+	      if (!more)
+		{
+		  s->trailer = create_trailer (s->check, s->ulen);
+		  s->pending = (unsigned char const *) &s->trailer;
+		  s->pending_len = sizeof (s->trailer);
+		  s->state = STREAM_TRAILER;
+		  break;
+		}
+	    }
+	  s->drain = take_job (s);
+	  if (s->drain == NULL)
+	    {
+	      stalled = true;
+	      break;
+	    }
+	  // a failed block is set before its job is written, and leaves
+	  // a hole in the member, so nothing more may go out
+	  if (get_status (pl) != Z_OK)
+	    {
+	      return_buffer (s->drain->out);
+	      return_job (pl, s->drain);
+	      s->drain = NULL;
+	      stalled = failed = true;
+	      break;
+	    }
+	  s->pending = s->drain->out->data;
+	  s->pending_len = s->drain->out->len;
+	  break;
+	case STREAM_TRAILER:
+	  s->state = STREAM_DONE;
+	  stalled = true;
+	  break;
+	case STREAM_DONE:
+	  stalled = true;
+	  break;
+	}
+    }
+
+  if (failed && done == 0)
+    {
+      stream_status (s);
+      return -1;
+    }
+  if (done == 0 && size != 0 && s->state != STREAM_DONE)
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+  return done;
+}
+
+// give back a job that never reached the compress stage
+static void
+drop_job (struct pipeline *pl, struct job *job)
+{
+  if (job->dict != NULL)
+    {
+      return_buffer (job->dict);
+    }
+  return_buffer (job->in);
+  return_job (pl, job);
+}
+
+/* Free the stream.  This waits for any of its blocks still being
+ * compressed, but need not be preceded by gzstream_finish.
+ */
+void
+gzstream_close (struct gzstream *s)
+{
+  struct pipeline *pl = &s->pl;
+  struct job *job;
+
+  lock (&pl->busy);
+  while (pl->busy.value > 0)
+    {
+      wait_lock (&pl->busy);
+    }
+  unlock (&pl->busy);
+
+  if (s->fill != NULL)
+    {
+      drop_job (pl, s->fill);
+    }
+  if (s->full != NULL)
+    {
+      drop_job (pl, s->full);
+    }
+  if (s->drain != NULL)
+    {
+      return_buffer (s->drain->out);
+      return_job (pl, s->drain);
+    }
+  while ((job = pl->write_jobs.head) != NULL)
+    {
+      pl->write_jobs.head = job->next;
+      return_buffer (job->out);
+      return_job (pl, job);
+    }
+  free_pipeline (pl);
+  close_event (s);
+  free (s->header);
+  free (s);
+}
+
+// Parallel decompression of concatenated members
+
+// most output of a member that a decode thread holds in memory; larger
+// members are decoded by the caller straight to the output
+#define MEMBER_BUFFER_MAX (32 << 20)
+
+// most output the decode threads hold in memory at once, over all the
+// members waiting to be written, whatever the number of threads; when
+// it is reached they wait, and the caller decodes the members that no
+// thread took as it comes to them
+#define MEMBER_HELD_MAX (64 << 20)
+
+enum member_state
+{
+  MEMBER_QUEUED,
+  MEMBER_RUNNING,
+  MEMBER_DONE
+};
+
+// a member, or what looks like the header of one
+struct member
+{
+  size_t header;		// offset of the header in the input
+  size_t data;			// offset of the deflate data
+  uint32_t size;		// ISIZE of the trailer before the next header
+  bool sized;			// SIZE is known
+  enum member_state state;
+  int ret;			// Z_OK once decoded and checked
+  size_t end;			// offset just past the trailer
+  unsigned char *out;		// output held by a decode thread
+  size_t len;
+  size_t held;			// its share of the decoder's held, under lock
+};
+
+struct member_decoder
+{
+  struct member_params const *params;
+  struct deflate_engine const *engine;
+  unsigned char const *in;
+  size_t len;
+  struct lock lock;		// value is set to stop the decode threads
+  struct member *ring;		// members not yet written, in input order
+  int slots;
+  int head;			// index in RING of the first
+  int count;
+  size_t scan;			// where to look for the next header
+  bool scanned;			// the input has no more headers
+  size_t held;			// output the decode threads may hold
+  double busy;			// decoding, over all threads
+};
+
+// what the write callbacks of decode_member work with
+struct member_output
+{
+  struct member_decoder *d;
+  struct member *m;
+  bool direct;			// write to params->write, not to m->out
+  bool write_failed;
+  unsigned long crc;
+  size_t total;
+  double write_busy;
+};
+
+static struct member *
+ring_member (struct member_decoder *d, int i)
+{
+  return &d->ring[(d->head + i) % d->slots];
+}
+
+// memory for the held output of a member, mapped where possible, so
+// that freeing it gives it back to the system and not to the malloc
+// arena of the thread that decoded it, which would keep it past the
+// bound of MEMBER_HELD_MAX
+static unsigned char *
+alloc_held (size_t size)
+{
+#if defined HAVE_SYS_MMAN_H && defined MAP_ANONYMOUS
+  void *p = mmap (NULL, size ? size : 1, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+#else
+  return malloc (size ? size : 1);
+#endif
+}
+
+static void
+free_held (unsigned char *p, size_t size)
+{
+  if (p == NULL)
+    {
+      return;
+    }
+#if defined HAVE_SYS_MMAN_H && defined MAP_ANONYMOUS
+  munmap (p, size ? size : 1);
+#else
+  free (p);
+#endif
+}
+
+static uint32_t
+get_le32 (unsigned char const *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static int
+member_write (void *opaque, unsigned char const *data, size_t len)
+{
+  struct member_output *o = opaque;
+
+  o->crc = crc32_z (o->crc, data, len);
+  o->total += len;
+  if (o->direct && o->d->params->write != NULL)
+    {
+      double start = now ();
+      int ret = o->d->params->write (o->d->params->opaque, data, len);
+      o->write_busy += now () - start;
+      if (ret != 0)
+	{
+	  o->write_failed = true;
+	  return -1;
+	}
+    }
+  else if (o->m->out != NULL)
+    {
+      // more than the trailer promised: not the member it seemed to be
+      if (o->m->size - o->m->len < len)
+	{
+	  return -1;
+	}
+      memcpy (o->m->out + o->m->len, data, len);
+      o->m->len += len;
+    }
+  return 0;
+}
+
+// decode M and check its trailer, writing the output straight out if
+// DIRECT and otherwise holding it in M->out, unless there is no write
+// callback to give it to; return the time spent writing
+static double
+decode_member (struct member_decoder *d, struct member *m, bool direct)
+{
+  struct member_output o = { d, m, direct, false, 0, 0, 0 };
+  size_t used;
+
+  m->len = 0;
+  if (!direct && d->params->write != NULL)
+    {
+      m->out = alloc_held (m->size);
+      if (m->out == NULL)
+	{
+	  m->ret = Z_MEM_ERROR;
+	  return 0;
+	}
+    }
+  o.crc = crc32 (0L, Z_NULL, 0);
+  m->ret = d->engine->inflate (d->in + m->data, d->len - m->data, &used,
+			       member_write, &o);
+  if (o.write_failed)
+    {
+      m->ret = Z_ERRNO;
+    }
+  else if (m->ret == Z_OK)
+    {
+      unsigned char const *trailer = d->in + m->data + used;
+      m->ret = Z_DATA_ERROR;
+      if (8 <= d->len - m->data - used && get_le32 (trailer) == o.crc
+	  && get_le32 (trailer + 4) == (uint32_t) o.total)
+	{
+	  m->ret = Z_OK;
+	  m->end = m->data + used + 8;
+	}
+    }
+  if (m->out == NULL)
+    {
+      m->len = o.total;
+    }
+  return o.write_busy;
+}
+
+// look for the next header that could start a member, and if there is
+// one add it to the ring, recording the ISIZE of the trailer before it
+// as the size of the member before; return false if there is none
+static bool
+scan_member (struct member_decoder *d)
+{
+  unsigned char const *in = d->in;
+  size_t pos = d->scan;
+
+  if (d->scanned)
+    {
+      return false;
+    }
+
+  // a member takes at least a 10 byte header, 2 bytes of deflate data
+  // and an 8 byte trailer
+  while (pos + 20 <= d->len)
+    {
+      unsigned char const *p = memchr (in + pos, 0x1f, d->len - pos - 19);
+      if (p == NULL)
+	{
+	  break;
+	}
+      pos = p - in;
+
+      // a header CRC is left to the caller to check, and the OS byte
+      // rules out most false matches in deflate data
+      size_t header = 0;
+      if (p[1] == 0x8b && !(p[3] & 2) && (p[9] <= 13 || p[9] == 255))
+	{
+	  header = gzip_header_length (p, d->len - pos);
+	}
+      if (header != 0)
+	{
+	  lock (&d->lock);
+	  struct member *prev = d->count ? ring_member (d, d->count - 1)
+	    : NULL;
+	  if (prev != NULL && !prev->sized)
+	    {
+	      prev->size = get_le32 (p - 4);
+	      prev->sized = true;
+	    }
+	  struct member *m = ring_member (d, d->count++);
+	  m->header = pos;
+	  m->data = pos + header;
+	  m->sized = false;
+	  m->state = MEMBER_QUEUED;
+	  m->out = NULL;
+	  m->held = 0;
+	  broadcast (&d->lock);
+	  unlock (&d->lock);
+	  d->scan = m->data + 10;
+	  return true;
+	}
+      pos++;
+    }
+
+  // the last member ends at the end of the input, if at all
+  lock (&d->lock);
+  if (d->count != 0)
+    {
+      struct member *last = ring_member (d, d->count - 1);
+      if (!last->sized && last->data + 10 <= d->len)
+	{
+	  last->size = get_le32 (in + d->len - 4);
+	  last->sized = true;
+	  broadcast (&d->lock);
+	}
+    }
+  unlock (&d->lock);
+  d->scanned = true;
+  return false;
+}
+
+static void *
+member_thread (void *arg)
+{
+  struct member_decoder *d = arg;
+
+  lock (&d->lock);
+  for (;;)
+    {
+      struct member *m = NULL;
+      for (int i = 0; i < d->count && m == NULL; i++)
+	{
+	  struct member *c = ring_member (d, i);
+	  if (c->state == MEMBER_QUEUED
+	      && (d->params->write == NULL
+		  || (c->sized && c->size <= MEMBER_BUFFER_MAX
+		      && d->held + c->size <= MEMBER_HELD_MAX)))
+	    {
+	      m = c;
+	    }
+	}
+      if (m == NULL)
+	{
+	  if (d->lock.value)
+	    {
+	      break;
+	    }
+	  wait_lock (&d->lock);
+	  continue;
+	}
+      m->state = MEMBER_RUNNING;
+      if (d->params->write != NULL)
+	{
+	  m->held = m->size;
+	  d->held += m->held;
+	}
+      unlock (&d->lock);
+      double start = now ();
+      decode_member (d, m, false);
+      double busy = now () - start;
+      lock (&d->lock);
+      d->busy += busy;
+      m->state = MEMBER_DONE;
+      broadcast (&d->lock);
+    }
+  unlock (&d->lock);
+  return NULL;
+}
+
+// free the output held for M, under the lock, and let the decode
+// threads take its share for other members
+static void
+release_member (struct member_decoder *d, struct member *m)
+{
+  free_held (m->out, m->size);
+  m->out = NULL;
+  if (m->held != 0)
+    {
+      d->held -= m->held;
+      m->held = 0;
+      broadcast (&d->lock);
+    }
+}
+
+// take the first member out of the ring, once no thread is decoding it
+static void
+drop_member (struct member_decoder *d)
+{
+  struct member *m = ring_member (d, 0);
+  while (m->state == MEMBER_RUNNING)
+    {
+      wait_lock (&d->lock);
+    }
+  release_member (d, m);
+  d->head = (d->head + 1) % d->slots;
+  d->count--;
+}
+
+/* Decode the members at IN.  The calling thread scans for headers and
+ * writes; the decode threads take the members the scan found, in order,
+ * and hold their output until it is written.  A member becomes certain
+ * when the one before it is found to end where it starts, and any
+ * headers found inside the one before are dropped.  When no header was
+ * found where a member ends, decoding stops there for the caller to go
+ * on with.  The caller decodes a member itself, straight to the output,
+ * when no thread has, when it is too big to hold, or when the ISIZE
+ * that sized its buffer belonged to a false header.  Beyond the input,
+ * the memory taken is the decode streams and at most MEMBER_HELD_MAX
+ * bytes of held output.
+ */
+int
+parallel_inflate (struct member_params const *params,
+		  unsigned char const *in, size_t len, size_t *used)
+{
+  struct member_decoder decoder;
+  struct member_decoder *d = &decoder;
+  double start = now ();
+  double busy = 0;		// decoding in this thread
+  double write_busy = 0;
+  uint64_t bytes_out = 0;
+  size_t pos = 0;
+  int ret = Z_OK;
+
+  d->params = params;
+  d->engine = params->engine != NULL ? params->engine : &zlib_engine;
+  d->in = in;
+  d->len = len;
+  init_lock (&d->lock);
+  d->slots = params->threads * 2 + 1;
+  d->ring = malloc (sizeof (struct member) * d->slots);
+  pthread_t *threads = malloc (sizeof (pthread_t) * params->threads);
+  int nthreads = 0;
+  if (d->ring == NULL || (threads == NULL && params->threads != 0))
+    {
+      free (d->ring);
+      free (threads);
+      return Z_MEM_ERROR;
+    }
+  d->head = 0;
+  d->count = 1;
+  d->scan = 10;
+  d->scanned = false;
+  d->held = 0;
+  d->busy = 0;
+
+  // the member whose header the caller has read
+  struct member *first = ring_member (d, 0);
+  first->header = 0;
+  first->data = 0;
+  first->sized = false;
+  first->state = MEMBER_QUEUED;
+  first->out = NULL;
+  first->held = 0;
+
+  for (;;)
+    {
+      // look ahead for as many members as there are slots, starting a
+      // decode thread for each member after the first up to the limit
+      while (d->count < d->slots && scan_member (d))
+	{
+	  if (nthreads < params->threads && nthreads < d->count - 1
+	      && pthread_create (threads + nthreads, NULL, member_thread,
+				 d) == 0)
+	    {
+	      nthreads++;
+	    }
+	}
+
+      lock (&d->lock);
+      struct member *m = ring_member (d, 0);
+      while (d->count != 0 && m->header < pos)
+	{
+	  drop_member (d);
+	  m = ring_member (d, 0);
+	}
+      if (d->count == 0 && !d->scanned)
+	{
+	  unlock (&d->lock);
+	  continue;
+	}
+      if (d->count == 0 || m->header != pos)
+	{
+	  unlock (&d->lock);
+	  break;
+	}
+      while (m->state == MEMBER_RUNNING)
+	{
+	  wait_lock (&d->lock);
+	}
+      bool direct = m->state == MEMBER_QUEUED || m->ret != Z_OK;
+      m->state = MEMBER_RUNNING;
+      if (direct)
+	{
+	  release_member (d, m);
+	}
+      unlock (&d->lock);
+
+      if (direct)
+	{
+	  double t = now ();
+	  double w = decode_member (d, m, true);
+	  busy += now () - t - w;
+	  write_busy += w;
+	}
+      else if (params->write != NULL)
+	{
+	  double t = now ();
+	  if (params->write (params->opaque, m->out, m->len) != 0)
+	    {
+	      m->ret = Z_ERRNO;
+	    }
+	  write_busy += now () - t;
+	}
+      lock (&d->lock);
+      m->state = MEMBER_DONE;
+      if (m->ret != Z_OK)
+	{
+	  ret = m->ret;
+	  unlock (&d->lock);
+	  break;
+	}
+      pos = m->end;
+      bytes_out += m->len;
+      drop_member (d);
+      unlock (&d->lock);
+
+      // headers before the end of this member are in its data
+      if (d->scan < pos)
+	{
+	  d->scan = pos;
+	}
+    }
+
+  lock (&d->lock);
+  d->lock.value = 1;
+  broadcast (&d->lock);
+  unlock (&d->lock);
+  for (int i = 0; i < nthreads; i++)
+    {
+      pthread_join (threads[i], NULL);
+    }
+  while (d->count != 0)
+    {
+      drop_member (d);
+    }
+  free (threads);
+  free (d->ring);
+
+  *used = pos;
+  if (params->stats != NULL)
+    {
+      memset (params->stats, 0, sizeof (*params->stats));
+      params->stats->wall = now () - start;
+      params->stats->bytes_in = pos;
+      params->stats->bytes_out = bytes_out;
+      params->stats->compress_busy = d->busy + busy;
+      params->stats->write_busy = write_busy;
+      params->stats->threads = nthreads;
+    }
+  return ret;
+}
+
+// Parallel checking of many files
+
+struct each_item
+{
+  enum member_state state;
+  bool ok;
+  struct pipeline_stats stats;
+};
+
+struct each_runner
+{
+  struct each_params const *params;
+  struct each_item *items;
+  size_t next;			// the first item no thread has taken
+  struct lock lock;
+};
+
+// run the item just taken, under the lock, which is held again on return
+static void
+run_item (struct each_runner *r, size_t i)
+{
+  struct each_item *item = &r->items[i];
+
+  item->state = MEMBER_RUNNING;
+  unlock (&r->lock);
+  memset (&item->stats, 0, sizeof (item->stats));
+  bool ok = r->params->work (r->params->opaque, i, &item->stats);
+  lock (&r->lock);
+  item->ok = ok;
+  item->state = MEMBER_DONE;
+  broadcast (&r->lock);
+}
+
+static void *
+each_thread (void *arg)
+{
+  struct each_runner *r = arg;
+
+  lock (&r->lock);
+  while (r->next < r->params->count)
+    {
+      run_item (r, r->next++);
+    }
+  unlock (&r->lock);
+  return NULL;
+}
+
+/* The threads take the items in order, as many ahead of the calling
+ * thread as they get to; the calling thread hands the results to DONE
+ * in order, and runs an item itself when it would otherwise wait for
+ * one that no thread has taken.
+ */
+void
+parallel_each (struct each_params const *params)
+{
+  struct each_runner runner;
+  struct each_runner *r = &runner;
+  size_t count = params->count;
+
+  r->params = params;
+  r->items = malloc (sizeof (struct each_item) * (count ? count : 1));
+  pthread_t *threads = malloc (sizeof (pthread_t) * params->threads);
+  int nthreads = 0;
+  if (r->items == NULL || (threads == NULL && params->threads != 0))
+    {
+      free (r->items);
+      free (threads);
+      for (size_t i = 0; i < count; i++)
+	{
+	  struct pipeline_stats stats = { 0 };
+	  bool ok = params->work (params->opaque, i, &stats);
+	  params->done (params->opaque, i, ok, &stats);
+	}
+      return;
+    }
+  for (size_t i = 0; i < count; i++)
+    {
+      r->items[i].state = MEMBER_QUEUED;
+    }
+  r->next = 0;
+  init_lock (&r->lock);
+  while (nthreads < params->threads && (size_t) nthreads + 1 < count
+	 && pthread_create (threads + nthreads, NULL, each_thread, r) == 0)
+    {
+      nthreads++;
+    }
+
+  for (size_t i = 0; i < count; i++)
+    {
+      struct each_item *item = &r->items[i];
+      lock (&r->lock);
+      while (item->state != MEMBER_DONE)
+	{
+	  if (item->state == MEMBER_QUEUED)
+	    {
+	      r->next++;
+	      run_item (r, i);
+	    }
+	  else
+	    {
+	      wait_lock (&r->lock);
+	    }
+	}
+      unlock (&r->lock);
+      params->done (params->opaque, i, item->ok, &item->stats);
+    }
+
+  for (int i = 0; i < nthreads; i++)
+    {
+      pthread_join (threads[i], NULL);
+    }
+  free (threads);
+  free (r->items);
 }
@@ -0,0 +1,383 @@
+/* parallel.h -- block-parallel compression pipeline and in-memory API
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/* Nothing in here depends on gzip's global state (ifd, ofd, inbuf, ...),
+ * so these modules can be linked into other programs such as the
+ * benchmark drivers.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// default size of the block handed to each compress job
+#define PARALLEL_BLOCK_SIZE 131072
+
+/* Compress threads whose work is reported one by one; the rest are only
+ * counted in the totals.
+ */
+#define PIPELINE_STATS_THREADS 64
+
+/* Buckets of the queue depth histograms: bucket 0 counts a depth of 0,
+ * bucket I a depth from 2^(I-1) to 2^I - 1, and the last bucket any
+ * greater depth as well.
+ */
+#define PIPELINE_DEPTHS 8
+
+/* The work of one compress thread.  */
+struct pipeline_thread_stats
+{
+  unsigned long jobs;		/* blocks compressed */
+  uint64_t bytes;		/* uncompressed bytes in those blocks */
+  double busy;			/* deflating and checksumming */
+  double wait;			/* waiting for a block to compress */
+  double cpu;			/* CPU time of the thread */
+};
+
+/* Where the time of one parallel_compress run went, in seconds.  Each
+ * stage is either busy with its own work or waiting on its neighbours;
+ * the compress figures are summed over all compress threads.  The serial
+ * compressor and decompressor fill in only the wall time, the busy
+ * times, in which compress stands for deflate or inflate and includes
+ * the CRC, the byte counts and the latency of each flush.
+ */
+struct pipeline_stats
+{
+  double wall;
+  double read_busy;		/* in the read callback */
+  double read_wait;		/* waiting for a free input buffer */
+  double compress_busy;		/* deflating and checksumming */
+  double compress_wait;		/* waiting for a block to compress */
+  double deflate;		/* part of compress_busy in deflate_buffer */
+  double crc;			/* part of compress_busy computing checks */
+  double write_busy;		/* in the write callback */
+  double write_wait;		/* waiting for the next block in order */
+  double check_wait;		/* waiting for a written block's check */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  unsigned long queue_depth[PIPELINE_DEPTHS];	/* blocks being compressed
+						   each time one is queued */
+  unsigned long write_depth[PIPELINE_DEPTHS];	/* blocks ready to write
+						   each time one is taken */
+  unsigned long levels[10];	/* blocks queued at each level */
+  unsigned long flushes;	/* blocks, or serial flushes, written */
+  double latency;		/* summed over those, from reading the first
+				   input in each to writing its end */
+  double latency_max;
+  int threads;			/* compress threads started */
+  unsigned long retired;	/* times a thread exited for lack of work */
+  struct pipeline_thread_stats thread[PIPELINE_STATS_THREADS];
+};
+
+        /* in stats.c */
+extern double pipeline_stats_now (void);
+extern void pipeline_stats_add (struct pipeline_stats *sum,
+                                struct pipeline_stats const *stats);
+extern void pipeline_stats_print (FILE *out, char const *what,
+                                  struct pipeline_stats const *stats,
+                                  bool json);
+
+/* Job timelines for chrome://tracing; see trace.c.  */
+struct pipeline_trace;
+
+/* Thread ids of the events of one run.  */
+enum
+{
+  PIPELINE_TRACE_READER = 1,
+  PIPELINE_TRACE_WRITER,
+  PIPELINE_TRACE_COMPRESS
+};
+
+        /* in trace.c */
+extern struct pipeline_trace *pipeline_trace_open (FILE *out);
+extern int pipeline_trace_close (struct pipeline_trace *trace);
+extern int pipeline_trace_begin (struct pipeline_trace *trace);
+extern void pipeline_trace_thread (struct pipeline_trace *trace, int run,
+                                   int index);
+extern void pipeline_trace_span (struct pipeline_trace *trace, int run,
+                                 int tid, char const *name, double start,
+                                 double end, long seq, size_t len);
+extern void pipeline_trace_flow (struct pipeline_trace *trace, int run,
+                                 int tid, char phase, double when, long seq);
+
+/* Description of one run of the parallel compressor.  The input is cut
+ * into blocks, the blocks are deflated concurrently and the write stage
+ * reassembles them, in order, into a single gzip member.
+ */
+struct pipeline_params
+{
+  int level;			/* compression level, 1..9, or 0 for the
+				   greedy level of the native compressor */
+  int threads;			/* maximum number of compress threads, > 0 */
+  size_t block_size;		/* input block size, 0 for the default */
+  bool independent;		/* do not prime blocks with a dictionary */
+  /* Cut the blocks where their content says to, as rsync_roll does,
+   * rather than every BLOCK_SIZE bytes, which is then the most a block
+   * holds.  An insertion or deletion in the input then changes only the
+   * blocks around it.  Ignored with BORROW.
+   */
+  bool rsyncable;
+  bool adaptive;		/* lower the level of blocks, down to 1, while
+				   the compress threads cannot keep up */
+  /* Queue each block as soon as it is read, instead of holding it back
+   * until the next read shows whether it is the last, so that a short
+   * block returned by READ when input stalls is written out at once.
+   * The end of input then costs an empty final block.
+   */
+  bool flush;
+  struct deflate_engine const *engine;	/* the compressor, NULL for zlib */
+  int iterations;		/* optimal parsing passes for the blocks at
+				   LEVEL, for engines that can, or 0 */
+  char const *name;		/* original name for the header, or NULL */
+  uint32_t mtime;		/* modification time for the header */
+
+  /* Input stage.  *DATA points to a pipeline buffer of SIZE bytes; fill
+   * it, or, if BORROW is set, point *DATA at up to SIZE bytes of memory
+   * that stays valid until the pipeline returns.  Return the number of
+   * bytes, 0 at end of input or -1 on error.
+   */
+  ssize_t (*read) (void *opaque, unsigned char **data, size_t size);
+  bool borrow;
+
+  /* Output stage.  Return 0 on success, -1 on error.  */
+  int (*write) (void *opaque, unsigned char const *data, size_t len);
+
+  void *opaque;
+
+  /* If not NULL, filled in when the run is over.  */
+  struct pipeline_stats *stats;
+
+  /* If not NULL, the events of each job are written to it.  */
+  struct pipeline_trace *trace;
+};
+
+        /* in parallel.c */
+extern int parallel_compress (struct pipeline_params const *params);
+extern int pipeline_cpus (void);
+
+/* Content-defined chunking for --rsyncable.  A chunk ends after the
+ * first byte, at least a quarter of MAX bytes in, where a rolling hash of
+ * the last 32 bytes has its top bits clear, about a quarter of MAX bytes
+ * later on average, or else at MAX bytes.  The cuts depend only on the
+ * bytes just before them, so that after an insertion or a deletion they
+ * fall again where they did.  rsync_roll_cut scans LEN bytes at IN, which
+ * continue the current chunk; it returns true if the chunk ends within
+ * them, setting *USED to the bytes up to the cut, and otherwise sets
+ * *USED to LEN.
+ */
+struct rsync_roll
+{
+  uint32_t hash;
+  uint32_t mask;		/* bits of HASH that are clear at a cut */
+  size_t len;			/* bytes of the current chunk scanned */
+  size_t min;
+  size_t max;
+};
+
+extern void rsync_roll_init (struct rsync_roll *r, size_t max);
+extern bool rsync_roll_cut (struct rsync_roll *r, unsigned char const *in,
+                            size_t len, size_t *used);
+
+/* Output of the in-memory API.  If GROW is set, DATA is malloc'd (or
+ * NULL) and is grown with realloc as needed, SIZE tracking the
+ * allocation; otherwise at most SIZE bytes are stored in the caller's
+ * DATA.  LEN is the number of bytes stored so far.
+ */
+struct mem_buffer
+{
+  unsigned char *data;
+  size_t size;
+  size_t len;
+  bool grow;
+};
+
+/* Decoder of raw deflate data held in memory, which needs no zlib
+ * stream; see inflate.c.
+ */
+        /* in inflate.c */
+extern int native_inflate (unsigned char const *in, size_t len, size_t *used,
+                           int (*write) (void *opaque,
+                                         unsigned char const *data,
+                                         size_t len),
+                           void *opaque);
+
+/* Compressor producing raw deflate data with gzip's own deflate code,
+ * whose state is in a struct native_deflate so that each thread can run
+ * its own.  native_deflate streams; native_deflate_block compresses a
+ * buffer held whole in memory into another, and native_deflate_optimal
+ * does it much more slowly and somewhat better.  See deflate.c and
+ * optimal.c.
+ */
+struct native_deflate;
+
+        /* in deflate.c */
+extern struct native_deflate *native_deflate_new (void);
+extern void native_deflate_reset (struct native_deflate *s, int level,
+                                  int (*write) (void *opaque,
+                                                unsigned char const *data,
+                                                size_t len),
+                                  void *opaque);
+extern void native_deflate_dictionary (struct native_deflate *s,
+                                       unsigned char const *dict,
+                                       size_t len);
+extern int native_deflate (struct native_deflate *s, unsigned char const *in,
+                           size_t len, int flush);
+extern size_t native_deflate_bound (size_t len);
+extern size_t native_deflate_block (struct native_deflate *s, int level,
+                                    unsigned char const *dict,
+                                    size_t dict_len,
+                                    unsigned char const *in, size_t len,
+                                    bool last, unsigned char *out);
+extern void native_deflate_free (struct native_deflate *s);
+
+        /* in optimal.c */
+extern size_t native_deflate_optimal (struct native_deflate *s,
+                                      int iterations,
+                                      unsigned char const *dict,
+                                      size_t dict_len,
+                                      unsigned char const *in, size_t len,
+                                      bool last, unsigned char *out);
+
+/* One of the deflate implementations that gzip chooses from at run time,
+ * all producing and reading the same raw deflate data.  STATE is what
+ * INIT returns, one for each thread that compresses; it is NULL if out of
+ * memory.  COMPRESS deflates LEN bytes at IN, primed with the DICT_LEN
+ * bytes at DICT if the engine can, into OUT, which has room for BOUND
+ * (LEN) bytes, at LEVEL with STRATEGY, Z_DEFAULT_STRATEGY or Z_RLE, as
+ * the last block of the stream if LAST is set and otherwise ending at a
+ * byte boundary; OPTIMAL, if not NULL, does the same with ITERATIONS
+ * passes of optimal parsing.  Both return the length of the output, or
+ * (size_t) -1 if out of memory.  INFLATE works as native_inflate does.
+ */
+struct deflate_engine
+{
+  char const *name;
+  bool (*available) (void);	/* whether this machine can run it */
+  void *(*init) (void);
+  size_t (*bound) (size_t len);
+  size_t (*compress) (void *state, int level, int strategy,
+                      unsigned char const *dict, size_t dict_len,
+                      unsigned char const *in, size_t len, bool last,
+                      unsigned char *out);
+  size_t (*optimal) (void *state, int iterations,
+                     unsigned char const *dict, size_t dict_len,
+                     unsigned char const *in, size_t len, bool last,
+                     unsigned char *out);
+  void (*finish) (void *state);
+  int (*inflate) (unsigned char const *in, size_t len, size_t *used,
+                  int (*write) (void *opaque, unsigned char const *data,
+                                size_t len),
+                  void *opaque);
+};
+
+        /* in engine.c */
+extern struct deflate_engine const zlib_engine;
+extern struct deflate_engine const native_engine;
+#ifdef IBM_Z_DFLTCC
+extern struct deflate_engine const dfltcc_engine;
+#endif
+extern struct deflate_engine const *const deflate_engines[];
+extern struct deflate_engine const *deflate_engine_find (char const *name);
+extern struct deflate_engine const *deflate_engine_default (bool
+                                                            decompress);
+
+/* Decoder of concatenated gzip members, as cat, log appenders and other
+ * compressors make them, held in memory.  The members are found by their
+ * headers, checked against the trailers before them, and decoded by up
+ * to THREADS threads at once; their output is written in order.
+ */
+struct member_params
+{
+  int threads;			/* decode threads besides the caller, or 0 */
+  struct deflate_engine const *engine;	/* the decoder, NULL for zlib */
+
+  /* Output stage.  Return 0 on success, -1 on error.  If WRITE is NULL
+   * the members are only checked, and the decode threads take any member,
+   * however big, as they hold no output.
+   */
+  int (*write) (void *opaque, unsigned char const *data, size_t len);
+  void *opaque;
+
+  /* If not NULL, filled in when the run is over.  */
+  struct pipeline_stats *stats;
+};
+
+/* gzip_header_length returns the length of the whole, plain gzip header
+ * at the start of the LEN bytes of BUF, or 0 if there is none there.
+ * parallel_inflate decodes the LEN bytes at IN: the deflate data of a
+ * member whose header the caller has read, then its trailer, then as
+ * many whole members with plain headers as directly follow it.  It sets
+ * *USED to the bytes that those take up, leaving anything else, such as
+ * trailing zeros or a member that no header scan found, to the caller,
+ * and returns Z_OK, Z_DATA_ERROR if a member is corrupt or fails its
+ * trailer, Z_ERRNO if WRITE failed, or Z_MEM_ERROR.
+ */
+        /* in parallel.c */
+extern size_t gzip_header_length (unsigned char const *buf, size_t len);
+extern int parallel_inflate (struct member_params const *params,
+                             unsigned char const *in, size_t len,
+                             size_t *used);
+
+/* Running the same work on many items at once, such as checking many
+ * files with gzip -t.  parallel_each calls WORK for each item I below
+ * COUNT, on up to THREADS threads besides the caller, which fills in
+ * STATS and returns whether it succeeded; and it calls DONE with what
+ * WORK returned, on the calling thread and in the order of the items.
+ */
+struct each_params
+{
+  int threads;
+  size_t count;
+  bool (*work) (void *opaque, size_t i, struct pipeline_stats *stats);
+  void (*done) (void *opaque, size_t i, bool ok,
+                struct pipeline_stats const *stats);
+  void *opaque;
+};
+
+        /* in parallel.c */
+extern void parallel_each (struct each_params const *params);
+
+        /* in memzip.c */
+extern int mem_zip (struct mem_buffer *out, struct iovec const *iov,
+                    int iovcnt, int pack_level, int nthreads);
+extern int mem_unzip (struct mem_buffer *out, struct iovec const *iov,
+                      int iovcnt);
+
+/* Non-blocking streaming interface for event loops.  Any number of
+ * streams share the compress threads of one worker pool.  The caller
+ * pushes input and pulls output; gzstream_fd becomes readable when more
+ * output is ready, which is also when a stream that refused input with
+ * EAGAIN may accept more once its output has been pulled.  Once a block
+ * fails to compress, push, finish and pull return -1 with errno ENOMEM,
+ * or EIO for other errors, and the stream can only be closed.
+ */
+struct worker_pool;
+struct gzstream;
+
+        /* in parallel.c */
+extern struct worker_pool *worker_pool_create (int threads);
+extern void worker_pool_destroy (struct worker_pool *pool);
+extern struct gzstream *gzstream_open (struct pipeline_params const *params,
+                                       struct worker_pool *pool);
+extern int gzstream_fd (struct gzstream const *s);
+extern ssize_t gzstream_push (struct gzstream *s, void const *data,
+                              size_t len);
+extern int gzstream_finish (struct gzstream *s);
+extern ssize_t gzstream_pull (struct gzstream *s, void *buf, size_t size);
+extern void gzstream_close (struct gzstream *s);
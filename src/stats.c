@@ -0,0 +1,230 @@
+/* stats.c -- report where the time of a compression run went
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/*
+ *  INTERFACE
+ *
+ *      double pipeline_stats_now (void)
+ *          Return a monotonic time in seconds, for timing the stages.
+ *
+ *      void pipeline_stats_add (struct pipeline_stats *sum,
+ *                               struct pipeline_stats const *stats)
+ *          Add the figures of one run to SUM, thread by thread.
+ *
+ *      void pipeline_stats_print (FILE *out, char const *what,
+ *                                 struct pipeline_stats const *stats,
+ *                                 bool json)
+ *          Print STATS to OUT, either as a table headed by WHAT or as
+ *          one JSON object.
+ */
+
+#include <config.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "parallel.h"
+
+double
+pipeline_stats_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+pipeline_stats_add (struct pipeline_stats *sum,
+		    struct pipeline_stats const *stats)
+{
+  int threads = stats->threads < PIPELINE_STATS_THREADS
+    ? stats->threads : PIPELINE_STATS_THREADS;
+
+  sum->wall += stats->wall;
+  sum->read_busy += stats->read_busy;
+  sum->read_wait += stats->read_wait;
+  sum->compress_busy += stats->compress_busy;
+  sum->compress_wait += stats->compress_wait;
+  sum->deflate += stats->deflate;
+  sum->crc += stats->crc;
+  sum->write_busy += stats->write_busy;
+  sum->write_wait += stats->write_wait;
+  sum->check_wait += stats->check_wait;
+  sum->bytes_in += stats->bytes_in;
+  sum->bytes_out += stats->bytes_out;
+  for (int i = 0; i < 10; i++)
+    sum->levels[i] += stats->levels[i];
+  sum->flushes += stats->flushes;
+  sum->latency += stats->latency;
+  if (sum->latency_max < stats->latency_max)
+    sum->latency_max = stats->latency_max;
+  for (int i = 0; i < PIPELINE_DEPTHS; i++)
+    {
+      sum->queue_depth[i] += stats->queue_depth[i];
+      sum->write_depth[i] += stats->write_depth[i];
+    }
+  sum->retired += stats->retired;
+  if (sum->threads < stats->threads)
+    sum->threads = stats->threads;
+  for (int i = 0; i < threads; i++)
+    {
+      struct pipeline_thread_stats *t = &sum->thread[i];
+      t->jobs += stats->thread[i].jobs;
+      t->bytes += stats->thread[i].bytes;
+      t->busy += stats->thread[i].busy;
+      t->wait += stats->thread[i].wait;
+      t->cpu += stats->thread[i].cpu;
+    }
+}
+
+/* Megabytes (10^6 bytes) per second.  */
+static double
+rate (uint64_t bytes, double secs)
+{
+  return secs > 0 ? bytes / 1e6 / secs : 0;
+}
+
+/* Mean latency in milliseconds.  */
+static double
+latency (struct pipeline_stats const *s)
+{
+  return s->flushes ? s->latency / s->flushes * 1e3 : 0;
+}
+
+/* Print a depth histogram as "low[-high]:count" pairs, or as a JSON
+ * array of counts.
+ */
+static void
+print_depths (FILE *out, unsigned long const *depth, bool json)
+{
+  for (int i = 0; i < PIPELINE_DEPTHS; i++)
+    {
+      long low = i ? 1L << (i - 1) : 0;
+      long high = i ? (1L << i) - 1 : 0;
+
+      if (json)
+	fprintf (out, "%s%lu", i ? ", " : "[", depth[i]);
+      else if (i == PIPELINE_DEPTHS - 1)
+	fprintf (out, " %ld+:%lu", low, depth[i]);
+      else if (low == high)
+	fprintf (out, " %ld:%lu", low, depth[i]);
+      else
+	fprintf (out, " %ld-%ld:%lu", low, high, depth[i]);
+    }
+  fputs (json ? "]" : "\n", out);
+}
+
+static void
+print_json (FILE *out, struct pipeline_stats const *s)
+{
+  int threads = s->threads < PIPELINE_STATS_THREADS
+    ? s->threads : PIPELINE_STATS_THREADS;
+
+  fprintf (out, "{\"wall\": %.6f, \"bytes_in\": %" PRIu64
+	   ", \"bytes_out\": %" PRIu64 ", \"mbps_in\": %.2f",
+	   s->wall, s->bytes_in, s->bytes_out, rate (s->bytes_in, s->wall));
+  fprintf (out, ", \"read\": {\"busy\": %.6f, \"wait\": %.6f}",
+	   s->read_busy, s->read_wait);
+  fprintf (out, ", \"compress\": {\"busy\": %.6f, \"wait\": %.6f"
+	   ", \"deflate\": %.6f, \"crc\": %.6f}",
+	   s->compress_busy, s->compress_wait, s->deflate, s->crc);
+  fprintf (out, ", \"write\": {\"busy\": %.6f, \"wait\": %.6f"
+	   ", \"check_wait\": %.6f}",
+	   s->write_busy, s->write_wait, s->check_wait);
+  fprintf (out, ", \"latency\": {\"flushes\": %lu, \"mean_ms\": %.3f"
+	   ", \"max_ms\": %.3f}",
+	   s->flushes, latency (s), s->latency_max * 1e3);
+  fputs (", \"queue_depth\": ", out);
+  print_depths (out, s->queue_depth, true);
+  fputs (", \"write_depth\": ", out);
+  print_depths (out, s->write_depth, true);
+  fputs (", \"levels\": [", out);
+  for (int i = 0; i < 10; i++)
+    fprintf (out, "%s%lu", i ? ", " : "", s->levels[i]);
+  fputc (']', out);
+  fprintf (out, ", \"threads\": %d, \"retired\": %lu, \"per_thread\": [",
+	   s->threads, s->retired);
+  for (int i = 0; i < threads; i++)
+    {
+      struct pipeline_thread_stats const *t = &s->thread[i];
+      fprintf (out, "%s{\"jobs\": %lu, \"bytes\": %" PRIu64
+	       ", \"busy\": %.6f, \"wait\": %.6f, \"cpu\": %.6f"
+	       ", \"mbps\": %.2f}",
+	       i ? ", " : "", t->jobs, t->bytes, t->busy, t->wait, t->cpu,
+	       rate (t->bytes, t->busy));
+    }
+  fputs ("]}", out);
+}
+
+void
+pipeline_stats_print (FILE *out, char const *what,
+		      struct pipeline_stats const *s, bool json)
+{
+  int threads = s->threads < PIPELINE_STATS_THREADS
+    ? s->threads : PIPELINE_STATS_THREADS;
+
+  if (json)
+    {
+      print_json (out, s);
+      return;
+    }
+
+  if (s->threads)
+    fprintf (out, "%s, %d compress threads:\n", what, s->threads);
+  else
+    fprintf (out, "%s, serial:\n", what);
+  fprintf (out, "  wall      %10.3f s   %" PRIu64 " bytes in (%.1f MB/s),"
+	   " %" PRIu64 " out\n", s->wall, s->bytes_in,
+	   rate (s->bytes_in, s->wall), s->bytes_out);
+  fprintf (out, "  read      %10.3f s busy", s->read_busy);
+  if (s->threads)
+    fprintf (out, "  %10.3f s waiting for input buffers", s->read_wait);
+  fputc ('\n', out);
+  fprintf (out, "  compress  %10.3f s busy", s->compress_busy);
+  if (s->threads)
+    fprintf (out, "  %10.3f s waiting for blocks\n"
+	     "    deflate %10.3f s\n"
+	     "    crc     %10.3f s", s->compress_wait, s->deflate, s->crc);
+  fputc ('\n', out);
+  fprintf (out, "  write     %10.3f s busy", s->write_busy);
+  if (s->threads)
+    fprintf (out, "  %10.3f s waiting for blocks, %.3f s for checks",
+	     s->write_wait, s->check_wait);
+  fputc ('\n', out);
+  if (s->flushes)
+    fprintf (out, "  latency   %10.3f ms mean, %.3f ms max, over %lu flushes\n",
+	     latency (s), s->latency_max * 1e3, s->flushes);
+  if (!s->threads)
+    return;
+
+  fputs ("  compress queue depth:", out);
+  print_depths (out, s->queue_depth, false);
+  fputs ("  write queue depth:   ", out);
+  print_depths (out, s->write_depth, false);
+  if (s->retired)
+    fprintf (out, "  compress threads retired when idle: %lu\n", s->retired);
+  fputs ("  blocks by level:     ", out);
+  for (int i = 0; i < 10; i++)
+    if (s->levels[i])
+      fprintf (out, " %d:%lu", i, s->levels[i]);
+  fputc ('\n', out);
+  for (int i = 0; i < threads; i++)
+    {
+      struct pipeline_thread_stats const *t = &s->thread[i];
+      fprintf (out, "  thread %-3d %6lu blocks  %10.3f s busy  %10.3f s idle"
+	       "  %10.3f s CPU  %8.1f MB/s\n", i, t->jobs, t->busy, t->wait,
+	       t->cpu, rate (t->bytes, t->busy));
+    }
+}
@@ -0,0 +1,141 @@
+/* trace.c -- job timelines in Chrome trace event format
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/*
+ *  INTERFACE
+ *
+ *      struct pipeline_trace *pipeline_trace_open (FILE *out)
+ *          Start a JSON array of trace events on OUT, which can be loaded
+ *          into chrome://tracing or Perfetto.  Return NULL if out of memory.
+ *
+ *      int pipeline_trace_close (struct pipeline_trace *trace)
+ *          End the array and flush OUT, which the caller then closes.
+ *          Return 0, or -1 if writing failed.
+ *
+ *  The other functions are called by the pipeline, which records each
+ *  job as a flow from the slice in which the reader read it, through the
+ *  compress thread that deflated it, to the slice in which the writer
+ *  wrote it, with the waits in between as slices of their own.  Each run
+ *  of the pipeline is one process in the trace.  Events are written as
+ *  they happen, one fprintf each, so the stdio lock keeps them whole.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+
+#include "parallel.h"
+
+struct pipeline_trace
+{
+  FILE *out;
+  double epoch;			/* time of pipeline_trace_open */
+  int runs;			/* pipeline runs so far */
+};
+
+struct pipeline_trace *
+pipeline_trace_open (FILE *out)
+{
+  struct pipeline_trace *trace = malloc (sizeof *trace);
+
+  if (trace == NULL)
+    return NULL;
+  trace->out = out;
+  trace->epoch = pipeline_stats_now ();
+  trace->runs = 0;
+  fputs ("[{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, "
+	 "\"args\": {\"name\": \"gzip\"}}", out);
+  return trace;
+}
+
+int
+pipeline_trace_close (struct pipeline_trace *trace)
+{
+  int status;
+
+  fputs ("\n]\n", trace->out);
+  status = fflush (trace->out) != 0 || ferror (trace->out) ? -1 : 0;
+  free (trace);
+  return status;
+}
+
+/* Microseconds since the trace began.  */
+static double
+stamp (struct pipeline_trace const *trace, double when)
+{
+  return (when - trace->epoch) * 1e6;
+}
+
+/* Start a run of the pipeline and return its number, which is the
+ * process id of its events.  The thread ids of the run are
+ * PIPELINE_TRACE_READER, PIPELINE_TRACE_WRITER and, for compress
+ * thread I, PIPELINE_TRACE_COMPRESS + I.
+ */
+int
+pipeline_trace_begin (struct pipeline_trace *trace)
+{
+  int run = ++trace->runs;
+
+  fprintf (trace->out,
+	   ",\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+	   "\"args\": {\"name\": \"run %d\"}}"
+	   ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+	   "\"tid\": %d, \"args\": {\"name\": \"reader\"}}"
+	   ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+	   "\"tid\": %d, \"args\": {\"name\": \"writer\"}}",
+	   run, run, run, PIPELINE_TRACE_READER, run, PIPELINE_TRACE_WRITER);
+  return run;
+}
+
+void
+pipeline_trace_thread (struct pipeline_trace *trace, int run, int index)
+{
+  fprintf (trace->out,
+	   ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+	   "\"tid\": %d, \"args\": {\"name\": \"compress %d\"}}",
+	   run, PIPELINE_TRACE_COMPRESS + index, index);
+}
+
+/* Record that thread TID of RUN spent START to END on NAME, for job SEQ
+ * (or -1) of LEN bytes.
+ */
+void
+pipeline_trace_span (struct pipeline_trace *trace, int run, int tid,
+		     char const *name, double start, double end, long seq,
+		     size_t len)
+{
+  fprintf (trace->out,
+	   ",\n{\"name\": \"%s\", \"cat\": \"job\", \"ph\": \"X\", "
+	   "\"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+	   "\"args\": {\"seq\": %ld, \"bytes\": %zu}}",
+	   name, run, tid, stamp (trace, start), (end - start) * 1e6, seq,
+	   len);
+}
+
+/* Record step PHASE of job SEQ's flow: 's' in the slice where it was
+ * read, 't' where it was compressed and 'f' where it was written, each
+ * at time WHEN in thread TID.
+ */
+void
+pipeline_trace_flow (struct pipeline_trace *trace, int run, int tid,
+		     char phase, double when, long seq)
+{
+  fprintf (trace->out,
+	   ",\n{\"name\": \"job\", \"cat\": \"job\", \"ph\": \"%c\", "
+	   "\"id\": %lld, \"pid\": %d, \"tid\": %d, \"ts\": %.3f%s}",
+	   phase, ((long long) run << 32) + seq, run, tid,
+	   stamp (trace, when),
+	   phase == 'f' ? ", \"bp\": \"e\"" : "");
+}
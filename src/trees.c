@@ -51,65 +51,56 @@
  *
  *  INTERFACE
  *
- *      void ct_init (ush *attr, int *methodp)
- *          Allocate the match buffer, initialize the various tables and save
- *          the location of the internal file attribute (ascii/binary) and
- *          method (DEFLATE/STORE)
+ *      void ct_static_init (void)
+ *          Build the tables shared by all compressors, once.
  *
- *      void ct_tally (int dist, int lc);
- *          Save the match info and tally the frequency counts.
+ *      void ct_init (struct native_deflate *s)
+ *          Start the first block of a new stream.
  *
- *      off_t flush_block (char *buf, ulg stored_len, int eof)
+ *      bool ct_tally (struct native_deflate *s, unsigned dist, unsigned lc)
+ *          Save the match info and tally the frequency counts; see
+ *          deflate.h.
+ *
+ *      void flush_block (struct native_deflate *s, uch const *buf,
+ *                        ulg stored_len, bool eof)
  *          Determine the best encoding for the current block: dynamic trees,
- *          static trees or store, and output the encoded block to the zip
- *          file. Returns the total compressed length for the file so far.
+ *          static trees or store, and output the encoded block.
+ *
+ *      void ct_align (struct native_deflate *s)
+ *          Pad the output to a byte boundary with empty blocks.
+ *
+ *      uint64_t ct_entropy (unsigned const *freq, int n)
+ *          Estimate the bits that N symbols of frequencies FREQ take.
  *
+ *      bool ct_end_block (struct native_deflate *s)
+ *          Decide, every 4096 literals and matches, whether to end the
+ *          current block, or with whole input at levels 4 to 9, flush
+ *          all of it but the last 4096 literals and matches.
+ *
+ *  All the state of a stream is in S, and the shared tables are only
+ *  written once, so any number of streams can be compressed at once.
  */
 
 #include <config.h>
-#include <ctype.h>
+#include <pthread.h>
+#include <string.h>
 
-#include "tailor.h"
-#include "gzip.h"
+#include "zlib.h"
+#include "deflate.h"
 
 /* ===========================================================================
  * Constants
  */
 
-#define MAX_BITS 15
-/* All codes must not exceed MAX_BITS bits */
-
-#define MAX_BL_BITS 7
-/* Bit length codes must not exceed MAX_BL_BITS bits */
-
-#define LENGTH_CODES 29
-/* number of length codes, not counting the special END_BLOCK code */
-
-#define LITERALS  256
-/* number of literal bytes 0..255 */
-
-#define END_BLOCK 256
-/* end of block literal code */
-
-#define L_CODES (LITERALS+1+LENGTH_CODES)
-/* number of Literal or Length codes, including the END_BLOCK code */
-
-#define D_CODES   30
-/* number of distance codes */
-
-#define BL_CODES  19
-/* number of codes used to transfer the bit lengths */
-
-
-static int extra_lbits[LENGTH_CODES]	/* extra bits for each length code */
+int const extra_lbits[LENGTH_CODES]	/* extra bits for each length code */
 = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
     5, 5, 5, 5, 0 };
 
-static int extra_dbits[D_CODES]	/* extra bits for each distance code */
+int const extra_dbits[D_CODES]	/* extra bits for each distance code */
 = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10,
     10, 11, 11, 12, 12, 13, 13 };
 
-static int extra_blbits[BL_CODES]	/* extra bits for each bit length code */
+static int const extra_blbits[BL_CODES]	/* extra bits for each bit length code */
 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
 
 #define STORED_BLOCK 0
@@ -117,83 +108,31 @@ static int extra_blbits[BL_CODES]	/* extra bits for each bit length code */
 #define DYN_TREES    2
 /* The three kinds of block type */
 
-#ifndef LIT_BUFSIZE
-#ifdef SMALL_MEM
-#define LIT_BUFSIZE  0x2000
-#else
-#ifdef MEDIUM_MEM
-#define LIT_BUFSIZE  0x4000
-#else
-#define LIT_BUFSIZE  0x8000
-#endif
-#endif
-#endif
-#ifndef DIST_BUFSIZE
-#define DIST_BUFSIZE  LIT_BUFSIZE
-#endif
-/* Sizes of match buffers for literals/lengths and distances.  There are
- * 4 reasons for limiting LIT_BUFSIZE to 64K:
- *   - frequencies can be kept in 16 bit counters
- *   - if compression is not successful for the first block, all input data is
- *     still in the window so we can still emit a stored block even when input
- *     comes from standard input.  (This can also be done for all blocks if
- *     LIT_BUFSIZE is not greater than 32K.)
- *   - if compression is not successful for a file smaller than 64K, we can
- *     even emit a stored file instead of a stored block (saving 5 bytes).
- *   - creating new Huffman trees less frequently may not provide fast
- *     adaptation to changes in the input data statistics. (Take for
- *     example a binary file with poorly compressible code followed by
- *     a highly compressible string table.) Smaller buffer sizes give
- *     fast adaptation but have of course the overhead of transmitting trees
- *     more frequently.
- *   - I can't count above 4
- * The current code is general and allows DIST_BUFSIZE < LIT_BUFSIZE (to save
- * memory at the expense of compression). Some optimizations would be possible
- * if we rely on DIST_BUFSIZE == LIT_BUFSIZE.
- */
-#if LIT_BUFSIZE > INBUFSIZE
-error cannot overlay l_buf and inbuf
-#endif
+#define MAX_STORED 65535
+/* Longest stored block */
+
+#define SPLIT_CHUNK 0x1000
+/* Literals and matches between the points where a block may be split */
+
+#define SPLIT_TREE_BITS 600
+/* Estimated cost of the trees of a new block, in bits */
+
 #define REP_3_6      16
 /* repeat previous bit length 3-6 times (2 bits of repeat count) */
 #define REPZ_3_10    17
 /* repeat a zero length 3-10 times  (3 bits of repeat count) */
 #define REPZ_11_138  18
 /* repeat a zero length 11-138 times  (7 bits of repeat count) */
+
 /* ===========================================================================
- * Local data
+ * Tables shared by all streams, built by ct_static_init.
  */
-/* Data structure describing a single value and its code string. */
-  typedef struct ct_data
-{
-  union
-  {
-    ush freq;			/* frequency count */
-    ush code;			/* bit string */
-  } fc;
-  union
-  {
-    ush dad;			/* father node in Huffman tree */
-    ush len;			/* length of bit string */
-  } dl;
-} ct_data;
-
-#define Freq fc.freq
-#define Code fc.code
-#define Dad  dl.dad
-#define Len  dl.len
-
-#define HEAP_SIZE (2*L_CODES+1)
-/* maximum heap size */
-
-static ct_data dyn_ltree[HEAP_SIZE];	/* literal and length tree */
-static ct_data dyn_dtree[2 * D_CODES + 1];	/* distance tree */
 
 static ct_data static_ltree[L_CODES + 2];
 /* The static literal tree. Since the bit lengths are imposed, there is no
  * need for the L_CODES extra codes used during heap construction. However
- * The codes 286 and 287 are needed to build a canonical tree (see ct_init
- * below).
+ * The codes 286 and 287 are needed to build a canonical tree (see
+ * init_static below).
  */
 
 static ct_data static_dtree[D_CODES];
@@ -201,54 +140,16 @@ static ct_data static_dtree[D_CODES];
  * 5 bits.)
  */
 
-static ct_data bl_tree[2 * BL_CODES + 1];
-/* Huffman tree for the bit lengths */
-
-typedef struct tree_desc
-{
-  ct_data *dyn_tree;		/* the dynamic tree */
-  ct_data *static_tree;		/* corresponding static tree or NULL */
-  int *extra_bits;		/* extra bits for each code or NULL */
-  int extra_base;		/* base index for extra_bits */
-  int elems;			/* max number of elements in the tree */
-  int max_length;		/* max bit length for the codes */
-  int max_code;			/* largest code with non zero frequency */
-} tree_desc;
-
-static tree_desc l_desc =
-  { dyn_ltree, static_ltree, extra_lbits, LITERALS + 1, L_CODES, MAX_BITS,
-0 };
-
-static tree_desc d_desc =
-  { dyn_dtree, static_dtree, extra_dbits, 0, D_CODES, MAX_BITS, 0 };
-
-static tree_desc bl_desc =
-  { bl_tree, (ct_data *) 0, extra_blbits, 0, BL_CODES, MAX_BL_BITS, 0 };
-
-
-static ush bl_count[MAX_BITS + 1];
-/* number of codes at each bit length for an optimal tree */
-
-static uch bl_order[BL_CODES]
+static uch const bl_order[BL_CODES]
   = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 /* The lengths of the bit length codes are sent in order of decreasing
  * probability, to avoid transmitting the lengths for unused bit length codes.
  */
 
-static int heap[2 * L_CODES + 1];	/* heap used to build the Huffman trees */
-static int heap_len;		/* number of elements in the heap */
-static int heap_max;		/* element of largest frequency */
-/* The sons of heap[n] are heap[2*n] and heap[2*n+1]. heap[0] is not used.
- * The same heap array is used to build all trees.
- */
-
-static uch depth[2 * L_CODES + 1];
-/* Depth of each subtree used as tie breaker for trees of equal frequency */
-
-static uch length_code[MAX_MATCH - MIN_MATCH + 1];
+uch length_code[MAX_MATCH - MIN_MATCH + 1];
 /* length code for each normalized match length (0 == MIN_MATCH) */
 
-static uch dist_code[512];
+uch dist_code[512];
 /* distance codes. The first 256 values correspond to the distances
  * 3 .. 258, the last 256 values correspond to the top 8 bits of
  * the 15 bit distances.
@@ -260,106 +161,130 @@ static int base_length[LENGTH_CODES];
 static int base_dist[D_CODES];
 /* First normalized distance for each code (0 = distance of 1) */
 
-#define l_buf inbuf
-/* DECLARE(uch, l_buf, LIT_BUFSIZE);  buffer for literals or lengths */
+static pthread_once_t static_once = PTHREAD_ONCE_INIT;
 
-/* DECLARE(ush, d_buf, DIST_BUFSIZE); buffer for distances */
-
-static uch flag_buf[(LIT_BUFSIZE / 8)];
-/* flag_buf is a bit array distinguishing literals from lengths in
- * l_buf, thus indicating the presence or absence of a distance.
- */
-
-static unsigned last_lit;	/* running index in l_buf */
-static unsigned last_dist;	/* running index in d_buf */
-static unsigned last_flags;	/* running index in flag_buf */
-static uch flags;		/* current flags not yet saved in flag_buf */
-static uch flag_bit;		/* current bit used in flags */
-/* bits are filled in flags starting at bit 0 (least significant).
- * Note: these flags are overkill in the current code since we don't
- * take advantage of DIST_BUFSIZE == LIT_BUFSIZE.
+/* ===========================================================================
+ * Local (static) routines in this file.
  */
 
-static ulg opt_len;		/* bit length of current block with optimal trees */
-static ulg static_len;		/* bit length of current block with static trees */
-
-static off_t compressed_len;	/* total bit length of compressed file */
-
-static off_t input_len;		/* total byte length of input file */
-/* input_len is for debugging only since we can get it by other means. */
-
-static ush *file_type;		/* pointer to UNKNOWN, BINARY or ASCII */
-static int *file_method;	/* pointer to DEFLATE or STORE */
+static void init_block (struct native_deflate *s);
+static void pqdownheap (struct native_deflate *s, ct_data * tree, int k);
+static void gen_bitlen (struct native_deflate *s, tree_desc * desc);
+static void gen_codes (ct_data * tree, int max_code, ush const *bl_count);
+static void build_tree (struct native_deflate *s, tree_desc * desc);
+static void scan_tree (struct native_deflate *s, ct_data * tree,
+                       int max_code);
+static void send_tree (struct native_deflate *s, ct_data const *tree,
+                       int max_code);
+static int build_bl_tree (struct native_deflate *s);
+static void send_all_trees (struct native_deflate *s, int lcodes, int dcodes,
+                            int blcodes);
+static void compress_block (struct native_deflate *s, ct_data const *ltree,
+                            ct_data const *dtree);
+
+#define send_code(s, c, tree) send_bits (s, (tree)[c].Code, (tree)[c].Len)
+   /* Send a code of the given tree. c and tree must not have side effects */
 
-#ifdef DEBUG
-extern off_t bits_sent;		/* bit length of the compressed data */
-#endif
+#define MAX(a,b) (a >= b ? a : b)
+/* the arguments must not have side effects */
 
-/* Previously defined in deflate.c, but since we are no longer linking that in,
- * I define that here
+/* ===========================================================================
+ * Reverse the first len bits of a code, using straightforward code (a faster
+ * method would use a table)
+ * IN assertion: 1 <= len <= 15
  */
-long block_start = 0L;		/* window offset of current block */
-unsigned strstart = 0;		/* window offset of current string */
+static unsigned
+bi_reverse (unsigned code, int len)
+{
+  unsigned res = 0;
+  do
+    {
+      res |= code & 1;
+      code >>= 1, res <<= 1;
+    }
+  while (--len > 0);
+  return res >> 1;
+}
 
 /* ===========================================================================
- * Local (static) routines in this file.
+ * Hand the collected output to the write callback.
  */
+void
+flush_out (struct native_deflate *s)
+{
+  if (s->outcnt != 0 && s->status == Z_OK
+      && s->write (s->opaque, s->out, s->outcnt) != 0)
+    s->status = Z_ERRNO;
+  s->outcnt = 0;
+}
 
-static void init_block (void);
-static void pqdownheap (ct_data * tree, int k);
-static void gen_bitlen (tree_desc * desc);
-static void gen_codes (ct_data * tree, int max_code);
-static void build_tree (tree_desc * desc);
-static void scan_tree (ct_data * tree, int max_code);
-static void send_tree (ct_data * tree, int max_code);
-static int build_bl_tree (void);
-static void send_all_trees (int lcodes, int dcodes, int blcodes);
-static void compress_block (ct_data * ltree, ct_data * dtree);
-static void set_file_type (void);
-
-
-#ifndef DEBUG
-#define send_code(c, tree) send_bits(tree[c].Code, tree[c].Len)
-   /* Send a code of the given tree. c and tree must not have side effects */
+static inline void
+put_byte (struct native_deflate *s, uch c)
+{
+  s->out[s->outcnt++] = c;
+  if (s->outcnt >= s->out_size)
+    flush_out (s);
+}
 
-#else /* DEBUG */
-#define send_code(c, tree) \
-     { if (verbose>1) fprintf(stderr,"\ncd %3d ",(c)); \
-       send_bits(tree[c].Code, tree[c].Len); }
-#endif
-
-#define d_code(dist) \
-   ((dist) < 256 ? dist_code[dist] : dist_code[256+((dist)>>7)])
-/* Mapping from a distance to a distance code. dist is the distance - 1 and
- * must not have side effects. dist_code[256] and dist_code[257] are never
- * used.
+/* ===========================================================================
+ * Write out any remaining bits in an incomplete byte.
  */
+static void
+bi_windup (struct native_deflate *s)
+{
+  for (; s->bi_valid > 0; s->bi_valid -= 8)
+    {
+      put_byte (s, (uch) s->bi_buf);
+      s->bi_buf >>= 8;
+    }
+  s->bi_buf = 0;
+  s->bi_valid = 0;
+}
 
-#define MAX(a,b) (a >= b ? a : b)
-/* the arguments must not have side effects */
+/* ===========================================================================
+ * Copy a stored block to the output, storing first the length and its
+ * one's complement if requested.
+ */
+static void
+copy_block (struct native_deflate *s, uch const *buf, unsigned len,
+            bool header)
+{
+  bi_windup (s);		/* align on byte boundary */
+
+  if (header)
+    {
+      put_byte (s, (uch) len);
+      put_byte (s, (uch) (len >> 8));
+      put_byte (s, (uch) ~len);
+      put_byte (s, (uch) (~len >> 8));
+    }
+  while (len != 0)
+    {
+      size_t n = s->out_size - s->outcnt;
+      if (n > len)
+        n = len;
+      memcpy (s->out + s->outcnt, buf, n);
+      s->outcnt += n;
+      buf += n;
+      len -= n;
+      if (s->outcnt >= s->out_size)
+        flush_out (s);
+    }
+}
 
 /* ===========================================================================
- * Allocate the match buffer, initialize the various tables and save the
- * location of the internal file attribute (ascii/binary) and method
- * (DEFLATE/STORE).
+ * Initialize the mappings from lengths and distances to codes, and the
+ * static trees.
  */
-void
-ct_init (attr, methodp)
-     ush *attr;			/* pointer to internal file attribute */
-     int *methodp;		/* pointer to compression method */
+static void
+init_static (void)
 {
   int n;			/* iterates over tree elements */
   int bits;			/* bit counter */
   int length;			/* length value */
   int code;			/* code value */
   int dist;			/* distance index */
-
-  file_type = attr;
-  file_method = methodp;
-  compressed_len = input_len = 0L;
-
-  if (static_dtree[0].Len != 0)
-    return;			/* ct_init already called */
+  ush bl_count[MAX_BITS + 1];
 
   /* Initialize the mapping length (0..255) -> length code (0..28) */
   length = 0;
@@ -371,12 +296,13 @@ ct_init (attr, methodp)
 	  length_code[length++] = (uch) code;
 	}
     }
-  Assert (length == 256, "ct_init: length != 256");
   /* Note that the length 255 (match length 258) can be represented
    * in two different ways: code 284 + 5 bits or code 285, so we
-   * overwrite length_code[255] to use the best encoding:
+   * overwrite length_code[255] to use the best encoding.  Code 285 has
+   * no extra bits, so its base must leave none for compress_block:
    */
   length_code[length - 1] = (uch) code;
+  base_length[code] = length - 1;
 
   /* Initialize the mapping dist (0..32K) -> dist code (0..29) */
   dist = 0;
@@ -388,7 +314,6 @@ ct_init (attr, methodp)
 	  dist_code[dist++] = (uch) code;
 	}
     }
-  Assert (dist == 256, "ct_init: dist != 256");
   dist >>= 7;			/* from now on, all distances are divided by 128 */
   for (; code < D_CODES; code++)
     {
@@ -398,7 +323,6 @@ ct_init (attr, methodp)
 	  dist_code[256 + dist++] = (uch) code;
 	}
     }
-  Assert (dist == 256, "ct_init: 256+dist != 512");
 
   /* Construct the codes of the static literal tree */
   for (bits = 0; bits <= MAX_BITS; bits++)
@@ -416,7 +340,7 @@ ct_init (attr, methodp)
    * tree construction to get a canonical Huffman tree (longest code
    * all ones)
    */
-  gen_codes ((ct_data *) static_ltree, L_CODES + 1);
+  gen_codes (static_ltree, L_CODES + 1, bl_count);
 
   /* The static distance tree is trivial: */
   for (n = 0; n < D_CODES; n++)
@@ -424,32 +348,48 @@ ct_init (attr, methodp)
       static_dtree[n].Len = 5;
       static_dtree[n].Code = bi_reverse (n, 5);
     }
+}
+
+void
+ct_static_init (void)
+{
+  pthread_once (&static_once, init_static);
+}
 
-  /* Initialize the first block of the first file: */
-  init_block ();
+/* ===========================================================================
+ * Set up the tree descriptors of S and start its first block.
+ */
+void
+ct_init (struct native_deflate *s)
+{
+  s->l_desc = (tree_desc) { s->dyn_ltree, static_ltree, extra_lbits,
+                            LITERALS + 1, L_CODES, MAX_BITS, 0 };
+  s->d_desc = (tree_desc) { s->dyn_dtree, static_dtree, extra_dbits, 0,
+                            D_CODES, MAX_BITS, 0 };
+  s->bl_desc = (tree_desc) { s->bl_tree, NULL, extra_blbits, 0, BL_CODES,
+                             MAX_BL_BITS, 0 };
+  init_block (s);
 }
 
 /* ===========================================================================
  * Initialize a new block.
  */
 static void
-init_block ()
+init_block (struct native_deflate *s)
 {
   int n;			/* iterates over tree elements */
 
   /* Initialize the trees. */
   for (n = 0; n < L_CODES; n++)
-    dyn_ltree[n].Freq = 0;
+    s->dyn_ltree[n].Freq = 0;
   for (n = 0; n < D_CODES; n++)
-    dyn_dtree[n].Freq = 0;
+    s->dyn_dtree[n].Freq = 0;
   for (n = 0; n < BL_CODES; n++)
-    bl_tree[n].Freq = 0;
+    s->bl_tree[n].Freq = 0;
 
-  dyn_ltree[END_BLOCK].Freq = 1;
-  opt_len = static_len = 0L;
-  last_lit = last_dist = last_flags = 0;
-  flags = 0;
-  flag_bit = 1;
+  s->dyn_ltree[END_BLOCK].Freq = 1;
+  s->opt_len = s->static_len = 0L;
+  s->last_lit = s->last_dist = 0;
 }
 
 #define SMALLEST 1
@@ -460,18 +400,18 @@ init_block ()
  * Remove the smallest element from the heap and recreate the heap with
  * one less element. Updates heap and heap_len.
  */
-#define pqremove(tree, top) \
+#define pqremove(s, tree, top) \
 {\
-    top = heap[SMALLEST]; \
-    heap[SMALLEST] = heap[heap_len--]; \
-    pqdownheap(tree, SMALLEST); \
+    top = s->heap[SMALLEST]; \
+    s->heap[SMALLEST] = s->heap[s->heap_len--]; \
+    pqdownheap(s, tree, SMALLEST); \
 }
 
 /* ===========================================================================
  * Compares to subtrees, using the tree depth as tie breaker when
  * the subtrees have equal frequency. This minimizes the worst case length.
  */
-#define smaller(tree, n, m) \
+#define smaller(tree, n, m, depth) \
    (tree[n].Freq < tree[m].Freq || \
    (tree[n].Freq == tree[m].Freq && depth[n] <= depth[m]))
 
@@ -482,20 +422,19 @@ init_block ()
  * two sons).
  */
 static void
-pqdownheap (tree, k)
-     ct_data *tree;		/* the tree to restore */
-     int k;			/* node to move down */
+pqdownheap (struct native_deflate *s, ct_data *tree, int k)
 {
+  int *heap = s->heap;
   int v = heap[k];
   int j = k << 1;		/* left son of k */
-  while (j <= heap_len)
+  while (j <= s->heap_len)
     {
       /* Set j to the smallest of the two sons: */
-      if (j < heap_len && smaller (tree, heap[j + 1], heap[j]))
+      if (j < s->heap_len && smaller (tree, heap[j + 1], heap[j], s->depth))
 	j++;
 
       /* Exit if v is smaller than both sons */
-      if (smaller (tree, v, heap[j]))
+      if (smaller (tree, v, heap[j], s->depth))
 	break;
 
       /* Exchange v with the smallest son */
@@ -519,15 +458,16 @@ pqdownheap (tree, k)
  *     not null.
  */
 static void
-gen_bitlen (desc)
-     tree_desc *desc;		/* the tree descriptor */
+gen_bitlen (struct native_deflate *s, tree_desc *desc)
 {
   ct_data *tree = desc->dyn_tree;
-  int *extra = desc->extra_bits;
+  int const *extra = desc->extra_bits;
   int base = desc->extra_base;
   int max_code = desc->max_code;
   int max_length = desc->max_length;
-  ct_data *stree = desc->static_tree;
+  ct_data const *stree = desc->static_tree;
+  int *heap = s->heap;
+  ush *bl_count = s->bl_count;
   int h;			/* heap index */
   int n, m;			/* iterate over the tree elements */
   int bits;			/* bit length */
@@ -541,9 +481,9 @@ gen_bitlen (desc)
   /* In a first pass, compute the optimal bit lengths (which may
    * overflow in the case of the bit length tree).
    */
-  tree[heap[heap_max]].Len = 0;	/* root of the heap */
+  tree[heap[s->heap_max]].Len = 0;	/* root of the heap */
 
-  for (h = heap_max + 1; h < HEAP_SIZE; h++)
+  for (h = s->heap_max + 1; h < HEAP_SIZE; h++)
     {
       n = heap[h];
       bits = tree[tree[n].Dad].Len + 1;
@@ -560,14 +500,13 @@ gen_bitlen (desc)
       if (n >= base)
 	xbits = extra[n - base];
       f = tree[n].Freq;
-      opt_len += (ulg) f *(bits + xbits);
+      s->opt_len += (ulg) f *(bits + xbits);
       if (stree)
-	static_len += (ulg) f *(stree[n].Len + xbits);
+	s->static_len += (ulg) f *(stree[n].Len + xbits);
     }
   if (overflow == 0)
     return;
 
-  Trace ((stderr, "\nbit length overflow\n"));
   /* This happens for example on obj2 and pic of the Calgary corpus */
 
   /* Find the first bit length which could increase: */
@@ -601,8 +540,7 @@ gen_bitlen (desc)
 	    continue;
 	  if (tree[m].Len != (unsigned) bits)
 	    {
-	      Trace ((stderr, "code %d bits %d->%d\n", m, tree[m].Len, bits));
-	      opt_len +=
+	      s->opt_len +=
 		((long) bits - (long) tree[m].Len) * (long) tree[m].Freq;
 	      tree[m].Len = (ush) bits;
 	    }
@@ -620,9 +558,7 @@ gen_bitlen (desc)
  *     zero code length.
  */
 static void
-gen_codes (tree, max_code)
-     ct_data *tree;		/* the tree to decorate */
-     int max_code;		/* largest code with non zero frequency */
+gen_codes (ct_data *tree, int max_code, ush const *bl_count)
 {
   ush next_code[MAX_BITS + 1];	/* next code value for each bit length */
   ush code = 0;			/* running code value */
@@ -636,12 +572,6 @@ gen_codes (tree, max_code)
     {
       next_code[bits] = code = (code + bl_count[bits - 1]) << 1;
     }
-  /* Check that the bit counts in bl_count are consistent. The last code
-   * must be all ones.
-   */
-  Assert (code + bl_count[MAX_BITS] - 1 == (1 << MAX_BITS) - 1,
-	  "inconsistent bit counts");
-  Tracev ((stderr, "\ngen_codes: max_code %d ", max_code));
 
   for (n = 0; n <= max_code; n++)
     {
@@ -650,10 +580,6 @@ gen_codes (tree, max_code)
 	continue;
       /* Now reverse the bits */
       tree[n].Code = bi_reverse (next_code[len]++, len);
-
-      Tracec (tree != static_ltree, (stderr, "\nn %3d %c l %2d c %4x (%x) ",
-				     n, (isgraph (n) ? n : ' '), len,
-				     tree[n].Code, next_code[len] - 1));
     }
 }
 
@@ -666,12 +592,13 @@ gen_codes (tree, max_code)
  *     also updated if stree is not null. The field max_code is set.
  */
 static void
-build_tree (desc)
-     tree_desc *desc;		/* the tree descriptor */
+build_tree (struct native_deflate *s, tree_desc *desc)
 {
   ct_data *tree = desc->dyn_tree;
-  ct_data *stree = desc->static_tree;
+  ct_data const *stree = desc->static_tree;
   int elems = desc->elems;
+  int *heap = s->heap;
+  uch *depth = s->depth;
   int n, m;			/* iterate over heap elements */
   int max_code = -1;		/* largest code with non zero frequency */
   int node = elems;		/* next internal node of the tree */
@@ -680,13 +607,13 @@ build_tree (desc)
    * heap[SMALLEST]. The sons of heap[n] are heap[2*n] and heap[2*n+1].
    * heap[0] is not used.
    */
-  heap_len = 0, heap_max = HEAP_SIZE;
+  s->heap_len = 0, s->heap_max = HEAP_SIZE;
 
   for (n = 0; n < elems; n++)
     {
       if (tree[n].Freq != 0)
 	{
-	  heap[++heap_len] = max_code = n;
+	  heap[++s->heap_len] = max_code = n;
 	  depth[n] = 0;
 	}
       else
@@ -700,14 +627,14 @@ build_tree (desc)
    * possible code. So to avoid special checks later on we force at least
    * two codes of non zero frequency.
    */
-  while (heap_len < 2)
+  while (s->heap_len < 2)
     {
-      int new = heap[++heap_len] = (max_code < 2 ? ++max_code : 0);
+      int new = heap[++s->heap_len] = (max_code < 2 ? ++max_code : 0);
       tree[new].Freq = 1;
       depth[new] = 0;
-      opt_len--;
+      s->opt_len--;
       if (stree)
-	static_len -= stree[new].Len;
+	s->static_len -= stree[new].Len;
       /* new is 0 or 1 so it does not have extra bits */
     }
   desc->max_code = max_code;
@@ -715,47 +642,40 @@ build_tree (desc)
   /* The elements heap[heap_len/2+1 .. heap_len] are leaves of the tree,
    * establish sub-heaps of increasing lengths:
    */
-  for (n = heap_len / 2; n >= 1; n--)
-    pqdownheap (tree, n);
+  for (n = s->heap_len / 2; n >= 1; n--)
+    pqdownheap (s, tree, n);
 
   /* Construct the Huffman tree by repeatedly combining the least two
    * frequent nodes.
    */
   do
     {
-      pqremove (tree, n);	/* n = node of least frequency */
+      pqremove (s, tree, n);	/* n = node of least frequency */
       m = heap[SMALLEST];	/* m = node of next least frequency */
 
-      heap[--heap_max] = n;	/* keep the nodes sorted by frequency */
-      heap[--heap_max] = m;
+      heap[--s->heap_max] = n;	/* keep the nodes sorted by frequency */
+      heap[--s->heap_max] = m;
 
       /* Create a new node father of n and m */
       tree[node].Freq = tree[n].Freq + tree[m].Freq;
       depth[node] = (uch) (MAX (depth[n], depth[m]) + 1);
       tree[n].Dad = tree[m].Dad = (ush) node;
-#ifdef DUMP_BL_TREE
-      if (tree == bl_tree)
-	{
-	  fprintf (stderr, "\nnode %d(%d), sons %d(%d) %d(%d)",
-		   node, tree[node].Freq, n, tree[n].Freq, m, tree[m].Freq);
-	}
-#endif
       /* and insert the new node in the heap */
       heap[SMALLEST] = node++;
-      pqdownheap (tree, SMALLEST);
+      pqdownheap (s, tree, SMALLEST);
 
     }
-  while (heap_len >= 2);
+  while (s->heap_len >= 2);
 
-  heap[--heap_max] = heap[SMALLEST];
+  heap[--s->heap_max] = heap[SMALLEST];
 
   /* At this point, the fields freq and dad are set. We can now
    * generate the bit lengths.
    */
-  gen_bitlen ((tree_desc *) desc);
+  gen_bitlen (s, desc);
 
   /* The field len is now set, we can generate the bit codes */
-  gen_codes ((ct_data *) tree, max_code);
+  gen_codes (tree, max_code, s->bl_count);
 }
 
 /* ===========================================================================
@@ -765,10 +685,9 @@ build_tree (desc)
  * during the construction of bl_tree.)
  */
 static void
-scan_tree (tree, max_code)
-     ct_data *tree;		/* the tree to be scanned */
-     int max_code;		/* and its largest code of non zero frequency */
+scan_tree (struct native_deflate *s, ct_data *tree, int max_code)
 {
+  ct_data *bl_tree = s->bl_tree;
   int n;			/* iterates over all tree elements */
   int prevlen = -1;		/* last emitted length */
   int curlen;			/* length of current code */
@@ -829,10 +748,9 @@ scan_tree (tree, max_code)
  * bl_tree.
  */
 static void
-send_tree (tree, max_code)
-     ct_data *tree;		/* the tree to be scanned */
-     int max_code;		/* and its largest code of non zero frequency */
+send_tree (struct native_deflate *s, ct_data const *tree, int max_code)
 {
+  ct_data const *bl_tree = s->bl_tree;
   int n;			/* iterates over all tree elements */
   int prevlen = -1;		/* last emitted length */
   int curlen;			/* length of current code */
@@ -857,7 +775,7 @@ send_tree (tree, max_code)
 	{
 	  do
 	    {
-	      send_code (curlen, bl_tree);
+	      send_code (s, curlen, bl_tree);
 	    }
 	  while (--count != 0);
 
@@ -866,24 +784,23 @@ send_tree (tree, max_code)
 	{
 	  if (curlen != prevlen)
 	    {
-	      send_code (curlen, bl_tree);
+	      send_code (s, curlen, bl_tree);
 	      count--;
 	    }
-	  Assert (count >= 3 && count <= 6, " 3_6?");
-	  send_code (REP_3_6, bl_tree);
-	  send_bits (count - 3, 2);
+	  send_code (s, REP_3_6, bl_tree);
+	  send_bits (s, count - 3, 2);
 
 	}
       else if (count <= 10)
 	{
-	  send_code (REPZ_3_10, bl_tree);
-	  send_bits (count - 3, 3);
+	  send_code (s, REPZ_3_10, bl_tree);
+	  send_bits (s, count - 3, 3);
 
 	}
       else
 	{
-	  send_code (REPZ_11_138, bl_tree);
-	  send_bits (count - 11, 7);
+	  send_code (s, REPZ_11_138, bl_tree);
+	  send_bits (s, count - 11, 7);
 	}
       count = 0;
       prevlen = curlen;
@@ -907,16 +824,16 @@ send_tree (tree, max_code)
  * bl_order of the last bit length code to send.
  */
 static int
-build_bl_tree ()
+build_bl_tree (struct native_deflate *s)
 {
   int max_blindex;		/* index of last bit length code of non zero freq */
 
   /* Determine the bit length frequencies for literal and distance trees */
-  scan_tree ((ct_data *) dyn_ltree, l_desc.max_code);
-  scan_tree ((ct_data *) dyn_dtree, d_desc.max_code);
+  scan_tree (s, s->dyn_ltree, s->l_desc.max_code);
+  scan_tree (s, s->dyn_dtree, s->d_desc.max_code);
 
   /* Build the bit length tree: */
-  build_tree ((tree_desc *) (&bl_desc));
+  build_tree (s, &s->bl_desc);
   /* opt_len now includes the length of the tree representations, except
    * the lengths of the bit lengths codes and the 5+5+4 bits for the counts.
    */
@@ -927,12 +844,11 @@ build_bl_tree ()
    */
   for (max_blindex = BL_CODES - 1; max_blindex >= 3; max_blindex--)
     {
-      if (bl_tree[bl_order[max_blindex]].Len != 0)
+      if (s->bl_tree[bl_order[max_blindex]].Len != 0)
 	break;
     }
   /* Update opt_len to include the bit length tree and counts */
-  opt_len += 3 * (max_blindex + 1) + 5 + 5 + 4;
-  Tracev ((stderr, "\ndyn trees: dyn %lu, stat %lu", opt_len, static_len));
+  s->opt_len += 3 * (max_blindex + 1) + 5 + 5 + 4;
 
   return max_blindex;
 }
@@ -943,56 +859,39 @@ build_bl_tree ()
  * IN assertion: lcodes >= 257, dcodes >= 1, blcodes >= 4.
  */
 static void
-send_all_trees (lcodes, dcodes, blcodes)
-     int lcodes, dcodes, blcodes;	/* number of codes for each tree */
+send_all_trees (struct native_deflate *s, int lcodes, int dcodes,
+                int blcodes)
 {
   int rank;			/* index in bl_order */
 
-  Assert (lcodes >= 257 && dcodes >= 1 && blcodes >= 4, "not enough codes");
-  Assert (lcodes <= L_CODES && dcodes <= D_CODES && blcodes <= BL_CODES,
-	  "too many codes");
-  Tracev ((stderr, "\nbl counts: "));
-  send_bits (lcodes - 257, 5);	/* not +255 as stated in appnote.txt */
-  send_bits (dcodes - 1, 5);
-  send_bits (blcodes - 4, 4);	/* not -3 as stated in appnote.txt */
+  send_bits (s, lcodes - 257, 5);	/* not +255 as stated in appnote.txt */
+  send_bits (s, dcodes - 1, 5);
+  send_bits (s, blcodes - 4, 4);	/* not -3 as stated in appnote.txt */
   for (rank = 0; rank < blcodes; rank++)
     {
-      Tracev ((stderr, "\nbl code %2d ", bl_order[rank]));
-      send_bits (bl_tree[bl_order[rank]].Len, 3);
+      send_bits (s, s->bl_tree[bl_order[rank]].Len, 3);
     }
 
-  send_tree ((ct_data *) dyn_ltree, lcodes - 1);	/* send the literal tree */
+  send_tree (s, s->dyn_ltree, lcodes - 1);	/* send the literal tree */
 
-  send_tree ((ct_data *) dyn_dtree, dcodes - 1);	/* send the distance tree */
+  send_tree (s, s->dyn_dtree, dcodes - 1);	/* send the distance tree */
 }
 
 /* ===========================================================================
  * Determine the best encoding for the current block: dynamic trees, static
- * trees or store, and output the encoded block to the zip file. This function
- * returns the total compressed length for the file so far.
+ * trees or store, and output the encoded block.  BUF is the input of the
+ * block, or NULL if it is no longer in the window.
  */
-off_t
-flush_block (buf, stored_len, pad, eof)
-     char *buf;			/* input block, or NULL if too old */
-     ulg stored_len;		/* length of input block */
-     int pad;			/* pad output to byte boundary */
-     int eof;			/* true if this is the last block for a file */
+void
+flush_block (struct native_deflate *s, uch const *buf, ulg stored_len,
+             bool eof)
 {
   ulg opt_lenb, static_lenb;	/* opt_len and static_len in bytes */
   int max_blindex;		/* index of last bit length code of non zero freq */
 
-  flag_buf[last_flags] = flags;	/* Save the flags for the last 8 items */
-
-  /* Check if the file is ascii or binary */
-  if (*file_type == (ush) UNKNOWN)
-    set_file_type ();
-
   /* Construct the literal and distance trees */
-  build_tree ((tree_desc *) (&l_desc));
-  Tracev ((stderr, "\nlit data: dyn %lu, stat %lu", opt_len, static_len));
-
-  build_tree ((tree_desc *) (&d_desc));
-  Tracev ((stderr, "\ndist data: dyn %lu, stat %lu", opt_len, static_len));
+  build_tree (s, &s->l_desc);
+  build_tree (s, &s->d_desc);
   /* At this point, opt_len and static_len are the total bit lengths of
    * the compressed block data, excluding the tree representations.
    */
@@ -1000,244 +899,236 @@ flush_block (buf, stored_len, pad, eof)
   /* Build the bit length tree for the above two trees, and get the index
    * in bl_order of the last bit length code to send.
    */
-  max_blindex = build_bl_tree ();
+  max_blindex = build_bl_tree (s);
 
   /* Determine the best encoding. Compute first the block length in bytes */
-  opt_lenb = (opt_len + 3 + 7) >> 3;
-  static_lenb = (static_len + 3 + 7) >> 3;
-  input_len += stored_len;	/* for debugging only */
-
-  Trace ((stderr, "\nopt %lu(%lu) stat %lu(%lu) stored %lu lit %u dist %u ",
-	  opt_lenb, opt_len, static_lenb, static_len, stored_len,
-	  last_lit, last_dist));
+  opt_lenb = (s->opt_len + 3 + 7) >> 3;
+  static_lenb = (s->static_len + 3 + 7) >> 3;
 
   if (static_lenb <= opt_lenb)
     opt_lenb = static_lenb;
 
-  /* If compression failed and this is the first and last block,
-   * and if we can seek through the zip file (to rewrite the local header),
-   * the whole file is transformed into a stored file:
-   */
-#ifdef FORCE_METHOD
-  if (level == 1 && eof && compressed_len == 0L)
-    {				/* force stored file */
-#else
-  if (stored_len <= opt_lenb && eof && compressed_len == 0L && seekable ())
+  if (stored_len + 4 <= opt_lenb && buf != NULL)
     {
-#endif
-      /* Since LIT_BUFSIZE <= 2*WSIZE, the input data must be there: */
-      if (!buf)
-	gzip_error ("block vanished");
-
-      copy_block (buf, (unsigned) stored_len, 0);	/* without header */
-      compressed_len = stored_len << 3;
-      *file_method = STORED;
-
-#ifdef FORCE_METHOD
-    }
-  else if (level == 2 && buf != (char *) 0)
-    {				/* force stored block */
-#else
-    }
-  else if (stored_len + 4 <= opt_lenb && buf != (char *) 0)
-    {
-      /* 4: two words for the lengths */
-#endif
-      /* The test buf != NULL is only necessary if LIT_BUFSIZE > WSIZE.
-       * Otherwise we can't have processed more than WSIZE input bytes since
-       * the last block flush, because compression would have been
-       * successful. If LIT_BUFSIZE <= WSIZE, it is never too late to
-       * transform a block into a stored block.
+      /* 4: two words for the lengths.  A block longer than a stored
+       * block can be is split.
        */
-      send_bits ((STORED_BLOCK << 1) + eof, 3);	/* send block type */
-      compressed_len = (compressed_len + 3 + 7) & ~7L;
-      compressed_len += (stored_len + 4) << 3;
-
-      copy_block (buf, (unsigned) stored_len, 1);	/* with header */
-
-#ifdef FORCE_METHOD
-    }
-  else if (level == 3)
-    {				/* force static trees */
-#else
+      do
+        {
+          unsigned len = stored_len < MAX_STORED ? stored_len : MAX_STORED;
+          stored_len -= len;
+          send_bits (s, (STORED_BLOCK << 1) + (eof && stored_len == 0), 3);
+          copy_block (s, buf, len, true);
+          buf += len;
+        }
+      while (stored_len != 0);
     }
   else if (static_lenb == opt_lenb)
     {
-#endif
-      send_bits ((STATIC_TREES << 1) + eof, 3);
-      compress_block ((ct_data *) static_ltree, (ct_data *) static_dtree);
-      compressed_len += 3 + static_len;
+      send_bits (s, (STATIC_TREES << 1) + eof, 3);
+      compress_block (s, static_ltree, static_dtree);
     }
   else
     {
-      send_bits ((DYN_TREES << 1) + eof, 3);
-      send_all_trees (l_desc.max_code + 1, d_desc.max_code + 1,
+      send_bits (s, (DYN_TREES << 1) + eof, 3);
+      send_all_trees (s, s->l_desc.max_code + 1, s->d_desc.max_code + 1,
 		      max_blindex + 1);
-      compress_block ((ct_data *) dyn_ltree, (ct_data *) dyn_dtree);
-      compressed_len += 3 + opt_len;
+      compress_block (s, s->dyn_ltree, s->dyn_dtree);
     }
-  Assert (compressed_len == bits_sent, "bad compressed size");
-  init_block ();
+  init_block (s);
 
   if (eof)
+    bi_windup (s);
+}
+
+/* ===========================================================================
+ * Pad the output to a byte boundary after the end of a block, which is
+ * also the end of what has been output so far.  Each empty block with
+ * static trees takes 10 bits, so up to three of them make up an even
+ * number of missing bits; an odd number takes an empty stored block.
+ */
+void
+ct_align (struct native_deflate *s)
+{
+  if (s->bi_valid & 1)
     {
-      Assert (input_len == bytes_in, "bad input size");
-      bi_windup ();
-      compressed_len += 7;	/* align on byte boundary */
+      send_bits (s, STORED_BLOCK << 1, 3);
+      copy_block (s, NULL, 0, true);
     }
-  else if (pad && (compressed_len % 8) != 0)
+  while (s->bi_valid & 7)
     {
-      send_bits ((STORED_BLOCK << 1) + eof, 3);	/* send block type */
-      compressed_len = (compressed_len + 3 + 7) & ~7L;
-      copy_block (buf, 0, 1);	/* with header */
+      send_bits (s, STATIC_TREES << 1, 3);
+      send_code (s, END_BLOCK, static_ltree);
     }
+  bi_windup (s);
+}
 
-  return compressed_len >> 3;
+/* ===========================================================================
+ * Return the entropy of the N frequencies FREQ, in 256ths of a bit: about
+ * the length of their data coded with their own Huffman tree.
+ */
+uint64_t
+ct_entropy (unsigned const *freq, int n)
+{
+  uint64_t total = 0, sum = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (freq[i] != 0)
+      {
+        total += freq[i];
+        sum += (uint64_t) freq[i] * log2_q8 (freq[i]);
+      }
+  return total == 0 ? 0 : total * log2_q8 ((unsigned) total) - sum;
 }
 
 /* ===========================================================================
- * Save the match info and tally the frequency counts. Return true if
- * the current block must be flushed.
+ * If the last SPLIT_CHUNK literals and matches of the current block are
+ * estimated to be coded better with trees of their own, by more than the
+ * trees cost, flush the block before them and keep them as the start of
+ * the next one.  Only the input of native_deflate_block, which stays in
+ * memory, allows this, since the block flushed may have to be stored.
  */
-int
-ct_tally (dist, lc)
-     int dist;			/* distance of matched string */
-     int lc;			/* match length-MIN_MATCH or unmatched char (if dist==0) */
+static void
+split_block (struct native_deflate *s)
 {
-  l_buf[last_lit++] = (uch) lc;
-  if (dist == 0)
+  unsigned head = s->last_lit - SPLIT_CHUNK;	/* symbols before the chunk */
+  unsigned lfreq[3][L_CODES], dfreq[3][D_CODES];	/* head, chunk, both */
+  unsigned lx, dists = 0;
+  ulg stored_len = 0;
+  int n;
+
+  if (head == 0)
+    return;
+  memset (lfreq[1], 0, sizeof lfreq[1]);
+  memset (dfreq[1], 0, sizeof dfreq[1]);
+  for (lx = head; lx < s->last_lit; lx++)
     {
-      /* lc is the unmatched char */
-      dyn_ltree[lc].Freq++;
+      unsigned dist = s->d_buf[lx];
+      unsigned lc = s->l_buf[lx];
+
+      if (dist == 0)
+        lfreq[1][lc]++;
+      else
+        {
+          lfreq[1][length_code[lc] + LITERALS + 1]++;
+          dfreq[1][d_code (dist - 1)]++;
+          dists++;
+        }
     }
-  else
+  for (n = 0; n < L_CODES; n++)
     {
-      /* Here, lc is the match length - MIN_MATCH */
-      dist--;			/* dist = match distance - 1 */
-      Assert ((ush) dist < (ush) MAX_DIST &&
-	      (ush) lc <= (ush) (MAX_MATCH - MIN_MATCH) &&
-	      (ush) d_code (dist) < (ush) D_CODES, "ct_tally: bad match");
-
-      dyn_ltree[length_code[lc] + LITERALS + 1].Freq++;
-      dyn_dtree[d_code (dist)].Freq++;
-
-      d_buf[last_dist++] = (ush) dist;
-      flags |= flag_bit;
+      lfreq[2][n] = s->dyn_ltree[n].Freq;
+      lfreq[0][n] = lfreq[2][n] - lfreq[1][n];
+    }
+  for (n = 0; n < D_CODES; n++)
+    {
+      dfreq[2][n] = s->dyn_dtree[n].Freq;
+      dfreq[0][n] = dfreq[2][n] - dfreq[1][n];
     }
-  flag_bit <<= 1;
+  if (ct_entropy (lfreq[0], L_CODES) + ct_entropy (dfreq[0], D_CODES)
+      + ct_entropy (lfreq[1], L_CODES) + ct_entropy (dfreq[1], D_CODES)
+      + (SPLIT_TREE_BITS << 8)
+      >= ct_entropy (lfreq[2], L_CODES) + ct_entropy (dfreq[2], D_CODES))
+    return;
+
+  /* Flush the head alone, with its own frequencies.  */
+  for (lx = 0; lx < head; lx++)
+    stored_len += s->d_buf[lx] == 0 ? 1 : s->l_buf[lx] + MIN_MATCH;
+  for (n = 0; n < L_CODES; n++)
+    s->dyn_ltree[n].Freq = lfreq[0][n];
+  for (n = 0; n < D_CODES; n++)
+    s->dyn_dtree[n].Freq = dfreq[0][n];
+  s->dyn_ltree[END_BLOCK].Freq = 1;
+  s->last_lit = head;
+  s->last_dist -= dists;
+  flush_block (s, block_data (s), stored_len, false);
+  s->block_start += (long) stored_len;
+
+  /* The chunk starts the next block.  */
+  memmove (s->l_buf, s->l_buf + head, SPLIT_CHUNK);
+  memmove (s->d_buf, s->d_buf + head, SPLIT_CHUNK * sizeof *s->d_buf);
+  for (n = 0; n < L_CODES; n++)
+    s->dyn_ltree[n].Freq = lfreq[1][n];
+  for (n = 0; n < D_CODES; n++)
+    s->dyn_dtree[n].Freq = dfreq[1][n];
+  s->dyn_ltree[END_BLOCK].Freq = 1;
+  s->last_lit = SPLIT_CHUNK;
+  s->last_dist = dists;
+}
 
-  /* Output the flags if they fill a byte: */
-  if ((last_lit & 7) == 0)
+/* ===========================================================================
+ * Return true if it is profitable to stop the current block here, which
+ * ct_tally asks every SPLIT_CHUNK literals and matches.  With whole
+ * input, at the lazy levels, whose matching costs far more than the
+ * estimate, split_block decides instead, from the statistics of the data.
+ */
+bool
+ct_end_block (struct native_deflate *s)
+{
+  if (s->whole && s->level >= 4)
     {
-      flag_buf[last_flags++] = flags;
-      flags = 0, flag_bit = 1;
+      split_block (s);
+      return false;
     }
-  /* Try to guess if it is profitable to stop the current block here */
-  if (level > 2 && (last_lit & 0xfff) == 0)
+  if (s->level <= 2)
+    return false;
+
+  /* Compute an upper bound for the compressed length */
+  ulg out_length = (ulg) s->last_lit * 8L;
+  ulg in_length = (ulg) ((long) s->strstart - s->block_start);
+  int dcode;
+  for (dcode = 0; dcode < D_CODES; dcode++)
     {
-      /* Compute an upper bound for the compressed length */
-      ulg out_length = (ulg) last_lit * 8L;
-      ulg in_length = (ulg) strstart - block_start;
-      int dcode;
-      for (dcode = 0; dcode < D_CODES; dcode++)
-	{
-	  out_length +=
-	    (ulg) dyn_dtree[dcode].Freq * (5L + extra_dbits[dcode]);
-	}
-      out_length >>= 3;
-      Trace ((stderr, "\nlast_lit %u, last_dist %u, in %ld, out ~%ld(%ld%%) ",
-	      last_lit, last_dist, in_length, out_length,
-	      100L - out_length * 100L / in_length));
-      if (last_dist < last_lit / 2 && out_length < in_length / 2)
-	return 1;
+      out_length +=
+	(ulg) s->dyn_dtree[dcode].Freq * (5L + extra_dbits[dcode]);
     }
-  return (last_lit == LIT_BUFSIZE - 1 || last_dist == DIST_BUFSIZE);
-  /* We avoid equality with LIT_BUFSIZE because of wraparound at 64K
-   * on 16 bit machines and because stored blocks are restricted to
-   * 64K-1 bytes.
-   */
+  out_length >>= 3;
+  return s->last_dist < s->last_lit / 2 && out_length < in_length / 2;
 }
 
 /* ===========================================================================
  * Send the block data compressed using the given Huffman trees
  */
 static void
-compress_block (ltree, dtree)
-     ct_data *ltree;		/* literal tree */
-     ct_data *dtree;		/* distance tree */
+compress_block (struct native_deflate *s, ct_data const *ltree,
+                ct_data const *dtree)
 {
   unsigned dist;		/* distance of matched string */
   int lc;			/* match length or unmatched char (if dist == 0) */
-  unsigned lx = 0;		/* running index in l_buf */
-  unsigned dx = 0;		/* running index in d_buf */
-  unsigned fx = 0;		/* running index in flag_buf */
-  uch flag = 0;			/* current flags */
+  unsigned lx;			/* running index in l_buf and d_buf */
   unsigned code;		/* the code to send */
-  int extra;			/* number of extra bits to send */
-
-  if (last_lit != 0)
-    do
-      {
-	if ((lx & 7) == 0)
-	  flag = flag_buf[fx++];
-	lc = l_buf[lx++];
-	if ((flag & 1) == 0)
-	  {
-	    send_code (lc, ltree);	/* send a literal byte */
-	    Tracecv (isgraph (lc), (stderr, " '%c' ", lc));
-	  }
-	else
-	  {
-	    /* Here, lc is the match length - MIN_MATCH */
-	    code = length_code[lc];
-	    send_code (code + LITERALS + 1, ltree);	/* send the length code */
-	    extra = extra_lbits[code];
-	    if (extra != 0)
-	      {
-		lc -= base_length[code];
-		send_bits (lc, extra);	/* send the extra length bits */
-	      }
-	    dist = d_buf[dx++];
-	    /* Here, dist is the match distance - 1 */
-	    code = d_code (dist);
-	    Assert (code < D_CODES, "bad d_code");
-
-	    send_code (code, dtree);	/* send the distance code */
-	    extra = extra_dbits[code];
-	    if (extra != 0)
-	      {
-		dist -= base_dist[code];
-		send_bits (dist, extra);	/* send the extra distance bits */
-	      }
-	  }			/* literal or match pair ? */
-	flag >>= 1;
-      }
-    while (lx < last_lit);
+  uint64_t bits;		/* a whole match, sent at once */
+  int len;			/* number of bits in BITS */
 
-  send_code (END_BLOCK, ltree);
-}
-
-/* ===========================================================================
- * Set the file type to ASCII or BINARY, using a crude approximation:
- * binary if more than 20% of the bytes are <= 6 or >= 128, ascii otherwise.
- * IN assertion: the fields freq of dyn_ltree are set and the total of all
- * frequencies does not exceed 64K (to fit in an int on 16 bit machines).
- */
-static void
-set_file_type ()
-{
-  int n = 0;
-  unsigned ascii_freq = 0;
-  unsigned bin_freq = 0;
-  while (n < 7)
-    bin_freq += dyn_ltree[n++].Freq;
-  while (n < 128)
-    ascii_freq += dyn_ltree[n++].Freq;
-  while (n < LITERALS)
-    bin_freq += dyn_ltree[n++].Freq;
-  *file_type = bin_freq > (ascii_freq >> 2) ? BINARY : ASCII;
-  if (*file_type == BINARY && translate_eol)
+  for (lx = 0; lx < s->last_lit; lx++)
     {
-      warning ("-l used on binary file");
+      lc = s->l_buf[lx];
+      dist = s->d_buf[lx];
+      if (dist == 0)
+	{
+	  send_code (s, lc, ltree);	/* send a literal byte */
+	  continue;
+	}
+
+      /* Here, lc is the match length - MIN_MATCH.  The length code, its
+       * extra bits, the distance code and its extra bits, at most 48
+       * bits in all, go out together.
+       */
+      code = length_code[lc];
+      bits = ltree[code + LITERALS + 1].Code;
+      len = ltree[code + LITERALS + 1].Len;
+      bits |= (uint64_t) (lc - base_length[code]) << len;
+      len += extra_lbits[code];
+
+      dist--;			/* dist is now the match distance - 1 */
+      code = d_code (dist);
+      bits |= (uint64_t) dtree[code].Code << len;
+      len += dtree[code].Len;
+      bits |= (uint64_t) (dist - base_dist[code]) << len;
+      len += extra_dbits[code];
+      send_bits (s, bits, len);
     }
+
+  send_code (s, END_BLOCK, ltree);
 }
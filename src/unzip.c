@@ -38,6 +38,12 @@
 #include <unistd.h>
 #include <sys/errno.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#include "parallel.h"
 #define CHUNK 16384
 
 /* PKZIP header definitions */
@@ -61,6 +67,7 @@
 
 static int decrypt;		/* flag to turn on decryption */
 static int ext_header = 0;	/* set if extended local header */
+struct pipeline_stats unzip_stats;	/* all files inflated so far */
 
 /* ===========================================================================
  * Check zip file and advance inptr to the start of the compressed data.
@@ -110,6 +117,251 @@ check_zipfile (int in)
   return OK;
 }
 
+/* Map the regular file FD for the inflaters to read in place.  Set *SIZE
+   to the size of the mapping, which covers the whole file, and *POS to
+   the offset in it of inbuf[0].  Return the mapping, or NULL if FD is
+   not a regular file with data past inbuf or cannot be mapped.  Reads
+   that must go through read_buffer, for --no-cache or --background, are
+   not mapped.  */
+static unsigned char *
+map_input (int fd, size_t *size, off_t *pos)
+{
+#ifdef HAVE_SYS_MMAN_H
+  struct stat st;
+  void *map;
+
+  if (no_cache || background_rate || fstat (fd, &st) != 0
+      || !S_ISREG (st.st_mode) || SIZE_MAX < (uintmax_t) st.st_size)
+    return NULL;
+  *pos = lseek (fd, 0, SEEK_CUR) - insize;
+  if (*pos < 0 || st.st_size <= *pos + (off_t) insize)
+    return NULL;
+  *size = st.st_size;
+  map = mmap (NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+# ifdef MADV_SEQUENTIAL
+  madvise (map, *size, MADV_SEQUENTIAL);
+# endif
+  return map;
+#else
+  return NULL;
+#endif
+}
+
+/* Release the mapping MAP of SIZE bytes from map_input, if any.  */
+static void
+unmap_input (unsigned char *map, size_t size)
+{
+#ifdef HAVE_SYS_MMAN_H
+  if (map != NULL)
+    munmap (map, size);
+#endif
+}
+
+/* What the decoders of inflate_mapped work with.  */
+struct mapped_state
+{
+  int dest;
+  bool sparse;
+  bool write_failed;
+  unsigned long crc;
+  uint64_t total;
+  double write_busy;
+};
+
+/* Write LEN bytes of output at BUF.  Return 0, or -1 if the write
+   failed.  */
+static int
+mapped_output (void *opaque, unsigned char const *buf, size_t len)
+{
+  struct mapped_state *m = opaque;
+  double t = pipeline_stats_now ();
+  int written;
+
+  for (size_t done = 0; done < len; done += written)
+    {
+      unsigned n = len - done < INT_MAX ? len - done : INT_MAX;
+      if (m->sparse)
+	written = write_sparse (m->dest, (voidp) (buf + done), n);
+      else
+	{
+	  written = write (m->dest, buf + done, n);
+	  if (written > 0)
+	    uncache (m->dest, written, true);
+	}
+      if (written <= 0)
+	{
+	  m->write_failed = true;
+	  break;
+	}
+    }
+  m->write_busy += pipeline_stats_now () - t;
+  return m->write_failed ? -1 : 0;
+}
+
+/* Check and write LEN bytes of output at BUF; -t only checks them.  */
+static int
+mapped_write (void *opaque, unsigned char const *buf, size_t len)
+{
+  struct mapped_state *m = opaque;
+
+  m->crc = crc32_z (m->crc, buf, len);
+  m->total += len;
+  return test ? 0 : mapped_output (opaque, buf, len);
+}
+
+/* The engine that decodes: the one --engine asked for, or else the one
+   for this machine.  */
+static struct deflate_engine const *
+decoder (void)
+{
+  return engine != NULL ? engine : deflate_engine_default (true);
+}
+
+/* Inflate the member at offset POS of the SIZE bytes mapped at MAP to
+   DEST, checking the gzip header and trailer here.  The decoder reads
+   the mapping in place.  With -j, the members that directly follow are
+   decoded too, in parallel.  Return false, having done nothing,
+   if the header is not a plain one; otherwise set *RET to a zlib return
+   code and add to STATS.  */
+static bool
+inflate_mapped (unsigned char *map, size_t size, off_t pos, int dest,
+		bool sparse, struct pipeline_stats *stats, int *ret)
+{
+  struct mapped_state m;
+  size_t header = gzip_header_length (map + pos, size - pos);
+  double start = pipeline_stats_now ();
+  unsigned char const *trailer;
+  size_t after, used;
+  double decode = 0;
+
+  if (header == 0)
+    return false;
+  m.dest = dest;
+  m.sparse = sparse;
+  m.write_failed = false;
+  m.crc = crc32 (0L, Z_NULL, 0);
+  m.total = 0;
+  m.write_busy = 0;
+
+  if (1 < threads)
+    {
+      struct pipeline_stats members;
+      struct member_params params = {
+	.threads = threads,
+	.engine = decoder (),
+	.write = test ? NULL : mapped_output,
+	.opaque = &m,
+	.stats = &members
+      };
+      *ret = parallel_inflate (&params, map + pos + header,
+			       size - pos - header, &used);
+      trailer = map + pos + header + used;
+      m.total = members.bytes_out;
+      decode = members.compress_busy;
+    }
+  else
+    {
+      *ret = decoder ()->inflate (map + pos + header, size - pos - header,
+				  &used, mapped_write, &m);
+      trailer = map + pos + header + used;
+    }
+  after = size - pos - header - used;
+
+  /* The input after the deflate data, which should start with the
+     trailer: the CRC and the length modulo 2^32, both little endian.  */
+  if (*ret == Z_OK && threads <= 1)
+    {
+      *ret = Z_DATA_ERROR;
+      if (8 <= after)
+	{
+	  unsigned long crc = (trailer[0] | trailer[1] << 8
+			       | trailer[2] << 16
+			       | (unsigned long) trailer[3] << 24);
+	  unsigned long isize = (trailer[4] | trailer[5] << 8
+				 | trailer[6] << 16
+				 | (unsigned long) trailer[7] << 24);
+	  if (crc == m.crc && isize == (m.total & 0xffffffff))
+	    {
+	      *ret = Z_OK;
+	      trailer += 8;
+	    }
+	}
+    }
+  if (*ret == Z_OK && sparse && finish_sparse (dest) != 0)
+    *ret = Z_ERRNO;
+
+  inptr = trailer - (map + pos);
+  stats->bytes_in += inptr;
+  stats->bytes_out += m.total;
+  stats->write_busy += m.write_busy;
+  if (threads <= 1)
+    decode = pipeline_stats_now () - start - m.write_busy;
+  stats->compress_busy += decode;
+  return true;
+}
+
+/* Test the file NAME, for -t on many files at once: decode all its
+   members from a mapping, without gzip's buffers and globals, and
+   discard the output.  Return true, filling in STATS, if the file is
+   regular and holds nothing but good members with plain headers, and
+   false, having said nothing, if it is anything else, so that it is
+   tested the usual way, errors and warnings included.  */
+bool
+test_mapped (char const *name, struct pipeline_stats *stats)
+{
+#ifdef HAVE_SYS_MMAN_H
+  struct stat st;
+  unsigned char *map;
+  size_t size, header, used;
+  double start = pipeline_stats_now ();
+  bool ok = false;
+  int fd;
+
+  if (no_cache || background_rate)
+    return false;
+  fd = open (name, O_RDONLY | O_NOCTTY);
+  if (fd < 0)
+    return false;
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode)
+      || SIZE_MAX < (uintmax_t) st.st_size || st.st_size == 0)
+    {
+      close (fd);
+      return false;
+    }
+  size = st.st_size;
+  map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return false;
+# ifdef MADV_SEQUENTIAL
+  madvise (map, size, MADV_SEQUENTIAL);
+# endif
+
+  /* A header CRC is only checked by get_method.  */
+  header = gzip_header_length (map, size);
+  if (header != 0 && !(map[3] & HEADER_CRC))
+    {
+      struct member_params params = {
+	.threads = 0,
+	.engine = decoder (),
+	.write = NULL,
+	.stats = stats
+      };
+      ok = (parallel_inflate (&params, map + header, size - header, &used)
+	    == Z_OK && header + used == size);
+      stats->bytes_in = size;
+      stats->wall = pipeline_stats_now () - start;
+      stats->threads = 0;
+    }
+  munmap (map, size);
+  return ok;
+#else
+  return false;
+#endif
+}
+
 /* Inflate pkzip files using zlib
  *
  * This function assumes that check_zipfile has already been run, and that inptr
@@ -137,6 +389,28 @@ inflatePKZIP (void)
   memcpy (&original_crc, inbuf + LOCCRC, 4);
   uLong crc = crc32 (0L, Z_NULL, 0);
 
+  // decode a mapped file in place with the native decoder
+  size_t map_size;
+  off_t map_pos;
+  unsigned char *map = map_input (source, &map_size, &map_pos);
+  if (map != NULL)
+    {
+      struct mapped_state m = { 0 };
+      size_t used;
+      m.dest = dest;
+      m.crc = crc;
+      map_pos += inptr;
+      ret = decoder ()->inflate (map + map_pos, map_size - map_pos, &used,
+				 mapped_write, &m);
+      inptr += used;
+      unmap_input (map, map_size);
+      if (ret == Z_OK && m.crc != original_crc)
+	{
+	  ret = Z_DATA_ERROR;
+	}
+      return ret;
+    }
+
   // assumes that check_zipfile incremented inptr to the first data value.
   if ((insize - inptr) > 0)
     {
@@ -221,7 +495,8 @@ inflatePKZIP (void)
 	  new_crc = crc32_z (new_crc, out, writtenOutBytes);
 	  crc = crc32_combine (crc, new_crc, writtenOutBytes);
 
-	  int bytes_written = write (dest, out, writtenOutBytes);
+	  int bytes_written = (test ? writtenOutBytes
+			       : write (dest, out, writtenOutBytes));
 	  if (bytes_written != writtenOutBytes)
 	    {
 	      (void) inflateEnd (&strm);
@@ -248,6 +523,28 @@ inflatePKZIP (void)
   return result;
 }
 
+/* Put back the LEN bytes at BUF that were read from SOURCE past the end
+   of a member, for get_method to look at.  If they start a gzip header,
+   read the rest of it too, as the decoders parse it again from
+   inbuf[0].  */
+static void
+unread_input (int source, unsigned char const *buf, size_t len)
+{
+  memmove (inbuf, buf, len);
+  insize = len;
+  inptr = 0;
+  while (0 < insize && insize < CHUNK && inbuf[0] == 0x1f
+	 && (insize < 2 || inbuf[1] == 0x8b)
+	 && gzip_header_length (inbuf, insize) == 0)
+    {
+      int n = read_buffer (source, inbuf + insize, CHUNK - insize);
+      if (n <= 0)
+	break;
+      insize += n;
+      bytes_in += n;
+    }
+}
+
 /* Inflate gzip files using zlib
  */
 int
@@ -262,11 +559,32 @@ inflateGZIP (void)
   int dest = ofd;		// set to global output fd
   bool read_prev = false;
   int bytes_to_read = CHUNK;
+  /* A regular file is inflated straight from a mapping of it.  */
+  size_t map_size;
+  off_t map_pos;
+  unsigned char *map = map_input (source, &map_size, &map_pos);
+  /* A file that gzip created itself may be given holes.  */
+  bool sparse = !to_stdout;
+  struct pipeline_stats stats = { 0 };
+  double start = pipeline_stats_now ();
+  double t;
 
   memzero (in, CHUNK);
   memzero (out, CHUNK);
 
-  if (insize > 0)
+  /* Whole members of a mapped file can be decoded faster in place.  */
+  if (map != NULL
+      && inflate_mapped (map, map_size, map_pos, dest, sparse, &stats, &ret))
+    {
+      lseek (source, map_pos + inptr, SEEK_SET);
+      insize = inptr = 0;
+      unmap_input (map, map_size);
+      stats.wall = pipeline_stats_now () - start;
+      pipeline_stats_add (&unzip_stats, &stats);
+      return ret;
+    }
+
+  if (insize > 0 && map == NULL)
     {
       memmove ((char *) in, (char *) inbuf, insize);
       bytes_to_read -= insize;
@@ -281,26 +599,41 @@ inflateGZIP (void)
   strm.next_in = Z_NULL;
   ret = inflateInit2 (&strm, MAX_WBITS + 16);
   if (ret != Z_OK)
-    return ret;
+    {
+      unmap_input (map, map_size);
+      return ret;
+    }
 
   /* decompress until deflate stream ends or end of file */
   do
     {
       int read_in;
-      if (read_prev)
+      t = pipeline_stats_now ();
+      if (map != NULL)
 	{
-	  read_in = read (source, in + insize, bytes_to_read);
+	  /* Hand inflate as much of the mapping as it can take.  */
+	  size_t left = map_size - map_pos;
+	  read_in = left < INT_MAX ? left : INT_MAX;
+	  strm.avail_in = read_in;
+	  strm.next_in = map + map_pos;
+	  map_pos += read_in;
+	}
+      else if (read_prev)
+	{
+	  read_in = read_buffer (source, in + insize, bytes_to_read);
 	}
       else
 	{
-	  read_in = read (source, in, CHUNK);
+	  read_in = read_buffer (source, in, CHUNK);
 	}
+      stats.read_busy += pipeline_stats_now () - t;
       if (read_in < 0)
 	{
 	  (void) inflateEnd (&strm);
+	  unmap_input (map, map_size);
 	  return Z_ERRNO;
 	}
-      else
+      else if (map == NULL)
 	{
 	  if (read_prev)
 	    {
@@ -311,19 +644,22 @@ inflateGZIP (void)
 	    {
 	      strm.avail_in = read_in;
 	    }
+	  strm.next_in = in;
 	}
       if (strm.avail_in == 0)
 	{
 	  break;
 	}
-      strm.next_in = in;
+      stats.bytes_in += strm.avail_in;
 
       /* run inflate() on input until output buffer not full */
       do
 	{
 	  strm.avail_out = CHUNK;
 	  strm.next_out = out;
+	  t = pipeline_stats_now ();
 	  ret = inflate (&strm, Z_NO_FLUSH);
+	  stats.compress_busy += pipeline_stats_now () - t;
 	  /* We need this line for a nasty side effect:
 	   * inptr must be set to the end of the input buffer for
 	   * input_eof to recognize that
@@ -345,13 +681,28 @@ inflateGZIP (void)
 	    case Z_DATA_ERROR:
 	    case Z_MEM_ERROR:
 	      (void) inflateEnd (&strm);
+	      unmap_input (map, map_size);
 	      return ret;
 	    }
 	  writtenOutBytes = CHUNK - strm.avail_out;
-	  int bytes_written = write (dest, out, writtenOutBytes);
+	  t = pipeline_stats_now ();
+	  int bytes_written;
+	  if (test)
+	    bytes_written = writtenOutBytes;
+	  else if (sparse)
+	    bytes_written = write_sparse (dest, out, writtenOutBytes);
+	  else
+	    {
+	      bytes_written = write (dest, out, writtenOutBytes);
+	      if (bytes_written > 0)
+		uncache (dest, bytes_written, true);
+	    }
+	  stats.write_busy += pipeline_stats_now () - t;
+	  stats.bytes_out += writtenOutBytes;
 	  if (bytes_written != writtenOutBytes)
 	    {
 	      (void) inflateEnd (&strm);
+	      unmap_input (map, map_size);
 	      return Z_ERRNO;
 	    }
 	}
@@ -359,6 +710,23 @@ inflateGZIP (void)
       /* done when inflate() says it's done */
     }
   while (ret != Z_STREAM_END);
+  if (sparse && finish_sparse (dest) != 0)
+    {
+      (void) inflateEnd (&strm);
+      unmap_input (map, map_size);
+      return Z_ERRNO;
+    }
+  if (map != NULL)
+    {
+      /* Leave the file offset just past the member.  */
+      lseek (source, map_pos - strm.avail_in, SEEK_SET);
+      insize = inptr = 0;
+      unmap_input (map, map_size);
+    }
+  else
+    unread_input (source, strm.next_in, strm.avail_in);
+  stats.wall = pipeline_stats_now () - start;
+  pipeline_stats_add (&unzip_stats, &stats);
   /* clean up and return */
   int end_ret = inflateEnd (&strm);
   if (end_ret == Z_STREAM_ERROR)
@@ -393,12 +761,12 @@ unzip (int in, int out)
 	}
       else
 	{
-
 #ifdef IBM_Z_DFLTCC
-	  res = dfltcc_inflate ();
-#else
-	  res = inflateGZIP ();
+	  if (decoder () == &dfltcc_engine)
+	    res = dfltcc_inflate ();
+	  else
 #endif
+	    res = inflateGZIP ();
 
 	}
 
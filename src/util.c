@@ -26,178 +26,176 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
 
 #include "tailor.h"
 #include "gzip.h"
+#include "parallel.h"
 #include <dirname.h>
 #include <xalloc.h>
+#include "ignore-value.h"
 
 #ifndef CHAR_BIT
 #define CHAR_BIT 8
 #endif
 
+/* With --no-cache, pages are dropped from the page cache a window of
+   this many bytes at a time.  */
+#define CACHE_WINDOW (8L << 20)
+
+/* How far the pages of a file have been dropped.  */
+struct cache_cursor
+{
+  int fd;		/* the file, or -1 */
+  off_t dropped;	/* pages before this offset have been dropped */
+  off_t flushing;	/* writeback was started up to this offset */
+  off_t end;		/* offset reached, or -1 if FD cannot seek */
+};
+
+static struct cache_cursor read_cursor = { -1, 0, 0, 0 };
+static struct cache_cursor write_cursor = { -1, 0, 0, 0 };
+
+/* write_sparse leaves a hole in place of each aligned block of this many
+   zeros, the usual file system block size.  */
+#define SPARSE_BLOCK 4096
+
+/* Where write_sparse is in its output file.  */
+static int sparse_fd = -1;	/* the file, or -1 */
+static off_t sparse_pos;	/* offset of the next byte */
+static bool sparse_tail;	/* the file ends in a hole not yet extended
+				   to sparse_pos */
+
 static int write_buffer (int, voidp, unsigned int);
 
-/* ========================================================================
- * Table of CRC-32's of all single-byte values (made by makecrc.c)
+/* Capacity asked of the pipes gzip reads and writes.  1 MiB is the
+   default limit for unprivileged users in /proc/sys/fs/pipe-max-size.  */
+#define PIPE_CAPACITY (1 << 20)
+
+/* Bytes moved by each copy_file_range or splice call in copy.  */
+#define COPY_CHUNK (1 << 20)
+
+/* ===========================================================================
+ * If FD is a pipe, raise its capacity to PIPE_CAPACITY, so that gzip and
+ * the process at the other end can each run further ahead of the other
+ * and switch less often.  A pipe that is already as big is left alone.
  */
-static const ulg crc_32_tab[] = {
-  0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
-  0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
-  0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
-  0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
-  0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
-  0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
-  0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
-  0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
-  0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
-  0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
-  0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
-  0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
-  0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
-  0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
-  0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
-  0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
-  0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
-  0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
-  0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
-  0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
-  0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
-  0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
-  0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
-  0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
-  0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
-  0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
-  0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
-  0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
-  0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
-  0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
-  0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
-  0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
-  0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
-  0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
-  0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
-  0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
-  0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
-  0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
-  0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
-  0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
-  0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
-  0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
-  0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
-  0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
-  0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
-  0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
-  0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
-  0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
-  0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
-  0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
-  0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
-  0x2d02ef8dL
-};
+void
+grow_pipe (int fd)
+{
+#if defined F_SETPIPE_SZ && defined F_GETPIPE_SZ
+  int size = fcntl (fd, F_GETPIPE_SZ);
+  if (0 <= size && size < PIPE_CAPACITY)
+    ignore_value (fcntl (fd, F_SETPIPE_SZ, PIPE_CAPACITY));
+#endif
+}
 
-/* Shift register contents.  */
-static ulg crc = 0xffffffffL;
+/* How copy moves data, from the fastest way down.  */
+enum copy_method { COPY_RANGE, COPY_SPLICE, COPY_BUFFER };
+
+/* Move up to COPY_CHUNK bytes from SOURCE to DEST in the kernel: with
+   copy_file_range between files, or splice when either end is a pipe.
+   Return the number of bytes moved, 0 at end of input, or -1 with
+   errno set.  If *METHOD does not work for these files, step it down
+   and try the next one; at COPY_BUFFER return -1 with errno EINVAL.
+   FIRST is set for the first call of a copy.  */
+static ssize_t
+copy_in_kernel (int source, int dest, bool first, enum copy_method *method)
+{
+  ssize_t n;
+
+  switch (*method)
+    {
+    case COPY_RANGE:
+#ifdef HAVE_COPY_FILE_RANGE
+      n = copy_file_range (source, NULL, dest, NULL, COPY_CHUNK, 0);
+      /* Linux 5.3 to 5.11 copy nothing from procfs, sysfs and the like
+	 and return 0 as if at end of input, so as coreutils does, let
+	 a read confirm an end of input found straight away.  */
+      if (n == 0 && first)
+	{
+	  *method = COPY_BUFFER;
+	  errno = EINVAL;
+	  return -1;
+	}
+      if (0 <= n || (errno != EINVAL && errno != EXDEV && errno != ENOSYS
+		     && errno != EBADF && errno != EOPNOTSUPP))
+	return n;
+#endif
+      *method = COPY_SPLICE;
+      FALLTHROUGH;
+    case COPY_SPLICE:
+#ifdef HAVE_SPLICE
+      n = splice (source, NULL, dest, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+      if (0 <= n || (errno != EINVAL && errno != ENOSYS && errno != EAGAIN))
+	return n;
+#endif
+      *method = COPY_BUFFER;
+      FALLTHROUGH;
+    default:
+      errno = EINVAL;
+      return -1;
+    }
+}
 
 /* ===========================================================================
  * Copy input to output unchanged: zcat == cat with --force.
  * IN assertion: insize bytes have already been read in inbuf and inptr bytes
  * already processed or copied.
+ * The rest is moved by the kernel where it can, so that plain files
+ * passed through never enter user space, except with --background or
+ * --no-cache.
  */
 int
 copy (int source, int dest)	/* input and output file descriptors */
 {
   unsigned char in[CHUNK];
-  bool read_prev = false;
-  int bytes_to_read = CHUNK;
+  /* Data moved in the kernel escapes the pacing of --background and the
+     page dropping of --no-cache, both done by read_buffer.  */
+  enum copy_method method = (background_rate || no_cache
+			     ? COPY_BUFFER : COPY_RANGE);
   const int COPY_ERROR = -1;
+  ssize_t n = insize;
 
-  memzero (in, CHUNK);
-
-  if (insize > 0)
+  grow_pipe (source);
+  grow_pipe (dest);
+  if (n > 0 && write_buffer (dest, inbuf, n) != n)
     {
-      memmove ((char *) in, (char *) inbuf, insize);
-      bytes_to_read -= insize;
-      read_prev = true;
+      fprintf (stderr, "write failed: %s\n", strerror (errno));
+      return COPY_ERROR;
     }
 
-  int read_in;
-  int bytes_written;
+  bool first = true;
   do
     {
-      if (read_prev)
+      n = copy_in_kernel (source, dest, first, &method);
+      first = false;
+      if (n < 0 && method == COPY_BUFFER)
 	{
-	  read_in = read (source, in + insize, bytes_to_read);
-	  bytes_to_read = CHUNK;
+	  n = read_buffer (source, in, CHUNK);
+	  if (n < 0)
+	    {
+	      fprintf (stderr, "read failed: %s\n", strerror (errno));
+	      return COPY_ERROR;
+	    }
+	  if (n > 0 && write_buffer (dest, in, n) != n)
+	    n = -1;
 	}
-      else
-	{
-	  read_in = read (source, in, bytes_to_read);
-	}
-
-      if (read_in < 0)
-	{
-	  fprintf (stderr, "read failed: %s\n", strerror (errno));
-	  return COPY_ERROR;
-	}
-
-      read_in += insize;
-      bytes_written = write (dest, in, read_in);
-      if (bytes_written != read_in)
+      if (n < 0)
 	{
 	  fprintf (stderr, "write failed: %s\n", strerror (errno));
 	  return COPY_ERROR;
 	}
     }
-  while (read_in == bytes_to_read);
+  while (n != 0);
 
   return OK;
 }
 
-/* ===========================================================================
- * Run a set of bytes through the crc shift register.  If s is a NULL
- * pointer, then initialize the crc shift register contents instead.
- * Return the current crc in either case.
- */
- /* s: pointer to bytes to pump through */
- /* n: number of bytes in s[] */
-ulg
-updcrc (const uch * s, unsigned n)
-{
-  register ulg c;		/* temporary variable */
-
-  if (s == NULL)
-    {
-      c = 0xffffffffL;
-    }
-  else
-    {
-      c = crc;
-      if (n)
-	do
-	  {
-	    c = crc_32_tab[((int) c ^ (*s++)) & 0xff] ^ (c >> 8);
-	  }
-	while (--n);
-    }
-  crc = c;
-  return c ^ 0xffffffffL;	/* (instead of ~c for 64-bit machines) */
-}
-
-/* Return a current CRC value.  */
-ulg
-getcrc (void)
-{
-  return crc ^ 0xffffffffL;
-}
-
-/* Set a new CRC value.  */
-void
-setcrc (ulg c)
-{
-  crc = c ^ 0xffffffffL;
-}
-
 /* ===========================================================================
  * Clear input and output buffers
  */
@@ -207,6 +205,8 @@ clear_bufs ()
   outcnt = 0;
   insize = inptr = 0;
   bytes_in = bytes_out = 0L;
+  read_cursor.fd = write_cursor.fd = -1;
+  sparse_fd = -1;
 }
 
 /* ===========================================================================
@@ -264,6 +264,110 @@ fill_inbuf (int eof_ok, int max_fill)
   return inbuf[0];
 }
 
+/* ===========================================================================
+ * Run gzip, and the threads it starts from now on, only when the CPU and
+ * the disk would otherwise be idle: in the SCHED_IDLE scheduling class,
+ * or at the lowest priority where there is none, and in the idle I/O
+ * class on Linux.  Failures are ignored; gzip then merely runs at normal
+ * priority.
+ */
+void
+enter_background (void)
+{
+#ifdef SCHED_IDLE
+  struct sched_param param = { 0 };
+  if (sched_setscheduler (0, SCHED_IDLE, &param) != 0)
+#endif
+    ignore_value (setpriority (PRIO_PROCESS, 0, 19));
+
+#if defined __linux__ && defined SYS_ioprio_set
+  /* IOPRIO_WHO_PROCESS, and the IOPRIO_CLASS_IDLE class in the top
+     bits of the priority; <linux/ioprio.h> is not always installed.  */
+  ignore_value (syscall (SYS_ioprio_set, 1, 0, 3 << 13));
+#endif
+}
+
+/* ===========================================================================
+ * With --no-cache, note that LEN bytes were just read from FD, or
+ * written to it if WRITTEN, and drop the pages behind the cursor from
+ * the page cache so that a big file does not evict everyone else's.
+ * Pages read are dropped at once.  Pages written must first reach the
+ * disk, so writeback of each window is started as soon as it fills, and
+ * only waited for, and the window dropped, once the next one fills.
+ * Files that cannot seek are left alone.
+ */
+void
+uncache (int fd, size_t len, bool written)
+{
+  struct cache_cursor *c = written ? &write_cursor : &read_cursor;
+
+  if (!no_cache || len == 0)
+    return;
+  if (c->fd != fd)
+    {
+      off_t pos = lseek (fd, 0, SEEK_CUR);
+      c->fd = fd;
+      c->end = pos < 0 ? -1 : pos - (off_t) len;
+      c->dropped = c->flushing = c->end;
+    }
+  if (c->end < 0)
+    return;
+  c->end += len;
+  if (c->end - c->flushing < CACHE_WINDOW)
+    return;
+
+  if (written)
+    {
+#ifdef SYNC_FILE_RANGE_WRITE
+      sync_file_range (fd, c->flushing, c->end - c->flushing,
+		       SYNC_FILE_RANGE_WRITE);
+      if (c->dropped < c->flushing)
+	sync_file_range (fd, c->dropped, c->flushing - c->dropped,
+			 (SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+			  | SYNC_FILE_RANGE_WAIT_AFTER));
+#endif
+    }
+  else
+    c->flushing = c->end;
+#ifdef POSIX_FADV_DONTNEED
+  if (c->dropped < c->flushing)
+    posix_fadvise (fd, c->dropped, c->flushing - c->dropped,
+		   POSIX_FADV_DONTNEED);
+#endif
+  c->dropped = c->flushing;
+  c->flushing = c->end;
+}
+
+/* Sleep as needed to keep the input to background_rate bytes per second
+   on average, after reading LEN bytes.  The bucket holds a tenth of a
+   second's worth of tokens, so short bursts go through unhindered.  */
+static void
+throttle (int len)
+{
+  static double tokens;
+  static double last;
+  double burst = background_rate / 10.0;
+  double now = pipeline_stats_now ();
+
+  if (last == 0)
+    tokens = burst;
+  else
+    tokens += (now - last) * background_rate;
+  if (tokens > burst)
+    tokens = burst;
+  last = now;
+  tokens -= len;
+  if (tokens < 0)
+    {
+      double secs = -tokens / background_rate;
+      struct timespec ts;
+      ts.tv_sec = (time_t) secs;
+      ts.tv_nsec = (long) ((secs - ts.tv_sec) * 1e9);
+      while (nanosleep (&ts, &ts) != 0 && errno == EINTR)
+	continue;
+    }
+}
+
 /* Like the standard read function, except do not attempt to read more
    than INT_MAX bytes at a time.  */
 int
@@ -293,6 +397,10 @@ read_buffer (fd, buf, cnt)
     }
 #endif
 
+  if (background_rate && len > 0)
+    throttle (len);
+  if (len > 0)
+    uncache (fd, len, false);
   return len;
 }
 
@@ -303,9 +411,105 @@ write_buffer (fd, buf, cnt)
      voidp buf;
      unsigned int cnt;
 {
+  int len;
   if (INT_MAX < cnt)
     cnt = INT_MAX;
-  return write (fd, buf, cnt);
+  len = write (fd, buf, cnt);
+  if (len > 0)
+    uncache (fd, len, true);
+  return len;
+}
+
+/* Return the length of the run at the start of BUF, of at most CNT
+   bytes, that write_sparse treats alike: aligned blocks of zeros, given
+   that BUF is at offset POS, if *ZEROS, or else data.  Blocks cut short
+   by either end of BUF count too; a block left partly unwritten reads
+   as zeros there all the same.  */
+static size_t
+sparse_run (unsigned char const *buf, size_t cnt, off_t pos, bool *zeros)
+{
+  size_t run = 0;
+
+  *zeros = false;
+  while (run < cnt)
+    {
+      size_t block = SPARSE_BLOCK - (pos + run) % SPARSE_BLOCK;
+      if (cnt - run < block)
+	block = cnt - run;
+      bool zero = (buf[run] == 0
+		   && memcmp (buf + run, buf + run + 1, block - 1) == 0);
+      if (run == 0)
+	*zeros = zero;
+      else if (zero != *zeros)
+	break;
+      run += block;
+    }
+  return run;
+}
+
+/* ===========================================================================
+ * Like write_buffer, but seek over the blocks of zeros in CNT bytes of
+ * BUF instead of writing them, so that the regular file FD, which must not
+ * be in append mode, gets holes there.  With --no-cache the output may
+ * have been preallocated, so the holes are punched as well.  Call
+ * finish_sparse once the output is complete.  Return CNT, or -1 on error.
+ */
+int
+write_sparse (int fd, voidp buf, unsigned int cnt)
+{
+  unsigned char *p = buf;
+  size_t left = cnt;
+
+  if (sparse_fd != fd)
+    {
+      sparse_pos = lseek (fd, 0, SEEK_CUR);
+      if (sparse_pos < 0)
+	return -1;
+      sparse_fd = fd;
+      sparse_tail = false;
+    }
+  while (left)
+    {
+      bool zeros;
+      size_t run = sparse_run (p, left, sparse_pos, &zeros);
+
+      if (zeros)
+	{
+	  if (lseek (fd, run, SEEK_CUR) < 0)
+	    return -1;
+	  uncache (fd, run, true);
+#ifdef FALLOC_FL_PUNCH_HOLE
+	  if (no_cache)
+	    ignore_value (fallocate (fd, (FALLOC_FL_PUNCH_HOLE
+					  | FALLOC_FL_KEEP_SIZE),
+				     sparse_pos, run));
+#endif
+	}
+      else
+	for (size_t done = 0; done < run; )
+	  {
+	    int len = write_buffer (fd, p + done, run - done);
+	    if (len < 0)
+	      return -1;
+	    done += len;
+	  }
+      sparse_tail = zeros;
+      sparse_pos += run;
+      p += run;
+      left -= run;
+    }
+  return cnt;
+}
+
+/* Give the output of write_sparse to FD its full size, if it ends in a
+   hole.  Return 0, or -1 on error.  */
+int
+finish_sparse (int fd)
+{
+  if (sparse_fd != fd || !sparse_tail)
+    return 0;
+  sparse_tail = false;
+  return ftruncate (fd, sparse_pos);
 }
 
 /* ===========================================================================
@@ -17,44 +17,450 @@
    along with this program; if not, write to the Free Software Foundation,
    Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
 
-#include <stdio.h>
 #include <config.h>
+#include <stdio.h>
 #include <ctype.h>
 #include <assert.h>
 #include "tailor.h"
 #include "gzip.h"
 #include "zlib.h"
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include <sys/errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <poll.h>
+#include "parallel.h"
 #define CHUNK 16384
 
 off_t header_bytes;   /* number of bytes in gzip header */
+struct pipeline_stats zip_stats;  /* all files compressed so far */
 
 /* Speed options for the general purpose bit flag.  */
 enum { SLOW = 2, FAST = 4 };
 
-/* Deflate using zlib
+/* ===========================================================================
+ * File descriptor stages for the parallel compressor.
+ */
+
+struct fd_stages
+{
+  int in;              /* input file descriptor */
+  int out;             /* output file descriptor */
+  int read_errno;      /* errno of a failed read, or 0 */
+  int write_errno;     /* errno of a failed write, or 0 */
+  bool eof;            /* a read returned 0 */
+  bool pending;        /* input was taken that is not yet flushed */
+
+  /* A sparse input file is read only where it has data.  */
+  bool sparse;         /* the input may have holes */
+  off_t pos;           /* read position */
+  off_t size;          /* size of the input file */
+  off_t data_end;      /* end of the data extent at POS */
+  off_t hole_end;      /* end of the hole at POS */
+  size_t zeros;        /* bytes of the last readn that were in holes */
+  off_t written;       /* bytes written by writen */
+};
+
+/* Set up FDS for compressing ifd to ofd.  */
+static void
+init_fd_stages (struct fd_stages *fds)
+{
+  fds->in = ifd;
+  fds->out = ofd;
+  fds->read_errno = fds->write_errno = 0;
+  fds->eof = fds->pending = false;
+  fds->sparse = false;
+  fds->pos = fds->data_end = fds->hole_end = 0;
+  fds->zeros = 0;
+  fds->written = 0;
+#ifdef SEEK_HOLE
+  /* Only a file with fewer blocks than its size needs can have holes.  */
+  struct stat st;
+  if (fstat (ifd, &st) == 0 && S_ISREG (st.st_mode)
+      && st.st_blocks < st.st_size / 512)
+    {
+      fds->pos = lseek (ifd, 0, SEEK_CUR);
+      fds->size = st.st_size;
+      fds->sparse = 0 <= fds->pos;
+    }
+#endif
+}
+
+/* If the read position of a sparse input is in a hole, fill BUF with up
+   to LEN of its zeros without reading them and return how many.  Return
+   0 if there is data to read there, or at end of file.  */
+static size_t
+skip_hole (struct fd_stages *fds, unsigned char *buf, size_t len)
+{
+#ifdef SEEK_HOLE
+  off_t n;
+
+  if (!fds->sparse || fds->pos < fds->data_end || fds->size <= fds->pos)
+    return 0;
+  if (fds->hole_end <= fds->pos)
+    {
+      off_t data = lseek (fds->in, fds->pos, SEEK_DATA);
+      if (data < 0 && errno == ENXIO)
+        data = fds->size;       /* a hole up to the end of the file */
+      if (data == fds->pos)
+        fds->data_end = lseek (fds->in, fds->pos, SEEK_HOLE);
+      else
+        fds->hole_end = data;
+      if (data < 0 || fds->data_end < 0
+          || lseek (fds->in, fds->pos, SEEK_SET) < 0)
+        {
+          /* Fall back on reading everything.  */
+          fds->sparse = false;
+          return 0;
+        }
+      if (data == fds->pos)
+        return 0;
+    }
+  n = fds->hole_end - fds->pos;
+  if ((off_t) len < n)
+    n = len;
+  memset (buf, 0, n);
+  fds->pos += n;
+  fds->zeros += n;
+  if (lseek (fds->in, fds->pos, SEEK_SET) < 0)
+    fds->sparse = false;
+  return n;
+#else
+  return 0;
+#endif
+}
+
+/* Return true if input is ready on FD within flush_interval
+   milliseconds.  End of file and errors count as ready.  */
+static bool
+input_ready (int fd)
+{
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  int n;
+
+  while ((n = poll (&pfd, 1, flush_interval)) < 0 && errno == EINTR)
+    continue;
+  return n != 0;
+}
+
+/* Read until LEN bytes have been read or end of file.  With
+   --flush-interval, stop early when no input arrives in that time and
+   some is waiting to be flushed.  The holes of a sparse input are
+   filled in with zeros rather than read.  */
+static ssize_t
+readn (void *opaque, unsigned char **data, size_t len)
+{
+  struct fd_stages *fds = opaque;
+  unsigned char *buf = *data;
+  ssize_t result;
+  ssize_t amount = 0;
+
+  fds->zeros = 0;
+  while (len)
+    {
+      size_t size = len > INT_MAX ? INT_MAX : len;
+      size_t zeros = skip_hole (fds, buf, size);
+      if (zeros)
+        {
+          buf += zeros;
+          amount += zeros;
+          len -= zeros;
+          continue;
+        }
+      if (fds->sparse && fds->pos < fds->data_end
+          && (off_t) size > fds->data_end - fds->pos)
+        size = fds->data_end - fds->pos;
+      if (flush_interval && (amount || fds->pending)
+          && !input_ready (fds->in))
+        {
+          break;
+        }
+      result = read_buffer (fds->in, buf, size);
+      if (result < 0)
+        {
+          fds->read_errno = errno;
+          return result;
+        }
+      if (result == 0)
+        {
+          fds->eof = true;
+          break;
+        }
+      buf += result;
+      amount += result;
+      len -= (size_t) result;
+      fds->pos += result;
+    }
+  return amount;
+}
+
+/* Write all of BUF, retrying partial writes.  */
+static int
+writen (void *opaque, unsigned char const *buf, size_t len)
+{
+  struct fd_stages *fds = opaque;
+  ssize_t result;
+
+  while (len != 0)
+    {
+      result = write (fds->out, buf, len > INT_MAX ? INT_MAX : len);
+      if (result < 0)
+        {
+          fds->write_errno = errno;
+          return -1;
+        }
+      uncache (fds->out, result, true);
+      fds->written += result;
+      buf += result;
+      len -= (size_t) result;
+    }
+  return 0;
+}
+
+/* Report the failed read or write of FDS, if any, which exits.  */
+static void
+check_fd_stages (struct fd_stages const *fds)
+{
+  if (fds->write_errno)
+    {
+      errno = fds->write_errno;
+      write_error ();
+    }
+  if (fds->read_errno)
+    {
+      errno = fds->read_errno;
+      read_error ();
+    }
+}
+
+/* The engine that compresses at PACK_LEVEL: the one --engine asked for,
+   or else the one for this machine, except that only gzip's own has -0
+   and --best-plus.  */
+static struct deflate_engine const *
+compressor (int pack_level)
+{
+  if (pack_level == 0 || best_plus)
+    return &native_engine;
+  return engine != NULL ? engine : deflate_engine_default (false);
+}
+
+/* Compress ifd to ofd with -j threads.  */
+static off_t
+parallel_zip (int pack_level)
+{
+  struct fd_stages fds;
+  init_fd_stages (&fds);
+  struct pipeline_params params = {
+    .level = best_plus ? 9 : pack_level,
+    .threads = threads ? threads : 1,
+    /* Each block is primed with the 32K before it, so a block cut
+       where its content says compresses the same wherever it lands.  */
+    .rsyncable = rsync,
+    .adaptive = adaptive,
+    .flush = flush_interval != 0,
+    .engine = compressor (pack_level),
+    .iterations = best_plus,
+    .name = ifd == STDIN_FILENO ? NULL : ifname,
+    .mtime = (uint32_t) time_stamp.tv_sec,
+    .read = readn,
+    .write = writen,
+    .opaque = &fds,
+    .trace = job_trace
+  };
+  struct pipeline_stats stats;
+  params.stats = &stats;
+
+  int ret = parallel_compress (&params);
+  pipeline_stats_add (&zip_stats, &stats);
+  if (ret == Z_MEM_ERROR)
+    xalloc_die ();
+  check_fd_stages (&fds);
+  return ret;
+}
+
+/* Compress ifd to ofd without threads, with gzip's own deflate.  The
+   header is the one zlib would write.  */
+static off_t
+native_zip (int pack_level)
+{
+  struct fd_stages fds;
+  struct pipeline_stats stats = { 0 };
+  unsigned char in[CHUNK];
+  unsigned char *next = in;
+  unsigned char header[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0,
+                               pack_level == 9 ? SLOW
+                               : pack_level <= 1 ? FAST : 0, OS_CODE };
+  unsigned char trailer[8];
+  unsigned long crc = crc32 (0L, Z_NULL, 0);
+  uint32_t isize = 0;
+  double start = pipeline_stats_now ();
+  double pending_since = 0;   /* when unflushed input was first read */
+  int flush;
+  int ret = Z_OK;
+  struct native_deflate *s = native_deflate_new ();
+  struct rsync_roll roll;
+
+  if (s == NULL)
+    xalloc_die ();
+  init_fd_stages (&fds);
+  rsync_roll_init (&roll, PARALLEL_BLOCK_SIZE);
+  native_deflate_reset (s, pack_level, writen, &fds);
+  writen (&fds, header, sizeof header);
+
+  do
+    {
+      double t = pipeline_stats_now ();
+      ssize_t bytes_in = readn (&fds, &next, CHUNK);
+      double read_end = pipeline_stats_now ();
+      stats.read_busy += read_end - t;
+      if (bytes_in < 0)
+        {
+          ret = Z_ERRNO;
+          break;
+        }
+      stats.bytes_in += bytes_in;
+      crc = crc32 (crc, in, bytes_in);
+      isize += bytes_in;
+
+      bool had_pending = fds.pending || bytes_in != 0;
+      if (!fds.pending && bytes_in != 0)
+        pending_since = read_end;
+      if (fds.eof)
+        flush = Z_FINISH;
+      else if (bytes_in != CHUNK)
+        flush = Z_SYNC_FLUSH;     /* input stalled; see readn */
+      else
+        flush = Z_NO_FLUSH;
+      fds.pending = had_pending && flush == Z_NO_FLUSH;
+
+      /* With --rsyncable, end a block where the input says to, as the
+         parallel compressor does.  */
+      size_t done = 0;
+      t = pipeline_stats_now ();
+      do
+        {
+          size_t n = bytes_in - done;
+          int f = flush;
+          if (rsync && rsync_roll_cut (&roll, in + done, n, &n)
+              && (done + n < (size_t) bytes_in || f == Z_NO_FLUSH))
+            f = Z_FULL_FLUSH;
+          ret = native_deflate (s, in + done, n, f);
+          done += n;
+        }
+      while (ret == Z_OK && done < (size_t) bytes_in);
+      stats.compress_busy += pipeline_stats_now () - t;
+      if (ret != Z_OK)
+        break;
+
+      if (had_pending && flush != Z_NO_FLUSH)
+        {
+          double latency = pipeline_stats_now () - pending_since;
+          stats.flushes++;
+          stats.latency += latency;
+          if (stats.latency_max < latency)
+            stats.latency_max = latency;
+        }
+    }
+  while (flush != Z_FINISH);
+  native_deflate_free (s);
+
+  if (ret == Z_OK)
+    {
+      for (int i = 0; i < 4; i++)
+        {
+          trailer[i] = crc >> (8 * i);
+          trailer[4 + i] = isize >> (8 * i);
+        }
+      writen (&fds, trailer, sizeof trailer);
+    }
+  stats.bytes_out = fds.written;
+  stats.wall = pipeline_stats_now () - start;
+  pipeline_stats_add (&zip_stats, &stats);
+  check_fd_stages (&fds);
+  return ret;
+}
+
+/* Switch STRM to LEVEL and STRATEGY, writing to FDS what deflate
+   emits on ending the current block, through the buffer OUT.  The
+   input already in STRM is left for the new parameters.  Return a zlib
+   error code.  */
+static int
+switch_params (z_stream *strm, int level, int strategy,
+               unsigned char *out, struct fd_stages *fds,
+               struct pipeline_stats *stats)
+{
+  int ret;
+  uInt avail_in = strm->avail_in;
+
+  strm->avail_in = 0;
+  do
+    {
+      strm->next_out = out;
+      strm->avail_out = CHUNK;
+      ret = deflateParams (strm, level, strategy);
+      size_t len = CHUNK - strm->avail_out;
+      stats->bytes_out += len;
+      if (writen (fds, out, len) != 0)
+        return Z_ERRNO;
+    }
+  while (ret == Z_BUF_ERROR);
+  strm->avail_in = avail_in;
+  return ret;
+}
+
+/* Deflate with -j threads, or else serially with the engine that
+ * compressor chooses.  The optimal parsing of --best-plus works block by
+ * block, so it always goes through the parallel pipeline, with one
+ * compress thread if there is no -j.
  */
 off_t
 deflateGZIP (int pack_level)
 {
-  if (threads > 0) {
-    return parallel_zip(pack_level);
-  }
-  
+  struct deflate_engine const *e = compressor (pack_level);
+
+  if (threads > 0 || best_plus)
+    {
+      return parallel_zip (pack_level);
+    }
+  if (e == &native_engine)
+    {
+      return native_zip (pack_level);
+    }
+#ifdef IBM_Z_DFLTCC
+  if (e == &dfltcc_engine)
+    {
+      return dfltcc_deflate (pack_level);
+    }
+#endif
+  return zlib_zip (pack_level);
+}
+
+/* Deflate ifd to ofd serially with zlib.  */
+off_t
+zlib_zip (int pack_level)
+{
     // source is input file descriptor, dest is input file descriptor
     int ret, flush;
     unsigned writtenOutBytes;
     z_stream strm;
     unsigned char in[CHUNK];
     unsigned char out[CHUNK];
-    int source = ifd;
-    int dest = ofd;
+    unsigned char *next = in;
+    struct fd_stages fds;
+    struct pipeline_stats stats = { 0 };
+    double start = pipeline_stats_now ();
+    double t;
+    double pending_since = 0;   /* when unflushed input was first read */
+    bool rle = false;           /* compressing the zeros of a hole */
+    struct rsync_roll roll;
 
     memzero(in, CHUNK);
     memzero(out, CHUNK);
+    init_fd_stages (&fds);
+    rsync_roll_init (&roll, PARALLEL_BLOCK_SIZE);
 
     /* allocate deflate state */
     strm.zalloc = Z_NULL;
@@ -73,48 +479,105 @@ deflateGZIP (int pack_level)
 
     /* compress until end of file */
     do {
-        int bytes_in = read(source, in, CHUNK);
+        t = pipeline_stats_now ();
+        ssize_t bytes_in = readn (&fds, &next, CHUNK);
+        double read_end = pipeline_stats_now ();
+        stats.read_busy += read_end - t;
         if(bytes_in < 0)
           {
             (void)deflateEnd(&strm);
+            check_fd_stages (&fds);
             return Z_ERRNO;
           }
         else
           {
             strm.avail_in = bytes_in;
+            stats.bytes_in += bytes_in;
           }
-        if (rsync == true)
-          {
-            // Very unsure about effectiveness of Z_FULL_FLUSH for rsyncabl
-            flush = (strm.avail_in != CHUNK) ? Z_FINISH : Z_FULL_FLUSH;
-          }
+        bool had_pending = fds.pending || bytes_in != 0;
+        if (!fds.pending && bytes_in != 0)
+          pending_since = read_end;
+        if (fds.eof)
+          flush = Z_FINISH;
+        else if (bytes_in != CHUNK)
+          flush = Z_SYNC_FLUSH;     /* input stalled; see readn */
         else
+          flush = Z_NO_FLUSH;
+        fds.pending = had_pending && flush == Z_NO_FLUSH;
+
+        /* Runs of zeros from the holes of a sparse file only need run
+           length encoding, which is much faster than searching for
+           matches.  */
+        if (bytes_in != 0 && rle != (fds.zeros == (size_t) bytes_in))
           {
-            flush = (strm.avail_in != CHUNK) ? Z_FINISH : Z_NO_FLUSH;
+            rle = !rle;
+            t = pipeline_stats_now ();
+            ret = switch_params (&strm, rle ? 1 : pack_level,
+                                 rle ? Z_RLE : Z_DEFAULT_STRATEGY, out, &fds,
+                                 &stats);
+            stats.compress_busy += pipeline_stats_now () - t;
+            if (ret == Z_ERRNO)
+              {
+                (void) deflateEnd (&strm);
+                check_fd_stages (&fds);
+                return Z_ERRNO;
+              }
           }
         strm.next_in = in;
 
-        /* run deflate() on input until output buffer not full, finish
-           compression if all of source has been read in */
+        /* With --rsyncable, end a block with a full flush where the
+           input says to, as the parallel compressor cuts its blocks, so
+           that an insertion only changes the output around it.  */
+        size_t done = 0;
         do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out;
-            ret = deflate(&strm, flush);    /* no bad return value */
-            assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-            writtenOutBytes = CHUNK - strm.avail_out;
-            if (write(dest, out, writtenOutBytes) != writtenOutBytes) {
-                fprintf(stderr, "%s\n", strerror(errno));
-                (void)deflateEnd(&strm);
-                return Z_ERRNO;
+            size_t n = bytes_in - done;
+            int segment_flush = flush;
+            if (rsync && rsync_roll_cut (&roll, in + done, n, &n)
+                && (done + n < (size_t) bytes_in || flush == Z_NO_FLUSH))
+                segment_flush = Z_FULL_FLUSH;
+            strm.avail_in = n;
+            done += n;
+
+            /* run deflate() on input until output buffer not full, finish
+               compression if all of source has been read in */
+            do {
+                strm.avail_out = CHUNK;
+                strm.next_out = out;
+                t = pipeline_stats_now ();
+                ret = deflate(&strm, segment_flush); /* no bad return value */
+                stats.compress_busy += pipeline_stats_now () - t;
+                assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
+                writtenOutBytes = CHUNK - strm.avail_out;
+                stats.bytes_out += writtenOutBytes;
+                t = pipeline_stats_now ();
+                int written = writen (&fds, out, writtenOutBytes);
+                stats.write_busy += pipeline_stats_now () - t;
+                if (written != 0) {
+                    (void)deflateEnd(&strm);
+                    check_fd_stages (&fds);
+                    return Z_ERRNO;
+                }
             }
+            while (strm.avail_out == 0);
+            assert (strm.avail_in == 0);     /* all input will be used */
+        }
+        while (done < (size_t) bytes_in);
+
+      if (had_pending && flush != Z_NO_FLUSH)
+        {
+          double latency = pipeline_stats_now () - pending_since;
+          stats.flushes++;
+          stats.latency += latency;
+          if (stats.latency_max < latency)
+            stats.latency_max = latency;
         }
-      while (strm.avail_out == 0);
-      assert (strm.avail_in == 0);     /* all input will be used */
 
       /* done when last data in file processed */
     }
   while (flush != Z_FINISH);
   assert (ret == Z_STREAM_END);        /* stream will be complete */
+  stats.wall = pipeline_stats_now () - start;
+  pipeline_stats_add (&zip_stats, &stats);
 
   /* clean up and return */
   int end_ret = deflateEnd (&strm);
@@ -146,13 +609,15 @@ zip (int in, int out)
       warning ("file timestamp out of range for gzip format");
     }
 
-#ifdef IBM_Z_DFLTCC
-  dfltcc_deflate (level);
-#else
-  deflateGZIP (level);
-#endif
-
-  return OK;
+  switch (deflateGZIP (level))
+    {
+    case Z_OK:
+      return OK;
+    case Z_MEM_ERROR:
+      xalloc_die ();
+    default:
+      gzip_error ("compression failed");
+    }
 }
 
 
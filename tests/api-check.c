@@ -0,0 +1,495 @@
+/* api-check.c -- exercise the in-memory and streaming APIs of parallel.h
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.  */
+
+/*
+ * Nothing in gzip itself calls mem_zip, mem_unzip or the gzstream
+ * functions, so this program does, and is run by the 'api' test:
+ *
+ *   buffers     growable and caller-provided output, and Z_BUF_ERROR
+ *               when a caller-provided one is too small
+ *   serial      input below the parallel threshold, which must come
+ *               out the same whatever the thread count
+ *   iovecs      input in many small pieces, round trip, compressing
+ *               about as well as one buffer
+ *   gzstream    a push refused with EAGAIN while the queue is full,
+ *               then a pull once the descriptor is readable, and a
+ *               retry, through to gzstream_finish
+ *   failure     a block that fails to compress, which must fail the
+ *               stream with ENOMEM rather than leave a hole in it
+ *
+ * It prints what failed and exits with status 1, or exits with 0.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zlib.h"
+#include "parallel.h"
+
+static int failures;
+
+static void
+fail (char const *format, ...)
+{
+  va_list args;
+  fputs ("api-check: ", stderr);
+  va_start (args, format);
+  vfprintf (stderr, format, args);
+  va_end (args);
+  fputc ('\n', stderr);
+  failures++;
+}
+
+/* Fill BUF with LEN bytes of text from a small vocabulary, which
+ * compresses about as well as prose.
+ */
+static void
+make_text (unsigned char *buf, size_t len)
+{
+  static char const *const words[] = {
+    "the ", "gzip ", "member ", "block ", "of ", "deflate ", "and ",
+    "thread ", "input ", "output ", "window ", "a ", "is ", "in ",
+    "header ", "trailer ", "crc ", "\n"
+  };
+  uint32_t seed = 12345;
+  size_t n = 0;
+
+  while (n < len)
+    {
+      seed = seed * 1103515245 + 12345;
+      char const *w = words[(seed >> 16) % (sizeof words / sizeof *words)];
+      for (; *w && n < len; w++)
+	{
+	  buf[n++] = *w;
+	}
+    }
+}
+
+static void
+mem_free (struct mem_buffer *b)
+{
+  free (b->data);
+  b->data = NULL;
+  b->size = b->len = 0;
+}
+
+/* Check that the gzip data in Z decompresses to the LEN bytes at IN.  */
+static void
+check_round_trip (char const *what, struct mem_buffer const *z,
+		  unsigned char const *in, size_t len)
+{
+  struct mem_buffer out = { NULL, 0, 0, true };
+  struct iovec iov = { z->data, z->len };
+  int ret = mem_unzip (&out, &iov, 1);
+
+  if (ret != Z_OK)
+    {
+      fail ("%s: mem_unzip returned %d", what, ret);
+    }
+  else if (out.len != len || memcmp (out.data, in, len) != 0)
+    {
+      fail ("%s: round trip differs", what);
+    }
+  mem_free (&out);
+}
+
+static void
+test_buffers (unsigned char const *text, size_t len)
+{
+  struct iovec iov = { (void *) text, len };
+  struct mem_buffer grown = { NULL, 0, 0, true };
+  int ret;
+
+  for (int threads = 0; threads <= 4; threads += 4)
+    {
+      ret = mem_zip (&grown, &iov, 1, 6, threads);
+      if (ret != Z_OK)
+	{
+	  fail ("buffers: mem_zip with %d threads returned %d", threads, ret);
+	  continue;
+	}
+      check_round_trip ("buffers", &grown, text, len);
+
+      // a caller-provided buffer just big enough, then one too small
+      size_t need = grown.len;
+      unsigned char *fixed = malloc (need);
+      struct mem_buffer exact = { fixed, need, 0, false };
+      ret = mem_zip (&exact, &iov, 1, 6, threads);
+      if (ret != Z_OK || exact.len != need)
+	{
+	  fail ("buffers: fixed buffer of %zu bytes, %d threads: %d",
+		need, threads, ret);
+	}
+      struct mem_buffer small = { fixed, need / 2, 0, false };
+      ret = mem_zip (&small, &iov, 1, 6, threads);
+      if (ret != Z_BUF_ERROR)
+	{
+	  fail ("buffers: fixed buffer too small, %d threads: %d, "
+		"not Z_BUF_ERROR", threads, ret);
+	}
+
+      // and the same for decompression
+      struct iovec ziov = { grown.data, grown.len };
+      unsigned char *plain = malloc (len);
+      struct mem_buffer out = { plain, len, 0, false };
+      ret = mem_unzip (&out, &ziov, 1);
+      if (ret != Z_OK || out.len != len || memcmp (plain, text, len) != 0)
+	{
+	  fail ("buffers: mem_unzip into a fixed buffer: %d", ret);
+	}
+      out.len = 0;
+      out.size = len - 1;
+      ret = mem_unzip (&out, &ziov, 1);
+      if (ret != Z_BUF_ERROR)
+	{
+	  fail ("buffers: mem_unzip into a short buffer: %d, "
+		"not Z_BUF_ERROR", ret);
+	}
+      free (plain);
+      free (fixed);
+      mem_free (&grown);
+    }
+}
+
+static void
+test_serial (unsigned char const *text)
+{
+  size_t len = PARALLEL_BLOCK_SIZE / 2;
+  struct iovec iov = { (void *) text, len };
+  struct mem_buffer serial = { NULL, 0, 0, true };
+  struct mem_buffer threaded = { NULL, 0, 0, true };
+
+  if (mem_zip (&serial, &iov, 1, 9, 0) != Z_OK
+      || mem_zip (&threaded, &iov, 1, 9, 4) != Z_OK)
+    {
+      fail ("serial: mem_zip failed");
+    }
+  else if (serial.len != threaded.len
+	   || memcmp (serial.data, threaded.data, serial.len) != 0)
+    {
+      fail ("serial: small input was not deflated by the calling thread");
+    }
+  else
+    {
+      check_round_trip ("serial", &threaded, text, len);
+    }
+  mem_free (&serial);
+  mem_free (&threaded);
+}
+
+static void
+test_iovecs (unsigned char const *text, size_t len)
+{
+  static size_t const pieces[] = { 512, 4096, 100000 };
+  struct iovec whole = { (void *) text, len };
+  struct mem_buffer one = { NULL, 0, 0, true };
+
+  if (mem_zip (&one, &whole, 1, 6, 4) != Z_OK)
+    {
+      fail ("iovecs: mem_zip of a single buffer failed");
+    }
+
+  for (size_t p = 0; p < sizeof pieces / sizeof *pieces; p++)
+    {
+      int iovcnt = (len + pieces[p] - 1) / pieces[p];
+      struct iovec *iov = malloc (sizeof (struct iovec) * iovcnt);
+      struct mem_buffer z = { NULL, 0, 0, true };
+
+      for (int i = 0; i < iovcnt; i++)
+	{
+	  size_t off = i * pieces[p];
+	  iov[i].iov_base = (void *) (text + off);
+	  iov[i].iov_len = len - off < pieces[p] ? len - off : pieces[p];
+	}
+      int ret = mem_zip (&z, iov, iovcnt, 6, 4);
+      if (ret != Z_OK)
+	{
+	  fail ("iovecs of %zu bytes: mem_zip returned %d", pieces[p], ret);
+	}
+      else
+	{
+	  check_round_trip ("iovecs", &z, text, len);
+	}
+      // small pieces are gathered into whole blocks, so that they
+      // compress as well as one buffer
+      if (z.len > one.len + one.len / 100)
+	{
+	  fail ("iovecs of %zu bytes: %zu bytes out, %zu for one buffer",
+		pieces[p], z.len, one.len);
+	}
+
+      // the compressed data in pieces too
+      struct mem_buffer out = { NULL, 0, 0, true };
+      struct iovec ziov[3];
+      size_t third = z.len / 3;
+      ziov[0].iov_base = z.data;
+      ziov[0].iov_len = third;
+      ziov[1].iov_base = z.data + third;
+      ziov[1].iov_len = third;
+      ziov[2].iov_base = z.data + 2 * third;
+      ziov[2].iov_len = z.len - 2 * third;
+      ret = mem_unzip (&out, ziov, 3);
+      if (ret != Z_OK || out.len != len || memcmp (out.data, text, len) != 0)
+	{
+	  fail ("iovecs of %zu bytes: mem_unzip of pieces: %d", pieces[p],
+		ret);
+	}
+      mem_free (&out);
+      mem_free (&z);
+      free (iov);
+    }
+  mem_free (&one);
+}
+
+/* Wait until S has output, for at most ten seconds.  */
+static bool
+wait_output (struct gzstream *s)
+{
+  struct pollfd pfd = { gzstream_fd (s), POLLIN, 0 };
+  return poll (&pfd, 1, 10000) == 1;
+}
+
+/* Pull what output S has into Z.  Return 1 once the whole member has
+ * been pulled, 0 if more is to come, or -1 on error.
+ */
+static int
+pull_some (struct gzstream *s, struct mem_buffer *z)
+{
+  for (;;)
+    {
+      if (z->size - z->len < 65536)
+	{
+	  z->size = z->size * 2 + 65536;
+	  z->data = realloc (z->data, z->size);
+	  if (z->data == NULL)
+	    {
+	      return -1;
+	    }
+	}
+      ssize_t n = gzstream_pull (s, z->data + z->len, z->size - z->len);
+      if (n < 0)
+	{
+	  return errno == EAGAIN ? 0 : -1;
+	}
+      if (n == 0)
+	{
+	  return 1;
+	}
+      z->len += n;
+    }
+}
+
+static void
+test_gzstream (unsigned char const *text, size_t len)
+{
+  struct worker_pool *pool = worker_pool_create (2);
+  struct pipeline_params params = { .level = 6 };
+  struct mem_buffer z = { NULL, 0, 0, true };
+  bool refused = false;
+  size_t pushed = 0;
+
+  if (pool == NULL)
+    {
+      fail ("gzstream: worker_pool_create failed");
+      return;
+    }
+  struct gzstream *s = gzstream_open (&params, pool);
+  if (s == NULL)
+    {
+      fail ("gzstream: gzstream_open failed");
+      worker_pool_destroy (pool);
+      return;
+    }
+
+  while (pushed < len)
+    {
+      ssize_t n = gzstream_push (s, text + pushed, len - pushed);
+      if (0 <= n)
+	{
+	  pushed += n;
+	  continue;
+	}
+      if (errno != EAGAIN)
+	{
+	  fail ("gzstream: push failed: %s", strerror (errno));
+	  break;
+	}
+      // the queue is full until output is pulled
+      refused = true;
+      if (!wait_output (s))
+	{
+	  fail ("gzstream: no output after a refused push");
+	  break;
+	}
+      if (pull_some (s, &z) < 0)
+	{
+	  fail ("gzstream: pull failed: %s", strerror (errno));
+	  break;
+	}
+    }
+  if (!refused)
+    {
+      fail ("gzstream: %zu bytes pushed without EAGAIN", len);
+    }
+  if (gzstream_finish (s) != 0)
+    {
+      fail ("gzstream: gzstream_finish failed");
+    }
+  for (;;)
+    {
+      int ret = pull_some (s, &z);
+      if (ret == 1)
+	{
+	  break;
+	}
+      if (ret < 0 || !wait_output (s))
+	{
+	  fail ("gzstream: the member never ended");
+	  break;
+	}
+    }
+  check_round_trip ("gzstream", &z, text, len);
+  gzstream_close (s);
+  worker_pool_destroy (pool);
+  mem_free (&z);
+}
+
+static pthread_mutex_t failing_lock = PTHREAD_MUTEX_INITIALIZER;
+static int failing_calls;
+
+/* zlib, except that the third block fails as if out of memory.  */
+static size_t
+failing_compress (void *state, int level, int strategy,
+		  unsigned char const *dict, size_t dict_len,
+		  unsigned char const *in, size_t len, bool last,
+		  unsigned char *out)
+{
+  pthread_mutex_lock (&failing_lock);
+  bool fail_now = ++failing_calls == 3;
+  pthread_mutex_unlock (&failing_lock);
+  if (fail_now)
+    {
+      return (size_t) -1;
+    }
+  return zlib_engine.compress (state, level, strategy, dict, dict_len, in,
+			       len, last, out);
+}
+
+static void
+test_gzstream_failure (unsigned char const *text, size_t len)
+{
+  struct worker_pool *pool = worker_pool_create (2);
+  struct deflate_engine failing = zlib_engine;
+  struct mem_buffer z = { NULL, 0, 0, true };
+  size_t pushed = 0;
+  int err = 0;
+
+  failing.compress = failing_compress;
+  failing_calls = 0;
+  struct pipeline_params params = { .level = 6, .engine = &failing };
+  if (pool == NULL)
+    {
+      fail ("failure: worker_pool_create failed");
+      return;
+    }
+  struct gzstream *s = gzstream_open (&params, pool);
+  if (s == NULL)
+    {
+      fail ("failure: gzstream_open failed");
+      worker_pool_destroy (pool);
+      return;
+    }
+
+  // push, finish and pull as far as the stream lets us
+  while (err == 0)
+    {
+      if (pushed < len)
+	{
+	  ssize_t n = gzstream_push (s, text + pushed, len - pushed);
+	  if (0 < n)
+	    {
+	      pushed += n;
+	      continue;
+	    }
+	  if (errno != EAGAIN)
+	    {
+	      err = errno;
+	      break;
+	    }
+	}
+      else if (gzstream_finish (s) != 0)
+	{
+	  err = errno;
+	  break;
+	}
+      if (!wait_output (s))
+	{
+	  fail ("failure: no output");
+	  break;
+	}
+      int ret = pull_some (s, &z);
+      if (ret < 0)
+	{
+	  err = errno;
+	}
+      else if (ret == 1)
+	{
+	  break;
+	}
+    }
+  if (err != ENOMEM)
+    {
+      fail ("failure: a block failed to compress, but %s",
+	    err ? strerror (err) : "the member was completed");
+    }
+
+  // and nothing more comes out
+  unsigned char buf[64];
+  if (gzstream_pull (s, buf, sizeof buf) != -1 || errno != ENOMEM)
+    {
+      fail ("failure: output pulled after the stream failed");
+    }
+  gzstream_close (s);
+  worker_pool_destroy (pool);
+  mem_free (&z);
+}
+
+int
+main (void)
+{
+  // enough blocks for the pipeline to fill its queue
+  size_t len = 64 * PARALLEL_BLOCK_SIZE;
+  unsigned char *text = malloc (len);
+
+  if (text == NULL)
+    {
+      return 77;
+    }
+  make_text (text, len);
+  test_buffers (text, 8 * PARALLEL_BLOCK_SIZE);
+  test_serial (text);
+  test_iovecs (text, 8 * PARALLEL_BLOCK_SIZE);
+  test_gzstream (text, len);
+  test_gzstream_failure (text, 8 * PARALLEL_BLOCK_SIZE);
+  free (text);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}